@@ -0,0 +1,127 @@
+#include "AotDictionary.h"
+#include "ByteIO.h"
+#include "Sha256.h"
+
+#include <cstdio>
+
+
+// Dictionary file: magic, format, class count, then per class u32 class number, name,
+// u32 image length, digest, u32 method count and the methods as in a class cache entry.
+static const uint32_t DICTIONARY_MAGIC = 0x4441544D;	 // "MTAD"
+static const uint32_t DICTIONARY_FORMAT = 1;
+
+
+AotDictionary::AotDictionary() :
+	m_class_count(0)
+{
+}
+
+void AotDictionary::add(const Class &instrumented)
+{
+	m_by_name.insert(std::make_pair(instrumented.m_name, m_classes.size()));
+	m_classes.push_back(instrumented);
+	if (instrumented.m_cnum >= m_class_count)
+	{
+		m_class_count = instrumented.m_cnum + 1;
+	}
+}
+
+bool AotDictionary::load(const std::string &path)
+{
+	FILE *file = fopen(path.c_str(), "rb");
+	if (file == nullptr)
+	{
+		return false;
+	}
+
+	uint32_t magic = 0, format = 0, class_count = 0;
+	bool ok = read_u32(file, magic) && magic == DICTIONARY_MAGIC && read_u32(file, format) &&
+		format == DICTIONARY_FORMAT && read_u32(file, class_count);
+
+	for (uint32_t i = 0; ok && i < class_count; i++)
+	{
+		Class instrumented;
+		uint32_t method_count = 0;
+		ok = read_u32(file, instrumented.m_cnum) && read_string(file, instrumented.m_name) &&
+			read_u32(file, instrumented.m_image_length) && read_string(file, instrumented.m_digest) &&
+			read_u32(file, method_count);
+
+		for (uint32_t mnum = 0; ok && mnum < method_count; mnum++)
+		{
+			ClassCache::Method method;
+			uint8_t interested = 0;
+			ok = read_u8(file, interested) && read_u8(file, method.m_trivial) &&
+				read_string(file, method.m_name) && read_string(file, method.m_signature);
+			method.m_interested = interested != 0;
+			instrumented.m_methods.push_back(method);
+		}
+
+		if (ok)
+		{
+			add(instrumented);
+		}
+	}
+
+	fclose(file);
+	return ok;
+}
+
+bool AotDictionary::save(const std::string &path) const
+{
+	FILE *file = fopen(path.c_str(), "wb");
+	if (file == nullptr)
+	{
+		return false;
+	}
+
+	bool ok = write_u32(file, DICTIONARY_MAGIC) && write_u32(file, DICTIONARY_FORMAT) &&
+		write_u32(file, static_cast<uint32_t>(m_classes.size()));
+	for (size_t i = 0; ok && i < m_classes.size(); i++)
+	{
+		const Class &instrumented = m_classes[i];
+		ok = write_u32(file, instrumented.m_cnum) && write_string(file, instrumented.m_name) &&
+			write_u32(file, instrumented.m_image_length) && write_string(file, instrumented.m_digest) &&
+			write_u32(file, static_cast<uint32_t>(instrumented.m_methods.size()));
+
+		for (size_t mnum = 0; ok && mnum < instrumented.m_methods.size(); mnum++)
+		{
+			const ClassCache::Method &method = instrumented.m_methods[mnum];
+			ok = write_u8(file, method.m_interested ? 1 : 0) && write_u8(file, method.m_trivial) &&
+				write_string(file, method.m_name) && write_string(file, method.m_signature);
+		}
+	}
+	ok = fclose(file) == 0 && ok;
+
+	if (!ok)
+	{
+		remove(path.c_str());
+	}
+	return ok;
+}
+
+const AotDictionary::Class *AotDictionary::find(const char *name, const unsigned char *class_data, size_t length) const
+{
+	// The name and length rule out nearly every class the cheap way, the digest is computed once
+	std::string digest;
+	const auto range = m_by_name.equal_range(name);
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		const Class &instrumented = m_classes[it->second];
+		if (instrumented.m_image_length != length)
+		{
+			continue;
+		}
+
+		if (digest.empty())
+		{
+			Sha256 hash;
+			hash.update(class_data, length);
+			digest = hash.hex_digest();
+		}
+		if (digest == instrumented.m_digest)
+		{
+			return &instrumented;
+		}
+	}
+	return nullptr;
+}
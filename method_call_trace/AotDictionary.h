@@ -0,0 +1,52 @@
+#ifndef _INCLUDE_AOT_DICTIONARY_H_
+#define _INCLUDE_AOT_DICTIONARY_H_
+
+#include "ClassCache.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// Classes rewritten ahead of time by aot_instrument, written next to the instrumented
+// jars and read by the agent's aot=file option.
+//
+// Each class has the number it was rewritten with, the method table mnum_callbacks()
+// would have built, and the length and SHA-256 of the instrumented image. A class the
+// JVM loads is taken as instrumented only if name, length and digest all match, so a
+// stale or uninstrumented copy of the class is rewritten at load time as usual.
+class AotDictionary
+{
+public:
+	struct Class
+	{
+		uint32_t    m_cnum;
+		std::string m_name;
+		uint32_t    m_image_length;
+		std::string m_digest;				 // Sha256 hex digest of the instrumented image
+		std::vector<ClassCache::Method> m_methods;
+	};
+
+	AotDictionary();
+
+	void add(const Class &instrumented);
+
+	bool load(const std::string &path);
+	bool save(const std::string &path) const;
+
+	// The class with these bytes, nullptr if they are not an instrumented image
+	const Class *find(const char *name, const unsigned char *class_data, size_t length) const;
+
+	// Class numbers below this are taken by instrumented classes
+	uint32_t class_count() const { return m_class_count; }
+	size_t size() const { return m_classes.size(); }
+
+private:
+	std::vector<Class> m_classes;
+	std::unordered_multimap<std::string, size_t> m_by_name;
+	uint32_t m_class_count;
+};
+
+#endif // _INCLUDE_AOT_DICTIONARY_H_
@@ -0,0 +1,91 @@
+#ifndef _INCLUDE_BYTE_IO_H_
+#define _INCLUDE_BYTE_IO_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+
+// Little endian values and u16-length strings in the agent's own files: class cache
+// entries and ahead-of-time dictionaries.
+
+inline bool write_u8(FILE *file, uint8_t value)
+{
+	return fwrite(&value, sizeof(value), 1, file) == 1;
+}
+
+inline bool write_u16(FILE *file, uint16_t value)
+{
+	const uint8_t bytes[2] = { static_cast<uint8_t>(value), static_cast<uint8_t>(value >> 8) };
+	return fwrite(bytes, sizeof(bytes), 1, file) == 1;
+}
+
+inline bool write_u32(FILE *file, uint32_t value)
+{
+	const uint8_t bytes[4] = { static_cast<uint8_t>(value), static_cast<uint8_t>(value >> 8),
+		static_cast<uint8_t>(value >> 16), static_cast<uint8_t>(value >> 24) };
+	return fwrite(bytes, sizeof(bytes), 1, file) == 1;
+}
+
+inline bool write_u64(FILE *file, uint64_t value)
+{
+	return write_u32(file, static_cast<uint32_t>(value)) && write_u32(file, static_cast<uint32_t>(value >> 32));
+}
+
+inline bool write_string(FILE *file, const std::string &value)
+{
+	return value.length() <= 0xFFFF && write_u16(file, static_cast<uint16_t>(value.length())) &&
+		(value.empty() || fwrite(value.data(), value.length(), 1, file) == 1);
+}
+
+inline bool read_u8(FILE *file, uint8_t &value)
+{
+	return fread(&value, sizeof(value), 1, file) == 1;
+}
+
+inline bool read_u16(FILE *file, uint16_t &value)
+{
+	uint8_t bytes[2];
+	if (fread(bytes, sizeof(bytes), 1, file) != 1)
+	{
+		return false;
+	}
+	value = static_cast<uint16_t>(bytes[0] | (bytes[1] << 8));
+	return true;
+}
+
+inline bool read_u32(FILE *file, uint32_t &value)
+{
+	uint8_t bytes[4];
+	if (fread(bytes, sizeof(bytes), 1, file) != 1)
+	{
+		return false;
+	}
+	value = static_cast<uint32_t>(bytes[0]) | (static_cast<uint32_t>(bytes[1]) << 8) |
+		(static_cast<uint32_t>(bytes[2]) << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+	return true;
+}
+
+inline bool read_u64(FILE *file, uint64_t &value)
+{
+	uint32_t low, high;
+	if (!read_u32(file, low) || !read_u32(file, high))
+	{
+		return false;
+	}
+	value = static_cast<uint64_t>(low) | (static_cast<uint64_t>(high) << 32);
+	return true;
+}
+
+inline bool read_string(FILE *file, std::string &value)
+{
+	uint16_t length;
+	if (!read_u16(file, length))
+	{
+		return false;
+	}
+	value.resize(length);
+	return length == 0 || fread(&value[0], length, 1, file) == 1;
+}
+
+#endif // _INCLUDE_BYTE_IO_H_
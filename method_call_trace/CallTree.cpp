@@ -0,0 +1,73 @@
+#include "CallTree.h"
+
+#include <vector>
+
+
+const uint32_t CallTree::ROOT;
+const uint32_t CallTree::NO_NODE;
+
+CallTree::CallTree(uint32_t max_nodes) :
+	m_max_nodes(max_nodes < m_nodes.capacity() ? max_nodes : static_cast<uint32_t>(m_nodes.capacity())),
+	m_size(0),
+	m_truncated(0)
+{
+	CallNode &root = m_nodes.at(ROOT);
+	root.m_parent = NO_NODE;
+	root.m_method_id = NO_NODE;
+	m_size.store(1, std::memory_order_release);
+}
+
+uint32_t CallTree::add_node(uint32_t parent, uint32_t method_id, uint64_t key)
+{
+	const uint32_t index = m_size.load(std::memory_order_relaxed);
+	if (index >= m_max_nodes)
+	{
+		bump(m_truncated, 1);
+		return NO_NODE;
+	}
+
+	CallNode &call_node = m_nodes.at(index);
+	call_node.m_parent = parent;
+	call_node.m_method_id = method_id;
+	m_children[key] = index;
+
+	// Readers see the node's keys before they see the node
+	m_size.store(index + 1, std::memory_order_release);
+	return index;
+}
+
+void CallTree::merge(const CallTree &other)
+{
+	const uint32_t count = other.size();
+
+	// Where each of other's nodes landed in this tree, parents come first
+	std::vector<uint32_t> mapping(count, NO_NODE);
+	mapping[ROOT] = ROOT;
+
+	for (uint32_t index = 1; index < count; index++)
+	{
+		const CallNode &call_node = other.node(index);
+		mapping[index] = child(mapping[call_node.m_parent], call_node.m_method_id);
+		if (mapping[index] != NO_NODE)
+		{
+			add(mapping[index], call_node.m_calls.load(std::memory_order_relaxed), call_node.m_time.load(std::memory_order_relaxed));
+		}
+	}
+
+	bump(m_truncated, other.truncated());
+}
+
+uint32_t CallTree::size() const
+{
+	return m_size.load(std::memory_order_acquire);
+}
+
+uint64_t CallTree::truncated() const
+{
+	return m_truncated.load(std::memory_order_relaxed);
+}
+
+const CallNode &CallTree::node(uint32_t index) const
+{
+	return *m_nodes.find(index);
+}
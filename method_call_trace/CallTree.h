@@ -0,0 +1,86 @@
+#ifndef _INCLUDE_CALL_TREE_H_
+#define _INCLUDE_CALL_TREE_H_
+
+#include "PagedArray.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+
+
+struct CallNode
+{
+	uint32_t m_parent;					 // Index of the calling node
+	uint32_t m_method_id;				 // Method of this call path's last frame
+	std::atomic<uint64_t> m_calls;
+	std::atomic<uint64_t> m_time;		 // Inclusive Clock ticks
+};
+
+
+// Calling-context tree: one node per distinct call path, keyed by (parent, method).
+// Node 0 is the root. A node's parent always has a lower index, so walking the nodes
+// in order visits every parent before its children.
+//
+// One thread adds nodes and updates counters, any other thread may read or merge()
+// the published nodes without a lock.
+class CallTree
+{
+public:
+	static const uint32_t ROOT = 0;
+	static const uint32_t NO_NODE = 0xFFFFFFFF;
+
+	explicit CallTree(uint32_t max_nodes);
+
+	CallTree(CallTree const&) = delete;
+	CallTree& operator=(CallTree const&) = delete;
+
+	// Writer side. NO_NODE once the tree is full, and for every call below a NO_NODE parent.
+	uint32_t child(uint32_t parent, uint32_t method_id)
+	{
+		if (parent == NO_NODE)
+		{
+			return NO_NODE;
+		}
+
+		const uint64_t key = (static_cast<uint64_t>(parent) << 32) | method_id;
+		std::unordered_map<uint64_t, uint32_t>::const_iterator it = m_children.find(key);
+		if (it != m_children.end())
+		{
+			return it->second;
+		}
+		return add_node(parent, method_id, key);
+	}
+
+	void add(uint32_t node, uint64_t calls, uint64_t time)
+	{
+		CallNode &call_node = m_nodes.at(node);
+		bump(call_node.m_calls, calls);
+		bump(call_node.m_time, time);
+	}
+
+	// Adds other's counters along the same call paths
+	void merge(const CallTree &other);
+
+	// Reader side
+	uint32_t size() const;
+	uint64_t truncated() const;
+	const CallNode &node(uint32_t index) const;
+
+private:
+	uint32_t add_node(uint32_t parent, uint32_t method_id, uint64_t key);
+
+	static void bump(std::atomic<uint64_t> &counter, uint64_t amount)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+private:
+	const uint32_t m_max_nodes;
+	PagedArray<CallNode, 12, 256> m_nodes;
+	std::atomic<uint32_t> m_size;		 // Published node count
+	std::atomic<uint64_t> m_truncated;	 // Paths not added because the tree was full
+	std::unordered_map<uint64_t, uint32_t> m_children; // Writer only
+};
+
+#endif // _INCLUDE_CALL_TREE_H_
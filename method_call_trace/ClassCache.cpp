@@ -0,0 +1,159 @@
+#include "ClassCache.h"
+#include "ByteIO.h"
+#include "Sha256.h"
+
+#include "agent_util.h"
+#include <cerrno>
+#include <cstdio>
+
+#ifdef WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+
+// Entry file: magic, format, u64 rewrite nanos, image length, class number offset, method
+// count, then per method u8 interested, u8 trivial, u16 name length, name, u16 signature
+// length, signature, then the image. Entries of another format are misses.
+static const uint32_t ENTRY_MAGIC = 0x4543434D;		 // "MCCE"
+static const uint32_t ENTRY_FORMAT = 2;
+
+
+ClassCache::ClassCache(const std::string &directory) :
+	m_directory(directory),
+	m_next_temporary(0),
+	m_hits(0),
+	m_misses(0),
+	m_hit_nanos(0),
+	m_hit_rewrite_nanos(0),
+	m_miss_nanos(0)
+{
+	// An existing directory is fine, anything else shows when the first store fails
+#ifdef WIN32
+	_mkdir(directory.c_str());
+#else
+	mkdir(directory.c_str(), 0777);
+#endif
+}
+
+/*static*/
+std::string ClassCache::key(const std::string &context, const unsigned char *class_data, size_t length)
+{
+	// The context length keeps context and class bytes from running into each other
+	Sha256 hash;
+	const uint32_t context_length = static_cast<uint32_t>(context.length());
+	hash.update(&context_length, sizeof(context_length));
+	hash.update(context);
+	hash.update(class_data, length);
+	return hash.hex_digest();
+}
+
+std::string ClassCache::entry_path(const std::string &key) const
+{
+	return m_directory + "/" + key + ".mcc";
+}
+
+bool ClassCache::load(const std::string &key, Entry &entry) const
+{
+	FILE *file = fopen(entry_path(key).c_str(), "rb");
+	if (file == nullptr)
+	{
+		return false;
+	}
+
+	uint32_t magic = 0, format = 0, image_length = 0, method_count = 0;
+	bool ok = read_u32(file, magic) && magic == ENTRY_MAGIC && read_u32(file, format) && format == ENTRY_FORMAT &&
+		read_u64(file, entry.m_rewrite_nanos) && read_u32(file, image_length) && read_u32(file, entry.m_class_number_offset) && read_u32(file, method_count);
+
+	entry.m_methods.clear();
+	for (uint32_t i = 0; ok && i < method_count; i++)
+	{
+		Method method;
+		uint8_t interested = 0;
+		ok = read_u8(file, interested) && read_u8(file, method.m_trivial) &&
+			read_string(file, method.m_name) && read_string(file, method.m_signature);
+		method.m_interested = interested != 0;
+		entry.m_methods.push_back(method);
+	}
+
+	if (ok)
+	{
+		entry.m_image.resize(image_length);
+		ok = image_length == 0 || fread(&entry.m_image[0], image_length, 1, file) == 1;
+	}
+	ok = ok && (entry.m_class_number_offset == 0 || entry.m_class_number_offset + 4 <= image_length);
+
+	fclose(file);
+	return ok;
+}
+
+void ClassCache::store(const std::string &key, const Entry &entry) const
+{
+	// Several JVMs, or threads of one, may store the same entry at once, each writes its own file
+	const std::string path = entry_path(key);
+#ifdef WIN32
+	const std::string process = std::to_string(_getpid());
+#else
+	const std::string process = std::to_string(getpid());
+#endif
+	const std::string temporary = path + "." + process + "." + std::to_string(m_next_temporary++);
+
+	FILE *file = fopen(temporary.c_str(), "wb");
+	if (file == nullptr)
+	{
+		stdout_message("WARNING: cannot write class cache entry %s (errno %d)\n", temporary.c_str(), errno);
+		return;
+	}
+
+	bool ok = write_u32(file, ENTRY_MAGIC) && write_u32(file, ENTRY_FORMAT) && write_u64(file, entry.m_rewrite_nanos) &&
+		write_u32(file, static_cast<uint32_t>(entry.m_image.length())) &&
+		write_u32(file, entry.m_class_number_offset) && write_u32(file, static_cast<uint32_t>(entry.m_methods.size()));
+	for (size_t i = 0; ok && i < entry.m_methods.size(); i++)
+	{
+		const Method &method = entry.m_methods[i];
+		ok = write_u8(file, method.m_interested ? 1 : 0) && write_u8(file, method.m_trivial) &&
+			write_string(file, method.m_name) && write_string(file, method.m_signature);
+	}
+	ok = ok && (entry.m_image.empty() || fwrite(entry.m_image.data(), entry.m_image.length(), 1, file) == 1);
+	ok = fclose(file) == 0 && ok;
+
+	// Windows does not rename over an existing file, the entry there is just as good
+	if (!ok || rename(temporary.c_str(), path.c_str()) != 0)
+	{
+		remove(temporary.c_str());
+	}
+}
+
+void ClassCache::record_hit(uint64_t nanos, uint64_t rewrite_nanos)
+{
+	m_hits++;
+	m_hit_nanos += nanos;
+	m_hit_rewrite_nanos += rewrite_nanos;
+}
+
+void ClassCache::record_miss(uint64_t nanos)
+{
+	m_misses++;
+	m_miss_nanos += nanos;
+}
+
+void ClassCache::print_report() const
+{
+	const uint32_t hits = m_hits;
+	const uint32_t misses = m_misses;
+	stdout_message("class cache: %u hits, %u misses\n", hits, misses);
+	if (hits == 0)
+	{
+		return;
+	}
+
+	// What rewriting the hit classes took when their entries were stored, less what the hits took
+	const double hit_nanos = static_cast<double>(m_hit_nanos);
+	const double rewrite_nanos = static_cast<double>(m_hit_rewrite_nanos);
+	stdout_message("class cache: %.1f ms of rewriting saved (hits took %.1f ms, their rewrites %.1f ms)\n",
+		(rewrite_nanos - hit_nanos) / 1e6, hit_nanos / 1e6, rewrite_nanos / 1e6);
+}
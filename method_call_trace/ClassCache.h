@@ -0,0 +1,67 @@
+#ifndef _INCLUDE_CLASS_CACHE_H_
+#define _INCLUDE_CLASS_CACHE_H_
+
+#include <cstddef>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+// Rewritten class images kept in a directory from one JVM run to the next.
+//
+// An entry is keyed by a SHA-256 of everything the rewrite depends on: the rewriter
+// version, the agent options, the rewrite flags and the class bytes. It holds the new
+// image, where the class number sits in it, and the method table that mnum_callbacks()
+// gets, so a hit skips java_crw_demo altogether. Entries are written to a temporary
+// file and renamed, so JVMs sharing the directory never read half an entry.
+//
+// Safe to use from class loads on several threads at once.
+class ClassCache
+{
+public:
+	struct Method
+	{
+		std::string m_name;
+		std::string m_signature;
+		bool        m_interested;
+		uint8_t     m_trivial;				 // TrivialKind
+	};
+
+	struct Entry
+	{
+		std::string m_image;				 // Empty when the class is left as it is
+		uint32_t    m_class_number_offset;	 // Big endian u4 in m_image, 0 if none
+		uint64_t    m_rewrite_nanos;		 // What the rewrite that made the entry took
+		std::vector<Method> m_methods;
+	};
+
+	explicit ClassCache(const std::string &directory);
+
+	// context is what besides the class bytes the rewrite depends on
+	static std::string key(const std::string &context, const unsigned char *class_data, size_t length);
+
+	bool load(const std::string &key, Entry &entry) const;
+	void store(const std::string &key, const Entry &entry) const;
+
+	// Time spent on a hit (hashing and loading) or on a miss (rewriting). A hit also
+	// gets the rewrite time stored in its entry, what it would have cost without the cache.
+	void record_hit(uint64_t nanos, uint64_t rewrite_nanos);
+	void record_miss(uint64_t nanos);
+
+	// Hits and misses of this run and the rewriting time the hits saved
+	void print_report() const;
+
+private:
+	std::string entry_path(const std::string &key) const;
+
+	std::string m_directory;
+	mutable std::atomic<uint32_t> m_next_temporary;	 // Tells apart this process's temporary files
+	std::atomic<uint32_t> m_hits;
+	std::atomic<uint32_t> m_misses;
+	std::atomic<uint64_t> m_hit_nanos;
+	std::atomic<uint64_t> m_hit_rewrite_nanos;
+	std::atomic<uint64_t> m_miss_nanos;
+};
+
+#endif // _INCLUDE_CLASS_CACHE_H_
@@ -0,0 +1,164 @@
+import java.io.ByteArrayOutputStream;
+import java.io.DataOutputStream;
+import java.io.IOException;
+import java.util.ArrayList;
+import java.util.List;
+import java.util.concurrent.CountDownLatch;
+
+// Wall time to define generated classes from 1..16 class loaders in parallel, each
+// loader on its own thread. Run with and without the agent to see the hook's cost:
+//   java -Xbootclasspath/a:bridge.jar -agentpath:./libmethod_call_trace.so=include=bench -jar classload_bench.jar
+public class ClassLoadBench
+{
+	private static final int[] LOADERS = { 1, 2, 4, 8, 16 };
+
+	public static void main(String[] args) throws Exception
+	{
+		int classes = args.length > 0 ? Integer.parseInt(args[0]) : 4000;
+		int methods = args.length > 1 ? Integer.parseInt(args[1]) : 20;
+
+		// Class bytes are made up front so only defineClass is timed
+		List<byte[]> images = new ArrayList<byte[]>();
+		for (int i = 0; i < classes; i++)
+		{
+			images.add(generate("bench/Gen" + i, methods));
+		}
+
+		System.out.println("classes " + classes + ", methods per class " + methods);
+		for (int loaders : LOADERS)
+		{
+			run(images, loaders);
+		}
+	}
+
+	private static void run(final List<byte[]> images, int loaders) throws Exception
+	{
+		final CountDownLatch start = new CountDownLatch(1);
+		final List<Class<?>> defined = new ArrayList<Class<?>>();
+		List<Thread> threads = new ArrayList<Thread>();
+
+		for (int loader = 0; loader < loaders; loader++)
+		{
+			final int first = loader;
+			final int step = loaders;
+			Thread thread = new Thread(new Runnable()
+			{
+				public void run()
+				{
+					BenchLoader classLoader = new BenchLoader();
+					List<Class<?>> mine = new ArrayList<Class<?>>();
+					try
+					{
+						start.await();
+						for (int i = first; i < images.size(); i += step)
+						{
+							mine.add(classLoader.define("bench.Gen" + i, images.get(i)));
+						}
+					}
+					catch (InterruptedException e)
+					{
+						return;
+					}
+					synchronized (defined)
+					{
+						defined.addAll(mine);
+					}
+				}
+			});
+			thread.start();
+			threads.add(thread);
+		}
+
+		long begin = System.nanoTime();
+		start.countDown();
+		for (Thread thread : threads)
+		{
+			thread.join();
+		}
+		long elapsed = System.nanoTime() - begin;
+
+		// Linking verifies the rewritten bytecodes, outside the timed part
+		long sum = 0;
+		for (Class<?> cls : defined)
+		{
+			sum += (Integer) cls.getMethod("m0", int.class).invoke(null, 1);
+		}
+		if (defined.size() != images.size() || sum != images.size())
+		{
+			throw new IllegalStateException("defined " + defined.size() + " classes, sum " + sum);
+		}
+
+		System.out.printf("loaders %2d: %6.1f ms, %6.1f us/class%n", loaders, elapsed / 1e6,
+			elapsed / 1e3 / images.size());
+	}
+
+	private static class BenchLoader extends ClassLoader
+	{
+		Class<?> define(String name, byte[] image)
+		{
+			return defineClass(name, image, 0, image.length);
+		}
+	}
+
+	// public class name { public static int m<j>(int x) { return x + j; } ... }
+	private static byte[] generate(String name, int methods) throws IOException
+	{
+		ByteArrayOutputStream bytes = new ByteArrayOutputStream();
+		DataOutputStream out = new DataOutputStream(bytes);
+
+		out.writeInt(0xCAFEBABE);
+		out.writeShort(0);
+		out.writeShort(49);					// Java 5, no stack maps needed
+
+		// 1 this, 2 its name, 3 super, 4 its name, 5 "Code", 6 "(I)I", then the method names
+		out.writeShort(7 + methods);
+		out.writeByte(7);
+		out.writeShort(2);
+		out.writeByte(1);
+		out.writeUTF(name);
+		out.writeByte(7);
+		out.writeShort(4);
+		out.writeByte(1);
+		out.writeUTF("java/lang/Object");
+		out.writeByte(1);
+		out.writeUTF("Code");
+		out.writeByte(1);
+		out.writeUTF("(I)I");
+		for (int j = 0; j < methods; j++)
+		{
+			out.writeByte(1);
+			out.writeUTF("m" + j);
+		}
+
+		out.writeShort(0x0021);				// public super
+		out.writeShort(1);
+		out.writeShort(3);
+		out.writeShort(0);					// interfaces
+		out.writeShort(0);					// fields
+
+		out.writeShort(methods);
+		for (int j = 0; j < methods; j++)
+		{
+			out.writeShort(0x0009);			// public static
+			out.writeShort(7 + j);
+			out.writeShort(6);
+			out.writeShort(1);
+			out.writeShort(5);
+			out.writeInt(2 + 2 + 4 + 6 + 2 + 2);
+			out.writeShort(2);				// max_stack
+			out.writeShort(1);				// max_locals
+			out.writeInt(6);
+			out.writeByte(0x1a);			// iload_0
+			out.writeByte(0x11);			// sipush j
+			out.writeShort(j);
+			out.writeByte(0x60);			// iadd
+			out.writeByte(0xac);			// ireturn
+			out.writeShort(0);				// exception table
+			out.writeShort(0);				// attributes
+		}
+
+		out.writeShort(0);					// class attributes
+		out.flush();
+		return bytes.toByteArray();
+	}
+}
@@ -0,0 +1,116 @@
+#include "Clock.h"
+
+#include <chrono>
+
+#if defined(CLOCK_HAS_TSC)
+#include <cpuid.h>
+#endif
+
+
+bool   Clock::s_use_tsc = false;
+double Clock::s_nanos_per_tick = 1.0;
+double Clock::s_ticks_per_second = 1e9;
+
+
+#if defined(CLOCK_HAS_TSC)
+
+// CPUID.80000007H:EDX[8], the TSC runs at a constant rate in every P/C state
+static bool tsc_is_invariant()
+{
+	unsigned eax, ebx, ecx, edx;
+	if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 || eax < 0x80000007)
+	{
+		return false;
+	}
+
+	__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+	return (edx & (1u << 8)) != 0;
+}
+
+static uint64_t monotonic_nanos()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+// Pairs a TSC read with CLOCK_MONOTONIC, keeping the tightest of a few tries
+static void tsc_sample(uint64_t &tsc, uint64_t &nanos)
+{
+	uint64_t best = ~0ULL;
+	for (int i = 0; i < 5; i++)
+	{
+		const uint64_t before = __rdtsc();
+		const uint64_t mono = monotonic_nanos();
+		const uint64_t after = __rdtsc();
+
+		if (after - before < best)
+		{
+			best = after - before;
+			tsc = before + (after - before) / 2;
+			nanos = mono;
+		}
+	}
+}
+
+#endif
+
+/*static*/
+void Clock::init()
+{
+#if defined(WIN32)
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	s_ticks_per_second = static_cast<double>(frequency.QuadPart);
+#elif defined(CLOCK_HAS_TSC)
+	if (tsc_is_invariant())
+	{
+		uint64_t tsc0, nanos0, tsc1, nanos1;
+
+		// 20 ms keeps the rate error well under 1 ppm without slowing startup much
+		tsc_sample(tsc0, nanos0);
+		struct timespec pause = { 0, 20 * 1000000 };
+		nanosleep(&pause, nullptr);
+		tsc_sample(tsc1, nanos1);
+
+		if (tsc1 > tsc0 && nanos1 > nanos0)
+		{
+			s_ticks_per_second = static_cast<double>(tsc1 - tsc0) * 1e9 / static_cast<double>(nanos1 - nanos0);
+			s_use_tsc = true;
+		}
+	}
+#endif
+
+	s_nanos_per_tick = 1e9 / s_ticks_per_second;
+}
+
+/*static*/
+uint64_t Clock::ticks_per_second()
+{
+	return static_cast<uint64_t>(s_ticks_per_second + 0.5);
+}
+
+/*static*/
+const char *Clock::source()
+{
+#if defined(WIN32)
+	return "qpc";
+#elif defined(CLOCK_HAS_TSC)
+	return s_use_tsc ? "tsc" : "monotonic_raw";
+#elif defined(__linux__)
+	return "monotonic_raw";
+#else
+	return "steady_clock";
+#endif
+}
+
+/*static*/
+void Clock::sync_point(uint64_t &ticks, uint64_t &wall_nanos)
+{
+	const uint64_t before = now();
+	wall_nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	const uint64_t after = now();
+
+	ticks = before + (after - before) / 2;
+}
@@ -0,0 +1,81 @@
+#ifndef _INCLUDE_CLOCK_H_
+#define _INCLUDE_CLOCK_H_
+
+#include <cstdint>
+
+#if defined(WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#elif defined(__linux__) && defined(__x86_64__)
+#define CLOCK_HAS_TSC
+#include <time.h>
+#include <x86intrin.h>
+#elif defined(__linux__)
+#include <time.h>
+#else
+#include <chrono>
+#endif
+
+
+// Timestamp source for everything the agent measures.
+//
+// now() returns ticks of the best counter the platform has:
+//   Linux x86-64   the invariant TSC, calibrated against CLOCK_MONOTONIC by init()
+//   Linux          CLOCK_MONOTONIC_RAW in nanoseconds when the TSC is not invariant
+//   Windows        QueryPerformanceCounter
+// Durations are converted with to_nanos(). Consumers of the trace stream convert
+// timestamps with the RECORD_CLOCK_SYNC records (see TraceProtocol.h).
+class Clock
+{
+public:
+	// Called once from Agent_OnLoad, before any probe can run
+	static void init();
+
+	static uint64_t now()
+	{
+#if defined(CLOCK_HAS_TSC)
+		if (s_use_tsc)
+		{
+			return __rdtsc();
+		}
+#endif
+		return fallback_now();
+	}
+
+	static uint64_t to_nanos(uint64_t ticks)
+	{
+		return static_cast<uint64_t>(static_cast<double>(ticks) * s_nanos_per_tick);
+	}
+
+	static uint64_t ticks_per_second();
+	static const char *source();
+
+	// A tick count and the wall clock (ns since 1970) read at the same moment
+	static void sync_point(uint64_t &ticks, uint64_t &wall_nanos);
+
+private:
+	static uint64_t fallback_now()
+	{
+#if defined(WIN32)
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return static_cast<uint64_t>(counter.QuadPart);
+#elif defined(__linux__)
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+private:
+	static bool   s_use_tsc;
+	static double s_nanos_per_tick;
+	static double s_ticks_per_second;
+};
+
+#endif // _INCLUDE_CLOCK_H_
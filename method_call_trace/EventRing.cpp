@@ -0,0 +1,40 @@
+#include "EventRing.h"
+
+#include <cassert>
+
+
+EventRing::EventRing(uint32_t capacity) :
+	m_capacity(capacity),
+	m_mask(capacity - 1),
+	m_events(nullptr),
+	m_head(0),
+	m_cached_tail(0),
+	m_dropped(0),
+	m_tail(0)
+{
+	assert(capacity != 0 && (capacity & (capacity - 1)) == 0);
+
+	m_events = new TraceEvent[capacity];
+}
+
+
+EventRing::~EventRing()
+{
+	delete[] m_events;
+	m_events = nullptr;
+}
+
+bool EventRing::empty() const
+{
+	return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_relaxed);
+}
+
+uint64_t EventRing::dropped() const
+{
+	return m_dropped.load(std::memory_order_relaxed);
+}
+
+uint32_t EventRing::capacity() const
+{
+	return m_capacity;
+}
@@ -0,0 +1,143 @@
+#ifndef _INCLUDE_EVENT_RING_H_
+#define _INCLUDE_EVENT_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+
+enum EventKind
+{
+	EVENT_METHOD_ENTRY = 0,
+	EVENT_METHOD_EXIT = 1,
+	EVENT_SLOW_CALL = 2,				 // Exit of a call over the threshold, m_weight frames follow
+	EVENT_CALL_FRAME = 3,				 // Open call of a slow call's chain, timestamp at its entry
+	EVENT_THREAD_START = 4,				 // No method, the thread's first event
+	EVENT_THREAD_END = 5,				 // No method, the thread's last event
+	EVENT_CLASS_LOAD = 6				 // This thread registered class m_cnum, no method
+};
+
+struct TraceEvent
+{
+	int m_kind;							 // EventKind
+	int m_cnum;							 // Class number
+	int m_mnum;							 // Method number
+	uint32_t m_weight;					 // Calls this event stands for when sampling
+	uint64_t m_timestamp;				 // Clock::now() at the probe, or at the thread or class event
+};
+
+
+// Single producer / single consumer ring of trace events.
+// The owning Java thread is the only producer, the network worker the only consumer,
+// so neither side ever takes a lock. When the ring is full the event is dropped.
+class EventRing
+{
+public:
+	explicit EventRing(uint32_t capacity);
+	~EventRing();
+
+	EventRing(EventRing const&) = delete;
+	EventRing& operator=(EventRing const&) = delete;
+
+	// Producer side. Returns true once per half ring of events, when the consumer
+	// should be woken; a dropped event never wakes it.
+	bool push(int kind, int cnum, int mnum, uint64_t timestamp, uint32_t weight)
+	{
+		const uint32_t head = m_head.load(std::memory_order_relaxed);
+		if (head - m_cached_tail == m_capacity)
+		{
+			m_cached_tail = m_tail.load(std::memory_order_acquire);
+			if (head - m_cached_tail == m_capacity)
+			{
+				m_dropped.store(m_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				return false;
+			}
+		}
+
+		TraceEvent &event = m_events[head & m_mask];
+		event.m_kind = kind;
+		event.m_cnum = cnum;
+		event.m_mnum = mnum;
+		event.m_weight = weight;
+		event.m_timestamp = timestamp;
+		m_head.store(head + 1, std::memory_order_release);
+
+		// m_cached_tail is only refreshed when the ring looks full, so this also fires
+		// now and then while the consumer keeps up
+		return head + 1 - m_cached_tail == (m_capacity >> 1);
+	}
+
+	// Producer side: publishes count events at once, so the consumer sees all of them
+	// in the same drain or none. A group that does not fit is dropped as one event.
+	bool push_group(const TraceEvent *events, uint32_t count)
+	{
+		const uint32_t head = m_head.load(std::memory_order_relaxed);
+		if (m_capacity - (head - m_cached_tail) < count)
+		{
+			m_cached_tail = m_tail.load(std::memory_order_acquire);
+			if (m_capacity - (head - m_cached_tail) < count)
+			{
+				m_dropped.store(m_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				return false;
+			}
+		}
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			m_events[(head + i) & m_mask] = events[i];
+		}
+		m_head.store(head + count, std::memory_order_release);
+
+		const uint32_t half = m_capacity >> 1;
+		return head - m_cached_tail < half && head + count - m_cached_tail >= half;
+	}
+
+	// Producer side: false if count events would not fit. Only looks at the consumer's
+	// index when the ring seems full, like push().
+	bool has_room(uint32_t count = 1)
+	{
+		const uint32_t head = m_head.load(std::memory_order_relaxed);
+		if (m_capacity - (head - m_cached_tail) < count)
+		{
+			m_cached_tail = m_tail.load(std::memory_order_acquire);
+		}
+		return m_capacity - (head - m_cached_tail) >= count;
+	}
+
+	// Consumer side: hands every published event to the visitor, returns their count
+	template <typename Visitor>
+	size_t drain(Visitor visitor)
+	{
+		uint32_t tail = m_tail.load(std::memory_order_relaxed);
+		const uint32_t head = m_head.load(std::memory_order_acquire);
+		const size_t count = head - tail;
+
+		for (; tail != head; ++tail)
+		{
+			visitor(m_events[tail & m_mask]);
+		}
+
+		m_tail.store(tail, std::memory_order_release);
+		return count;
+	}
+
+	bool empty() const;
+	uint64_t dropped() const;
+	uint32_t capacity() const;
+
+private:
+	const uint32_t m_capacity;			 // Power of two
+	const uint32_t m_mask;
+	TraceEvent    *m_events;
+
+	// Producer and consumer indices live on separate cache lines
+	char m_pad0[64];
+	std::atomic<uint32_t> m_head;		 // Written by producer
+	uint32_t              m_cached_tail; // Producer's last view of m_tail
+	std::atomic<uint64_t> m_dropped;	 // Written by producer
+	char m_pad1[64];
+	std::atomic<uint32_t> m_tail;		 // Written by consumer
+	char m_pad2[64];
+};
+
+#endif // _INCLUDE_EVENT_RING_H_
@@ -0,0 +1,54 @@
+#ifndef _INCLUDE_EVENT_SOURCE_H_
+#define _INCLUDE_EVENT_SOURCE_H_
+
+#include "Subscription.h"
+
+#include <string>
+#include <vector>
+
+
+// What happens to new events once the output buffer is full
+enum OverflowPolicy
+{
+	OVERFLOW_DROP_NEWEST,				 // Stop draining, probes drop what no longer fits
+	OVERFLOW_DROP_OLDEST,				 // Keep draining, discard what the probes had queued
+	OVERFLOW_BLOCK,						 // Stop draining, probes wait for room before dropping
+	OVERFLOW_SAMPLE						 // Stop draining, probes trace fewer calls until it clears
+};
+
+
+// Something the network worker can pull encoded events from.
+class EventSource
+{
+public:
+	virtual ~EventSource() {}
+
+	// Written once to a client before any events
+	virtual void stream_header(std::string &buffer) = 0;
+
+	// Appends everything produced since the previous call to buffer
+	virtual void drain_events(std::string &buffer) = 0;
+
+	// The same, and each subscription gets the part it selects in its output().
+	// buffer is null when no client takes the whole stream. A source that cannot
+	// filter gives the subscribers everything.
+	virtual void drain_events(std::string *buffer, const std::vector<Subscription *> &subscriptions)
+	{
+		std::string events;
+		drain_events(events);
+
+		if (buffer != nullptr)
+		{
+			*buffer += events;
+		}
+		for (Subscription *subscription : subscriptions)
+		{
+			subscription->output() += events;
+		}
+	}
+
+	// Throws away everything produced since the previous call, counting it as dropped
+	virtual void discard_events() = 0;
+};
+
+#endif // _INCLUDE_EVENT_SOURCE_H_
@@ -0,0 +1,295 @@
+#include "FileSegmentServer.h"
+#include "Clock.h"
+#include "EventSource.h"
+#include "JVMAgentConstants.h"
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <agent_util.h>
+
+#ifdef WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <glob.h>
+#endif
+
+
+FileSegmentServer::FileSegmentServer(EventSource &source, const std::string &path) :
+	m_source(source),
+	m_path(path),
+	m_segment_bytes(static_cast<size_t>(SEGMENT_MB) * 1024 * 1024),
+	m_segment_nanos(0),
+	m_max_disk_bytes(static_cast<size_t>(MAX_DISK_MB) * 1024 * 1024),
+	m_readable_by_all(false),
+	m_current_start(0),
+	m_header_bytes(0),
+	m_sequence(0),
+	m_first_sequence(0),
+	m_closed_bytes(0),
+	m_create_failed(false),
+	m_worker_active(false),
+	m_wake_pending(false),
+	m_batches(0),
+	m_bytes_written(0),
+	m_batches_dropped(0),
+	m_segments_deleted(0)
+{
+}
+
+
+FileSegmentServer::~FileSegmentServer()
+{
+}
+
+void FileSegmentServer::set_rotation(size_t segment_bytes, uint64_t segment_ms, size_t max_disk_bytes)
+{
+	m_segment_bytes = segment_bytes;
+	m_segment_nanos = segment_ms * 1000000;
+	m_max_disk_bytes = max_disk_bytes;
+}
+
+void FileSegmentServer::set_readable_by_all(bool readable_by_all)
+{
+	m_readable_by_all = readable_by_all;
+}
+
+void FileSegmentServer::start()
+{
+	m_sequence = last_sequence();
+	m_first_sequence = m_sequence;
+
+	// The first segment is made here so a bad path stops the JVM at startup
+	if (!open_segment(0))
+	{
+		fatal_error("ERROR: Cannot create trace file %s\n", m_current.m_name.c_str());
+	}
+
+	stdout_message("Writing trace to %s.*.mtrc, %llu MB segments, %llu MB on disk\n", m_path.c_str(),
+		static_cast<unsigned long long>(m_segment_bytes / (1024 * 1024)),
+		static_cast<unsigned long long>(m_max_disk_bytes / (1024 * 1024)));
+
+	m_worker_active = true;
+	m_worker = std::thread(&FileSegmentServer::worker_proc, this);
+}
+
+void FileSegmentServer::stop()
+{
+	if (m_worker_active)
+	{
+		assert(m_worker.joinable());
+
+		m_worker_active = false;
+		wake();
+		m_worker.join();
+		close_segment();
+
+		stdout_message("Wrote %llu bytes in %llu batches to %u segments\n", m_bytes_written, m_batches, m_sequence - m_first_sequence);
+		if (m_segments_deleted != 0)
+		{
+			stdout_message("%llu segments were deleted to stay under the disk cap\n", m_segments_deleted);
+		}
+		if (m_batches_dropped != 0)
+		{
+			stdout_message("%llu batches were dropped, no segment could be created\n", m_batches_dropped);
+		}
+	}
+}
+
+void FileSegmentServer::wake()
+{
+	// No lock on this path, a wakeup lost to the race costs one flush interval at most
+	if (!m_wake_pending.exchange(true, std::memory_order_acq_rel))
+	{
+		m_wake.notify_one();
+	}
+}
+
+void FileSegmentServer::wait_for_work()
+{
+	std::unique_lock<std::mutex> guard(m_wake_lock);
+	m_wake.wait_for(guard, std::chrono::milliseconds(WORKER_FLUSH_MS), [this]()
+	{
+		return m_wake_pending.load(std::memory_order_acquire) || !m_worker_active;
+	});
+	m_wake_pending.store(false, std::memory_order_release);
+}
+
+bool FileSegmentServer::open_segment(size_t payload)
+{
+	close_segment();
+
+	std::string header;
+	m_source.stream_header(header);
+
+	// A batch bigger than a segment gets a segment of its own
+	size_t size = header.length() + payload;
+	if (size < m_segment_bytes)
+	{
+		size = m_segment_bytes;
+	}
+	trim_disk(size);
+
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%06u.mtrc", ++m_sequence);
+	m_current.m_name = m_path + suffix;
+
+	if (!m_file.create(m_current.m_name, size, m_readable_by_all))
+	{
+		if (!m_create_failed)
+		{
+			stdout_message("Cannot create trace file %s\n", m_current.m_name.c_str());
+			m_create_failed = true;
+		}
+		return false;
+	}
+
+	m_file.append(header.data(), header.length());
+	m_header_bytes = header.length();
+	m_current_start = Clock::now();
+	m_create_failed = false;
+	return true;
+}
+
+void FileSegmentServer::close_segment()
+{
+	if (m_file.is_open())
+	{
+		m_current.m_bytes = m_file.used();
+		m_file.close();
+
+		m_closed.push_back(m_current);
+		m_closed_bytes += m_current.m_bytes;
+	}
+}
+
+void FileSegmentServer::trim_disk(size_t incoming)
+{
+	while (!m_closed.empty() && m_closed_bytes + incoming > m_max_disk_bytes)
+	{
+		remove(m_closed.front().m_name.c_str());
+		m_closed_bytes -= m_closed.front().m_bytes;
+		m_closed.pop_front();
+		m_segments_deleted++;
+	}
+}
+
+unsigned FileSegmentServer::last_sequence() const
+{
+	// Names that matched path.*.mtrc, as the platform lists them
+	std::vector<std::string> names;
+	std::string prefix = m_path;
+#ifdef WIN32
+	// Found names come without their directory
+	const size_t slash = m_path.find_last_of("/\\");
+	if (slash != std::string::npos)
+	{
+		prefix = m_path.substr(slash + 1);
+	}
+
+	WIN32_FIND_DATAA found;
+	HANDLE find = FindFirstFileA((m_path + ".*.mtrc").c_str(), &found);
+	if (find != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			names.push_back(found.cFileName);
+		} while (FindNextFileA(find, &found));
+		FindClose(find);
+	}
+#else
+	glob_t found;
+	if (glob((m_path + ".*.mtrc").c_str(), GLOB_NOSORT, nullptr, &found) == 0)
+	{
+		for (size_t i = 0; i < found.gl_pathc; i++)
+		{
+			names.push_back(found.gl_pathv[i]);
+		}
+	}
+	globfree(&found);
+#endif
+
+	// Only prefix, a dot, digits and .mtrc: path.other.000003.mtrc is not ours
+	unsigned last = 0;
+	for (const std::string &name : names)
+	{
+		const size_t digits = prefix.length() + 1;
+		if (name.length() <= digits + 5 || name.compare(0, prefix.length(), prefix) != 0 ||
+			name[prefix.length()] != '.' || name.compare(name.length() - 5, 5, ".mtrc") != 0)
+		{
+			continue;
+		}
+
+		const std::string number = name.substr(digits, name.length() - 5 - digits);
+		if (number.find_first_not_of("0123456789") == std::string::npos)
+		{
+			const unsigned long sequence = strtoul(number.c_str(), nullptr, 10);
+			if (sequence > last)
+			{
+				last = static_cast<unsigned>(sequence);
+			}
+		}
+	}
+	return last;
+}
+
+void FileSegmentServer::write_batch(const std::string &batch)
+{
+	// Batches are never split, so every segment ends on a record boundary
+	if (!m_file.append(batch.data(), batch.length()))
+	{
+		if (!open_segment(batch.length()))
+		{
+			m_batches_dropped++;
+			return;
+		}
+		m_file.append(batch.data(), batch.length());
+	}
+
+	m_batches++;
+	m_bytes_written += batch.length();
+}
+
+void FileSegmentServer::worker_body()
+{
+	std::string batch;
+
+	while (m_worker_active)
+	{
+		wait_for_work();
+
+		// Only segments holding more than their header rotate, an idle agent makes no files
+		if (m_segment_nanos != 0 && m_file.is_open() && m_file.used() > m_header_bytes &&
+			Clock::to_nanos(Clock::now() - m_current_start) >= m_segment_nanos)
+		{
+			close_segment();
+		}
+
+		batch.clear();
+		m_source.drain_events(batch);
+
+		if (!batch.empty())
+		{
+			write_batch(batch);
+		}
+	}
+
+	// What the probes left behind, the end of the run is what a post-mortem wants most
+	batch.clear();
+	m_source.drain_events(batch);
+	if (!batch.empty())
+	{
+		write_batch(batch);
+	}
+}
+
+/*static */
+void FileSegmentServer::worker_proc(FileSegmentServer *self)
+{
+	self->worker_body();
+}
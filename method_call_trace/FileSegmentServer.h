@@ -0,0 +1,98 @@
+#ifndef _INCLUDE_FILE_SEGMENT_SERVER_H_
+#define _INCLUDE_FILE_SEGMENT_SERVER_H_
+
+#include "MappedFile.h"
+#include "TraceOutput.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+
+class EventSource;
+
+
+// Writes the trace stream to local disk for post-mortem analysis, no client needed.
+//
+// The stream goes into segment files path.000001.mtrc, path.000002.mtrc, ... each
+// preallocated and memory-mapped (see MappedFile.h). Numbering carries on after the
+// highest segment already at path, so a restarted JVM leaves the last run's files be. A segment starts with the
+// stream header and the whole dictionary, so any one decodes on its own. It is
+// closed when full or older than the rotation time, and the oldest segments are
+// deleted to keep this run's files under the disk cap.
+//
+// All file work happens on the worker thread; probes only ever see their rings.
+class FileSegmentServer : public TraceOutput
+{
+public:
+	FileSegmentServer(EventSource &source, const std::string &path);
+	~FileSegmentServer();
+
+	// Segment size in bytes, age in ms (0 rotates by size only) and the total on disk
+	void set_rotation(size_t segment_bytes, uint64_t segment_ms, size_t max_disk_bytes);
+
+	// Other users may read the segments, off by default
+	void set_readable_by_all(bool readable_by_all);
+
+	void start() override;
+	void stop() override;
+	void wake() override;
+
+private:
+	static void worker_proc(FileSegmentServer *self);
+	void worker_body();
+	void wait_for_work();
+
+	// Starts a new segment with room for payload bytes after its header
+	bool open_segment(size_t payload);
+	void close_segment();
+	void write_batch(const std::string &batch);
+	// Deletes the oldest segments until incoming more bytes fit under the cap
+	void trim_disk(size_t incoming);
+	// Highest sequence number of the segments already at m_path, 0 if none
+	unsigned last_sequence() const;
+
+	struct Segment
+	{
+		std::string m_name;
+		size_t      m_bytes;
+	};
+
+private:
+	EventSource &m_source;
+	std::string m_path;
+	size_t m_segment_bytes;
+	uint64_t m_segment_nanos;
+	size_t m_max_disk_bytes;
+	bool m_readable_by_all;
+
+	MappedFile m_file;
+	Segment m_current;
+	uint64_t m_current_start;			 // Clock ticks when m_current was opened
+	size_t m_header_bytes;				 // Leading stream header of m_current
+	unsigned m_sequence;
+	unsigned m_first_sequence;			 // m_sequence before this run's first segment
+	std::deque<Segment> m_closed;		 // Oldest first
+	size_t m_closed_bytes;
+	bool m_create_failed;
+
+	std::thread m_worker;
+	std::atomic<bool> m_worker_active;
+
+	// Set by wake(), cleared by the worker once it is up
+	std::atomic<bool> m_wake_pending;
+	std::mutex m_wake_lock;
+	std::condition_variable m_wake;
+
+	unsigned long long m_batches;
+	unsigned long long m_bytes_written;
+	unsigned long long m_batches_dropped;
+	unsigned long long m_segments_deleted;
+};
+
+
+#endif // _INCLUDE_FILE_SEGMENT_SERVER_H_
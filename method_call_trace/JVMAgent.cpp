@@ -1,9 +1,16 @@
 #include "JVMAgent.h"
 #include "NetworkServer.h"
+#include "SharedMemoryServer.h"
+#include "FileSegmentServer.h"
+#include "TraceProtocol.h"
+#include "Clock.h"
 
 #include "agent_util.h"
 #include "java_crw_demo.h"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <thread>
 
 
 
@@ -12,9 +19,46 @@ JVMAgent::JVMAgent():
 	m_vm_is_dead(false),
 	m_vm_is_started(false), 
 	m_lock(nullptr),
+	m_mode(MODE_TRACE),
+	m_format(FORMAT_BINARY),
+	m_snapshot_interval(COUNT_SNAPSHOT_INTERVAL_MS * 1000000ULL),
+	m_sample_default(1),
+	m_sample_budget(0),
+	m_sampling(false),
+	m_slow_threshold(0),
+	m_slow_stack(0),
+	m_array_counters(true),
+	m_backlog_bytes(PRECONNECT_BACKLOG_KB * 1024),
+	m_backlog_keep_newest(false),
+	m_port(TRACE_SERVER_PORT),
+	m_output(OUTPUT_TCP),
+	m_output_readable_by_all(false),
+	m_segment_bytes(static_cast<size_t>(SEGMENT_MB) * 1024 * 1024),
+	m_segment_ms(0),
+	m_max_disk_bytes(static_cast<size_t>(MAX_DISK_MB) * 1024 * 1024),
+	m_max_buffer_bytes(MAX_BUFFER_MB * 1024 * 1024),
+	m_overflow(OVERFLOW_DROP_NEWEST),
+	m_block_nanos(BLOCK_TIMEOUT_MS * 1000000ULL),
+	m_class_cache(nullptr),
+	m_aot_dictionary(nullptr),
+	m_class_count(0),
+	m_next_method_id(0),
+	m_dictionary_sent(0),
+	m_next_thread_id(0),
+	m_ring_events(0),
+	m_dropped_total(0),
+	m_drop_report_time(0),
+	m_snapshot_time(0),
+	m_bridge_class(nullptr),
+	m_counters_field(nullptr),
+	m_counter_table(nullptr),
+	m_array_counting(false),
+	m_sync_time(0),
+	m_adapt_time(0),
+	m_latency_report_pending(false),
+	m_retired_tree(nullptr),
 	m_server(nullptr)
 {
-	m_server = new NetworkServer();
 }
 
 
@@ -22,25 +66,131 @@ JVMAgent::~JVMAgent()
 {
 	delete m_server;
 	m_server = nullptr;
+
+	delete m_class_cache;
+	m_class_cache = nullptr;
+
+	delete m_aot_dictionary;
+	m_aot_dictionary = nullptr;
+
+	for (ThreadContext *context : m_threads)
+	{
+		delete context;
+	}
+	m_threads.clear();
+
+	for (MethodLatency *latency : m_retired_latency)
+	{
+		delete latency;
+	}
+	m_retired_latency.clear();
+
+	delete m_retired_tree;
+	m_retired_tree = nullptr;
+}
+
+
+AGENT_THREAD_LOCAL JVMAgent::ThreadContext *JVMAgent::s_thread_context = nullptr;
+AGENT_THREAD_LOCAL JVMAgent::ClassInfo *JVMAgent::s_loading_class = nullptr;
+
+
+JVMAgent::ThreadContext::ThreadContext(int id, uint32_t ring_capacity, uint32_t tree_nodes) :
+	m_id(id),
+	m_ring(nullptr),
+	m_ringless(0),
+	m_tree(nullptr),
+	m_random(0x9E3779B9u * static_cast<uint32_t>(id + 1) | 1),
+	m_degrade(0),
+	m_degrade_time(0),
+	m_discarded(0),
+	m_reported_dropped(0),
+	m_retired(false)
+{
+	if (ring_capacity != 0)
+	{
+		m_ring = new EventRing(ring_capacity);
+	}
+	if (tree_nodes != 0)
+	{
+		m_tree = new CallTree(tree_nodes);
+	}
+	m_stack.reserve(64);
+}
+
+
+uint64_t JVMAgent::ThreadContext::dropped() const
+{
+	const uint64_t lost = m_ring != nullptr ? m_ring->dropped() : m_ringless.load(std::memory_order_relaxed);
+	return lost + m_discarded;
+}
+
+JVMAgent::ThreadContext::~ThreadContext()
+{
+	delete m_ring;
+	m_ring = nullptr;
+
+	delete m_tree;
+	m_tree = nullptr;
+
+	for (MethodLatency *latency : m_latencies)
+	{
+		delete latency;
+	}
+	m_latencies.clear();
+}
+
+// get_token() for an option name: nullptr at the end of the options, fatal when the name 
+// does not fit rather than dropping it and every option after it 
+static char *get_option_name(char *options, const char *seps, char *token, int size)
+{
+	char *next = get_token(options, seps, token, size);
+	if (next == nullptr && options != nullptr && options[strspn(options, seps)] != 0)
+	{
+		fatal_error("ERROR: Unknown option: %s\n", options + strspn(options, seps));
+	}
+	return next;
+}
+
+// Counters have a single writer, so a plain load/store pair is enough 
+static inline void increment(std::atomic<uint64_t> &counter)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+/*static*/ 
+void JVMAgent::set_sample_rate(SampleRate &sample_rate, uint32_t rate)
+{
+	if (rate < 1)
+	{
+		rate = 1;
+	}
+
+	sample_rate.m_rate.store(rate, std::memory_order_relaxed);
+	sample_rate.m_threshold.store(0xFFFFFFFFu / rate, std::memory_order_relaxed);
 }
 
 /*static*/ 
 void JVMAgent::init_jvmti(JavaVM *jvm, char * options)
 {
 	JVMAgent &self = instance();
+	Clock::init();
+	const uint64_t start = Clock::now();
+
 	self.do_init_jvmti(jvm);
 	self.parse_options(options);		
 	self.init_lock();
 	self.init_capabilities();
 	self.set_event_notifications();	
 	self.set_event_callbacks();
-	self.start_network_server();
+	self.start_output();
+
+	stdout_message("Agent_OnLoad took %llu us\n", static_cast<unsigned long long>(Clock::to_nanos(Clock::now() - start) / 1000));
 }
 
 void JVMAgent::finit_jvmti(JavaVM *jvm)
 {
 	JVMAgent &self = instance();
-	self.stop_network_server();
+	self.stop_output();
 }
 
 /*static */
@@ -57,6 +207,7 @@ void JVMAgent::unlock()
 
 void JVMAgent::parse_options(char *options)
 {
+	stdout_message("clock: %s, %llu ticks/s\n", Clock::source(), static_cast<unsigned long long>(Clock::ticks_per_second()));
 	stdout_message("agent options: ");
 	stdout_message(options == nullptr ? "nullptr" : options);
 	stdout_message("\n");
@@ -69,9 +220,10 @@ void JVMAgent::parse_options(char *options)
 	{
 		return;
 	}
+	m_options = options;
 
 	// Get the first token from the options string. 
-	next = get_token(options, " ,=", token, sizeof(token));
+	next = get_option_name(options, " ,=", token, sizeof(token));
 
 	// While not at the end of the options string, process this option. 
 	while (next != nullptr)
@@ -85,6 +237,30 @@ void JVMAgent::parse_options(char *options)
 			stdout_message("The options are comma separated:\n");
 			stdout_message("\t help\t\t\t Print help information\n");
 			stdout_message("\t include=item\t\t Only these classes/methods\n");
+			stdout_message("\t mode=trace|count|time|tree Stream every call, call counts, latency histograms or call tree\n");
+			stdout_message("\t interval=ms\t\t Count and call tree snapshot period (default %d)\n", COUNT_SNAPSHOT_INTERVAL_MS);
+			stdout_message("\t counters=array|jni\t mode=count counts in Java arrays or through JNI (default array)\n");
+			stdout_message("\t sample=n\t\t Trace 1 in n calls of each method\n");
+			stdout_message("\t sample_budget=n\t Adapt each method's rate to n events/s in total\n");
+			stdout_message("\t slow_threshold_us=n\t Only send calls that took n us or more, at their exit\n");
+			stdout_message("\t slow_stack=n\t\t Enclosing calls sent with each slow call (default 0)\n");
+			stdout_message("\t skip_small=n\t\t No probes in methods with fewer than n bytecode bytes\n");
+			stdout_message("\t skip_accessors=on|off\t No probes in plain field getters and setters\n");
+			stdout_message("\t skip_synthetic=on|off\t No probes in synthetic and bridge methods\n");
+			stdout_message("\t cache=dir\t\t Keep rewritten classes in dir for later runs\n");
+			stdout_message("\t aot=file\t\t Dictionary of classes aot_instrument rewrote, loaded as they are\n");
+			stdout_message("\t format=text|binary\t Trace stream format (default binary)\n");
+			stdout_message("\t output=tcp|shm:name|file:path Trace server, shared memory ring or segment files (default tcp)\n");
+			stdout_message("\t output_access=owner|all Who may read the shm ring or segment files (default owner)\n");
+			stdout_message("\t port=n\t\t\t Trace server port (default %d)\n", TRACE_SERVER_PORT);
+			stdout_message("\t backlog=kb\t\t Output kept until a client connects (default %d)\n", PRECONNECT_BACKLOG_KB);
+			stdout_message("\t backlog_keep=oldest|newest Which output a full backlog keeps\n");
+			stdout_message("\t max_buffer_mb=n\t Memory for queued output (default %d)\n", MAX_BUFFER_MB);
+			stdout_message("\t overflow=drop_newest|drop_oldest|block|sample What a full buffer does\n");
+			stdout_message("\t block_ms=n\t\t overflow=block longest wait (default %d)\n", BLOCK_TIMEOUT_MS);
+			stdout_message("\t segment_mb=n\t\t output=file segment size (default %d)\n", SEGMENT_MB);
+			stdout_message("\t segment_s=n\t\t output=file segment age limit (default none)\n");
+			stdout_message("\t max_disk_mb=n\t\t output=file total, oldest segments deleted (default %d)\n", MAX_DISK_MB);
 			stdout_message("\n");
 			stdout_message("item\t Qualified class and/or method names\n");
 			stdout_message("\n");
@@ -102,170 +278,581 @@ void JVMAgent::parse_options(char *options)
 				fatal_error("ERROR: include option error\n");
 			}
 		}
-		else if (token[0] != 0)
+		else if (strcmp(token, "mode") == 0)
 		{
-			// We got a non-empty token and we don't know what it is. 
-			fatal_error("ERROR: Unknown option: %s\n", token);
+			char value[MAX_TOKEN_LENGTH];
+
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr)
+			{
+				fatal_error("ERROR: mode option error\n");
+			}
+
+			if (strcmp(value, "trace") == 0)
+			{
+				m_mode = MODE_TRACE;
+			}
+			else if (strcmp(value, "count") == 0)
+			{
+				m_mode = MODE_COUNT;
+			}
+			else if (strcmp(value, "time") == 0)
+			{
+				m_mode = MODE_TIME;
+			}
+			else if (strcmp(value, "tree") == 0)
+			{
+				m_mode = MODE_TREE;
+			}
+			else
+			{
+				fatal_error("ERROR: Unknown mode: %s\n", value);
+			}
 		}
+		else if (strcmp(token, "counters") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
 
-		// Get the next token (returns nullptr if there are no more) 
-		next = get_token(next, ",=", token, sizeof(token));
-	}
-}
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr)
+			{
+				fatal_error("ERROR: counters option error\n");
+			}
 
-void JVMAgent::do_init_jvmti(JavaVM *jvm)
-{
-	jint res = jvm->GetEnv(reinterpret_cast<void **>(&m_jvmti), JVMTI_VERSION_1);
-	if (res != JNI_OK)
-	{
-		// This means that the VM was unable to obtain this version of the
-		// JVMTI interface, this is a fatal error.         
-		fatal_error("ERROR: Unable to access JVMTI Version 1 (0x%x),"
-			" is your JDK a 5.0 or newer version?"
-			" JNIEnv's GetEnv() returned %d\n",
-			JVMTI_VERSION_1, res);
-	}
-}
+			if (strcmp(value, "array") == 0)
+			{
+				m_array_counters = true;
+			}
+			else if (strcmp(value, "jni") == 0)
+			{
+				m_array_counters = false;
+			}
+			else
+			{
+				fatal_error("ERROR: Unknown counters: %s\n", value);
+			}
+		}
+		else if (strcmp(token, "interval") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
 
-void JVMAgent::init_capabilities() const
-{
-	jvmtiError error;
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr || atoi(value) <= 0)
+			{
+				fatal_error("ERROR: interval option error\n");
+			}
 
-	static jvmtiCapabilities capabilities;
-	(void)memset(&capabilities, 0, sizeof(jvmtiCapabilities));
-	capabilities.can_generate_all_class_hook_events = 1;
-	error = m_jvmti->AddCapabilities(&capabilities);
-	check_jvmti_error(m_jvmti, error, "Unable to get necessary JVMTI capabilities.");
-}
+			m_snapshot_interval = atoi(value) * 1000000ULL;
+		}
+		else if (strcmp(token, "sample") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
 
-void JVMAgent::set_event_notifications() const
-{
-	jvmtiEnv *jvmti = m_jvmti;
-	jvmtiError error;
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr || atoi(value) <= 0 || atoi(value) > SAMPLE_MAX_RATE)
+			{
+				fatal_error("ERROR: sample option error\n");
+			}
 
-	/* At first the only initial events we are interested in are VM
-	*   initialization, VM death, and Class File Loads.
-	*   Once the VM is initialized we will request more events.
-	*/
-	error = (*jvmti).SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_START, static_cast<jthread>(nullptr));
-	check_jvmti_error(jvmti, error, "Cannot set event notification");
+			m_sample_default = atoi(value);
+		}
+		else if (strcmp(token, "slow_threshold_us") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
 
-	error = (*jvmti).SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_INIT, static_cast<jthread>(nullptr));
-	check_jvmti_error(jvmti, error, "Cannot set event notification");
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr || atoi(value) <= 0)
+			{
+				fatal_error("ERROR: slow_threshold_us option error\n");
+			}
 
-	error = (*jvmti).SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_DEATH, static_cast<jthread>(nullptr));
-	check_jvmti_error(jvmti, error, "Cannot set event notification");
+			m_slow_threshold = atoi(value) * 1000ULL;
+		}
+		else if (strcmp(token, "slow_stack") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
 
-	error = (*jvmti).SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, static_cast<jthread>(nullptr));
-	check_jvmti_error(jvmti, error, "Cannot set event notification");
-}
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr || atoi(value) < 0 || atoi(value) > SLOW_STACK_MAX)
+			{
+				fatal_error("ERROR: slow_stack option error\n");
+			}
 
-void JVMAgent::set_event_callbacks() const 
-{
-	jvmtiEnv *jvmti = m_jvmti;
-	jvmtiError error;
+			m_slow_stack = atoi(value);
+		}
+		else if (strcmp(token, "skip_small") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
 
-	jvmtiEventCallbacks callbacks;
-	(void)memset(&callbacks, 0, sizeof(callbacks));
-	callbacks.VMStart = &JVMAgent::cbVMStart; // JVMTI_EVENT_VM_START 
-	callbacks.VMInit = &JVMAgent::cbVMInit; // JVMTI_EVENT_VM_INIT 
-	callbacks.VMDeath = &JVMAgent::cbVMDeath; // JVMTI_EVENT_VM_DEATH 
-	callbacks.ClassFileLoadHook = &JVMAgent::cbClassFileLoadHook; // JVMTI_EVENT_CLASS_FILE_LOAD_HOOK     
-	callbacks.ThreadStart = &JVMAgent::cbThreadStart; // JVMTI_EVENT_THREAD_START 
-	callbacks.ThreadEnd = &JVMAgent::cbThreadEnd; // JVMTI_EVENT_THREAD_END 
-	error = jvmti->SetEventCallbacks(&callbacks, static_cast<jint>(sizeof(callbacks)));
-	check_jvmti_error(jvmti, error, "Cannot set jvmti callbacks");
-}
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr || atoi(value) < 0)
+			{
+				fatal_error("ERROR: skip_small option error\n");
+			}
 
-void JVMAgent::init_lock()
-{
-	jvmtiEnv *jvmti = m_jvmti;
-	jvmtiError error;
+			m_trivial_methods.set_min_code_length(atoi(value));
+		}
+		else if (strcmp(token, "skip_accessors") == 0 || strcmp(token, "skip_synthetic") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
 
-	error = (*jvmti).CreateRawMonitor("agent data", &(m_lock));
-	check_jvmti_error(jvmti, error, "Cannot create raw monitor");
-}
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr || (strcmp(value, "on") != 0 && strcmp(value, "off") != 0))
+			{
+				fatal_error("ERROR: %s option error\n", token);
+			}
 
-void JVMAgent::do_lock() const
-{
-	jvmtiError error = m_jvmti->RawMonitorEnter(m_lock);
-	check_jvmti_error(m_jvmti, error, "Cannot enter with raw monitor");
-}
+			const bool skip = strcmp(value, "on") == 0;
+			if (strcmp(token, "skip_accessors") == 0)
+			{
+				m_trivial_methods.set_accessors(skip);
+			}
+			else
+			{
+				m_trivial_methods.set_synthetic(skip);
+			}
+		}
+		else if (strcmp(token, "sample_budget") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
 
-void JVMAgent::do_unlock() const
-{
-	jvmtiError error = m_jvmti->RawMonitorExit(m_lock);
-	check_jvmti_error(m_jvmti, error, "Cannot exit with raw monitor");
-}
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr || atoi(value) <= 0)
+			{
+				fatal_error("ERROR: sample_budget option error\n");
+			}
 
-//////////////////////////////////////////////////////////
-//
-//////////////////////////////////////////////////////////
+			m_sample_budget = atoi(value);
+		}
+		else if (strcmp(token, "cache") == 0)
+		{
+			char value[MAX_OUTPUT_LENGTH];
 
-/*static*/ 
-void JVMAgent::MTRACE_native_entry(JNIEnv *env, jclass klass, jobject thread, jint cnum, jint mnum)
-{
-	JVMAgent::instance().process_method_entry(env, klass, thread, cnum, mnum);
-}
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr || value[0] == 0)
+			{
+				fatal_error("ERROR: cache option error\n");
+			}
 
-/*static*/ 
-void JVMAgent::MTRACE_native_exit(JNIEnv *env, jclass klass, jobject thread, jint cnum, jint mnum)
-{
-	JVMAgent::instance().process_method_exit(env, klass, thread, cnum, mnum);
-}
+			delete m_class_cache;
+			m_class_cache = new ClassCache(value);
+		}
+		else if (strcmp(token, "aot") == 0)
+		{
+			char value[MAX_OUTPUT_LENGTH];
 
-/////////////////////////////////////////////////////////////////////////////
-//
-/////////////////////////////////////////////////////////////////////////////
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr || value[0] == 0)
+			{
+				fatal_error("ERROR: aot option error\n");
+			}
 
-// JVMTI_EVENT_VM_START 
-void __stdcall JVMAgent::cbVMStart(jvmtiEnv *jvmti, JNIEnv *env)
-{
-	JVMAgent::instance().process_cbVMStart(jvmti, env);
-}
+			delete m_aot_dictionary;
+			m_aot_dictionary = new AotDictionary();
+			if (!m_aot_dictionary->load(value))
+			{
+				fatal_error("ERROR: Cannot load aot dictionary %s\n", value);
+			}
 
-// JVMTI_EVENT_VM_INIT 
-void __stdcall JVMAgent::cbVMInit(jvmtiEnv *jvmti, JNIEnv* env, jthread thread)
-{
-	JVMAgent::instance().process_cbVMInit(jvmti, env, thread);
-}
+			// Numbers at run time come after the ones the instrumented classes carry 
+			m_class_count = m_aot_dictionary->class_count();
+		}
+		else if (strcmp(token, "output") == 0)
+		{
+			char value[MAX_OUTPUT_LENGTH];
 
-// JVMTI_EVENT_VM_DEATH 
-void __stdcall JVMAgent::cbVMDeath(jvmtiEnv *jvmti, JNIEnv* env)
-{
-	JVMAgent::instance().process_cbVMDeath(jvmti, env);
-}
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr)
+			{
+				fatal_error("ERROR: output option error\n");
+			}
 
-// JVMTI_EVENT_THREAD_START 
-void __stdcall JVMAgent::cbThreadStart(jvmtiEnv *jvmti, JNIEnv *env, jthread thread)
-{
-	JVMAgent::instance().process_cbThreadStart(jvmti, env, thread);
-}
+			if (strcmp(value, "tcp") == 0)
+			{
+				m_output = OUTPUT_TCP;
+			}
+			else if (strncmp(value, "shm:", 4) == 0 && value[4] != 0)
+			{
+				m_output = OUTPUT_SHM;
+				m_output_name = value + 4;
+			}
+			else if (strncmp(value, "file:", 5) == 0 && value[5] != 0)
+			{
+				m_output = OUTPUT_FILE;
+				m_output_name = value + 5;
+			}
+			else
+			{
+				fatal_error("ERROR: Unknown output: %s\n", value);
+			}
+		}
+		else if (strcmp(token, "port") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
 
-// JVMTI_EVENT_THREAD_END
-void __stdcall JVMAgent::cbThreadEnd(jvmtiEnv *jvmti, JNIEnv *env, jthread thread)
-{
-	JVMAgent::instance().process_cbThreadEnd(jvmti, env, thread);
-}
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr || atoi(value) <= 0 || atoi(value) > 0xFFFF)
+			{
+				fatal_error("ERROR: port option error\n");
+			}
 
-// JVMTI_EVENT_CLASS_FILE_LOAD_HOOK 
-void __stdcall JVMAgent::cbClassFileLoadHook(jvmtiEnv *jvmti, JNIEnv* env,
-	jclass class_being_redefined, jobject loader,
-	const char* name, jobject protection_domain,
-	jint class_data_len, const unsigned char* class_data,
-	jint* new_class_data_len, unsigned char** new_class_data)
-{
-	JVMAgent::instance().process_cbClassFileLoadHook(jvmti, env, class_being_redefined, loader,
-		name, protection_domain, class_data_len, class_data, new_class_data_len, new_class_data);	
-}
+			m_port = atoi(value);
+		}
+		else if (strcmp(token, "backlog") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
 
-void JVMAgent::process_cbVMStart(jvmtiEnv *jvmti, JNIEnv *env)
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr || atoi(value) < 0)
+			{
+				fatal_error("ERROR: backlog option error\n");
+			}
+
+			m_backlog_bytes = static_cast<size_t>(atoi(value)) * 1024;
+		}
+		else if (strcmp(token, "output_access") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
+
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr)
+			{
+				fatal_error("ERROR: output_access option error\n");
+			}
+
+			if (strcmp(value, "owner") == 0)
+			{
+				m_output_readable_by_all = false;
+			}
+			else if (strcmp(value, "all") == 0)
+			{
+				m_output_readable_by_all = true;
+			}
+			else
+			{
+				fatal_error("ERROR: Unknown output_access: %s\n", value);
+			}
+		}
+		else if (strcmp(token, "backlog_keep") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
+
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr)
+			{
+				fatal_error("ERROR: backlog_keep option error\n");
+			}
+
+			if (strcmp(value, "oldest") == 0)
+			{
+				m_backlog_keep_newest = false;
+			}
+			else if (strcmp(value, "newest") == 0)
+			{
+				m_backlog_keep_newest = true;
+			}
+			else
+			{
+				fatal_error("ERROR: Unknown backlog_keep: %s\n", value);
+			}
+		}
+		else if (strcmp(token, "max_buffer_mb") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
+
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr || atoi(value) <= 0)
+			{
+				fatal_error("ERROR: max_buffer_mb option error\n");
+			}
+
+			m_max_buffer_bytes = static_cast<size_t>(atoi(value)) * 1024 * 1024;
+		}
+		else if (strcmp(token, "overflow") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
+
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr)
+			{
+				fatal_error("ERROR: overflow option error\n");
+			}
+
+			if (strcmp(value, "drop_newest") == 0)
+			{
+				m_overflow = OVERFLOW_DROP_NEWEST;
+			}
+			else if (strcmp(value, "drop_oldest") == 0)
+			{
+				m_overflow = OVERFLOW_DROP_OLDEST;
+			}
+			else if (strcmp(value, "block") == 0)
+			{
+				m_overflow = OVERFLOW_BLOCK;
+			}
+			else if (strcmp(value, "sample") == 0)
+			{
+				m_overflow = OVERFLOW_SAMPLE;
+			}
+			else
+			{
+				fatal_error("ERROR: Unknown overflow: %s\n", value);
+			}
+		}
+		else if (strcmp(token, "block_ms") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
+
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr || atoi(value) < 0)
+			{
+				fatal_error("ERROR: block_ms option error\n");
+			}
+
+			m_block_nanos = static_cast<uint64_t>(atoi(value)) * 1000000ULL;
+		}
+		else if (strcmp(token, "segment_mb") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
+
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr || atoi(value) <= 0)
+			{
+				fatal_error("ERROR: segment_mb option error\n");
+			}
+
+			m_segment_bytes = static_cast<size_t>(atoi(value)) * 1024 * 1024;
+		}
+		else if (strcmp(token, "segment_s") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
+
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr || atoi(value) < 0)
+			{
+				fatal_error("ERROR: segment_s option error\n");
+			}
+
+			m_segment_ms = static_cast<uint64_t>(atoi(value)) * 1000;
+		}
+		else if (strcmp(token, "max_disk_mb") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
+
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr || atoi(value) <= 0)
+			{
+				fatal_error("ERROR: max_disk_mb option error\n");
+			}
+
+			m_max_disk_bytes = static_cast<size_t>(atoi(value)) * 1024 * 1024;
+		}
+		else if (strcmp(token, "format") == 0)
+		{
+			char value[MAX_TOKEN_LENGTH];
+
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr)
+			{
+				fatal_error("ERROR: format option error\n");
+			}
+
+			if (strcmp(value, "text") == 0)
+			{
+				m_format = FORMAT_TEXT;
+			}
+			else if (strcmp(value, "binary") == 0)
+			{
+				m_format = FORMAT_BINARY;
+			}
+			else
+			{
+				fatal_error("ERROR: Unknown format: %s\n", value);
+			}
+		}
+		else if (token[0] != 0)
+		{
+			// We got a non-empty token and we don't know what it is. 
+			fatal_error("ERROR: Unknown option: %s\n", token);
+		}
+
+		// Get the next token (returns nullptr if there are no more) 
+		next = get_option_name(next, ",=", token, sizeof(token));
+	}
+
+	// overflow=sample needs the sampled probes to have something to turn down. 
+	// Slow calls are picked by their time, sampling does not apply to them. 
+	if (m_mode != MODE_TRACE)
+	{
+		m_slow_threshold = 0;
+	}
+	m_sampling = m_mode == MODE_TRACE && m_slow_threshold == 0 &&
+		(m_sample_default > 1 || m_sample_budget != 0 || m_overflow == OVERFLOW_SAMPLE);
+}
+
+void JVMAgent::do_init_jvmti(JavaVM *jvm)
+{
+	jint res = jvm->GetEnv(reinterpret_cast<void **>(&m_jvmti), JVMTI_VERSION_1);
+	if (res != JNI_OK)
+	{
+		// This means that the VM was unable to obtain this version of the
+		// JVMTI interface, this is a fatal error.         
+		fatal_error("ERROR: Unable to access JVMTI Version 1 (0x%x),"
+			" is your JDK a 5.0 or newer version?"
+			" JNIEnv's GetEnv() returned %d\n",
+			JVMTI_VERSION_1, res);
+	}
+}
+
+void JVMAgent::init_capabilities() const
+{
+	jvmtiError error;
+
+	static jvmtiCapabilities capabilities;
+	(void)memset(&capabilities, 0, sizeof(jvmtiCapabilities));
+	capabilities.can_generate_all_class_hook_events = 1;
+	error = m_jvmti->AddCapabilities(&capabilities);
+	check_jvmti_error(m_jvmti, error, "Unable to get necessary JVMTI capabilities.");
+}
+
+void JVMAgent::set_event_notifications() const
+{
+	jvmtiEnv *jvmti = m_jvmti;
+	jvmtiError error;
+
+	/* At first the only initial events we are interested in are VM
+	*   initialization, VM death, and Class File Loads.
+	*   Once the VM is initialized we will request more events.
+	*/
+	error = (*jvmti).SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_START, static_cast<jthread>(nullptr));
+	check_jvmti_error(jvmti, error, "Cannot set event notification");
+
+	error = (*jvmti).SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_INIT, static_cast<jthread>(nullptr));
+	check_jvmti_error(jvmti, error, "Cannot set event notification");
+
+	error = (*jvmti).SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_DEATH, static_cast<jthread>(nullptr));
+	check_jvmti_error(jvmti, error, "Cannot set event notification");
+
+	error = (*jvmti).SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, static_cast<jthread>(nullptr));
+	check_jvmti_error(jvmti, error, "Cannot set event notification");
+
+	error = (*jvmti).SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_DATA_DUMP_REQUEST, static_cast<jthread>(nullptr));
+	check_jvmti_error(jvmti, error, "Cannot set event notification");
+}
+
+void JVMAgent::set_event_callbacks() const 
+{
+	jvmtiEnv *jvmti = m_jvmti;
+	jvmtiError error;
+
+	jvmtiEventCallbacks callbacks;
+	(void)memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.VMStart = &JVMAgent::cbVMStart; // JVMTI_EVENT_VM_START 
+	callbacks.VMInit = &JVMAgent::cbVMInit; // JVMTI_EVENT_VM_INIT 
+	callbacks.VMDeath = &JVMAgent::cbVMDeath; // JVMTI_EVENT_VM_DEATH 
+	callbacks.ClassFileLoadHook = &JVMAgent::cbClassFileLoadHook; // JVMTI_EVENT_CLASS_FILE_LOAD_HOOK     
+	callbacks.ThreadStart = &JVMAgent::cbThreadStart; // JVMTI_EVENT_THREAD_START 
+	callbacks.ThreadEnd = &JVMAgent::cbThreadEnd; // JVMTI_EVENT_THREAD_END 
+	callbacks.DataDumpRequest = &JVMAgent::cbDataDumpRequest; // JVMTI_EVENT_DATA_DUMP_REQUEST 
+	error = jvmti->SetEventCallbacks(&callbacks, static_cast<jint>(sizeof(callbacks)));
+	check_jvmti_error(jvmti, error, "Cannot set jvmti callbacks");
+}
+
+void JVMAgent::init_lock()
+{
+	jvmtiEnv *jvmti = m_jvmti;
+	jvmtiError error;
+
+	error = (*jvmti).CreateRawMonitor("agent data", &(m_lock));
+	check_jvmti_error(jvmti, error, "Cannot create raw monitor");
+}
+
+void JVMAgent::do_lock() const
+{
+	jvmtiError error = m_jvmti->RawMonitorEnter(m_lock);
+	check_jvmti_error(m_jvmti, error, "Cannot enter with raw monitor");
+}
+
+void JVMAgent::do_unlock() const
+{
+	jvmtiError error = m_jvmti->RawMonitorExit(m_lock);
+	check_jvmti_error(m_jvmti, error, "Cannot exit with raw monitor");
+}
+
+//////////////////////////////////////////////////////////
+//
+//////////////////////////////////////////////////////////
+
+/*static*/ 
+void JNICALL JVMAgent::MTRACE_native_entry(JNIEnv *env, jclass klass, jint cnum, jint mnum)
+{
+	JVMAgent::instance().process_method_entry(env, klass, cnum, mnum);
+}
+
+/*static*/ 
+void JNICALL JVMAgent::MTRACE_native_exit(JNIEnv *env, jclass klass, jint cnum, jint mnum)
+{
+	JVMAgent::instance().process_method_exit(env, klass, cnum, mnum);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+/////////////////////////////////////////////////////////////////////////////
+
+// JVMTI_EVENT_VM_START 
+void JNICALL JVMAgent::cbVMStart(jvmtiEnv *jvmti, JNIEnv *env)
+{
+	JVMAgent::instance().process_cbVMStart(jvmti, env);
+}
+
+// JVMTI_EVENT_VM_INIT 
+void JNICALL JVMAgent::cbVMInit(jvmtiEnv *jvmti, JNIEnv* env, jthread thread)
+{
+	JVMAgent::instance().process_cbVMInit(jvmti, env, thread);
+}
+
+// JVMTI_EVENT_VM_DEATH 
+void JNICALL JVMAgent::cbVMDeath(jvmtiEnv *jvmti, JNIEnv* env)
+{
+	JVMAgent::instance().process_cbVMDeath(jvmti, env);
+}
+
+// JVMTI_EVENT_THREAD_START 
+void JNICALL JVMAgent::cbThreadStart(jvmtiEnv *jvmti, JNIEnv *env, jthread thread)
+{
+	JVMAgent::instance().process_cbThreadStart(jvmti, env, thread);
+}
+
+// JVMTI_EVENT_THREAD_END
+void JNICALL JVMAgent::cbThreadEnd(jvmtiEnv *jvmti, JNIEnv *env, jthread thread)
+{
+	JVMAgent::instance().process_cbThreadEnd(jvmti, env, thread);
+}
+
+// JVMTI_EVENT_DATA_DUMP_REQUEST 
+void JNICALL JVMAgent::cbDataDumpRequest(jvmtiEnv *jvmti)
+{
+	JVMAgent::instance().process_cbDataDumpRequest(jvmti);
+}
+
+// JVMTI_EVENT_CLASS_FILE_LOAD_HOOK 
+void JNICALL JVMAgent::cbClassFileLoadHook(jvmtiEnv *jvmti, JNIEnv* env,
+	jclass class_being_redefined, jobject loader,
+	const char* name, jobject protection_domain,
+	jint class_data_len, const unsigned char* class_data,
+	jint* new_class_data_len, unsigned char** new_class_data)
+{
+	JVMAgent::instance().process_cbClassFileLoadHook(jvmti, env, class_being_redefined, loader,
+		name, protection_domain, class_data_len, class_data, new_class_data_len, new_class_data);	
+}
+
+void JVMAgent::process_cbVMStart(jvmtiEnv *jvmti, JNIEnv *env)
 {
 	stdout_message("VMStart\n");
 	m_vm_is_started = JNI_TRUE;
 }
 
-void JVMAgent::process_cbVMInit(jvmtiEnv *jvmti, JNIEnv *env, jthread thread) const
+void JVMAgent::process_cbVMInit(jvmtiEnv *jvmti, JNIEnv *env, jthread thread)
 {
 	lock();
 	{
@@ -275,9 +862,9 @@ void JVMAgent::process_cbVMInit(jvmtiEnv *jvmti, JNIEnv *env, jthread thread) co
 
 		// Java Native Methods for class 
 		static JNINativeMethod registry[2] = {
-			{ STRING(MTRACE_native_entry), "(Ljava/lang/Object;II)V",
+			{ const_cast<char *>(STRING(MTRACE_native_entry)), const_cast<char *>("(II)V"),
 			(void*)&MTRACE_native_entry },
-			{ STRING(MTRACE_native_exit), "(Ljava/lang/Object;II)V",
+			{ const_cast<char *>(STRING(MTRACE_native_exit)), const_cast<char *>("(II)V"),
 			(void*)&MTRACE_native_exit }
 		};
 
@@ -306,6 +893,12 @@ void JVMAgent::process_cbVMInit(jvmtiEnv *jvmti, JNIEnv *env, jthread thread) co
 
 		(*env).SetStaticIntField(klass, field, 1);
 
+		// Classes loaded from now on count in arrays, the ones before keep calling the bridge 
+		if (m_mode == MODE_COUNT && m_array_counters)
+		{
+			init_counter_arrays(jvmti, env, klass);
+		}
+
 		/////////////////////////////////////////////
 		/////////////////////////////////////////////
 		/////////////////////////////////////////////
@@ -338,6 +931,11 @@ void JVMAgent::process_cbVMInit(jvmtiEnv *jvmti, JNIEnv *env, jthread thread) co
 
 void JVMAgent::process_cbVMDeath(jvmtiEnv *jvmti, JNIEnv *env)
 {
+	if (m_mode == MODE_TIME)
+	{
+		print_latency_report();
+	}
+
 	lock();
 	{
 		jclass   klass;
@@ -361,14 +959,31 @@ void JVMAgent::process_cbVMDeath(jvmtiEnv *jvmti, JNIEnv *env)
 
 		(*env).SetStaticIntField(klass, field, 0);
 
-		m_vm_is_dead = JNI_TRUE;
+		// Last counts for the final snapshot, the counter thread stops here 
+		if (m_counter_table != nullptr)
+		{
+			read_counter_arrays(env);
+		}
+
+		m_vm_is_dead = JNI_TRUE;
 
+		if (m_class_cache != nullptr)
+		{
+			m_class_cache->print_report();
+		}
 	}
 	unlock();
 }
 
-void JVMAgent::process_cbThreadStart(jvmtiEnv *jvmti, JNIEnv *env, jthread thread) const
+void JVMAgent::process_cbThreadStart(jvmtiEnv *jvmti, JNIEnv *env, jthread thread)
 {
+	// Sent on the new thread, which gets its number and ring here rather than at its 
+	// first probe. Pushed without the agent lock, overflow=block may wait on the worker 
+	if (m_mode == MODE_TRACE && !m_vm_is_dead)
+	{
+		push_event(current_thread_context(), EVENT_THREAD_START, 0, 0, 1);
+	}
+
 	lock();
 	{
 		// It's possible we get here right after VmDeath event, be careful 
@@ -383,8 +998,22 @@ void JVMAgent::process_cbThreadStart(jvmtiEnv *jvmti, JNIEnv *env, jthread threa
 	unlock();
 }
 
-void JVMAgent::process_cbThreadEnd(jvmtiEnv *jvmti, JNIEnv *env, jthread thread) const
+void JVMAgent::process_cbThreadEnd(jvmtiEnv *jvmti, JNIEnv *env, jthread thread)
 {
+	// Sent on the ending thread itself. Hand its context over to the network worker, 
+	// which frees it once drained 
+	ThreadContext *context = s_thread_context;
+	if (context != nullptr)
+	{
+		if (m_mode == MODE_TRACE && !m_vm_is_dead)
+		{
+			push_event(context, EVENT_THREAD_END, 0, 0, 1);
+		}
+
+		s_thread_context = nullptr;
+		context->m_retired.store(true, std::memory_order_release);
+	}
+
 	lock();
 	{
 		// It's possible we get here right after VmDeath event, be careful 
@@ -399,110 +1028,473 @@ void JVMAgent::process_cbThreadEnd(jvmtiEnv *jvmti, JNIEnv *env, jthread thread)
 	unlock();
 }
 
+void JVMAgent::process_cbDataDumpRequest(jvmtiEnv *jvmti)
+{
+	// Ctrl-Break, SIGQUIT or jcmd; the JVM prints its thread dump alongside 
+	stdout_message("DataDumpRequest\n");
+
+	if (m_mode == MODE_TIME && !m_vm_is_dead)
+	{
+		print_latency_report();
+	}
+}
+
 void JVMAgent::process_cbClassFileLoadHook(jvmtiEnv *jvmti, JNIEnv *env, jclass class_being_redefined, jobject loader, const char *name, jobject protection_domain, jint class_data_len, const unsigned char *class_data, jint *new_class_data_len, unsigned char **new_class_data)
 {
-	lock();
+	// Runs without the agent lock so parallel class loaders rewrite in parallel, only 
+	// register_class() takes it. It's possible we get here right after VmDeath event, be careful 
+	if (m_vm_is_dead)
 	{
-		// It's possible we get here right after VmDeath event, be careful 
-		if (!m_vm_is_dead)
+		return;
+	}
+
+	const char *classname;
+
+	/* Name could be nullptr */
+	if (name == nullptr)
+	{
+		classname = java_crw_demo_classname(class_data, class_data_len, nullptr);
+		if (classname == nullptr)
+		{
+			fatal_error("ERROR: No classname inside classfile\n");
+		}
+	}
+	else
+	{
+		classname = strdup(name);
+		if (classname == nullptr)
+		{
+			fatal_error("ERROR: Out of malloc memory\n");
+		}
+	}
+
+	*new_class_data_len = 0;
+	*new_class_data = nullptr;
+
+	// A class aot_instrument rewrote already has its probes and class number 
+	const AotDictionary::Class *instrumented = m_aot_dictionary != nullptr ?
+		m_aot_dictionary->find(classname, class_data, static_cast<size_t>(class_data_len)) : nullptr;
+
+	if (instrumented != nullptr)
+	{
+		use_instrumented_class(env, *instrumented);
+	}
+	else if (interested(const_cast<char*>(classname), const_cast<char *>(""), const_cast<char *>(m_include.data()), nullptr) &&
+		has_included_method(classname, class_data, class_data_len))
+	{
+		stdout_message("Class load %s\n", classname);
+
+		jint           cnum;
+		int            system_class;
+		unsigned char *new_image;
+		long           new_length;
+		ClassInfo      loaded;
+
+		/* Get unique number for every class file image loaded */
+		cnum = static_cast<jint>(m_class_count.fetch_add(1));
+
+		/* Class information is collected here, no other thread sees it before register_class() */
+		loaded.m_name = classname;
+		loaded.m_calls = 0;
+		loaded.m_mcount = 0;
+		loaded.m_method_base = 0;
+
+		/* Is it a system class? If the class load is before VmStart
+		*   then we will consider it a system class that should
+		*   be treated carefully. (See java_crw_demo)
+		*/
+		system_class = 0;
+		if (!m_vm_is_started)
+		{
+			system_class = 1;
+		}
+
+		/* Counting in an array needs the table, which exists from VMInit on */
+		const bool array_counters = m_array_counting;
+		char *counters_name = array_counters ? const_cast<char *>(STRING(MTRACE_counters)) : nullptr;
+		char *counters_sig = array_counters ? const_cast<char *>("[[J") : nullptr;
+
+		/* The same class rewritten the same way in an earlier run needs no rewrite */
+		ClassCache::Entry cached;
+		std::string cache_key;
+		bool cache_hit = false;
+		long class_number_offset = 0;
+		const uint64_t rewrite_start = Clock::now();
+		if (m_class_cache != nullptr)
 		{
-			const char *classname;
+			cache_key = ClassCache::key(class_cache_context(classname, system_class, array_counters),
+				class_data, class_data_len);
+			cache_hit = m_class_cache->load(cache_key, cached);
+		}
 
-			/* Name could be nullptr */
-			if (name == nullptr)
+		if (cache_hit)
+		{
+			use_cached_class(cnum, loaded, cached);
+			new_image = nullptr;
+			new_length = static_cast<long>(cached.m_image.length());
+			m_class_cache->record_hit(Clock::to_nanos(Clock::now() - rewrite_start), cached.m_rewrite_nanos);
+		}
+		else
+		{
+			/* Call the class file reader/write demo code, its callbacks fill in loaded */
+			s_loading_class = &loaded;
+			java_crw_demo(cnum,
+				classname,
+				class_data,
+				class_data_len,
+				system_class,
+				const_cast<char *>(STRING(MTRACE_class)), const_cast<char *>("L" STRING(MTRACE_class) ";"),
+				const_cast<char *>(STRING(MTRACE_entry)), const_cast<char *>("(II)V"),
+				const_cast<char *>(STRING(MTRACE_exit)), const_cast<char *>("(II)V"),
+				nullptr, nullptr,
+				nullptr, nullptr,
+				counters_name, counters_sig,
+				&new_image,
+				&new_length,
+				m_class_cache != nullptr ? &class_number_offset : nullptr,
+				nullptr,
+				&mnum_callbacks,
+				&method_filter,
+				&allocate_image);
+			s_loading_class = nullptr;
+
+			if (m_class_cache != nullptr)
 			{
-				classname = java_crw_demo_classname(class_data, class_data_len, nullptr);
-				if (classname == nullptr)
-				{
-					fatal_error("ERROR: No classname inside classfile\n");
-				}
+				const uint64_t rewrite_nanos = Clock::to_nanos(Clock::now() - rewrite_start);
+				m_class_cache->record_miss(rewrite_nanos);
+				store_cached_class(loaded, cache_key, new_image, new_length, class_number_offset, rewrite_nanos);
 			}
-			else
+		}
+
+		/* If we got back a new class image, return it back as "the"
+		*   new class image. This must be JVMTI Allocate space, which
+		*   java_crw_demo() already used through allocate_image().
+		*   The class's counts must be in place before any of its code runs.
+		*/
+		if (register_class(env, cnum, loaded, array_counters && new_length > 0) && new_length > 0)
+		{
+			if (cache_hit)
 			{
-				classname = strdup(name);
-				if (classname == nullptr)
-				{
-					fatal_error("ERROR: Out of malloc memory\n");
-				}
+				new_image = (unsigned char *)allocate(jvmti, (jint)new_length);
+				(void)memcpy((void*)new_image, (const void*)cached.m_image.data(), (int)new_length);
 			}
+			*new_class_data_len = (jint)new_length;
+			*new_class_data = new_image; /* VM will deallocate */
+			new_image = nullptr;
 
-			*new_class_data_len = 0;
-			*new_class_data = nullptr;
+			stdout_message("Class hooked %s\n", classname);
+		}
 
-			if (interested(const_cast<char*>(classname), "", const_cast<char *>(m_include.data()), nullptr))
-			{
-				stdout_message("Class load %s\n", classname);
+		/* An image the VM did not take is still ours */
+		if (new_image != nullptr)
+		{
+			deallocate(jvmti, (void*)new_image);
+		}
+	}
+
+	(void)free((void*)classname);
+}
 
-				jint           cnum;
-				int            system_class;
-				unsigned char *new_image;
-				long           new_length;
-				ClassInfo     *cp;
+// Registers a class loaded as aot_instrument rewrote it, under the number it was given there. 
+// Its probes call bridge, array counters are for classes rewritten at load time 
+void JVMAgent::use_instrumented_class(JNIEnv *env, const AotDictionary::Class &instrumented)
+{
+	ClassInfo loaded;
+	loaded.m_name = instrumented.m_name;
+	loaded.m_calls = 0;
+	loaded.m_method_base = 0;
+	use_methods(loaded, instrumented.m_methods);
 
-				/* Get unique number for every class file image loaded */
+	if (register_class(env, static_cast<jint>(instrumented.m_cnum), loaded, false))
+	{
+		stdout_message("Class instrumented ahead of time %s\n", instrumented.m_name.c_str());
+	}
+}
 
-				/* Save away class information */
+// A quick scan of the class file before any rewriting: interfaces and classes where the 
+// include list covers no method are left as they are, with no class number 
+/*static*/
+bool JVMAgent::has_included_method(const char *classname, const unsigned char *class_data, jint class_data_len)
+{
+	ClassInfo scanned;
+	scanned.m_name = classname;
 
-				cnum = m_classes.size();
-				m_classes.resize(cnum + 1);
-				cp = &m_classes[cnum];
-				cp->m_name = classname;
+	s_loading_class = &scanned;
+	const bool included = java_crw_demo_scan(0, class_data, class_data_len, nullptr, &method_included) != 0;
+	s_loading_class = nullptr;
+	return included;
+}
 
-				cp->m_calls = 0;
-				cp->m_mcount = 0;
+/* Publishes a class once rewritten: method ids, dictionary records and its counter array. 
+   False if the VM died in the meantime, the class then loads as it is */
+bool JVMAgent::register_class(JNIEnv *env, jint cnum, ClassInfo &loaded, bool counter_array)
+{
+	bool registered = false;
+	bool announce = false;
 
-				/* Is it a system class? If the class load is before VmStart
-				*   then we will consider it a system class that should
-				*   be treated carefully. (See java_crw_demo)
-				*/
-				system_class = 0;
-				if (!m_vm_is_started)
-				{
-					system_class = 1;
-				}
+	lock();
+	{
+		// An instrumented class loaded again by another class loader keeps the number's records 
+		if (!m_vm_is_dead && !m_classes.at(cnum).m_name.empty())
+		{
+			registered = true;
+		}
+		else if (!m_vm_is_dead)
+		{
+			ClassInfo *class_info = &m_classes.at(cnum);
+			*class_info = std::move(loaded);
 
-				/* Call the class file reader/write demo code */
-				java_crw_demo(cnum,
-					classname,
-					class_data,
-					class_data_len,
-					system_class,
-					STRING(MTRACE_class), "L" STRING(MTRACE_class) ";",
-					STRING(MTRACE_entry), "(II)V",
-					STRING(MTRACE_exit), "(II)V",
-					nullptr, nullptr,
-					nullptr, nullptr,
-					&new_image,
-					&new_length,
-					nullptr,
-					&mnum_callbacks);
-
-				/* If we got back a new class image, return it back as "the"
-				*   new class image. This must be JVMTI Allocate space.
-				*/
-				if (new_length > 0)
-				{
-					unsigned char *jvmti_space;
+			if (class_info->m_mcount > 0)
+			{
+				// Dictionary records go out ahead of the first event that needs them 
+				TraceEncoder::class_record(m_dictionary, cnum, class_info->m_name);
 
-					jvmti_space = (unsigned char *)allocate(jvmti, (jint)new_length);
-					(void)memcpy((void*)jvmti_space, (void*)new_image, (int)new_length);
-					*new_class_data_len = (jint)new_length;
-					*new_class_data = jvmti_space; /* VM will deallocate */
+				// Give the methods dense ids, published before any probe of this class can run 
+				class_info->m_method_base = m_next_method_id;
+				m_method_base.at(cnum) = class_info->m_method_base;
+				m_next_method_id += class_info->m_mcount;
 
-					stdout_message("Class hooked %s\n", classname);
+				for (int method_index = 0; method_index < class_info->m_mcount; method_index++)
+				{
+					const MethodInfo *mp = &class_info->m_methods[method_index];
+					set_sample_rate(m_sample_rates.at(class_info->m_method_base + method_index), m_sample_default);
+
+					TraceEncoder::method_record(m_dictionary, cnum, method_index, mp->m_name, mp->m_signature);
+					if (mp->m_trivial != TRIVIAL_NONE)
+					{
+						TraceEncoder::method_skipped(m_dictionary, cnum, method_index, static_cast<uint8_t>(mp->m_trivial));
+					}
 				}
 
-				/* Always free up the space we get from java_crw_demo() */
-				if (new_image != nullptr)
+				if (counter_array)
 				{
-					(void)free((void*)new_image); /* Free malloc() space with free() */
+					add_counter_array(env, cnum, class_info->m_mcount);
 				}
+
+				announce = m_mode == MODE_TRACE;
 			}
 
-			(void)free((void*)classname);
+			registered = true;
 		}
 	}
 	unlock();
+
+	// Behind the class record in the dictionary, which is drained ahead of the rings 
+	if (announce)
+	{
+		push_event(current_thread_context(), EVENT_CLASS_LOAD, cnum, 0, 1);
+	}
+
+	return registered;
+}
+
+/* Class number to its registered information, nullptr if the number was never handed out */
+const JVMAgent::ClassInfo *JVMAgent::find_class(size_t cnum) const
+{
+	return cnum < m_class_count ? m_classes.find(cnum) : nullptr;
+}
+
+// Everything besides the class bytes that decides how a class is rewritten 
+std::string JVMAgent::class_cache_context(const char *classname, int system_class, bool array_counters) const
+{
+	return "crw=" + std::to_string(JAVA_CRW_DEMO_VERSION) + ";options=" + m_options +
+		";system=" + std::to_string(system_class) + ";counters=" + (array_counters ? "array" : "call") +
+		";class=" + classname;
+}
+
+// Does what java_crw_demo() would have: fills in the methods as mnum_callbacks() and 
+// method_filter() did when the entry was stored, and puts cnum into the image 
+/*static*/
+void JVMAgent::use_cached_class(jint cnum, ClassInfo &loaded, ClassCache::Entry &entry)
+{
+	use_methods(loaded, entry.m_methods);
+
+	// The class number is the big endian value of a CONSTANT_Integer 
+	if (entry.m_class_number_offset != 0)
+	{
+		char *number = &entry.m_image[entry.m_class_number_offset];
+		number[0] = static_cast<char>(cnum >> 24);
+		number[1] = static_cast<char>(cnum >> 16);
+		number[2] = static_cast<char>(cnum >> 8);
+		number[3] = static_cast<char>(cnum);
+	}
+}
+
+// The method table mnum_callbacks() and method_filter() would have built 
+/*static*/
+void JVMAgent::use_methods(ClassInfo &loaded, const std::vector<ClassCache::Method> &methods)
+{
+	loaded.m_mcount = static_cast<int>(methods.size());
+	loaded.m_methods.resize(methods.size());
+	for (size_t mnum = 0; mnum < methods.size(); mnum++)
+	{
+		MethodInfo *mp = &loaded.m_methods[mnum];
+		mp->m_name = methods[mnum].m_name;
+		mp->m_signature = methods[mnum].m_signature;
+		mp->m_calls = 0;
+		mp->m_returns = 0;
+		mp->m_interested = methods[mnum].m_interested;
+		mp->m_trivial = static_cast<TrivialKind>(methods[mnum].m_trivial);
+	}
+}
+
+void JVMAgent::store_cached_class(const ClassInfo &loaded, const std::string &key, const unsigned char *image, long length, long class_number_offset,
+	uint64_t rewrite_nanos) const
+{
+	ClassCache::Entry entry;
+
+	if (image != nullptr)
+	{
+		entry.m_image.assign(reinterpret_cast<const char *>(image), length);
+	}
+	entry.m_class_number_offset = static_cast<uint32_t>(class_number_offset);
+	entry.m_rewrite_nanos = rewrite_nanos;
+	for (int mnum = 0; mnum < loaded.m_mcount; mnum++)
+	{
+		const MethodInfo &method_info = loaded.m_methods[mnum];
+		ClassCache::Method method;
+		method.m_name = method_info.m_name;
+		method.m_signature = method_info.m_signature;
+		method.m_interested = method_info.m_interested;
+		method.m_trivial = static_cast<uint8_t>(method_info.m_trivial);
+		entry.m_methods.push_back(method);
+	}
+
+	m_class_cache->store(key, entry);
+}
+
+/* Called at VMInit with the agent lock held */
+void JVMAgent::init_counter_arrays(jvmtiEnv *jvmti, JNIEnv *env, jclass klass)
+{
+	m_bridge_class = static_cast<jclass>((*env).NewGlobalRef(klass));
+	m_counters_field = (*env).GetStaticFieldID(klass, STRING(MTRACE_counters), "[[J");
+	if (m_counters_field == nullptr)
+	{
+		fatal_error("ERROR: JNI: Cannot get field from %s\n", STRING(MTRACE_class));
+	}
+
+	grow_counter_table(env, COUNTER_TABLE_CAPACITY);
+	m_array_counting = true;
+
+	// JNI array reads need a Java thread, RunAgentThread makes one that stays out of the 
+	// way of the application 
+	jclass thread_class = (*env).FindClass("java/lang/Thread");
+	if (thread_class == nullptr)
+	{
+		fatal_error("ERROR: JNI: Cannot find java/lang/Thread with FindClass\n");
+	}
+
+	jmethodID constructor = (*env).GetMethodID(thread_class, "<init>", "(Ljava/lang/String;)V");
+	jstring   thread_name = (*env).NewStringUTF("method_call_trace counters");
+	jthread   thread = (constructor != nullptr && thread_name != nullptr) ?
+		(*env).NewObject(thread_class, constructor, thread_name) : nullptr;
+	if (thread == nullptr)
+	{
+		fatal_error("ERROR: JNI: Cannot create the counter thread\n");
+	}
+
+	jvmtiError error = (*jvmti).RunAgentThread(thread, &counter_reader, nullptr, JVMTI_THREAD_NORM_PRIORITY);
+	check_jvmti_error(jvmti, error, "Cannot start the counter thread");
+}
+
+/* Replaces bridge's long[][] with a larger one holding the same arrays, agent lock held */
+void JVMAgent::grow_counter_table(JNIEnv *env, jsize capacity)
+{
+	jclass array_class = (*env).FindClass("[J");
+	jobjectArray table = (array_class != nullptr) ? (*env).NewObjectArray(capacity, array_class, nullptr) : nullptr;
+	if (table == nullptr)
+	{
+		fatal_error("ERROR: JNI: Cannot allocate the counter table\n");
+	}
+
+	for (size_t cnum = 0; cnum < m_counter_arrays.size(); cnum++)
+	{
+		if (m_counter_arrays[cnum] != nullptr)
+		{
+			(*env).SetObjectArrayElement(table, static_cast<jsize>(cnum), m_counter_arrays[cnum]);
+		}
+	}
+	(*env).SetStaticObjectField(m_bridge_class, m_counters_field, table);
+
+	if (m_counter_table != nullptr)
+	{
+		(*env).DeleteGlobalRef(m_counter_table);
+	}
+	m_counter_table = static_cast<jobjectArray>((*env).NewGlobalRef(table));
+	(*env).DeleteLocalRef(table);
+}
+
+/* Gives a class being hooked its long[2 * mcount], agent lock held */
+void JVMAgent::add_counter_array(JNIEnv *env, jint cnum, int mcount)
+{
+	const jsize capacity = (*env).GetArrayLength(m_counter_table);
+	if (cnum >= capacity)
+	{
+		grow_counter_table(env, std::max(capacity * 2, cnum + 1));
+	}
+
+	jlongArray counts = (*env).NewLongArray(2 * mcount);
+	if (counts == nullptr)
+	{
+		fatal_error("ERROR: JNI: Cannot allocate counters for %s\n", find_class(cnum)->m_name.c_str());
+	}
+	(*env).SetObjectArrayElement(m_counter_table, cnum, counts);
+
+	m_counter_arrays.resize(cnum + 1, nullptr);
+	m_counter_arrays[cnum] = static_cast<jlongArray>((*env).NewGlobalRef(counts));
+	(*env).DeleteLocalRef(counts);
+}
+
+/* Copies every class's counts to m_array_calls/m_array_returns, agent lock held */
+void JVMAgent::read_counter_arrays(JNIEnv *env)
+{
+	m_array_calls.resize(m_next_method_id, 0);
+	m_array_returns.resize(m_next_method_id, 0);
+
+	std::vector<jlong> counts;
+	for (size_t cnum = 0; cnum < m_counter_arrays.size(); cnum++)
+	{
+		if (m_counter_arrays[cnum] == nullptr)
+		{
+			continue;
+		}
+
+		const ClassInfo &class_info = *find_class(cnum);
+		counts.resize(2 * class_info.m_mcount);
+		(*env).GetLongArrayRegion(m_counter_arrays[cnum], 0, static_cast<jsize>(counts.size()), counts.data());
+
+		for (int mnum = 0; mnum < class_info.m_mcount; mnum++)
+		{
+			const size_t id = class_info.m_method_base + mnum;
+			m_array_calls[id] = static_cast<uint64_t>(counts[2 * mnum]);
+			m_array_returns[id] = static_cast<uint64_t>(counts[2 * mnum + 1]);
+		}
+	}
+}
+
+/* Agent thread started at VMInit, polls the arrays until VMDeath */
+/*static*/
+void JNICALL JVMAgent::counter_reader(jvmtiEnv *jvmti, JNIEnv *env, void *arg)
+{
+	JVMAgent &self = instance();
+
+	for (;;)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(COUNTER_POLL_MS));
+
+		lock();
+		const bool dead = self.m_vm_is_dead;
+		if (!dead)
+		{
+			self.read_counter_arrays(env);
+		}
+		unlock();
+
+		if (dead)
+		{
+			return;
+		}
+	}
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -513,13 +1505,11 @@ void JVMAgent::process_cbClassFileLoadHook(jvmtiEnv *jvmti, JNIEnv *env, jclass
 /*static*/
 void JVMAgent::mnum_callbacks(unsigned cnum, const char **names, const char**sigs, int mcount)
 {
-	ClassInfo *class_info;
-	int mnum;
-	JVMAgent &self = instance();
+	ClassInfo *class_info = s_loading_class;
 
-	if (cnum >= self.m_classes.size())
+	if (class_info == nullptr)
 	{
-		fatal_error("ERROR: Class number out of range\n");
+		fatal_error("ERROR: No class being rewritten on this thread\n");
 	}
 
 	if (mcount == 0)
@@ -527,7 +1517,7 @@ void JVMAgent::mnum_callbacks(unsigned cnum, const char **names, const char**sig
 		return;
 	}
 
-	class_info = &self.m_classes[cnum];
+	// Ids and dictionary records wait for register_class() 
 	class_info->m_calls = 0;
 	class_info->m_mcount = mcount;
 	class_info->m_methods.resize(mcount);
@@ -537,11 +1527,71 @@ void JVMAgent::mnum_callbacks(unsigned cnum, const char **names, const char**sig
 		MethodInfo *mp = &class_info->m_methods[method_index];
 		mp->m_name = names[method_index];
 		mp->m_signature = sigs[method_index];
+		mp->m_calls = 0;
+		mp->m_returns = 0;
+	}
+}
+
+/* Callback from java_crw_demo() asking if a method should get probes */
+/*static*/
+int JVMAgent::method_filter(unsigned cnum, unsigned mnum, const char *name, const char *sig,
+	unsigned access_flags, const unsigned char *code, long code_length)
+{
+	JVMAgent &self = instance();
+	ClassInfo *class_info = s_loading_class;
+
+	if (class_info == nullptr)
+	{
+		fatal_error("ERROR: No class being rewritten on this thread\n");
+	}
+
+	// Evaluated once here, mnum_callbacks() keeps the flag when it fills in the names 
+	if (mnum >= class_info->m_methods.size())
+	{
+		class_info->m_methods.resize(mnum + 1);
+	}
+
+	MethodInfo *mp = &class_info->m_methods[mnum];
+	mp->m_interested = interested(const_cast<char*>(class_info->m_name.c_str()),
+		const_cast<char*>(name),
+		const_cast<char *>(self.m_include.c_str()), nullptr) != 0;
+	if (!mp->m_interested)
+	{
+		return 0;
 	}
+
+	// Reported with the method in the dictionary 
+	mp->m_trivial = self.m_trivial_methods.classify(access_flags, code, static_cast<size_t>(code_length));
+	return mp->m_trivial == TRIVIAL_NONE ? 1 : 0;
+}
+
+/* Callback from java_crw_demo_scan(), is a method of the class included at all? */
+/*static*/
+int JVMAgent::method_included(unsigned cnum, unsigned mnum, const char *name, const char *sig,
+	unsigned access_flags, const unsigned char *code, long code_length)
+{
+	JVMAgent &self = instance();
+	const ClassInfo *class_info = s_loading_class;
+
+	if (class_info == nullptr)
+	{
+		fatal_error("ERROR: No class being scanned on this thread\n");
+	}
+
+	// Trivial methods count, the rewrite marks them skipped in the dictionary 
+	return interested(const_cast<char*>(class_info->m_name.c_str()), const_cast<char*>(name),
+		const_cast<char *>(self.m_include.c_str()), nullptr);
+}
+
+/* Callback from java_crw_demo() for the new class image, sized exactly, handed to the VM as it is */
+/*static*/
+unsigned char *JVMAgent::allocate_image(long length)
+{
+	return static_cast<unsigned char *>(allocate(instance().m_jvmti, static_cast<jint>(length)));
 }
 
 /* Get a name for a jthread */
-void JVMAgent::get_thread_name(jvmtiEnv *jvmti, jthread thread, char *tname, int maxlen)
+void JVMAgent::get_thread_name(jvmtiEnv *jvmti, jthread thread, char *tname, size_t maxlen)
 {
 	jvmtiThreadInfo info;
 	jvmtiError      error;
@@ -573,79 +1623,1250 @@ void JVMAgent::get_thread_name(jvmtiEnv *jvmti, jthread thread, char *tname, int
 	}
 }
 
-void JVMAgent::process_method_entry(JNIEnv *env, jclass klass, jobject thread, jint cnum, jint mnum)
+JVMAgent::ThreadContext *JVMAgent::current_thread_context()
 {
-	lock();
+	if (s_thread_context != nullptr)
 	{
-		// It's possible we get here right after VmDeath event, be careful 
-		if (!m_vm_is_dead)
-		{
-			if (cnum >= m_classes.size())
-			{
-				fatal_error("ERROR: Class number out of range\n");
-			}
+		return s_thread_context;
+	}
 
-			ClassInfo  *class_info = &m_classes[cnum];
-			if (mnum >= class_info->m_mcount)
-			{
-				fatal_error("ERROR: Method number out of range\n");
-			}
+	// First probe on this thread 
+	ThreadContext *context;
+	{
+		std::lock_guard<std::mutex> guard(m_threads_lock);
+		const uint32_t capacity = m_mode == MODE_TRACE ? ring_capacity() : 0;
+		context = new ThreadContext(m_next_thread_id++, capacity,
+			m_mode == MODE_TREE ? CALL_TREE_MAX_NODES : 0);
+		m_threads.push_back(context);
+		m_ring_events += capacity;
+	}
 
-			MethodInfo *method_info = &class_info->m_methods[mnum];
+	s_thread_context = context;
+	return context;
+}
+
+size_t JVMAgent::method_id(jint cnum, jint mnum) const
+{
+	const size_t *base = m_method_base.find(cnum);
+	if (base == nullptr)
+	{
+		fatal_error("ERROR: Class number out of range\n");
+	}
+	return *base + mnum;
+}
+
+void JVMAgent::process_method_entry(JNIEnv *env, jclass klass, jint cnum, jint mnum)
+{
+	// It's possible we get here right after VmDeath event, be careful 
+	if (!m_vm_is_dead)
+	{
+		ThreadContext *context = current_thread_context();
+
+		if (m_mode == MODE_COUNT)
+		{
+			increment(context->m_counters.at(method_id(cnum, mnum)).m_calls);
+		}
+		else if (m_mode == MODE_TIME)
+		{
+			ShadowFrame frame = { method_id(cnum, mnum), 0, 0, 0, 0 };
+			context->m_stack.push_back(frame);
+			// Taken last so the probe's own cost stays outside the call 
+			context->m_stack.back().m_start = Clock::now();
+		}
+		else if (m_mode == MODE_TREE)
+		{
+			const size_t id = method_id(cnum, mnum);
+			const uint32_t parent = context->m_stack.empty() ? CallTree::ROOT : context->m_stack.back().m_node;
+
+			ShadowFrame frame = { id, 0, 0, 0, context->m_tree->child(parent, static_cast<uint32_t>(id)) };
+			context->m_stack.push_back(frame);
+			context->m_stack.back().m_start = Clock::now();
+		}
+		else if (m_slow_threshold != 0)
+		{
+			// Nothing is sent yet, whether the call is slow is known at its exit 
+			ShadowFrame frame = { method_id(cnum, mnum), 0, 0, 0, 0, cnum, mnum };
+			context->m_stack.push_back(frame);
+			context->m_stack.back().m_start = Clock::now();
+		}
+		else if (m_sampling)
+		{
+			// Decided once at entry, the frame carries the decision to the exit 
+			ShadowFrame frame = { method_id(cnum, mnum), 0, 0, 0, 0 };
+			frame.m_weight = sample_call(context, frame.m_method_id);
+			context->m_stack.push_back(frame);
 
-			if (interested(const_cast<char*>(class_info->m_name.c_str()), 
-				const_cast<char*>(method_info->m_name.c_str()), 
-				const_cast<char *>(m_include.c_str()), nullptr))
+			if (frame.m_weight != 0)
 			{
-				//mp->calls++;
-				//cp->calls++;
-				m_server->enqueue_for_sending("enter: " + class_info->m_name + ":" + method_info->m_name + "\r\n");
+				push_event(context, EVENT_METHOD_ENTRY, cnum, mnum, frame.m_weight);
 			}
 		}
+		else
+		{
+			push_event(context, EVENT_METHOD_ENTRY, cnum, mnum, 1);
+		}
 	}
-	unlock();
 }
 
-void JVMAgent::process_method_exit(JNIEnv *env, jclass klass, jobject thread, jint cnum, jint mnum)
+void JVMAgent::process_method_exit(JNIEnv *env, jclass klass, jint cnum, jint mnum)
 {
-	lock();
+	// It's possible we get here right after VmDeath event, be careful 
+	if (!m_vm_is_dead)
 	{
-		// It's possible we get here right after VmDeath event, be careful 
-		if (!m_vm_is_dead)
+		ThreadContext *context = current_thread_context();
+
+		if (m_mode == MODE_COUNT)
 		{
-			if (cnum >= m_classes.size())
-			{
-				fatal_error("ERROR: Class number out of range\n");
-			}
+			increment(context->m_counters.at(method_id(cnum, mnum)).m_returns);
+		}
+		else if (m_mode == MODE_TIME)
+		{
+			record_call_time(context, method_id(cnum, mnum), Clock::now());
+		}
+		else if (m_mode == MODE_TREE)
+		{
+			const uint64_t now = Clock::now();
 
-			ClassInfo  *class_info = &m_classes[cnum];
-			if (mnum >= class_info->m_mcount)
+			ShadowFrame frame;
+			if (pop_frame(context, method_id(cnum, mnum), frame) && frame.m_node != CallTree::NO_NODE)
 			{
-				fatal_error("ERROR: Method number out of range\n");
+				context->m_tree->add(frame.m_node, 1, now > frame.m_start ? now - frame.m_start : 0);
 			}
+		}
+		else if (m_slow_threshold != 0)
+		{
+			const uint64_t now = Clock::now();
 
-			MethodInfo *method_info = &class_info->m_methods[mnum];
-			if (interested(const_cast<char*>(class_info->m_name.c_str()), 
-				const_cast<char*>(method_info->m_name.c_str()), 
-				const_cast<char *>(m_include.c_str()),
-				nullptr))
+			ShadowFrame frame;
+			if (pop_frame(context, method_id(cnum, mnum), frame) && now > frame.m_start &&
+				Clock::to_nanos(now - frame.m_start) >= m_slow_threshold)
 			{
-				//mp->returns++;
-				m_server->enqueue_for_sending("exit: " + class_info->m_name + ":" + method_info->m_name + "\r\n");
+				push_slow_call(context, frame, now);
 			}
 		}
-	}
+		else if (m_sampling)
+		{
+			ShadowFrame frame;
+			if (pop_frame(context, method_id(cnum, mnum), frame) && frame.m_weight != 0)
+			{
+				push_event(context, EVENT_METHOD_EXIT, cnum, mnum, frame.m_weight);
+			}
+		}
+		else
+		{
+			push_event(context, EVENT_METHOD_EXIT, cnum, mnum, 1);
+		}
+	}
+}
+
+void JVMAgent::push_event(ThreadContext *context, int kind, jint cnum, jint mnum, uint32_t weight)
+{
+	if (context->m_ring == nullptr)
+	{
+		context->m_ringless.store(context->m_ringless.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return;
+	}
+
+	if ((m_overflow == OVERFLOW_BLOCK || m_overflow == OVERFLOW_SAMPLE) && !context->m_ring->has_room())
+	{
+		make_room(context, 1);
+	}
+
+	if (context->m_ring->push(kind, cnum, mnum, Clock::now(), weight))
+	{
+		m_server->wake();
+	}
+}
+
+/* frame was just popped; the calls still on the stack enclose it */
+void JVMAgent::push_slow_call(ThreadContext *context, const ShadowFrame &frame, uint64_t now)
+{
+	// Counted as one event, as a ring drops a group that does not fit 
+	if (context->m_ring == nullptr)
+	{
+		context->m_ringless.store(context->m_ringless.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return;
+	}
+
+	// The exit, then the call itself with its entry time and the enclosing calls, 
+	// innermost first 
+	const std::vector<ShadowFrame> &stack = context->m_stack;
+	const size_t depth = std::min(stack.size(), m_slow_stack);
+
+	TraceEvent events[SLOW_STACK_MAX + 2];
+	const uint32_t count = static_cast<uint32_t>(depth + 2);
+
+	TraceEvent call = { EVENT_SLOW_CALL, frame.m_cnum, frame.m_mnum, count - 1, now };
+	TraceEvent self = { EVENT_CALL_FRAME, frame.m_cnum, frame.m_mnum, 0, frame.m_start };
+	events[0] = call;
+	events[1] = self;
+	for (size_t i = 0; i < depth; i++)
+	{
+		const ShadowFrame &open = stack[stack.size() - 1 - i];
+		TraceEvent enclosing = { EVENT_CALL_FRAME, open.m_cnum, open.m_mnum, 0, open.m_start };
+		events[2 + i] = enclosing;
+	}
+
+	if (m_overflow == OVERFLOW_BLOCK && !context->m_ring->has_room(count))
+	{
+		make_room(context, count);
+	}
+
+	if (context->m_ring->push_group(events, count))
+	{
+		m_server->wake();
+	}
+}
+
+/* Called by a probe that found no room for count events in its ring */
+void JVMAgent::make_room(ThreadContext *context, uint32_t count)
+{
+	const uint64_t now = Clock::now();
+
+	if (m_overflow == OVERFLOW_SAMPLE)
+	{
+		// This event is lost, trace fewer of the next ones. One step per 
+		// SAMPLE_DEGRADE_STEP_MS so a single burst doesn't go all the way down. 
+		const uint32_t degrade = context->m_degrade.load(std::memory_order_relaxed);
+		if (degrade < SAMPLE_MAX_DEGRADE &&
+			Clock::to_nanos(now - context->m_degrade_time) >= SAMPLE_DEGRADE_STEP_MS * 1000000ULL)
+		{
+			context->m_degrade.fetch_add(1, std::memory_order_relaxed);
+			context->m_degrade_time = now;
+		}
+		return;
+	}
+
+	// OVERFLOW_BLOCK: hold the Java thread until the worker catches up 
+	m_server->wake();
+	while (!context->m_ring->has_room(count) && !m_vm_is_dead &&
+		Clock::to_nanos(Clock::now() - now) < m_block_nanos)
+	{
+		std::this_thread::sleep_for(std::chrono::microseconds(50));
+	}
+}
+
+/* Ring size for a new thread, called with m_threads_lock held. 0 when the budget is spent. */
+uint32_t JVMAgent::ring_capacity() const
+{
+	// Rings get half of max_buffer_mb, the server's output the other half. A thread gets 
+	// the largest ring that still fits, but none below EVENT_RING_MIN_CAPACITY: past that 
+	// the thread goes without and its events count as drops, the rings never outgrow 
+	// the budget. Rings of ended threads give their share back. 
+	const size_t budget = m_max_buffer_bytes / 2 / sizeof(TraceEvent);
+
+	uint32_t capacity = EVENT_RING_CAPACITY;
+	while (capacity >= EVENT_RING_MIN_CAPACITY && m_ring_events + capacity > budget)
+	{
+		capacity >>= 1;
+	}
+	return capacity >= EVENT_RING_MIN_CAPACITY ? capacity : 0;
+}
+
+/* Returns the weight of a sampled call, or 0 when this call is not traced */
+uint32_t JVMAgent::sample_call(ThreadContext *context, size_t id)
+{
+	const SampleRate &rate = m_sample_rates.at(id);
+
+	// xorshift32, a few cycles and no shared state 
+	uint32_t x = context->m_random;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	context->m_random = x;
+
+	// overflow=sample turns a thread with a full ring down by 2^degrade 
+	const uint32_t degrade = context->m_degrade.load(std::memory_order_relaxed);
+	if (x > (rate.m_threshold.load(std::memory_order_relaxed) >> degrade))
+	{
+		return 0;
+	}
+	return rate.m_rate.load(std::memory_order_relaxed) << degrade;
+}
+
+bool JVMAgent::pop_frame(ThreadContext *context, size_t id, ShadowFrame &frame)
+{
+	std::vector<ShadowFrame> &stack = context->m_stack;
+
+	// Exceptions leave without an exit probe, so the matching frame may not be on top. 
+	// Frames above it were unwound and are dropped. 
+	size_t depth = stack.size();
+	while (depth != 0 && stack[depth - 1].m_method_id != id)
+	{
+		depth--;
+	}
+	if (depth == 0)
+	{
+		// Entered before the probes were engaged 
+		return false;
+	}
+	stack.resize(depth);
+
+	frame = stack.back();
+	stack.pop_back();
+	return true;
+}
+
+void JVMAgent::record_call_time(ThreadContext *context, size_t id, uint64_t now)
+{
+	// Time of frames unwound by an exception counts as this call's own 
+	ShadowFrame frame;
+	if (!pop_frame(context, id, frame))
+	{
+		return;
+	}
+
+	std::vector<ShadowFrame> &stack = context->m_stack;
+	const uint64_t inclusive = now > frame.m_start ? now - frame.m_start : 0;
+	const uint64_t exclusive = inclusive > frame.m_children ? inclusive - frame.m_children : 0;
+	if (!stack.empty())
+	{
+		stack.back().m_children += inclusive;
+	}
+
+	std::atomic<MethodLatency *> &slot = context->m_latency.at(id);
+	MethodLatency *latency = slot.load(std::memory_order_relaxed);
+	if (latency == nullptr)
+	{
+		latency = new MethodLatency();
+		context->m_latencies.push_back(latency);
+		slot.store(latency, std::memory_order_release);
+	}
+
+	latency->m_inclusive.record(inclusive);
+	latency->m_exclusive.record(exclusive);
+}
+
+/* Called on the network worker thread */
+void JVMAgent::stream_header(std::string &buffer)
+{
+	lock();
+	{
+		if (m_format == FORMAT_BINARY)
+		{
+			TraceEncoder::stream_header(buffer);
+
+			// The client may join late and miss dictionary records from the backlog, 
+			// everything drained so far goes out again up front 
+			buffer.append(m_dictionary, 0, m_dictionary_sent);
+		}
+		else
+		{
+			buffer += "Hello Client , I am JVM TI\n";
+		}
+
+		write_clock_sync(buffer);
+	}
 	unlock();
 }
 
-void JVMAgent::start_network_server() const
+/* Lets the client turn Clock ticks into wall time */
+void JVMAgent::write_clock_sync(std::string &buffer)
 {
-	assert(m_server != nullptr);
+	uint64_t ticks, wall_nanos;
+	Clock::sync_point(ticks, wall_nanos);
+
+	if (m_format == FORMAT_BINARY)
+	{
+		TraceEncoder::clock_sync(buffer, ticks, wall_nanos, Clock::ticks_per_second());
+	}
+	else
+	{
+		char line[128];
+		snprintf(line, sizeof(line), "clock: %s %llu %llu %llu\r\n", Clock::source(),
+			static_cast<unsigned long long>(ticks), static_cast<unsigned long long>(wall_nanos),
+			static_cast<unsigned long long>(Clock::ticks_per_second()));
+		buffer += line;
+	}
+	m_sync_time = ticks;
+}
+
+/* Called on the network worker thread */
+void JVMAgent::drain_events(std::string &buffer)
+{
+	drain_events(&buffer, std::vector<Subscription *>());
+}
+
+/* Copies the records written to common since start to every subscriber */
+static void share_records(const std::string &common, size_t start, const std::vector<Subscription *> &subscriptions)
+{
+	for (Subscription *subscription : subscriptions)
+	{
+		subscription->output().append(common, start, std::string::npos);
+	}
+}
+
+/* Called on the network worker thread */
+void JVMAgent::drain_events(std::string *buffer, const std::vector<Subscription *> &subscriptions)
+{
+	std::lock_guard<std::mutex> guard(m_threads_lock);
+
+	// Everything but the trace events is written once and shared with the subscribers 
+	std::string &common = buffer != nullptr ? *buffer : m_common_records;
+	size_t start = common.length();
+
+	lock();
+	{
+		if (m_format == FORMAT_BINARY)
+		{
+			common.append(m_dictionary, m_dictionary_sent, std::string::npos);
+			m_dictionary_sent = m_dictionary.length();
+		}
+
+		if (Clock::to_nanos(Clock::now() - m_sync_time) >= CLOCK_SYNC_INTERVAL_MS * 1000000ULL)
+		{
+			write_clock_sync(common);
+		}
+
+		if (m_mode == MODE_COUNT)
+		{
+			write_count_snapshot(common);
+		}
+		else if (m_mode == MODE_TREE)
+		{
+			write_call_tree(common);
+		}
+		else if (m_mode == MODE_TIME)
+		{
+			collect_retired_latency();
+			if (m_latency_report_pending.exchange(false))
+			{
+				write_latency_report(common, m_format == FORMAT_BINARY, "\r\n");
+			}
+		}
+		else
+		{
+			// Dictionary records go ahead of the events that refer to them 
+			share_records(common, start, subscriptions);
+			drain_rings(buffer, subscriptions);
+			start = common.length();
+
+			write_drop_report(common);
+		}
+	}
+	unlock();
+
+	share_records(common, start, subscriptions);
+	m_common_records.clear();
+}
+
+/* Called on the network worker thread while the clients are too far behind */
+void JVMAgent::discard_events()
+{
+	std::lock_guard<std::mutex> guard(m_threads_lock);
+
+	lock();
+	{
+		if (m_mode == MODE_TRACE)
+		{
+			drain_rings(nullptr, std::vector<Subscription *>());
+		}
+	}
+	unlock();
+}
+
+/* Called with m_threads_lock and the agent lock held, no buffer and no subscriptions discards the events */
+void JVMAgent::drain_rings(std::string *buffer, const std::vector<Subscription *> &subscriptions)
+{
+	const bool discard = buffer == nullptr && subscriptions.empty();
+	m_sampled_calls.resize(m_next_method_id, 0);
+
+	// A slow call's frames follow it in the same drain, its group is published at once 
+	TraceEvent slow_call = TraceEvent();
+	std::vector<TraceEvent> slow_frames;
+
+	std::vector<ThreadContext *>::iterator it = m_threads.begin();
+	while (it != m_threads.end())
+	{
+		ThreadContext *context = *it;
+
+		// Read the flag before draining so nothing published after it is lost 
+		const bool retired = context->m_retired.load(std::memory_order_acquire);
+
+		// No ring if max_buffer_mb was spent when the thread started 
+		if (context->m_ring != nullptr)
+		{
+			context->m_ring->drain([this, buffer, &subscriptions, discard, context, &slow_call, &slow_frames](const TraceEvent &event)
+			{
+				if (discard)
+				{
+					if (event.m_kind != EVENT_CALL_FRAME)
+					{
+						context->m_discarded++;
+					}
+					return;
+				}
+
+				if (event.m_kind == EVENT_SLOW_CALL)
+				{
+					slow_call = event;
+					slow_frames.clear();
+					return;
+				}
+				if (event.m_kind == EVENT_CALL_FRAME)
+				{
+					slow_frames.push_back(event);
+					if (slow_frames.size() == slow_call.m_weight)
+					{
+						write_slow_call(buffer, subscriptions, context->m_id, slow_call, slow_frames);
+					}
+					return;
+				}
+				if (event.m_kind >= EVENT_THREAD_START)
+				{
+					write_lifecycle_event(buffer, subscriptions, context->m_id, event);
+					return;
+				}
+
+				const ClassInfo *class_info = find_class(event.m_cnum);
+				if (class_info == nullptr)
+				{
+					fatal_error("ERROR: Class number out of range\n");
+				}
+
+				if (event.m_mnum >= class_info->m_mcount)
+				{
+					fatal_error("ERROR: Method number out of range\n");
+				}
+
+				const MethodInfo *method_info = &class_info->m_methods[event.m_mnum];
+				if (!method_info->m_interested)
+				{
+					return;
+				}
+
+				if (event.m_kind == EVENT_METHOD_ENTRY)
+				{
+					m_sampled_calls[class_info->m_method_base + event.m_mnum] += event.m_weight;
+				}
+
+				if (buffer != nullptr)
+				{
+					encode_event(*buffer, context->m_id, event, class_info->m_name, method_info->m_name, event.m_weight);
+				}
+
+				// Each subscriber's filter runs before anything is encoded for it 
+				for (Subscription *subscription : subscriptions)
+				{
+					uint32_t weight = event.m_weight;
+					if (subscription->select(context->m_id, event.m_kind == EVENT_METHOD_ENTRY,
+						class_info->m_method_base + event.m_mnum, class_info->m_name, method_info->m_name, weight))
+					{
+						encode_event(subscription->output(), context->m_id, event, class_info->m_name, method_info->m_name, weight);
+					}
+				}
+			});
+		}
+
+		if (retired)
+		{
+			// Its last count is reported with the next drop report 
+			const uint64_t dropped = context->dropped();
+			if (dropped != context->m_reported_dropped)
+			{
+				m_dropped_total += dropped - context->m_reported_dropped;
+				m_retired_drops.push_back(std::make_pair(static_cast<uint32_t>(context->m_id), dropped));
+			}
+
+			if (context->m_ring != nullptr)
+			{
+				m_ring_events -= context->m_ring->capacity();
+			}
+			delete context;
+			it = m_threads.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	if (m_sample_budget != 0)
+	{
+		const uint64_t now = Clock::now();
+		if (m_adapt_time == 0)
+		{
+			m_adapt_time = now;
+		}
+		else if (Clock::to_nanos(now - m_adapt_time) >= SAMPLE_ADAPT_INTERVAL_MS * 1000000ULL)
+		{
+			adapt_sample_rates(now);
+		}
+	}
+}
+
+/* frames[0] is the call itself, the rest are the calls open around it */
+void JVMAgent::write_slow_call(std::string *buffer, const std::vector<Subscription *> &subscriptions, uint32_t thread,
+	const TraceEvent &call, const std::vector<TraceEvent> &frames)
+{
+	for (const TraceEvent &frame : frames)
+	{
+		const ClassInfo *frame_class = find_class(frame.m_cnum);
+		if (frame_class == nullptr || frame.m_mnum >= frame_class->m_mcount)
+		{
+			fatal_error("ERROR: Method number out of range\n");
+		}
+	}
+
+	const ClassInfo  *class_info = find_class(call.m_cnum);
+	const MethodInfo *method_info = &class_info->m_methods[call.m_mnum];
+	if (!method_info->m_interested)
+	{
+		return;
+	}
+
+	// Same bytes for every receiver, no per-client weight 
+	std::string record;
+	const uint64_t duration = Clock::to_nanos(call.m_timestamp - frames[0].m_timestamp);
+	if (m_format == FORMAT_BINARY)
+	{
+		TraceEncoder::slow_call(record, thread, call.m_cnum, call.m_mnum, frames[0].m_timestamp, duration,
+			static_cast<uint16_t>(frames.size() - 1));
+		for (size_t i = 1; i < frames.size(); i++)
+		{
+			TraceEncoder::slow_call_frame(record, frames[i].m_cnum, frames[i].m_mnum);
+		}
+	}
+	else
+	{
+		char text[32];
+		snprintf(text, sizeof(text), " %llu us\r\n", static_cast<unsigned long long>(duration / 1000));
+		record += "slow: ";
+		record += class_info->m_name;
+		record += ":";
+		record += method_info->m_name;
+		record += text;
+		for (size_t i = 1; i < frames.size(); i++)
+		{
+			const ClassInfo &caller = *find_class(frames[i].m_cnum);
+			record += "  in ";
+			record += caller.m_name;
+			record += ":";
+			record += caller.m_methods[frames[i].m_mnum].m_name;
+			record += "\r\n";
+		}
+	}
+
+	if (buffer != nullptr)
+	{
+		*buffer += record;
+	}
+
+	for (Subscription *subscription : subscriptions)
+	{
+		if (subscription->select_call(thread, class_info->m_method_base + call.m_mnum, class_info->m_name,
+			method_info->m_name))
+		{
+			subscription->output() += record;
+		}
+	}
+}
+
+/* Thread start and end, class load: no method, the same bytes for every receiver */
+void JVMAgent::write_lifecycle_event(std::string *buffer, const std::vector<Subscription *> &subscriptions, uint32_t thread,
+	const TraceEvent &event)
+{
+	std::string record;
+	unsigned kind;
+	if (event.m_kind == EVENT_CLASS_LOAD)
+	{
+		const ClassInfo *class_info = find_class(event.m_cnum);
+		if (class_info == nullptr)
+		{
+			fatal_error("ERROR: Class number out of range\n");
+		}
+
+		if (m_format == FORMAT_BINARY)
+		{
+			TraceEncoder::class_load(record, thread, event.m_cnum, event.m_timestamp);
+		}
+		else
+		{
+			record += "class load: ";
+			record += class_info->m_name;
+			record += "\r\n";
+		}
+		kind = SUBSCRIBE_CLASS_LOAD;
+	}
+	else
+	{
+		const bool start = event.m_kind == EVENT_THREAD_START;
+		if (m_format == FORMAT_BINARY)
+		{
+			TraceEncoder::thread_record(record, start ? RECORD_THREAD_START : RECORD_THREAD_END, thread, event.m_timestamp);
+		}
+		else
+		{
+			char text[48];
+			snprintf(text, sizeof(text), "thread %s: %u\r\n", start ? "start" : "end", thread);
+			record += text;
+		}
+		kind = SUBSCRIBE_THREAD;
+	}
+
+	if (buffer != nullptr)
+	{
+		*buffer += record;
+	}
+
+	for (Subscription *subscription : subscriptions)
+	{
+		if (subscription->select_record(thread, kind))
+		{
+			subscription->output() += record;
+		}
+	}
+}
+
+void JVMAgent::encode_event(std::string &buffer, uint32_t thread, const TraceEvent &event, const std::string &class_name,
+	const std::string &method_name, uint32_t weight) const
+{
+	if (m_format == FORMAT_BINARY)
+	{
+		TraceEncoder::event_record(buffer,
+			event.m_kind == EVENT_METHOD_ENTRY ? RECORD_METHOD_ENTRY : RECORD_METHOD_EXIT,
+			thread, event.m_cnum, event.m_mnum, event.m_timestamp, weight);
+	}
+	else
+	{
+		buffer += (event.m_kind == EVENT_METHOD_ENTRY) ? "enter: " : "exit: ";
+		buffer += class_name;
+		buffer += ":";
+		buffer += method_name;
+		if (weight != 1)
+		{
+			char text[16];
+			snprintf(text, sizeof(text), " x%u", weight);
+			buffer += text;
+		}
+		buffer += "\r\n";
+	}
+}
+
+/* Called with m_threads_lock and the agent lock held */
+void JVMAgent::adapt_sample_rates(uint64_t now)
+{
+	const double seconds = Clock::to_nanos(now - m_adapt_time) / 1e9;
+
+	// Calls per second of each method, scaled up from the sampled ones 
+	std::vector<std::pair<double, size_t> > active;
+	for (size_t id = 0; id < m_sampled_calls.size(); id++)
+	{
+		if (m_sampled_calls[id] != 0)
+		{
+			active.push_back(std::make_pair(m_sampled_calls[id] / seconds, id));
+		}
+		else
+		{
+			// Quiet at this rate, ease it back towards tracing every call 
+			SampleRate &rate = m_sample_rates.at(id);
+			set_sample_rate(rate, rate.m_rate.load(std::memory_order_relaxed) / 2);
+		}
+	}
+
+	// Max-min fair split of the budget: every traced call costs an entry and an exit event. 
+	// Quiet methods keep all their calls, what they leave over goes to the busier ones. 
+	std::sort(active.begin(), active.end());
+	double remaining = m_sample_budget / 2.0;
+	for (size_t i = 0; i < active.size(); i++)
+	{
+		const double calls = active[i].first;
+		const double share = remaining / (active.size() - i);
+
+		uint32_t rate = 1;
+		if (calls > share)
+		{
+			const double wanted = share > 1.0 ? calls / share + 0.999 : SAMPLE_MAX_RATE;
+			rate = wanted < SAMPLE_MAX_RATE ? static_cast<uint32_t>(wanted) : SAMPLE_MAX_RATE;
+		}
+
+		set_sample_rate(m_sample_rates.at(active[i].second), rate);
+		remaining -= calls / rate;
+	}
+
+	m_sampled_calls.assign(m_sampled_calls.size(), 0);
+	m_adapt_time = now;
+}
+
+/* Called with m_threads_lock and the agent lock held */
+void JVMAgent::write_drop_report(std::string &buffer)
+{
+	const uint64_t now = Clock::now();
+	if (Clock::to_nanos(now - m_drop_report_time) < DROP_REPORT_INTERVAL_MS * 1000000ULL)
+	{
+		return;
+	}
+	m_drop_report_time = now;
+
+	// Threads whose count moved since the last report, with their totals 
+	std::vector<std::pair<uint32_t, uint64_t> > changed;
+	changed.swap(m_retired_drops);
+
+	for (ThreadContext *context : m_threads)
+	{
+		const uint64_t dropped = context->dropped();
+		if (dropped != context->m_reported_dropped)
+		{
+			m_dropped_total += dropped - context->m_reported_dropped;
+			context->m_reported_dropped = dropped;
+			changed.push_back(std::make_pair(static_cast<uint32_t>(context->m_id), dropped));
+		}
+		else if (context->m_degrade.load(std::memory_order_relaxed) != 0)
+		{
+			// A whole interval without drops, overflow=sample traces twice as many calls again 
+			context->m_degrade.fetch_sub(1, std::memory_order_relaxed);
+		}
+	}
+
+	if (changed.empty())
+	{
+		return;
+	}
+
+	if (m_format == FORMAT_BINARY)
+	{
+		TraceEncoder::drop_report(buffer, now, m_dropped_total, static_cast<uint32_t>(changed.size()));
+		for (size_t i = 0; i < changed.size(); i++)
+		{
+			TraceEncoder::drop_entry(buffer, changed[i].first, changed[i].second);
+		}
+	}
+	else
+	{
+		char line[64];
+		snprintf(line, sizeof(line), "dropped: %llu", static_cast<unsigned long long>(m_dropped_total));
+		buffer += line;
+		for (size_t i = 0; i < changed.size(); i++)
+		{
+			snprintf(line, sizeof(line), " thread %u %llu", changed[i].first,
+				static_cast<unsigned long long>(changed[i].second));
+			buffer += line;
+		}
+		buffer += "\r\n";
+	}
+}
+
+/* Called with m_threads_lock and the agent lock held */
+void JVMAgent::write_count_snapshot(std::string &buffer)
+{
+	const uint64_t now = Clock::now();
+	if (m_snapshot_time == 0)
+	{
+		m_snapshot_time = now;
+	}
+	const uint64_t interval = Clock::to_nanos(now - m_snapshot_time);
+	if (interval < m_snapshot_interval)
+	{
+		return;
+	}
+
+	const size_t method_count = m_next_method_id;
+	m_retired_calls.resize(method_count, 0);
+	m_retired_returns.resize(method_count, 0);
+	m_snapshot_calls.resize(method_count, 0);
+	m_snapshot_returns.resize(method_count, 0);
+
+	// Sum the shards: ended threads were folded in already, add the live ones 
+	std::vector<uint64_t> calls(m_retired_calls);
+	std::vector<uint64_t> returns(m_retired_returns);
+
+	std::vector<ThreadContext *>::iterator it = m_threads.begin();
+	while (it != m_threads.end())
+	{
+		ThreadContext *context = *it;
+		const bool retired = context->m_retired.load(std::memory_order_acquire);
+
+		for (size_t id = 0; id < method_count; id++)
+		{
+			const CallCounters *counters = context->m_counters.find(id);
+			if (counters != nullptr)
+			{
+				const uint64_t thread_calls = counters->m_calls.load(std::memory_order_relaxed);
+				const uint64_t thread_returns = counters->m_returns.load(std::memory_order_relaxed);
+
+				calls[id] += thread_calls;
+				returns[id] += thread_returns;
+				if (retired)
+				{
+					m_retired_calls[id] += thread_calls;
+					m_retired_returns[id] += thread_returns;
+				}
+			}
+		}
+
+		if (retired)
+		{
+			delete context;
+			it = m_threads.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	// Classes counting in bridge arrays, as of the counter thread's last read 
+	m_array_calls.resize(method_count, 0);
+	m_array_returns.resize(method_count, 0);
+	for (size_t id = 0; id < method_count; id++)
+	{
+		calls[id] += m_array_calls[id];
+		returns[id] += m_array_returns[id];
+	}
+
+	// Only methods called during the interval are reported 
+	std::string entries;
+	uint32_t entry_count = 0;
+
+	if (m_format == FORMAT_TEXT)
+	{
+		char header[64];
+		snprintf(header, sizeof(header), "counts: %llu ms\r\n",
+			static_cast<unsigned long long>(interval / 1000000));
+		entries += header;
+	}
+
+	const size_t class_count = m_class_count;
+	for (size_t cnum = 0; cnum < class_count; cnum++)
+	{
+		ClassInfo *class_info = m_classes.find(cnum);
+		if (class_info == nullptr)
+		{
+			continue;
+		}
+
+		for (int mnum = 0; mnum < class_info->m_mcount; mnum++)
+		{
+			const size_t id = class_info->m_method_base + mnum;
+			const uint64_t delta_calls = calls[id] - m_snapshot_calls[id];
+			const uint64_t delta_returns = returns[id] - m_snapshot_returns[id];
+
+			MethodInfo *method_info = &class_info->m_methods[mnum];
+			class_info->m_calls += calls[id] - method_info->m_calls;
+			method_info->m_calls = calls[id];
+			method_info->m_returns = returns[id];
+
+			if (delta_calls == 0 && delta_returns == 0)
+			{
+				continue;
+			}
+
+			if (m_format == FORMAT_BINARY)
+			{
+				TraceEncoder::count_entry(entries, cnum, mnum, delta_calls, delta_returns);
+			}
+			else
+			{
+				char counts[64];
+				snprintf(counts, sizeof(counts), " %llu %llu\r\n",
+					static_cast<unsigned long long>(delta_calls), static_cast<unsigned long long>(delta_returns));
+				entries += "count: " + class_info->m_name + ":" + method_info->m_name + counts;
+			}
+			entry_count++;
+		}
+	}
+
+	if (m_format == FORMAT_BINARY)
+	{
+		TraceEncoder::count_snapshot(buffer, now, interval, entry_count);
+	}
+	buffer += entries;
+
+	m_snapshot_calls.swap(calls);
+	m_snapshot_returns.swap(returns);
+	m_snapshot_time = now;
+}
+
+/* Called with m_threads_lock and the agent lock held */
+void JVMAgent::collect_retired_latency()
+{
+	m_retired_latency.resize(m_next_method_id, nullptr);
+
+	std::vector<ThreadContext *>::iterator it = m_threads.begin();
+	while (it != m_threads.end())
+	{
+		ThreadContext *context = *it;
+		if (!context->m_retired.load(std::memory_order_acquire))
+		{
+			++it;
+			continue;
+		}
+
+		for (size_t id = 0; id < m_retired_latency.size(); id++)
+		{
+			const std::atomic<MethodLatency *> *slot = context->m_latency.find(id);
+			const MethodLatency *latency = slot != nullptr ? slot->load(std::memory_order_acquire) : nullptr;
+			if (latency != nullptr)
+			{
+				if (m_retired_latency[id] == nullptr)
+				{
+					m_retired_latency[id] = new MethodLatency();
+				}
+				m_retired_latency[id]->m_inclusive.add(latency->m_inclusive);
+				m_retired_latency[id]->m_exclusive.add(latency->m_exclusive);
+			}
+		}
+
+		delete context;
+		it = m_threads.erase(it);
+	}
+}
+
+/* Called with m_threads_lock and the agent lock held */
+void JVMAgent::write_latency_report(std::string &buffer, bool binary, const char *newline)
+{
+	collect_retired_latency();
+
+	std::string entries;
+	uint32_t entry_count = 0;
+
+	if (!binary)
+	{
+		entries += "latency (ns): calls, inclusive p50 p90 p99 p99.9 max, exclusive p50 p90 p99 p99.9 max";
+		entries += newline;
+	}
+
+	const size_t class_count = m_class_count;
+	for (size_t cnum = 0; cnum < class_count; cnum++)
+	{
+		const ClassInfo *class_info = find_class(cnum);
+		if (class_info == nullptr)
+		{
+			continue;
+		}
+
+		for (int mnum = 0; mnum < class_info->m_mcount; mnum++)
+		{
+			const size_t id = class_info->m_method_base + mnum;
+
+			// Merge the ended threads and every live thread's shard 
+			MethodLatency merged;
+			if (m_retired_latency[id] != nullptr)
+			{
+				merged.m_inclusive.add(m_retired_latency[id]->m_inclusive);
+				merged.m_exclusive.add(m_retired_latency[id]->m_exclusive);
+			}
+			for (ThreadContext *context : m_threads)
+			{
+				const std::atomic<MethodLatency *> *slot = context->m_latency.find(id);
+				const MethodLatency *latency = slot != nullptr ? slot->load(std::memory_order_acquire) : nullptr;
+				if (latency != nullptr)
+				{
+					merged.m_inclusive.add(latency->m_inclusive);
+					merged.m_exclusive.add(latency->m_exclusive);
+				}
+			}
+
+			if (merged.m_inclusive.count() == 0)
+			{
+				continue;
+			}
+
+			uint64_t inclusive[LATENCY_SUMMARY_SIZE];
+			uint64_t exclusive[LATENCY_SUMMARY_SIZE];
+			for (size_t i = 0; i + 1 < LATENCY_SUMMARY_SIZE; i++)
+			{
+				inclusive[i] = Clock::to_nanos(merged.m_inclusive.value_at_percentile(LATENCY_PERCENTILES[i]));
+				exclusive[i] = Clock::to_nanos(merged.m_exclusive.value_at_percentile(LATENCY_PERCENTILES[i]));
+			}
+			inclusive[LATENCY_SUMMARY_SIZE - 1] = Clock::to_nanos(merged.m_inclusive.max());
+			exclusive[LATENCY_SUMMARY_SIZE - 1] = Clock::to_nanos(merged.m_exclusive.max());
+
+			if (binary)
+			{
+				TraceEncoder::latency_entry(entries, cnum, mnum, merged.m_inclusive.count(), inclusive, exclusive);
+			}
+			else
+			{
+				char line[256];
+				snprintf(line, sizeof(line), " %llu, %llu %llu %llu %llu %llu, %llu %llu %llu %llu %llu",
+					static_cast<unsigned long long>(merged.m_inclusive.count()),
+					static_cast<unsigned long long>(inclusive[0]), static_cast<unsigned long long>(inclusive[1]),
+					static_cast<unsigned long long>(inclusive[2]), static_cast<unsigned long long>(inclusive[3]),
+					static_cast<unsigned long long>(inclusive[4]),
+					static_cast<unsigned long long>(exclusive[0]), static_cast<unsigned long long>(exclusive[1]),
+					static_cast<unsigned long long>(exclusive[2]), static_cast<unsigned long long>(exclusive[3]),
+					static_cast<unsigned long long>(exclusive[4]));
+				entries += "latency: " + class_info->m_name + ":" + class_info->m_methods[mnum].m_name + line + newline;
+			}
+			entry_count++;
+		}
+	}
+
+	if (binary)
+	{
+		TraceEncoder::latency_report(buffer, Clock::now(), entry_count);
+	}
+	buffer += entries;
+}
+
+/* Prints the latency report and has it sent to the client as well */
+void JVMAgent::print_latency_report()
+{
+	std::string report;
+	{
+		std::lock_guard<std::mutex> guard(m_threads_lock);
+
+		lock();
+		{
+			write_latency_report(report, false, "\n");
+		}
+		unlock();
+	}
+
+	stdout_message("%s", report.c_str());
+	m_latency_report_pending = true;
+}
+
+/* Called with m_threads_lock and the agent lock held */
+void JVMAgent::write_call_tree(std::string &buffer)
+{
+	const uint64_t now = Clock::now();
+	if (m_snapshot_time == 0)
+	{
+		m_snapshot_time = now;
+	}
+	if (Clock::to_nanos(now - m_snapshot_time) < m_snapshot_interval)
+	{
+		return;
+	}
+	m_snapshot_time = now;
+
+	if (m_retired_tree == nullptr)
+	{
+		m_retired_tree = new CallTree(CALL_TREE_MAX_MERGED_NODES);
+	}
+
+	// Totals since the start: ended threads were folded in already, add the live ones 
+	CallTree merged(CALL_TREE_MAX_MERGED_NODES);
+	merged.merge(*m_retired_tree);
+
+	std::vector<ThreadContext *>::iterator it = m_threads.begin();
+	while (it != m_threads.end())
+	{
+		ThreadContext *context = *it;
+
+		if (context->m_retired.load(std::memory_order_acquire))
+		{
+			m_retired_tree->merge(*context->m_tree);
+			merged.merge(*context->m_tree);
+			delete context;
+			it = m_threads.erase(it);
+		}
+		else
+		{
+			merged.merge(*context->m_tree);
+			++it;
+		}
+	}
+
+	// Method id back to class and method number 
+	std::vector<std::pair<uint32_t, uint32_t> > methods(m_next_method_id);
+	const size_t class_count = m_class_count;
+	for (size_t cnum = 0; cnum < class_count; cnum++)
+	{
+		const ClassInfo *class_info = find_class(cnum);
+		for (int mnum = 0; class_info != nullptr && mnum < class_info->m_mcount; mnum++)
+		{
+			methods[class_info->m_method_base + mnum] = std::make_pair(static_cast<uint32_t>(cnum), static_cast<uint32_t>(mnum));
+		}
+	}
+
+	const uint32_t count = merged.size();
+
+	if (m_format == FORMAT_BINARY)
+	{
+		TraceEncoder::call_tree(buffer, now, count - 1, merged.truncated());
+		for (uint32_t index = 1; index < count; index++)
+		{
+			const CallNode &node = merged.node(index);
+			TraceEncoder::call_tree_node(buffer, node.m_parent,
+				methods[node.m_method_id].first, methods[node.m_method_id].second,
+				node.m_calls.load(std::memory_order_relaxed), Clock::to_nanos(node.m_time.load(std::memory_order_relaxed)));
+		}
+		return;
+	}
+
+	// Collapsed stacks, "frame;frame;frame self_ns" per call path 
+	std::vector<uint64_t> self_time(count, 0);
+	for (uint32_t index = 1; index < count; index++)
+	{
+		const CallNode &node = merged.node(index);
+		const uint64_t time = node.m_time.load(std::memory_order_relaxed);
+
+		self_time[index] += time;
+		if (node.m_parent != CallTree::ROOT)
+		{
+			self_time[node.m_parent] -= time;
+		}
+	}
+
+	char header[96];
+	snprintf(header, sizeof(header), "tree: %u paths\r\n", count - 1);
+	buffer += header;
+
+	// A comment line, flamegraph.pl and the README's grep skip it 
+	if (merged.truncated() != 0)
+	{
+		snprintf(header, sizeof(header), "# %llu calls left out, the tree was full\r\n",
+			static_cast<unsigned long long>(merged.truncated()));
+		buffer += header;
+	}
+
+	std::vector<std::string> paths(count);
+	for (uint32_t index = 1; index < count; index++)
+	{
+		const CallNode &node = merged.node(index);
+		const ClassInfo &class_info = *find_class(methods[node.m_method_id].first);
+
+		if (node.m_parent != CallTree::ROOT)
+		{
+			paths[index] = paths[node.m_parent] + ";";
+		}
+		paths[index] += class_info.m_name + "." + class_info.m_methods[methods[node.m_method_id].second].m_name;
+
+		// Children can outlast a parent that is still running, never go below zero 
+		const int64_t self = static_cast<int64_t>(self_time[index]);
+		if (self > 0)
+		{
+			char value[32];
+			snprintf(value, sizeof(value), " %llu\r\n", static_cast<unsigned long long>(Clock::to_nanos(self)));
+			buffer += paths[index] + value;
+		}
+	}
+}
+
+void JVMAgent::start_output()
+{
+	assert(m_server == nullptr);
+
+	if (m_output == OUTPUT_SHM)
+	{
+		// The ring takes the server's share of max_buffer_mb, readers never hold anything back 
+		SharedMemoryServer *server = new SharedMemoryServer(*this, m_output_name, m_max_buffer_bytes / 2);
+		server->set_readable_by_all(m_output_readable_by_all);
+		m_server = server;
+	}
+	else if (m_output == OUTPUT_FILE)
+	{
+		FileSegmentServer *server = new FileSegmentServer(*this, m_output_name);
+		server->set_rotation(m_segment_bytes, m_segment_ms, m_max_disk_bytes);
+		server->set_readable_by_all(m_output_readable_by_all);
+		m_server = server;
+	}
+	else
+	{
+		NetworkServer *server = new NetworkServer(*this);
+		server->set_port(m_port);
+		server->set_overflow(m_max_buffer_bytes / 2, m_overflow);
+		server->set_backlog(m_backlog_bytes, m_backlog_keep_newest ? BACKLOG_KEEP_NEWEST : BACKLOG_KEEP_OLDEST);
+		m_server = server;
+	}
 
 	m_server->start();
 }
 
-void JVMAgent::stop_network_server() const
+void JVMAgent::stop_output() const
 {
 	assert(m_server != nullptr);
 
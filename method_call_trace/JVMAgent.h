@@ -3,17 +3,28 @@
 
 
 #include "JVMAgentConstants.h"
+#include "EventRing.h"
+#include "EventSource.h"
+#include "CallTree.h"
+#include "LatencyHistogram.h"
+#include "PagedArray.h"
+#include "TrivialMethods.h"
+#include "ClassCache.h"
+#include "AotDictionary.h"
 
 #include <jvmti.h>
 
+#include <atomic>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
 
 
-class NetworkServer;
+class TraceOutput;
 
 
-class JVMAgent
+class JVMAgent : public EventSource
 {
 public:
 	static JVMAgent & instance()
@@ -32,6 +43,12 @@ public:
 	static void lock();
 	static void unlock();
 
+	// EventSource
+	void stream_header(std::string &buffer) override;
+	void drain_events(std::string &buffer) override;
+	void drain_events(std::string *buffer, const std::vector<Subscription *> &subscriptions) override;
+	void discard_events() override;
+
 protected:
 	JVMAgent();
 	~JVMAgent();
@@ -46,21 +63,23 @@ private:
 	void do_lock() const;
 	void do_unlock() const;
 
-	static void __stdcall cbVMStart(jvmtiEnv *jvmti, JNIEnv *env);
-	static void __stdcall cbVMInit(jvmtiEnv *jvmti, JNIEnv *env, jthread thread);
-	static void __stdcall cbVMDeath(jvmtiEnv *jvmti, JNIEnv *env);
-	static void __stdcall cbThreadStart(jvmtiEnv *jvmti, JNIEnv *env, jthread thread);
-	static void __stdcall cbThreadEnd(jvmtiEnv *jvmti, JNIEnv *env, jthread thread);
-	static void __stdcall cbClassFileLoadHook(jvmtiEnv *jvmti, JNIEnv *env, 
+	static void JNICALL cbVMStart(jvmtiEnv *jvmti, JNIEnv *env);
+	static void JNICALL cbVMInit(jvmtiEnv *jvmti, JNIEnv *env, jthread thread);
+	static void JNICALL cbVMDeath(jvmtiEnv *jvmti, JNIEnv *env);
+	static void JNICALL cbThreadStart(jvmtiEnv *jvmti, JNIEnv *env, jthread thread);
+	static void JNICALL cbThreadEnd(jvmtiEnv *jvmti, JNIEnv *env, jthread thread);
+	static void JNICALL cbDataDumpRequest(jvmtiEnv *jvmti);
+	static void JNICALL cbClassFileLoadHook(jvmtiEnv *jvmti, JNIEnv *env, 
 		jclass class_being_redefined, jobject loader, const char *name, 
 		jobject protection_domain, jint class_data_len, const unsigned char *class_data, 
 		jint *new_class_data_len, unsigned char **new_class_data);
 
 	void process_cbVMStart(jvmtiEnv *jvmti, JNIEnv *env);
-	void process_cbVMInit(jvmtiEnv *jvmti, JNIEnv *env, jthread thread) const;
+	void process_cbVMInit(jvmtiEnv *jvmti, JNIEnv *env, jthread thread);
 	void process_cbVMDeath(jvmtiEnv *jvmti, JNIEnv *env);
-	void process_cbThreadStart(jvmtiEnv *jvmti, JNIEnv *env, jthread thread) const;
-	void process_cbThreadEnd(jvmtiEnv *jvmti, JNIEnv *env, jthread thread) const;
+	void process_cbThreadStart(jvmtiEnv *jvmti, JNIEnv *env, jthread thread);
+	void process_cbThreadEnd(jvmtiEnv *jvmti, JNIEnv *env, jthread thread);
+	void process_cbDataDumpRequest(jvmtiEnv *jvmti);
 	void process_cbClassFileLoadHook(jvmtiEnv *jvmti, JNIEnv *env,
 		jclass class_being_redefined, jobject loader, const char *name,
 		jobject protection_domain, jint class_data_len, const unsigned char *class_data,
@@ -68,23 +87,98 @@ private:
 
 
 	static void mnum_callbacks(unsigned cnum, const char **names, const char **sigs, int mcount);
-	static void get_thread_name(jvmtiEnv *jvmti, jthread thread, char *tname, int maxlen);
+	static int method_filter(unsigned cnum, unsigned mnum, const char *name, const char *sig,
+		unsigned access_flags, const unsigned char *code, long code_length);
+	static int method_included(unsigned cnum, unsigned mnum, const char *name, const char *sig,
+		unsigned access_flags, const unsigned char *code, long code_length);
+	static unsigned char *allocate_image(long length);
+	struct SampleRate;
+	static void set_sample_rate(SampleRate &sample_rate, uint32_t rate);
+	static void get_thread_name(jvmtiEnv *jvmti, jthread thread, char *tname, size_t maxlen);
+
+	struct ClassInfo;
+	static bool has_included_method(const char *classname, const unsigned char *class_data, jint class_data_len);
+	bool register_class(JNIEnv *env, jint cnum, ClassInfo &loaded, bool counter_array);
+	const ClassInfo *find_class(size_t cnum) const;
+	std::string class_cache_context(const char *classname, int system_class, bool array_counters) const;
+	static void use_cached_class(jint cnum, ClassInfo &loaded, ClassCache::Entry &entry);
+	static void use_methods(ClassInfo &loaded, const std::vector<ClassCache::Method> &methods);
+	void use_instrumented_class(JNIEnv *env, const AotDictionary::Class &instrumented);
+	void store_cached_class(const ClassInfo &loaded, const std::string &key, const unsigned char *image, long length, long class_number_offset,
+		uint64_t rewrite_nanos) const;
+
+	void init_counter_arrays(jvmtiEnv *jvmti, JNIEnv *env, jclass klass);
+	void grow_counter_table(JNIEnv *env, jsize capacity);
+	void add_counter_array(JNIEnv *env, jint cnum, int mcount);
+	void read_counter_arrays(JNIEnv *env);
+	static void JNICALL counter_reader(jvmtiEnv *jvmti, JNIEnv *env, void *arg);
 
-	static void MTRACE_native_entry(JNIEnv *env, jclass klass, jobject thread, jint cnum, jint mnum);
-	static void MTRACE_native_exit(JNIEnv *env, jclass klass, jobject thread, jint cnum, jint mnum);
-	void process_method_entry(JNIEnv *env, jclass klass, jobject thread, jint cnum, jint mnum);
-	void process_method_exit(JNIEnv *env, jclass klass, jobject thread, jint cnum, jint mnum);
+	static void JNICALL MTRACE_native_entry(JNIEnv *env, jclass klass, jint cnum, jint mnum);
+	static void JNICALL MTRACE_native_exit(JNIEnv *env, jclass klass, jint cnum, jint mnum);
+	void process_method_entry(JNIEnv *env, jclass klass, jint cnum, jint mnum);
+	void process_method_exit(JNIEnv *env, jclass klass, jint cnum, jint mnum);
 
-	void start_network_server() const;
-	void stop_network_server() const;
+	struct ThreadContext;
+	struct ShadowFrame;
+	ThreadContext *current_thread_context();
+	size_t method_id(jint cnum, jint mnum) const;
+	uint32_t sample_call(ThreadContext *context, size_t id);
+	void push_event(ThreadContext *context, int kind, jint cnum, jint mnum, uint32_t weight);
+	void push_slow_call(ThreadContext *context, const ShadowFrame &frame, uint64_t now);
+	void make_room(ThreadContext *context, uint32_t count);
+	uint32_t ring_capacity() const;
+	bool pop_frame(ThreadContext *context, size_t id, ShadowFrame &frame);
+	void record_call_time(ThreadContext *context, size_t id, uint64_t now);
+	void adapt_sample_rates(uint64_t now);
+
+	void write_clock_sync(std::string &buffer);
+	void drain_rings(std::string *buffer, const std::vector<Subscription *> &subscriptions);
+	void encode_event(std::string &buffer, uint32_t thread, const TraceEvent &event, const std::string &class_name,
+		const std::string &method_name, uint32_t weight) const;
+	void write_slow_call(std::string *buffer, const std::vector<Subscription *> &subscriptions, uint32_t thread,
+		const TraceEvent &call, const std::vector<TraceEvent> &frames);
+	void write_lifecycle_event(std::string *buffer, const std::vector<Subscription *> &subscriptions, uint32_t thread,
+		const TraceEvent &event);
+	void write_drop_report(std::string &buffer);
+	void write_count_snapshot(std::string &buffer);
+	void collect_retired_latency();
+	void write_latency_report(std::string &buffer, bool binary, const char *newline);
+	void print_latency_report();
+	void write_call_tree(std::string &buffer);
+
+	void start_output();
+	void stop_output() const;
 
 private:
+	enum AgentMode
+	{
+		MODE_TRACE,							 // Stream every entry/exit event 
+		MODE_COUNT,							 // Per-method call counts, sent periodically 
+		MODE_TIME,							 // Per-method latency histograms, reported on request 
+		MODE_TREE							 // Calling-context tree, sent periodically 
+	};
+
+	enum OutputKind
+	{
+		OUTPUT_TCP,							 // NetworkServer on m_port 
+		OUTPUT_SHM,							 // SharedMemoryServer ring named m_output_name 
+		OUTPUT_FILE							 // FileSegmentServer segments at path m_output_name 
+	};
+
+	enum TraceFormat
+	{
+		FORMAT_TEXT,						 // "enter: class:method" lines 
+		FORMAT_BINARY						 // TraceProtocol.h records 
+	};
+
 	struct MethodInfo
 	{
 		std::string m_name;					 // Method name 
 		std::string m_signature;			 // Method signature 
-		int         m_calls;				 // Method call count 
-		int         m_returns;				 // Method return count 
+		uint64_t    m_calls;				 // Method call count 
+		uint64_t    m_returns;				 // Method return count 
+		bool        m_interested;			 // Matches include list, decided at class load 
+		TrivialKind m_trivial;				 // Heuristic that kept the probes out, if any 
 	};
 
 	struct ClassInfo
@@ -92,26 +186,172 @@ private:
 		std::string m_name;					 // Class name 
 		int         m_mcount;				 // Method count 
 		std::vector<MethodInfo> m_methods;   // Method information 
-		int         m_calls;				 // Method call count for this class 
+		uint64_t    m_calls;				 // Method call count for this class 
+		size_t      m_method_base;			 // Method id of mnum 0 
+	};
+
+	// Only the owning thread writes, the network worker reads 
+	struct CallCounters
+	{
+		std::atomic<uint64_t> m_calls;
+		std::atomic<uint64_t> m_returns;
+	};
+
+	// Inclusive time counts the callees, exclusive time does not 
+	struct MethodLatency
+	{
+		LatencyHistogram m_inclusive;
+		LatencyHistogram m_exclusive;
+	};
+
+	// An open call on a thread's shadow stack 
+	struct ShadowFrame
+	{
+		size_t   m_method_id;
+		uint64_t m_start;					 // Clock::now() at entry 
+		uint64_t m_children;				 // Inclusive time of the calls it made 
+		uint32_t m_weight;					 // Sampled call weight, 0 if not traced 
+		uint32_t m_node;					 // Call tree node, MODE_TREE only 
+		jint     m_cnum;					 // Call chain of slow calls, slow_threshold_us only 
+		jint     m_mnum;
+	};
+
+	// 1-in-m_rate calls of a method are traced, the rest skipped 
+	struct SampleRate
+	{
+		std::atomic<uint32_t> m_rate;
+		std::atomic<uint32_t> m_threshold;	 // Random draws at or below it are traced 
+	};
+
+	struct ThreadContext
+	{
+		ThreadContext(int id, uint32_t ring_capacity, uint32_t tree_nodes);
+		~ThreadContext();
+
+		// Events lost on the way out: full ring, no ring, or thrown away by the worker 
+		uint64_t dropped() const;
+
+		int                m_id;			 // Agent assigned thread number 
+		EventRing         *m_ring;			 // Events produced by this thread, MODE_TRACE only, nullptr once max_buffer_mb is spent 
+		std::atomic<uint64_t> m_ringless;	 // Events dropped for want of m_ring, producer writes 
+		CallTree          *m_tree;			 // Call paths of this thread, MODE_TREE only 
+		PagedArray<CallCounters, 10, 1024> m_counters; // This thread's shard, by method id 
+		std::vector<ShadowFrame> m_stack;	 // Open calls, MODE_TIME, MODE_TREE and sampled MODE_TRACE 
+		uint32_t           m_random;		 // Sampling PRNG state 
+		std::atomic<uint32_t> m_degrade;	 // overflow=sample: calls traced 2^n times more rarely 
+		uint64_t           m_degrade_time;	 // Clock ticks of the last degrade step, producer only 
+		uint64_t           m_discarded;		 // Events the worker threw away, overflow=drop_oldest 
+		uint64_t           m_reported_dropped; // Drops in the last drop report 
+		PagedArray<std::atomic<MethodLatency *>, 10, 1024> m_latency; // This thread's histograms, by method id 
+		std::vector<MethodLatency *> m_latencies; // Everything in m_latency, for cleanup 
+		std::atomic<bool>  m_retired;		 // Thread ended, free once drained 
 	};
 
 private:
 	// JVMTI Environment 
 	jvmtiEnv *m_jvmti;
-	bool m_vm_is_dead;
-	bool m_vm_is_started;
+	std::atomic<bool> m_vm_is_dead;
+	std::atomic<bool> m_vm_is_started;
 
 	// Data access Lock 
 	jrawMonitorID m_lock;
 
 	// Options 
+	std::string m_options;				 // Whole options string, part of every class cache key 
 	std::string m_include;
+	AgentMode   m_mode;
+	TraceFormat m_format;
+	uint64_t    m_snapshot_interval;	 // MODE_COUNT and MODE_TREE snapshot period, ns 
+	uint32_t    m_sample_default;		 // Initial 1-in-N rate of every method 
+	uint64_t    m_sample_budget;		 // Events per second to adapt to, 0 for fixed rates 
+	bool        m_sampling;				 // MODE_TRACE with sample or sample_budget 
+	uint64_t    m_slow_threshold;		 // MODE_TRACE sends only calls this long, ns, 0 for all 
+	size_t      m_slow_stack;			 // Enclosing calls sent with each slow call 
+	bool        m_array_counters;		 // MODE_COUNT counts in bridge arrays, not through JNI 
+	size_t      m_backlog_bytes;		 // Output kept until a client connects 
+	bool        m_backlog_keep_newest;	 // Full backlog drops the oldest output, not the newest 
+	int         m_port;				 // Trace server TCP port 
+	OutputKind  m_output;
+	std::string m_output_name;			 // Ring name for OUTPUT_SHM, path for OUTPUT_FILE 
+	bool        m_output_readable_by_all; // OUTPUT_SHM ring or OUTPUT_FILE segments readable by other users 
+	size_t      m_segment_bytes;		 // OUTPUT_FILE segment size 
+	uint64_t    m_segment_ms;			 // OUTPUT_FILE segment age limit, 0 for none 
+	size_t      m_max_disk_bytes;		 // OUTPUT_FILE cap on all segments 
+	size_t      m_max_buffer_bytes;		 // Rings and server output together 
+	OverflowPolicy m_overflow;			 // What a full buffer does to the probes 
+	uint64_t    m_block_nanos;			 // overflow=block longest wait for room 
+	TrivialMethods m_trivial_methods;	 // skip_small, skip_accessors and skip_synthetic 
+	ClassCache *m_class_cache;			 // Rewritten images from earlier runs, nullptr without cache=dir 
+	AotDictionary *m_aot_dictionary;	 // Classes aot_instrument rewrote, nullptr without aot=file 
+
+	// ClassInfo Table: cnums come from m_class_count, an entry is written once under the 
+	// agent lock by register_class() and read under it 
+	PagedArray<ClassInfo> m_classes;
+	std::atomic<size_t> m_class_count;
+
+	// Class this thread is rewriting, filled in by the java_crw_demo() callbacks 
+	static AGENT_THREAD_LOCAL ClassInfo *s_loading_class;
+
+	// Dense method ids: cnum -> id of its mnum 0, readable from probes without the lock 
+	PagedArray<size_t> m_method_base;
+	size_t m_next_method_id;
+
+	// Encoded class/method dictionary, and how much of it the client has seen 
+	std::string m_dictionary;
+	size_t m_dictionary_sent;
+
+	// Records every client gets, collected here while no client takes the whole stream 
+	std::string m_common_records;
+
+	// Calling thread's context, a native thread-local so probes make no JVMTI call 
+	static AGENT_THREAD_LOCAL ThreadContext *s_thread_context;
+
+	// Per-thread event rings, registered lazily on first probe 
+	std::mutex m_threads_lock;
+	std::vector<ThreadContext *> m_threads;
+	int m_next_thread_id;
+	size_t m_ring_events;				 // Capacity of all rings in m_threads 
+
+	// Events dropped since the agent started, and the last counts of ended threads 
+	// that still have to be reported 
+	uint64_t m_dropped_total;
+	std::vector<std::pair<uint32_t, uint64_t> > m_retired_drops;
+	uint64_t m_drop_report_time;
+
+	// MODE_COUNT aggregation, indexed by method id 
+	std::vector<uint64_t> m_retired_calls;	 // Folded in from ended threads 
+	std::vector<uint64_t> m_retired_returns;
+	std::vector<uint64_t> m_snapshot_calls;  // Totals at the previous snapshot 
+	std::vector<uint64_t> m_snapshot_returns;
+	uint64_t m_snapshot_time;
+
+	// MODE_COUNT bridge arrays: the long[][] in MTRACE_counters and each class's long[], 
+	// global refs, and their contents at the last read, indexed by method id 
+	jclass       m_bridge_class;
+	jfieldID     m_counters_field;
+	jobjectArray m_counter_table;
+	std::atomic<bool> m_array_counting;	 // m_counter_table exists, classes hooked from now on count in arrays 
+	std::vector<jlongArray> m_counter_arrays;
+	std::vector<uint64_t> m_array_calls;
+	std::vector<uint64_t> m_array_returns;
+
+	// Clock ticks of the last RECORD_CLOCK_SYNC 
+	uint64_t m_sync_time;
+
+	// Sampling rates by method id, and the calls each method stood for since the last adaptation 
+	PagedArray<SampleRate> m_sample_rates;
+	std::vector<uint64_t> m_sampled_calls;
+	uint64_t m_adapt_time;
+
+	// MODE_TIME aggregation, indexed by method id 
+	std::vector<MethodLatency *> m_retired_latency; // Folded in from ended threads 
+	std::atomic<bool> m_latency_report_pending;	 // Client gets a report on the next drain 
 
-	// ClassInfo Table 
-	std::vector<ClassInfo> m_classes;
+	// MODE_TREE call paths folded in from ended threads 
+	CallTree *m_retired_tree;
 
-	// Network Server Data
-	NetworkServer *m_server;
+	// Network server or shared memory ring 
+	TraceOutput *m_server;
 };
 
 #endif // _INCLUDE_JVM_AGENT_H_
@@ -7,14 +7,47 @@
 #define MTRACE_native_entry _method_entry   /* Name of java entry native */
 #define MTRACE_native_exit  _method_exit    /* Name of java exit native */
 #define MTRACE_engaged      engaged         /* Name of java static field */
+#define MTRACE_counters     counters        /* Name of java static long[][] field */
+
+/* Native thread-local storage (VS2013 has no C++11 thread_local) */
+#ifdef _MSC_VER
+#define AGENT_THREAD_LOCAL  __declspec(thread)
+#else
+#define AGENT_THREAD_LOCAL  __thread
+#endif
 
 /* C macros to create strings from tokens */
 #define _STRING(s) #s
 #define STRING(s) _STRING(s)
 
 
-#define MAX_TOKEN_LENGTH        16
+#define MAX_TOKEN_LENGTH        32     /* Longest option name and short value + 1 */
 #define MAX_THREAD_NAME_LENGTH  512
 #define MAX_METHOD_NAME_LENGTH  1024
+#define MAX_OUTPUT_LENGTH       512
+#define MAX_CONTROL_LINE_LENGTH 4096
+
+#define EVENT_RING_CAPACITY     (64 * 1024)    /* Events per thread, power of two */
+#define COUNT_SNAPSHOT_INTERVAL_MS  1000       /* mode=count default interval */
+#define CLOCK_SYNC_INTERVAL_MS      1000       /* Clock sync records on the stream */
+#define SAMPLE_ADAPT_INTERVAL_MS    1000       /* sample_budget rate adjustment period */
+#define SAMPLE_MAX_RATE             (1 << 20)  /* Most calls one sampled call stands for */
+#define CALL_TREE_MAX_NODES         (64 * 1024)   /* Call paths kept per thread */
+#define CALL_TREE_MAX_MERGED_NODES  (1024 * 1024) /* Call paths sent to the client */
+#define PRECONNECT_BACKLOG_KB       (4 * 1024) /* Output kept until a client connects */
+#define WORKER_FLUSH_MS             10         /* Longest the worker sleeps between drains */
+#define SEND_CHUNK_BYTES            (1024 * 1024) /* Largest single send() of a batch */
+#define TRACE_SERVER_PORT           8888       /* port= default */
+#define MAX_BUFFER_MB               256        /* max_buffer_mb default, rings and server together */
+#define EVENT_RING_MIN_CAPACITY     1024       /* Smallest ring a thread gets under max_buffer_mb, else none */
+#define BLOCK_TIMEOUT_MS            10         /* overflow=block default wait for room */
+#define SAMPLE_MAX_DEGRADE          10         /* overflow=sample traces at least 1 in 2^n calls */
+#define SAMPLE_DEGRADE_STEP_MS      1          /* overflow=sample halves a thread's rate at most this often */
+#define DROP_REPORT_INTERVAL_MS     1000       /* Drop counters on the stream, when they changed */
+#define SEGMENT_MB                  64         /* output=file segment size default */
+#define MAX_DISK_MB                 1024       /* output=file default cap on all segments */
+#define SLOW_STACK_MAX              64         /* Most enclosing calls sent with a slow call */
+#define COUNTER_POLL_MS             100        /* counters=array reads of the bridge arrays */
+#define COUNTER_TABLE_CAPACITY      1024       /* counters=array initial class slots, grows by doubling */
 
-#endif // _INCLUDE_JVM_AGENT_CONSTANTS_H_
\ No newline at end of file
+#endif // _INCLUDE_JVM_AGENT_CONSTANTS_H_
\ No newline at end of file
@@ -0,0 +1,81 @@
+#include "LatencyHistogram.h"
+
+
+LatencyHistogram::LatencyHistogram() :
+	m_count(0),
+	m_max(0)
+{
+	for (size_t i = 0; i < BUCKET_COUNT; i++)
+	{
+		m_buckets[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+void LatencyHistogram::add(const LatencyHistogram &other)
+{
+	for (size_t i = 0; i < BUCKET_COUNT; i++)
+	{
+		const uint64_t value = other.m_buckets[i].load(std::memory_order_relaxed);
+		if (value != 0)
+		{
+			bump(m_buckets[i], value);
+		}
+	}
+
+	bump(m_count, other.count());
+	if (other.max() > max())
+	{
+		m_max.store(other.max(), std::memory_order_relaxed);
+	}
+}
+
+uint64_t LatencyHistogram::count() const
+{
+	return m_count.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::max() const
+{
+	return m_max.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::value_at_percentile(double percentile) const
+{
+	const uint64_t total = count();
+	if (total == 0)
+	{
+		return 0;
+	}
+
+	uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * total + 0.5);
+	if (rank == 0)
+	{
+		rank = 1;
+	}
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i < BUCKET_COUNT; i++)
+	{
+		seen += m_buckets[i].load(std::memory_order_relaxed);
+		if (seen >= rank)
+		{
+			// Never report more than was actually recorded
+			const uint64_t value = highest_equivalent_value(i);
+			return value < max() ? value : max();
+		}
+	}
+	return max();
+}
+
+/*static*/
+uint64_t LatencyHistogram::highest_equivalent_value(size_t index)
+{
+	if (index < SUB_BUCKET_COUNT)
+	{
+		return index;
+	}
+
+	const unsigned shift = static_cast<unsigned>(index / SUB_BUCKET_COUNT) - 1;
+	const uint64_t lowest = (static_cast<uint64_t>(SUB_BUCKET_COUNT + index % SUB_BUCKET_COUNT)) << shift;
+	return lowest + (static_cast<uint64_t>(1) << shift) - 1;
+}
@@ -0,0 +1,94 @@
+#ifndef _INCLUDE_LATENCY_HISTOGRAM_H_
+#define _INCLUDE_LATENCY_HISTOGRAM_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+
+// Log-linear latency histogram in the style of HdrHistogram.
+// Values below 2^SUB_BUCKET_BITS get a bucket each, above that every power of two
+// is split into 2^SUB_BUCKET_BITS equal buckets, so any recorded value is reported
+// within 1/32 (about 3%) of itself. Values are Clock ticks; those past 2^MAX_VALUE_BITS
+// (minutes at any tick rate) share the last bucket, the exact maximum is kept separately.
+//
+// One thread records, any other thread may read or add() it into another histogram.
+class LatencyHistogram
+{
+public:
+	static const unsigned SUB_BUCKET_BITS = 5;
+	static const unsigned MAX_VALUE_BITS = 40;
+	static const size_t   SUB_BUCKET_COUNT = static_cast<size_t>(1) << SUB_BUCKET_BITS;
+	static const size_t   BUCKET_COUNT = SUB_BUCKET_COUNT * (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1);
+
+	LatencyHistogram();
+
+	LatencyHistogram(LatencyHistogram const&) = delete;
+	LatencyHistogram& operator=(LatencyHistogram const&) = delete;
+
+	// Recording side, single writer
+	void record(uint64_t value)
+	{
+		bump(m_buckets[bucket_index(value)], 1);
+		bump(m_count, 1);
+		if (value > m_max.load(std::memory_order_relaxed))
+		{
+			m_max.store(value, std::memory_order_relaxed);
+		}
+	}
+
+	// Reading side
+	void add(const LatencyHistogram &other);
+	uint64_t count() const;
+	uint64_t max() const;
+
+	// Highest value equivalent to the one at percentile (0..100]
+	uint64_t value_at_percentile(double percentile) const;
+
+private:
+	static size_t bucket_index(uint64_t value)
+	{
+		if (value < SUB_BUCKET_COUNT)
+		{
+			return static_cast<size_t>(value);
+		}
+
+		unsigned msb = highest_bit(value);
+		if (msb >= MAX_VALUE_BITS)
+		{
+			return BUCKET_COUNT - 1;
+		}
+
+		// Top SUB_BUCKET_BITS + 1 bits of the value select the bucket within its power of two
+		const unsigned shift = msb - SUB_BUCKET_BITS;
+		return SUB_BUCKET_COUNT * (shift + 1) + static_cast<size_t>((value >> shift) - SUB_BUCKET_COUNT);
+	}
+
+	static unsigned highest_bit(uint64_t value)
+	{
+		unsigned bit = 0;
+		for (unsigned step = 32; step != 0; step >>= 1)
+		{
+			if (value >> step)
+			{
+				value >>= step;
+				bit += step;
+			}
+		}
+		return bit;
+	}
+
+	static uint64_t highest_equivalent_value(size_t index);
+
+	static void bump(std::atomic<uint64_t> &counter, uint64_t amount)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<uint64_t> m_buckets[BUCKET_COUNT];
+	std::atomic<uint64_t> m_count;
+	std::atomic<uint64_t> m_max;
+};
+
+#endif // _INCLUDE_LATENCY_HISTOGRAM_H_
@@ -0,0 +1,175 @@
+#include "MappedFile.h"
+
+#include <cstring>
+
+#ifdef WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+
+MappedFile::MappedFile() :
+	m_base(nullptr),
+	m_size(0),
+	m_used(0),
+#ifdef WIN32
+	m_file(INVALID_HANDLE_VALUE),
+	m_mapping(nullptr)
+#else
+	m_fd(-1)
+#endif
+{
+}
+
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+#ifdef WIN32
+
+bool MappedFile::create(const std::string &name, size_t size, bool readable_by_all)
+{
+	close();
+
+	// The file gets its directory's ACL, readable_by_all is for the POSIX mode only
+	DeleteFileA(name.c_str());
+	m_file = CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+		CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (m_file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	// Mapping past the end grows the file to size
+	const unsigned long long length = size;
+	m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE,
+		static_cast<DWORD>(length >> 32), static_cast<DWORD>(length), nullptr);
+	m_base = m_mapping != nullptr ? static_cast<char *>(MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size)) : nullptr;
+	if (m_base == nullptr)
+	{
+		close();
+		return false;
+	}
+
+	m_size = size;
+	m_used = 0;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (m_base != nullptr)
+	{
+		UnmapViewOfFile(m_base);
+	}
+	if (m_mapping != nullptr)
+	{
+		CloseHandle(m_mapping);
+	}
+	if (m_file != INVALID_HANDLE_VALUE)
+	{
+		LARGE_INTEGER end;
+		end.QuadPart = static_cast<long long>(m_used);
+		SetFilePointerEx(m_file, end, nullptr, 0);
+		SetEndOfFile(m_file);
+		CloseHandle(m_file);
+	}
+
+	m_base = nullptr;
+	m_mapping = nullptr;
+	m_file = INVALID_HANDLE_VALUE;
+	m_size = 0;
+	m_used = 0;
+}
+
+#else
+
+bool MappedFile::create(const std::string &name, size_t size, bool readable_by_all)
+{
+	close();
+
+	// As ShmRingWriter::open(): a planted link goes, and a new one is not followed
+	unlink(name.c_str());
+	m_fd = open(name.c_str(), O_CREAT | O_EXCL | O_NOFOLLOW | O_RDWR | O_CLOEXEC, readable_by_all ? 0644 : 0600);
+	if (m_fd < 0)
+	{
+		return false;
+	}
+
+	// Blocks are reserved now, so a full disk fails here and not as SIGBUS on a store
+	if (posix_fallocate(m_fd, 0, size) != 0)
+	{
+		close();
+		return false;
+	}
+
+	void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+	if (base == MAP_FAILED)
+	{
+		close();
+		return false;
+	}
+
+	m_base = static_cast<char *>(base);
+	m_size = size;
+	m_used = 0;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (m_base != nullptr)
+	{
+		munmap(m_base, m_size);
+	}
+	if (m_fd >= 0)
+	{
+		if (ftruncate(m_fd, m_used) != 0)
+		{
+			// Left at full size, readers stop at the zero padding
+		}
+		::close(m_fd);
+	}
+
+	m_base = nullptr;
+	m_fd = -1;
+	m_size = 0;
+	m_used = 0;
+}
+
+#endif
+
+bool MappedFile::append(const void *data, size_t length)
+{
+	if (length > m_size - m_used)
+	{
+		return false;
+	}
+
+	memcpy(m_base + m_used, data, length);
+	m_used += length;
+	return true;
+}
+
+bool MappedFile::is_open() const
+{
+	return m_base != nullptr;
+}
+
+size_t MappedFile::used() const
+{
+	return m_used;
+}
+
+size_t MappedFile::size() const
+{
+	return m_size;
+}
@@ -0,0 +1,46 @@
+#ifndef _INCLUDE_MAPPED_FILE_H_
+#define _INCLUDE_MAPPED_FILE_H_
+
+#include <cstddef>
+#include <string>
+
+
+// A file created at its full size and mapped read-write, filled front to back.
+// Writes are memory copies; the OS writes the pages back on its own, and they
+// reach the file even if the process dies. close() trims the file to what was
+// written.
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	MappedFile(MappedFile const&) = delete;
+	MappedFile& operator=(MappedFile const&) = delete;
+
+	// Creates name with size bytes allocated on disk. Whatever is at name already, a
+	// file or a link, is removed first and never written through. On Linux only its
+	// owner may read the file unless readable_by_all.
+	bool create(const std::string &name, size_t size, bool readable_by_all);
+	void close();
+
+	// False, writing nothing, if length doesn't fit
+	bool append(const void *data, size_t length);
+
+	bool is_open() const;
+	size_t used() const;
+	size_t size() const;
+
+private:
+	char  *m_base;
+	size_t m_size;
+	size_t m_used;
+#ifdef WIN32
+	void  *m_file;
+	void  *m_mapping;
+#else
+	int    m_fd;
+#endif
+};
+
+#endif // _INCLUDE_MAPPED_FILE_H_
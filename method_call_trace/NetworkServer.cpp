@@ -1,16 +1,59 @@
 #include "NetworkServer.h"
+#include "EventSource.h"
+#include "JVMAgentConstants.h"
 #include <cassert>
 #include <agent_util.h>
-#include <mutex>
 
+#ifdef WIN32
 #pragma comment(lib,"ws2_32.lib") //Winsock Library
+#else
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 
-NetworkServer::NetworkServer(): 
-	m_worker(nullptr), 
+#ifdef WIN32
+#define socket_error()       WSAGetLastError()
+#define would_block(error)   ((error) == WSAEWOULDBLOCK)
+#define close_socket(s)      closesocket(s)
+#define SEND_FLAGS           0
+#else
+#define INVALID_SOCKET       (-1)
+#define SOCKET_ERROR         (-1)
+#define socket_error()       errno
+#define would_block(error)   ((error) == EAGAIN || (error) == EWOULDBLOCK)
+#define close_socket(s)      close(s)
+#define SEND_FLAGS           MSG_NOSIGNAL
+#endif
+
+
+NetworkServer::NetworkServer(EventSource &source):
+	m_source(source),
 	m_worker_active(false),
-	m_listen_socket(0), 
-	m_client_socket(0)
+	m_port(TRACE_SERVER_PORT),
+	m_listen_socket(INVALID_SOCKET),
+	m_buffered_bytes(0),
+	m_max_buffered_bytes(MAX_BUFFER_MB * 1024 * 1024),
+	m_overflow_policy(OVERFLOW_DROP_NEWEST),
+	m_overflowing(false),
+	m_overflows(0),
+	m_had_client(false),
+	m_backlog_bytes(0),
+	m_backlog_max_bytes(PRECONNECT_BACKLOG_KB * 1024),
+	m_backlog_policy(BACKLOG_KEEP_OLDEST),
+	m_backlog_dropped(0),
+	m_wake_pending(false),
+#ifndef WIN32
+	m_epoll(-1),
+	m_wake_fd(-1),
+#endif
+	m_batches(0),
+	m_bytes_sent(0)
 {
 }
 
@@ -19,55 +62,405 @@ NetworkServer::~NetworkServer()
 {
 }
 
+void NetworkServer::set_port(int port)
+{
+	m_port = port;
+}
+
+void NetworkServer::set_backlog(size_t max_bytes, BacklogPolicy policy)
+{
+	m_backlog_max_bytes = max_bytes;
+	m_backlog_policy = policy;
+}
+
+void NetworkServer::set_overflow(size_t max_bytes, OverflowPolicy policy)
+{
+	m_max_buffered_bytes = max_bytes;
+	m_overflow_policy = policy;
+}
+
 void NetworkServer::start()
 {
-	if (!init_client_connection())
+	// The backlog is held in the same buffer
+	if (m_backlog_max_bytes > m_max_buffered_bytes)
+	{
+		m_backlog_max_bytes = m_max_buffered_bytes;
+	}
+
+	if (!init_listener())
 	{
 		return;
 	}
 
 	m_worker_active = true;
-	m_worker = new std::thread(&NetworkServer::worker_proc, this);
+	m_worker = std::thread(&NetworkServer::worker_proc, this);
 }
 
 void NetworkServer::stop()
 {
 	if (m_worker_active)
 	{
-		assert(m_worker != NULL);
+		assert(m_worker.joinable());
 
 		m_worker_active = false;
-		finit_client_connection();
-		m_worker->join();
+		wake();
+		m_worker.join();
+
+		while (!m_clients.empty())
+		{
+			drop_client(m_clients.back(), "agent stopped");
+		}
+		finit_listener();
+
+		stdout_message("Sent %llu bytes in %llu batches\n", m_bytes_sent, m_batches);
+		if (m_overflows != 0)
+		{
+			stdout_message("Output buffer filled up %llu times\n", m_overflows);
+		}
+	}
+}
+
+void NetworkServer::worker_body()
+{
+	std::string batch;
+	std::vector<Subscription *> subscriptions;
+
+	while (m_worker_active)
+	{
+		// Sleeps until a ring is half full, a socket is ready or the flush interval ends
+		wait_for_io(m_wake_pending.exchange(false) ? 0 : WORKER_FLUSH_MS);
+
+		batch.clear();
+
+		// May drop a client, so before its subscription is handed out
+		const bool overflowing = relieve_pressure();
+
+		subscriptions.clear();
+		for (Client *client : m_clients)
+		{
+			if (client->m_subscription != nullptr)
+			{
+				subscriptions.push_back(client->m_subscription);
+			}
+		}
+
+		// Per-thread event rings, left to fill up while the clients are behind
+		if (!overflowing)
+		{
+			// The whole stream is only encoded if a client or the backlog takes it
+			const bool whole_stream = subscriptions.empty() || subscriptions.size() < m_clients.size();
+			m_source.drain_events(whole_stream ? &batch : nullptr, subscriptions);
+		}
+		else if (m_overflow_policy == OVERFLOW_DROP_OLDEST)
+		{
+			m_source.discard_events();
+		}
+
+		if (!batch.empty())
+		{
+			// Encoded once, every client sends from the same copy
+			dispatch(make_batch(batch));
+		}
+		dispatch_subscribed();
 	}
 }
 
-void NetworkServer::enqueue_for_sending(const std::string &msg)
+/* Takes over the bytes, the buffer accounting follows the batch until its last holder lets go */
+NetworkServer::Batch NetworkServer::make_batch(std::string &bytes)
 {
-	m_queue_lock.lock();
-	m_queue.push(msg);
-	m_queue_lock.unlock();
+	std::string *batch = new std::string();
+	batch->swap(bytes);
+	m_buffered_bytes += batch->length();
+
+	return Batch(batch, [this](const std::string *batch)
+	{
+		m_buffered_bytes -= batch->length();
+		delete batch;
+	});
 }
 
-void NetworkServer::worker_body()
+/* Returns true while the output held for clients is over the limit */
+bool NetworkServer::relieve_pressure()
 {
-	while (m_worker_active)
+	// Before the first client the backlog policy decides what is kept
+	if (!m_had_client)
 	{
-		const char *message = "Hello Client , I am JVM TI\n";
-		send(m_client_socket, message, strlen(message), 0);
+		return false;
+	}
 
-		while (m_worker_active)
+	if (m_buffered_bytes >= m_max_buffered_bytes && m_clients.size() > 1)
+	{
+		// One stalled client must not hold back the others
+		Client *slowest = m_clients[0];
+		for (Client *client : m_clients)
 		{
-			m_queue_lock.lock();
-			while (!m_queue.empty())
+			if (client->m_pending_bytes > slowest->m_pending_bytes)
 			{
-				const std::string &msg = m_queue.front();
-				send(m_client_socket, msg.data(), msg.length(), 0);
-				m_queue.pop();
+				slowest = client;
 			}
-			m_queue_lock.unlock();
+		}
+
+		if (slowest->m_pending_bytes > m_max_buffered_bytes / 2)
+		{
+			drop_client(slowest, "too slow");
 		}
 	}
+
+	const bool overflowing = m_buffered_bytes >= m_max_buffered_bytes;
+	if (overflowing && !m_overflowing)
+	{
+		m_overflows++;
+	}
+	m_overflowing = overflowing;
+	return overflowing;
+}
+
+void NetworkServer::dispatch(const Batch &batch)
+{
+	if (!m_had_client)
+	{
+		keep_in_backlog(batch);
+		return;
+	}
+
+	// Batches that reached a client
+	m_batches++;
+
+	for (size_t i = 0; i < m_clients.size();)
+	{
+		Client *client = m_clients[i];
+
+		if (client->m_subscription != nullptr || queue_batch(client, batch))
+		{
+			i++;
+		}
+	}
+}
+
+/* Each subscriber's own events, encoded for it alone */
+void NetworkServer::dispatch_subscribed()
+{
+	for (size_t i = 0; i < m_clients.size();)
+	{
+		Client *client = m_clients[i];
+
+		if (client->m_subscription == nullptr || client->m_subscription->output().empty() ||
+			queue_batch(client, make_batch(client->m_subscription->output())))
+		{
+			i++;
+		}
+	}
+}
+
+/* Returns false if the client was dropped */
+bool NetworkServer::queue_batch(Client *client, const Batch &batch)
+{
+	client->m_pending.push_back(batch);
+	client->m_pending_bytes += batch->length();
+
+	return flush_client(client);
+}
+
+void NetworkServer::keep_in_backlog(const Batch &batch)
+{
+	if (m_backlog_policy == BACKLOG_KEEP_NEWEST)
+	{
+		while (!m_backlog.empty() && m_backlog_bytes + batch->length() > m_backlog_max_bytes)
+		{
+			m_backlog_bytes -= m_backlog.front()->length();
+			m_backlog.pop_front();
+			m_backlog_dropped++;
+		}
+	}
+
+	if (m_backlog_bytes + batch->length() > m_backlog_max_bytes)
+	{
+		m_backlog_dropped++;
+		return;
+	}
+
+	m_backlog_bytes += batch->length();
+	m_backlog.push_back(batch);
+}
+
+void NetworkServer::add_client(socket_t socket)
+{
+	Client *client = new Client();
+	client->m_socket = socket;
+	client->m_offset = 0;
+	client->m_pending_bytes = 0;
+	client->m_want_write = false;
+	client->m_subscription = nullptr;
+	m_clients.push_back(client);
+
+	// Header and dictionary so far, then the live stream
+	std::string header;
+	m_source.stream_header(header);
+	client->m_pending.push_back(make_batch(header));
+	client->m_pending_bytes += client->m_pending.back()->length();
+
+	// The first client also gets what was produced before it came
+	if (!m_had_client)
+	{
+		if (m_backlog_dropped != 0)
+		{
+			stdout_message("Backlog full before connect, %llu batches dropped\n", m_backlog_dropped);
+		}
+
+		for (const Batch &batch : m_backlog)
+		{
+			client->m_pending.push_back(batch);
+			client->m_pending_bytes += batch->length();
+		}
+
+		m_backlog.clear();
+		m_backlog_bytes = 0;
+		m_backlog_dropped = 0;
+		m_had_client = true;
+	}
+
+	stdout_message("Connection accepted, %u clients\n", static_cast<unsigned>(m_clients.size()));
+	flush_client(client);
+}
+
+/* Sends what the socket takes without blocking, returns false if the client was dropped */
+bool NetworkServer::flush_client(Client *client)
+{
+	while (!client->m_pending.empty())
+	{
+		const std::string &batch = *client->m_pending.front();
+		const size_t left = batch.length() - client->m_offset;
+		const int chunk = left > SEND_CHUNK_BYTES ? SEND_CHUNK_BYTES : static_cast<int>(left);
+
+		const int sent = send(client->m_socket, batch.data() + client->m_offset, chunk, SEND_FLAGS);
+		if (sent == SOCKET_ERROR)
+		{
+			if (would_block(socket_error()))
+			{
+				// Carry on when the socket drains, the other clients don't wait for it
+				watch_writable(client, true);
+				return true;
+			}
+
+			drop_client(client, "send failed");
+			return false;
+		}
+
+		m_bytes_sent += sent;
+		client->m_offset += sent;
+		client->m_pending_bytes -= sent;
+		if (client->m_offset == batch.length())
+		{
+			client->m_pending.pop_front();
+			client->m_offset = 0;
+		}
+	}
+
+	watch_writable(client, false);
+	return true;
+}
+
+/* Reads what the client sent without blocking, returns false if the client was dropped */
+bool NetworkServer::read_client(Client *client)
+{
+	char input[256];
+
+	for (;;)
+	{
+		const int received = recv(client->m_socket, input, sizeof(input), 0);
+		if (received == 0 || (received == SOCKET_ERROR && !would_block(socket_error())))
+		{
+			drop_client(client, "closed");
+			return false;
+		}
+		if (received == SOCKET_ERROR)
+		{
+			return true;
+		}
+
+		for (int i = 0; i < received; i++)
+		{
+			if (input[i] == '\n')
+			{
+				apply_control(client, client->m_input);
+				client->m_input.clear();
+			}
+			else if (input[i] != '\r')
+			{
+				client->m_input += input[i];
+			}
+		}
+
+		if (client->m_input.length() > MAX_CONTROL_LINE_LENGTH)
+		{
+			drop_client(client, "control line too long");
+			return false;
+		}
+	}
+}
+
+void NetworkServer::apply_control(Client *client, const std::string &line)
+{
+	if (line.empty())
+	{
+		return;
+	}
+
+	if (client->m_subscription == nullptr)
+	{
+		client->m_subscription = new Subscription();
+	}
+
+	std::string error;
+	if (!client->m_subscription->apply(line, error))
+	{
+		stdout_message("Client control line ignored: %s\n", error.c_str());
+	}
+
+	// Back on the shared stream once nothing is filtered
+	if (client->m_subscription->is_everything())
+	{
+		delete client->m_subscription;
+		client->m_subscription = nullptr;
+	}
+}
+
+void NetworkServer::drop_client(Client *client, const char *reason)
+{
+	for (size_t i = 0; i < m_clients.size(); i++)
+	{
+		if (m_clients[i] == client)
+		{
+			m_clients.erase(m_clients.begin() + i);
+			break;
+		}
+	}
+
+	// Closing also takes it out of the epoll set
+	close_socket(client->m_socket);
+	delete client->m_subscription;
+	delete client;
+
+	// With nobody left, output goes to the backlog for the next client again rather
+	// than being drained and thrown away
+	if (m_clients.empty())
+	{
+		m_had_client = false;
+	}
+
+	stdout_message("Client disconnected (%s), %u clients\n", reason, static_cast<unsigned>(m_clients.size()));
+}
+
+NetworkServer::Client *NetworkServer::find_client(socket_t socket)
+{
+	for (Client *client : m_clients)
+	{
+		if (client->m_socket == socket)
+		{
+			return client;
+		}
+	}
+	return nullptr;
 }
 
 /*static */
@@ -77,8 +470,9 @@ void NetworkServer::worker_proc(NetworkServer *self)
 }
 
 
+#ifdef WIN32
 
-bool NetworkServer::init_client_connection()
+bool NetworkServer::init_listener()
 {
 	WSADATA wsa;
 
@@ -103,7 +497,7 @@ bool NetworkServer::init_client_connection()
 	//Prepare the sockaddr_in structure
 	server_addr.sin_family = AF_INET;
 	server_addr.sin_addr.s_addr = INADDR_ANY;
-	server_addr.sin_port = htons(8888);
+	server_addr.sin_port = htons(static_cast<unsigned short>(m_port));
 
 	//Bind
 	if (bind(m_listen_socket, reinterpret_cast<struct sockaddr *>(&server_addr), sizeof(server_addr)) == SOCKET_ERROR)
@@ -113,38 +507,241 @@ bool NetworkServer::init_client_connection()
 
 	stdout_message("Bind done\n");
 
-	listen(m_listen_socket, 1);
+	unsigned long non_blocking = 1;
+	ioctlsocket(m_listen_socket, FIONBIO, &non_blocking);
+	listen(m_listen_socket, SOMAXCONN);
 
-	stdout_message("Waiting for incoming connections...\n");
+	stdout_message("Waiting for incoming connections on port %d...\n", m_port);
+	return true;
+}
 
-	struct sockaddr_in client;
-	int sockaddr_size = sizeof(struct sockaddr_in);
-	m_client_socket = accept(m_listen_socket, reinterpret_cast<struct sockaddr *>(&client), &sockaddr_size);
-	if (m_client_socket == INVALID_SOCKET)
+void NetworkServer::wait_for_io(int timeout_ms)
+{
+	// select() can't be woken by wake(), the flush interval bounds the delay instead
+	fd_set readable, writable;
+	FD_ZERO(&readable);
+	FD_ZERO(&writable);
+	FD_SET(m_listen_socket, &readable);
+
+	for (Client *client : m_clients)
 	{
-		stdout_message("accept failed with error code : %d\n", WSAGetLastError());
-		return false;
+		FD_SET(client->m_socket, &readable);
+		if (client->m_want_write)
+		{
+			FD_SET(client->m_socket, &writable);
+		}
+	}
+
+	struct timeval timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+	if (select(0, &readable, &writable, nullptr, &timeout) <= 0)
+	{
+		return;
+	}
+
+	std::vector<Client *> clients(m_clients);
+	for (Client *client : clients)
+	{
+		if (FD_ISSET(client->m_socket, &readable) && !read_client(client))
+		{
+			continue;
+		}
+
+		if (FD_ISSET(client->m_socket, &writable))
+		{
+			flush_client(client);
+		}
+	}
+
+	if (FD_ISSET(m_listen_socket, &readable))
+	{
+		accept_clients();
+	}
+}
+
+void NetworkServer::watch_writable(Client *client, bool writable)
+{
+	client->m_want_write = writable;
+}
+
+#else
+
+bool NetworkServer::init_listener()
+{
+	struct sockaddr_in server_addr;
+
+	m_listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (m_listen_socket == INVALID_SOCKET)
+	{
+		fatal_error("Could not create socket : %d\n", errno);
+	}
+
+	int reuse = 1;
+	setsockopt(m_listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	server_addr.sin_port = htons(static_cast<unsigned short>(m_port));
+
+	if (bind(m_listen_socket, reinterpret_cast<struct sockaddr *>(&server_addr), sizeof(server_addr)) == SOCKET_ERROR)
+	{
+		fatal_error("Bind failed with error code : %d\n", errno);
+	}
+
+	listen(m_listen_socket, SOMAXCONN);
+
+	m_epoll = epoll_create1(EPOLL_CLOEXEC);
+	m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_epoll < 0 || m_wake_fd < 0)
+	{
+		fatal_error("Cannot create epoll/eventfd : %d\n", errno);
 	}
 
-	stdout_message("Connection accepted\n");
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.fd = m_listen_socket;
+	epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_listen_socket, &event);
+
+	event.events = EPOLLIN;
+	event.data.fd = m_wake_fd;
+	epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake_fd, &event);
+
+	stdout_message("Waiting for incoming connections on port %d...\n", m_port);
 	return true;
 }
 
-void NetworkServer::finit_client_connection()
+void NetworkServer::wait_for_io(int timeout_ms)
 {
-	if (m_listen_socket != INVALID_SOCKET)
+	struct epoll_event events[64];
+	const int count = epoll_wait(m_epoll, events, sizeof(events) / sizeof(events[0]), timeout_ms);
+
+	for (int i = 0; i < count; i++)
 	{
-		shutdown(m_listen_socket, SD_BOTH);
-		closesocket(m_listen_socket);
-		m_listen_socket = INVALID_SOCKET;
+		const int fd = events[i].data.fd;
+
+		if (fd == m_wake_fd)
+		{
+			uint64_t value;
+			if (read(m_wake_fd, &value, sizeof(value)) < 0)
+			{
+				// Already reset, nothing to do
+			}
+			m_wake_pending = false;
+		}
+		else if (fd == m_listen_socket)
+		{
+			accept_clients();
+		}
+		else
+		{
+			Client *client = find_client(fd);
+			if (client == nullptr)
+			{
+				continue;
+			}
+
+			if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+			{
+				drop_client(client, "closed");
+				continue;
+			}
+
+			if ((events[i].events & EPOLLIN) && !read_client(client))
+			{
+				continue;
+			}
+
+			if (events[i].events & EPOLLOUT)
+			{
+				flush_client(client);
+			}
+		}
+	}
+}
+
+void NetworkServer::watch_writable(Client *client, bool writable)
+{
+	if (client->m_want_write == writable)
+	{
+		return;
+	}
+
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLRDHUP | (writable ? EPOLLOUT : 0);
+	event.data.fd = client->m_socket;
+	epoll_ctl(m_epoll, EPOLL_CTL_MOD, client->m_socket, &event);
+	client->m_want_write = writable;
+}
+
+#endif
+
+void NetworkServer::accept_clients()
+{
+	for (;;)
+	{
+		struct sockaddr_in address;
+#ifdef WIN32
+		int address_size = sizeof(address);
+		socket_t client_socket = accept(m_listen_socket, reinterpret_cast<struct sockaddr *>(&address), &address_size);
+#else
+		socklen_t address_size = sizeof(address);
+		socket_t client_socket = accept4(m_listen_socket, reinterpret_cast<struct sockaddr *>(&address), &address_size,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+#endif
+		if (client_socket == INVALID_SOCKET)
+		{
+			if (!would_block(socket_error()))
+			{
+				stdout_message("accept failed with error code : %d\n", socket_error());
+			}
+			return;
+		}
+
+#ifdef WIN32
+		unsigned long non_blocking = 1;
+		ioctlsocket(client_socket, FIONBIO, &non_blocking);
+#else
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLRDHUP;
+		event.data.fd = client_socket;
+		epoll_ctl(m_epoll, EPOLL_CTL_ADD, client_socket, &event);
+#endif
+
+		add_client(client_socket);
 	}
+}
 
-	if (m_client_socket != INVALID_SOCKET)
+void NetworkServer::wake()
+{
+	// Only the first wake since the worker last looked costs a syscall
+	if (!m_wake_pending.exchange(true, std::memory_order_acq_rel))
 	{
-		shutdown(m_client_socket, SD_BOTH);
-		closesocket(m_client_socket);
-		m_client_socket = INVALID_SOCKET;
+#ifndef WIN32
+		const uint64_t one = 1;
+		if (write(m_wake_fd, &one, sizeof(one)) < 0)
+		{
+			// Counter already non-zero, the worker is woken anyway
+		}
+#endif
+	}
+}
+
+void NetworkServer::finit_listener()
+{
+	if (m_listen_socket != INVALID_SOCKET)
+	{
+		close_socket(m_listen_socket);
+		m_listen_socket = INVALID_SOCKET;
 	}
 
+#ifdef WIN32
 	WSACleanup();
+#else
+	close(m_epoll);
+	close(m_wake_fd);
+	m_epoll = -1;
+	m_wake_fd = -1;
+#endif
 }
\ No newline at end of file
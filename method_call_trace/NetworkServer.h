@@ -2,35 +2,135 @@
 #define _INCLUDE_NETWORK_SERVER_H_
 
 #include <string>
-#include <queue>
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <thread>
+#include <vector>
 
+#ifdef WIN32
 #include <winsock2.h>
-#include <mutex>
+#endif
 
+#include "EventSource.h"
+#include "TraceOutput.h"
 
-class NetworkServer
+
+
+// What to give up when the pre-connection backlog is full
+enum BacklogPolicy
+{
+	BACKLOG_KEEP_OLDEST,				 // Drop new events, keep the start of the run
+	BACKLOG_KEEP_NEWEST					 // Drop the oldest events, keep the most recent
+};
+
+
+// Serves the trace stream to any number of TCP clients.
+// Every batch is encoded once and shared by all clients; each client only keeps
+// its own position in it. A client that sends control lines (see Subscription.h)
+// gets its own batches instead, holding only the events it subscribed to.
+// Sockets are non-blocking, a client that cannot keep up is disconnected instead
+// of holding the others back.
+// The worker waits in epoll on Linux and in select() on Windows.
+// Output held for clients is capped; once the cap is reached the worker stops
+// draining (or discards, see OverflowPolicy) so the pressure reaches the probes.
+class NetworkServer : public TraceOutput
 {
 public:
-	NetworkServer();
+#ifdef WIN32
+	typedef SOCKET socket_t;
+#else
+	typedef int socket_t;
+#endif
+
+	explicit NetworkServer(EventSource &source);
 	~NetworkServer();
-	
-	void start();
-	void stop();
-	void enqueue_for_sending(const std::string &msg);
+
+	void set_port(int port);
+
+	// Events produced before the first client connects are kept up to max_bytes
+	void set_backlog(size_t max_bytes, BacklogPolicy policy);
+
+	// Most output held for clients, including the backlog
+	void set_overflow(size_t max_bytes, OverflowPolicy policy);
+
+	// Returns at once, the worker thread listens and waits for clients
+	void start() override;
+	void stop() override;
+
+	// Producers call this when output piles up, cheap enough for a probe
+	void wake() override;
 
 private:
+	typedef std::shared_ptr<const std::string> Batch;
+
+	struct Client
+	{
+		socket_t          m_socket;
+		std::deque<Batch> m_pending;		 // Batches not fully sent yet
+		size_t            m_offset;			 // Bytes of m_pending.front() already sent
+		size_t            m_pending_bytes;
+		bool              m_want_write;		 // Waiting for the socket to drain
+		Subscription     *m_subscription;	 // Null while it takes the whole stream
+		std::string       m_input;			 // Control line read so far
+	};
+
 	static void worker_proc(NetworkServer *self);
 	void worker_body();
-	bool init_client_connection();
-	void finit_client_connection();
+	Batch make_batch(std::string &batch);
+	bool relieve_pressure();
+	void dispatch(const Batch &batch);
+	void dispatch_subscribed();
+	bool queue_batch(Client *client, const Batch &batch);
+	void keep_in_backlog(const Batch &batch);
+	void add_client(socket_t socket);
+	bool flush_client(Client *client);
+	bool read_client(Client *client);
+	void apply_control(Client *client, const std::string &line);
+	void drop_client(Client *client, const char *reason);
+	Client *find_client(socket_t socket);
+
+	// Platform part
+	bool init_listener();
+	void wait_for_io(int timeout_ms);
+	void accept_clients();
+	void watch_writable(Client *client, bool writable);
+	void finit_listener();
+
 private:
-	std::thread *m_worker;
-	bool m_worker_active;
-	SOCKET m_listen_socket;
-	SOCKET m_client_socket;
-	std::mutex m_queue_lock;
-	std::queue<std::string> m_queue;
+	EventSource &m_source;
+	std::thread m_worker;
+	std::atomic<bool> m_worker_active;
+	int m_port;
+	socket_t m_listen_socket;
+
+	// Bytes of all live batches, each counted once however many clients hold it.
+	// Declared before anything holding batches so it outlives them.
+	size_t m_buffered_bytes;
+	size_t m_max_buffered_bytes;
+	OverflowPolicy m_overflow_policy;
+	bool m_overflowing;
+	unsigned long long m_overflows;		 // Times the buffer filled up
+
+	std::vector<Client *> m_clients;
+	bool m_had_client;					 // A client took the backlog and is still connected
+
+	// Pre-connection backlog, whole batches so records are never split
+	std::deque<Batch> m_backlog;
+	size_t m_backlog_bytes;
+	size_t m_backlog_max_bytes;
+	BacklogPolicy m_backlog_policy;
+	unsigned long long m_backlog_dropped;
+
+	// Set by wake(), cleared by the worker once it is up
+	std::atomic<bool> m_wake_pending;
+#ifndef WIN32
+	int m_epoll;
+	int m_wake_fd;						 // eventfd, readable while a wake is pending
+#endif
+
+	unsigned long long m_batches;
+	unsigned long long m_bytes_sent;
 };
 
 
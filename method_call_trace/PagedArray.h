@@ -0,0 +1,86 @@
+#ifndef _INCLUDE_PAGED_ARRAY_H_
+#define _INCLUDE_PAGED_ARRAY_H_
+
+#include "agent_util.h"
+
+#include <atomic>
+#include <cstddef>
+
+
+// Array that grows a page at a time and never moves an element once created.
+// Lookups are lock-free and safe from any thread while other threads add pages,
+// which is what the probe path needs for tables indexed by cnum or method id.
+template <typename T, unsigned PAGE_BITS = 12, unsigned PAGE_COUNT = 4096>
+class PagedArray
+{
+public:
+	PagedArray()
+	{
+		for (unsigned i = 0; i < PAGE_COUNT; i++)
+		{
+			m_pages[i].store(nullptr, std::memory_order_relaxed);
+		}
+	}
+
+	~PagedArray()
+	{
+		for (unsigned i = 0; i < PAGE_COUNT; i++)
+		{
+			delete[] m_pages[i].load(std::memory_order_relaxed);
+		}
+	}
+
+	PagedArray(PagedArray const&) = delete;
+	PagedArray& operator=(PagedArray const&) = delete;
+
+	static size_t capacity()
+	{
+		return static_cast<size_t>(PAGE_COUNT) << PAGE_BITS;
+	}
+
+	// Element at index, or nullptr if its page was never created
+	T *find(size_t index) const
+	{
+		if (index >= capacity())
+		{
+			return nullptr;
+		}
+
+		T *page = m_pages[index >> PAGE_BITS].load(std::memory_order_acquire);
+		return page != nullptr ? &page[index & PAGE_MASK] : nullptr;
+	}
+
+	// Element at index, creating its page (value initialized) if needed
+	T &at(size_t index)
+	{
+		if (index >= capacity())
+		{
+			fatal_error("ERROR: Paged array index out of range\n");
+		}
+
+		std::atomic<T *> &slot = m_pages[index >> PAGE_BITS];
+		T *page = slot.load(std::memory_order_acquire);
+		if (page == nullptr)
+		{
+			T *fresh = new T[PAGE_SIZE]();
+			if (slot.compare_exchange_strong(page, fresh, std::memory_order_acq_rel))
+			{
+				page = fresh;
+			}
+			else
+			{
+				// Someone else installed the page first, page now holds theirs
+				delete[] fresh;
+			}
+		}
+		return page[index & PAGE_MASK];
+	}
+
+private:
+	static const size_t PAGE_SIZE = static_cast<size_t>(1) << PAGE_BITS;
+	static const size_t PAGE_MASK = PAGE_SIZE - 1;
+
+	std::atomic<T *> m_pages[PAGE_COUNT];
+};
+
+#endif // _INCLUDE_PAGED_ARRAY_H_
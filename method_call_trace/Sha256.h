@@ -0,0 +1,30 @@
+#ifndef _INCLUDE_SHA256_H_
+#define _INCLUDE_SHA256_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+// SHA-256 (FIPS 180-4), for keys that must not collide by accident
+class Sha256
+{
+public:
+	Sha256();
+
+	void update(const void *data, size_t length);
+	void update(const std::string &value);
+
+	// Finishes the hash, 64 lowercase hex digits
+	std::string hex_digest();
+
+private:
+	void transform(const uint8_t *block);
+
+	uint32_t m_state[8];
+	uint8_t  m_block[64];
+	size_t   m_block_used;
+	uint64_t m_length;					 // Bytes hashed so far
+};
+
+#endif // _INCLUDE_SHA256_H_
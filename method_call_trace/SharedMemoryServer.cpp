@@ -0,0 +1,154 @@
+#include "SharedMemoryServer.h"
+#include "EventSource.h"
+#include "JVMAgentConstants.h"
+#include <cassert>
+#include <chrono>
+#include <agent_util.h>
+
+
+SharedMemoryServer::SharedMemoryServer(EventSource &source, const std::string &name, size_t capacity) :
+	m_source(source),
+	m_name(name),
+	m_capacity(capacity),
+	m_readable_by_all(false),
+	m_worker_active(false),
+	m_wake_pending(false),
+	m_has_keyframe(false),
+	m_frames(0),
+	m_bytes_written(0),
+	m_frames_dropped(0),
+	m_keyframes_dropped(0)
+{
+}
+
+
+SharedMemoryServer::~SharedMemoryServer()
+{
+}
+
+void SharedMemoryServer::set_readable_by_all(bool readable_by_all)
+{
+	m_readable_by_all = readable_by_all;
+}
+
+void SharedMemoryServer::start()
+{
+	if (!m_ring.open(m_name, m_capacity, m_readable_by_all))
+	{
+		fatal_error("ERROR: Cannot create shared memory ring %s\n", m_name.c_str());
+	}
+
+	stdout_message("Writing trace to shared memory ring %s, %llu KB\n", m_name.c_str(),
+		static_cast<unsigned long long>(m_ring.capacity() / 1024));
+
+	m_worker_active = true;
+	m_worker = std::thread(&SharedMemoryServer::worker_proc, this);
+}
+
+void SharedMemoryServer::stop()
+{
+	if (m_worker_active)
+	{
+		assert(m_worker.joinable());
+
+		m_worker_active = false;
+		wake();
+		m_worker.join();
+		m_ring.close();
+
+		stdout_message("Wrote %llu bytes in %llu frames\n", m_bytes_written, m_frames);
+		if (m_frames_dropped != 0)
+		{
+			stdout_message("%llu frames that did not fit the ring were dropped\n", m_frames_dropped);
+		}
+		if (m_keyframes_dropped != 0)
+		{
+			stdout_message("%llu times header and dictionary did not fit the ring with the next frame\n", m_keyframes_dropped);
+		}
+	}
+}
+
+void SharedMemoryServer::wake()
+{
+	// No lock on this path, a wakeup lost to the race costs one flush interval at most
+	if (!m_wake_pending.exchange(true, std::memory_order_acq_rel))
+	{
+		m_wake.notify_one();
+	}
+}
+
+void SharedMemoryServer::wait_for_work()
+{
+	std::unique_lock<std::mutex> guard(m_wake_lock);
+	m_wake.wait_for(guard, std::chrono::milliseconds(WORKER_FLUSH_MS), [this]()
+	{
+		return m_wake_pending.load(std::memory_order_acquire) || !m_worker_active;
+	});
+	m_wake_pending.store(false, std::memory_order_release);
+}
+
+/* Header and dictionary as a keyframe, false (and counted) if it and following bytes of frame after it do not fit */
+bool SharedMemoryServer::write_keyframe(size_t following)
+{
+	std::string header;
+	m_source.stream_header(header);
+	if (sizeof(ShmFrame) + header.length() + following > m_ring.capacity() || !m_ring.write(header, true))
+	{
+		m_keyframes_dropped++;
+		return false;
+	}
+	m_has_keyframe = true;
+	return true;
+}
+
+void SharedMemoryServer::write_batch(const std::string &batch)
+{
+	// A reader starts at the latest keyframe, or lands on it after being overrun. A frame
+	// that would end more than half a ring past it gets a fresh one first, so the keyframe
+	// is never overwritten and a new reader never has more than half a ring to catch up.
+	// Without one in the ring, readers would have no dictionary: the batch is dropped.
+	const size_t frame = sizeof(ShmFrame) + batch.length();
+	if ((!m_has_keyframe || m_ring.position() + frame - m_ring.keyframe() > m_ring.capacity() / 2) &&
+		!write_keyframe(frame))
+	{
+		m_frames_dropped++;
+		return;
+	}
+
+	if (m_ring.write(batch, false))
+	{
+		m_frames++;
+		m_bytes_written += batch.length();
+	}
+	else
+	{
+		m_frames_dropped++;
+	}
+}
+
+void SharedMemoryServer::worker_body()
+{
+	std::string batch;
+
+	// Readers that come before the first events find the header waiting
+	write_keyframe(0);
+
+	while (m_worker_active)
+	{
+		wait_for_work();
+
+		batch.clear();
+		m_source.drain_events(batch);
+
+		if (!batch.empty())
+		{
+			write_batch(batch);
+		}
+	}
+}
+
+/*static */
+void SharedMemoryServer::worker_proc(SharedMemoryServer *self)
+{
+	self->worker_body();
+}
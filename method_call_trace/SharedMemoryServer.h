@@ -0,0 +1,64 @@
+#ifndef _INCLUDE_SHARED_MEMORY_SERVER_H_
+#define _INCLUDE_SHARED_MEMORY_SERVER_H_
+
+#include "ShmRing.h"
+#include "TraceOutput.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+
+class EventSource;
+
+
+// Writes the trace stream into a named shared-memory ring (see ShmRing.h) for a
+// collector on the same host. Nothing waits for the readers: one that falls a ring
+// behind loses data and picks up again at the latest keyframe, which this rewrites
+// before any frame that would end more than half a ring after it.
+class SharedMemoryServer : public TraceOutput
+{
+public:
+	SharedMemoryServer(EventSource &source, const std::string &name, size_t capacity);
+	~SharedMemoryServer();
+
+	// Other users may map the ring, off by default
+	void set_readable_by_all(bool readable_by_all);
+
+	void start() override;
+	void stop() override;
+	void wake() override;
+
+private:
+	static void worker_proc(SharedMemoryServer *self);
+	void worker_body();
+	void wait_for_work();
+	bool write_keyframe(size_t following);
+	void write_batch(const std::string &batch);
+
+private:
+	EventSource &m_source;
+	std::string m_name;
+	size_t m_capacity;
+	bool m_readable_by_all;
+	ShmRingWriter m_ring;
+
+	std::thread m_worker;
+	std::atomic<bool> m_worker_active;
+
+	// Set by wake(), cleared by the worker once it is up
+	std::atomic<bool> m_wake_pending;
+	std::mutex m_wake_lock;
+	std::condition_variable m_wake;
+
+	bool m_has_keyframe;				 // One was written, m_ring.keyframe() is valid
+	unsigned long long m_frames;
+	unsigned long long m_bytes_written;
+	unsigned long long m_frames_dropped;
+	unsigned long long m_keyframes_dropped;	 // Header and dictionary, with the frame after, too big for the ring
+};
+
+
+#endif // _INCLUDE_SHARED_MEMORY_SERVER_H_
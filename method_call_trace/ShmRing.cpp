@@ -0,0 +1,473 @@
+#include "ShmRing.h"
+
+#include <cstring>
+#include <new>
+
+#ifdef WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <climits>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+
+// Frames are read back into ShmFrame with plain copies on both sides
+static_assert(sizeof(ShmRingHeader) <= SHM_RING_DATA, "ring header must fit its page");
+static_assert(sizeof(ShmFrame) == 16, "frame header layout is shared with readers");
+
+
+#ifdef WIN32
+
+static std::string mapping_name(const std::string &name)
+{
+	return "Local\\" + (name[0] == '/' ? name.substr(1) : name);
+}
+
+#else
+
+static std::string mapping_name(const std::string &name)
+{
+	return name[0] == '/' ? name : "/" + name;
+}
+
+/* m_wake lives in a shared mapping, so these are the process-shared futex operations */
+static void futex_wake(const std::atomic<uint32_t> *word)
+{
+	syscall(SYS_futex, reinterpret_cast<const uint32_t *>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+static void futex_wait(const std::atomic<uint32_t> *word, uint32_t seen, int timeout_ms)
+{
+	struct timespec timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	syscall(SYS_futex, reinterpret_cast<const uint32_t *>(word), FUTEX_WAIT, seen, &timeout, nullptr, 0);
+}
+
+#endif
+
+
+ShmRingWriter::ShmRingWriter() :
+	m_header(nullptr),
+	m_data(nullptr),
+	m_position(0),
+	m_mapped(0),
+#ifdef WIN32
+	m_mapping(nullptr),
+	m_event(nullptr)
+#else
+	m_fd(-1)
+#endif
+{
+}
+
+
+ShmRingWriter::~ShmRingWriter()
+{
+	close();
+}
+
+bool ShmRingWriter::open(const std::string &name, size_t capacity, bool readable_by_all)
+{
+	if (name.empty() || capacity < sizeof(ShmFrame))
+	{
+		return false;
+	}
+
+	size_t rounded = 1;
+	while (rounded <= capacity / 2)
+	{
+		rounded <<= 1;
+	}
+
+	m_name = mapping_name(name);
+	m_mapped = SHM_RING_DATA + rounded;
+
+#ifdef WIN32
+	const unsigned long long size = m_mapped;
+	m_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+		static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), m_name.c_str());
+	if (m_mapping == nullptr)
+	{
+		return false;
+	}
+
+	void *base = MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, m_mapped);
+	m_event = CreateEventA(nullptr, FALSE, FALSE, (m_name + "_wake").c_str());
+	if (base == nullptr || m_event == nullptr)
+	{
+		close();
+		return false;
+	}
+#else
+	// A stale ring from an earlier run is replaced, its readers keep the old one
+	shm_unlink(m_name.c_str());
+	m_fd = shm_open(m_name.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, readable_by_all ? 0644 : 0600);
+	if (m_fd < 0)
+	{
+		return false;
+	}
+
+	if (ftruncate(m_fd, m_mapped) != 0)
+	{
+		close();
+		return false;
+	}
+
+	void *base = mmap(nullptr, m_mapped, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+	if (base == MAP_FAILED)
+	{
+		m_mapped = 0;
+		close();
+		return false;
+	}
+#endif
+
+	m_header = new (base) ShmRingHeader();
+	m_data = static_cast<char *>(base) + SHM_RING_DATA;
+	m_position = 0;
+
+	m_header->m_capacity = rounded;
+	m_header->m_reserve.store(0, std::memory_order_relaxed);
+	m_header->m_commit.store(0, std::memory_order_relaxed);
+	m_header->m_keyframe.store(0, std::memory_order_relaxed);
+	m_header->m_wake.store(0, std::memory_order_relaxed);
+	m_header->m_version = SHM_RING_VERSION;
+
+	// Readers check the magic last
+	std::atomic_thread_fence(std::memory_order_release);
+	m_header->m_magic = SHM_RING_MAGIC;
+	return true;
+}
+
+void ShmRingWriter::close()
+{
+#ifdef WIN32
+	if (m_header != nullptr)
+	{
+		UnmapViewOfFile(m_header);
+	}
+	if (m_mapping != nullptr)
+	{
+		CloseHandle(m_mapping);
+	}
+	if (m_event != nullptr)
+	{
+		CloseHandle(m_event);
+	}
+	m_mapping = nullptr;
+	m_event = nullptr;
+#else
+	if (m_header != nullptr)
+	{
+		munmap(m_header, m_mapped);
+	}
+	if (m_fd >= 0)
+	{
+		::close(m_fd);
+		shm_unlink(m_name.c_str());
+	}
+	m_fd = -1;
+#endif
+
+	m_header = nullptr;
+	m_data = nullptr;
+	m_mapped = 0;
+}
+
+bool ShmRingWriter::write(const std::string &payload, bool keyframe)
+{
+	const uint64_t start = m_position;
+	const uint64_t end = start + sizeof(ShmFrame) + payload.length();
+	if (end - start > m_header->m_capacity)
+	{
+		return false;
+	}
+
+	ShmFrame frame;
+	frame.m_position = start;
+	frame.m_length = static_cast<uint32_t>(payload.length());
+	frame.m_keyframe = keyframe ? 1 : 0;
+
+	// Readers check m_reserve after copying, anything it covers may be torn
+	m_header->m_reserve.store(end, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	copy_in(start, &frame, sizeof(frame));
+	copy_in(start + sizeof(frame), payload.data(), payload.length());
+
+	m_header->m_commit.store(end, std::memory_order_release);
+	if (keyframe)
+	{
+		m_header->m_keyframe.store(start, std::memory_order_release);
+	}
+	m_position = end;
+
+	wake_readers();
+	return true;
+}
+
+uint64_t ShmRingWriter::position() const
+{
+	return m_position;
+}
+
+uint64_t ShmRingWriter::keyframe() const
+{
+	return m_header->m_keyframe.load(std::memory_order_relaxed);
+}
+
+size_t ShmRingWriter::capacity() const
+{
+	return static_cast<size_t>(m_header->m_capacity);
+}
+
+void ShmRingWriter::copy_in(uint64_t position, const void *data, size_t length)
+{
+	const uint64_t mask = m_header->m_capacity - 1;
+	const size_t offset = static_cast<size_t>(position & mask);
+	const size_t first = length < m_header->m_capacity - offset ? length : static_cast<size_t>(m_header->m_capacity - offset);
+
+	memcpy(m_data + offset, data, first);
+	memcpy(m_data, static_cast<const char *>(data) + first, length - first);
+}
+
+void ShmRingWriter::wake_readers()
+{
+	m_header->m_wake.fetch_add(1, std::memory_order_release);
+#ifdef WIN32
+	SetEvent(m_event);
+#else
+	futex_wake(&m_header->m_wake);
+#endif
+}
+
+
+ShmRingReader::ShmRingReader() :
+	m_header(nullptr),
+	m_data(nullptr),
+	m_capacity(0),
+	m_position(0),
+	m_need_keyframe(false),
+	m_mapped(0),
+#ifdef WIN32
+	m_mapping(nullptr),
+	m_event(nullptr)
+#else
+	m_fd(-1)
+#endif
+{
+}
+
+
+ShmRingReader::~ShmRingReader()
+{
+	close();
+}
+
+bool ShmRingReader::open(const std::string &name)
+{
+	if (name.empty())
+	{
+		return false;
+	}
+
+	const std::string mapped_name = mapping_name(name);
+
+#ifdef WIN32
+	m_mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, mapped_name.c_str());
+	m_event = OpenEventA(SYNCHRONIZE, FALSE, (mapped_name + "_wake").c_str());
+	if (m_mapping == nullptr || m_event == nullptr)
+	{
+		close();
+		return false;
+	}
+
+	// Map the header page first to learn the size
+	const void *base = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, SHM_RING_DATA);
+	if (base == nullptr)
+	{
+		close();
+		return false;
+	}
+	const ShmRingHeader *header = static_cast<const ShmRingHeader *>(base);
+	const size_t size = SHM_RING_DATA + static_cast<size_t>(header->m_capacity);
+	const bool valid = header->m_magic == SHM_RING_MAGIC && header->m_version == SHM_RING_VERSION;
+	UnmapViewOfFile(base);
+
+	base = valid ? MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, size) : nullptr;
+	if (base == nullptr)
+	{
+		close();
+		return false;
+	}
+	m_mapped = size;
+#else
+	m_fd = shm_open(mapped_name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+	if (m_fd < 0)
+	{
+		return false;
+	}
+
+	struct stat info;
+	if (fstat(m_fd, &info) != 0 || static_cast<size_t>(info.st_size) <= SHM_RING_DATA)
+	{
+		close();
+		return false;
+	}
+
+	const void *base = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, m_fd, 0);
+	if (base == MAP_FAILED)
+	{
+		close();
+		return false;
+	}
+	m_mapped = info.st_size;
+#endif
+
+	m_header = static_cast<const ShmRingHeader *>(base);
+	m_data = static_cast<const char *>(base) + SHM_RING_DATA;
+
+	if (m_header->m_magic != SHM_RING_MAGIC || m_header->m_version != SHM_RING_VERSION ||
+		SHM_RING_DATA + m_header->m_capacity > m_mapped)
+	{
+		close();
+		return false;
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+
+	m_capacity = m_header->m_capacity;
+	m_position = m_header->m_keyframe.load(std::memory_order_acquire);
+	return true;
+}
+
+void ShmRingReader::close()
+{
+#ifdef WIN32
+	if (m_header != nullptr)
+	{
+		UnmapViewOfFile(m_header);
+	}
+	if (m_mapping != nullptr)
+	{
+		CloseHandle(m_mapping);
+	}
+	if (m_event != nullptr)
+	{
+		CloseHandle(m_event);
+	}
+	m_mapping = nullptr;
+	m_event = nullptr;
+#else
+	if (m_header != nullptr)
+	{
+		munmap(const_cast<ShmRingHeader *>(m_header), m_mapped);
+	}
+	if (m_fd >= 0)
+	{
+		::close(m_fd);
+	}
+	m_fd = -1;
+#endif
+
+	m_header = nullptr;
+	m_data = nullptr;
+	m_mapped = 0;
+}
+
+bool ShmRingReader::read(std::string &payload, uint64_t &lost, int timeout_ms)
+{
+	bool waited = false;
+
+	for (;;)
+	{
+		const uint32_t seen = m_header->m_wake.load(std::memory_order_acquire);
+		const uint64_t commit = m_header->m_commit.load(std::memory_order_acquire);
+
+		if (m_position == commit)
+		{
+			if (waited)
+			{
+				return false;
+			}
+			wait(seen, timeout_ms);
+			waited = true;
+			continue;
+		}
+
+		bool overrun = commit - m_position > m_capacity;
+		if (!overrun)
+		{
+			ShmFrame frame;
+			copy_out(m_position, &frame, sizeof(frame));
+			if (frame.m_length <= m_capacity - sizeof(frame))
+			{
+				payload.resize(frame.m_length);
+				copy_out(m_position + sizeof(frame), &payload[0], frame.m_length);
+			}
+
+			// The copies only count if the writer had not started on those bytes again
+			std::atomic_thread_fence(std::memory_order_acquire);
+			const uint64_t reserve = m_header->m_reserve.load(std::memory_order_relaxed);
+			overrun = reserve - m_position > m_capacity || frame.m_position != m_position ||
+				frame.m_length > m_capacity - sizeof(frame);
+
+			if (!overrun)
+			{
+				m_position += sizeof(frame) + frame.m_length;
+				if (m_need_keyframe && frame.m_keyframe == 0)
+				{
+					lost += sizeof(frame) + frame.m_length;
+					continue;
+				}
+				m_need_keyframe = false;
+				return true;
+			}
+		}
+
+		// Lapped by the writer, carry on from the latest keyframe
+		const uint64_t keyframe = m_header->m_keyframe.load(std::memory_order_acquire);
+		if (keyframe > m_position)
+		{
+			lost += keyframe - m_position;
+			m_position = keyframe;
+		}
+		else
+		{
+			// The keyframe moved on while we looked: skip to the newest data, and on to
+			// the next keyframe, the frames in between have no dictionary to go with
+			lost += commit - m_position;
+			m_position = commit;
+			m_need_keyframe = true;
+		}
+	}
+}
+
+void ShmRingReader::copy_out(uint64_t position, void *data, size_t length) const
+{
+	const uint64_t mask = m_capacity - 1;
+	const size_t offset = static_cast<size_t>(position & mask);
+	const size_t first = length < m_capacity - offset ? length : static_cast<size_t>(m_capacity - offset);
+
+	memcpy(data, m_data + offset, first);
+	memcpy(static_cast<char *>(data) + first, m_data, length - first);
+}
+
+void ShmRingReader::wait(uint32_t seen, int timeout_ms)
+{
+#ifdef WIN32
+	(void)seen;
+	WaitForSingleObject(m_event, timeout_ms);
+#else
+	futex_wait(&m_header->m_wake, seen, timeout_ms);
+#endif
+}
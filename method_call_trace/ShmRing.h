@@ -0,0 +1,121 @@
+#ifndef _INCLUDE_SHM_RING_H_
+#define _INCLUDE_SHM_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+// Shared-memory byte ring between the agent and a collector on the same host.
+//
+// The agent's worker thread is the only writer; readers map the ring read-only, so
+// the writer never waits for them. Data goes in frames, each a ShmFrame followed by
+// its payload, at increasing stream positions. A reader that falls a whole ring
+// behind is overrun: it notices from the positions and skips to the latest keyframe,
+// a frame the writer starts with the stream header and the whole dictionary. The
+// writer puts a new one in before any frame that would end more than half a ring
+// after the latest, so one is always still in the ring; a reader that still misses
+// it skips frames up to the next keyframe rather than decode without a dictionary.
+//
+// The only system calls are the wakeups: the writer bumps m_wake after every frame
+// and wakes the readers waiting on it (futex on Linux, named event on Windows).
+
+#define SHM_RING_MAGIC      0x4D52484D     /* "MHRM" */
+#define SHM_RING_VERSION    1
+#define SHM_RING_DATA       4096           /* Offset of the data, after the header page */
+
+struct ShmRingHeader
+{
+	uint32_t m_magic;
+	uint32_t m_version;
+	uint64_t m_capacity;				 // Data bytes, power of two
+	std::atomic<uint64_t> m_reserve;	 // End of the frame being written
+	std::atomic<uint64_t> m_commit;		 // End of the last complete frame
+	std::atomic<uint64_t> m_keyframe;	 // Start of the latest keyframe
+	std::atomic<uint32_t> m_wake;		 // Bumped after every frame, readers sleep on it
+};
+
+struct ShmFrame
+{
+	uint64_t m_position;				 // Stream position of this frame, checks the read
+	uint32_t m_length;					 // Payload bytes
+	uint32_t m_keyframe;				 // 1 if a reader can start here
+};
+
+
+class ShmRingWriter
+{
+public:
+	ShmRingWriter();
+	~ShmRingWriter();
+
+	ShmRingWriter(ShmRingWriter const&) = delete;
+	ShmRingWriter& operator=(ShmRingWriter const&) = delete;
+
+	// Creates (or replaces) the named ring, capacity is rounded down to a power of two.
+	// On Linux only its owner may read it unless readable_by_all.
+	bool open(const std::string &name, size_t capacity, bool readable_by_all);
+	void close();
+
+	// Appends one frame and wakes the readers, false if it can never fit
+	bool write(const std::string &payload, bool keyframe);
+
+	uint64_t position() const;
+	uint64_t keyframe() const;
+	size_t capacity() const;
+
+private:
+	void copy_in(uint64_t position, const void *data, size_t length);
+	void wake_readers();
+
+	ShmRingHeader *m_header;
+	char          *m_data;
+	uint64_t       m_position;			 // m_header->m_commit, the writer's own copy
+	size_t         m_mapped;
+	std::string    m_name;
+#ifdef WIN32
+	void          *m_mapping;
+	void          *m_event;
+#else
+	int            m_fd;
+#endif
+};
+
+
+class ShmRingReader
+{
+public:
+	ShmRingReader();
+	~ShmRingReader();
+
+	ShmRingReader(ShmRingReader const&) = delete;
+	ShmRingReader& operator=(ShmRingReader const&) = delete;
+
+	// Maps an existing ring read-only and positions at its latest keyframe
+	bool open(const std::string &name);
+	void close();
+
+	// Next frame's payload, false if none came within timeout_ms.
+	// lost grows by the bytes skipped when the writer overran this reader.
+	bool read(std::string &payload, uint64_t &lost, int timeout_ms);
+
+private:
+	void copy_out(uint64_t position, void *data, size_t length) const;
+	void wait(uint32_t seen, int timeout_ms);
+
+	const ShmRingHeader *m_header;
+	const char          *m_data;
+	uint64_t             m_capacity;
+	uint64_t             m_position;
+	bool                 m_need_keyframe;	 // Overrun past the keyframe, skipping to the next
+	size_t               m_mapped;
+#ifdef WIN32
+	void                *m_mapping;
+	void                *m_event;
+#else
+	int                  m_fd;
+#endif
+};
+
+#endif // _INCLUDE_SHM_RING_H_
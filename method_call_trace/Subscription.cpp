@@ -0,0 +1,237 @@
+#include "Subscription.h"
+#include <algorithm>
+#include <cstdlib>
+#include <agent_util.h>
+
+
+Subscription::Subscription() :
+	m_kinds(SUBSCRIBE_ALL),
+	m_sample(1)
+{
+}
+
+/* Splits "a,b,c" into its non-empty items */
+static std::vector<std::string> split_list(const std::string &list)
+{
+	std::vector<std::string> items;
+	size_t start = 0;
+
+	while (start <= list.length())
+	{
+		size_t end = list.find(',', start);
+		if (end == std::string::npos)
+		{
+			end = list.length();
+		}
+		if (end > start)
+		{
+			items.push_back(list.substr(start, end - start));
+		}
+		start = end + 1;
+	}
+	return items;
+}
+
+bool Subscription::apply(const std::string &line, std::string &error)
+{
+	const size_t space = line.find(' ');
+	const std::string command = line.substr(0, space);
+	const std::string argument = space == std::string::npos ? std::string() : line.substr(space + 1);
+
+	if (command == "include" || command == "exclude")
+	{
+		(command == "include" ? m_include : m_exclude) = argument;
+		m_methods.clear();
+	}
+	else if (command == "kinds")
+	{
+		unsigned kinds = 0;
+		for (const std::string &kind : split_list(argument))
+		{
+			if (kind == "entry")
+			{
+				kinds |= SUBSCRIBE_ENTRY;
+			}
+			else if (kind == "exit")
+			{
+				kinds |= SUBSCRIBE_EXIT;
+			}
+			else if (kind == "thread")
+			{
+				kinds |= SUBSCRIBE_THREAD;
+			}
+			else if (kind == "classload")
+			{
+				kinds |= SUBSCRIBE_CLASS_LOAD;
+			}
+			else
+			{
+				error = "unknown kind " + kind;
+				return false;
+			}
+		}
+		m_kinds = kinds;
+	}
+	else if (command == "threads")
+	{
+		std::vector<uint32_t> threads;
+		for (const std::string &thread : split_list(argument))
+		{
+			char *end;
+			const unsigned long id = strtoul(thread.c_str(), &end, 10);
+			if (*end != 0)
+			{
+				error = "bad thread id " + thread;
+				return false;
+			}
+			threads.push_back(static_cast<uint32_t>(id));
+		}
+		std::sort(threads.begin(), threads.end());
+		m_threads.swap(threads);
+	}
+	else if (command == "sample")
+	{
+		const int rate = atoi(argument.c_str());
+		if (rate <= 0)
+		{
+			error = "bad sample rate " + argument;
+			return false;
+		}
+		m_sample = static_cast<uint32_t>(rate);
+	}
+	else if (command == "reset")
+	{
+		m_include.clear();
+		m_exclude.clear();
+		m_kinds = SUBSCRIBE_ALL;
+		m_threads.clear();
+		m_sample = 1;
+		m_methods.clear();
+	}
+	else
+	{
+		error = "unknown command " + command;
+		return false;
+	}
+
+	return true;
+}
+
+bool Subscription::is_everything() const
+{
+	return m_include.empty() && m_exclude.empty() && m_kinds == SUBSCRIBE_ALL && m_threads.empty() && m_sample == 1;
+}
+
+bool Subscription::wants_method(size_t id, const std::string &class_name, const std::string &method_name)
+{
+	if (id >= m_methods.size())
+	{
+		m_methods.resize(id + 1, 0);
+	}
+
+	// Patterns are matched once per method, not per event
+	if (m_methods[id] == 0)
+	{
+		const bool wanted = interested(const_cast<char *>(class_name.c_str()), const_cast<char *>(method_name.c_str()),
+			const_cast<char *>(m_include.c_str()), const_cast<char *>(m_exclude.c_str())) != 0;
+		m_methods[id] = wanted ? 1 : 2;
+	}
+	return m_methods[id] == 1;
+}
+
+bool Subscription::select(uint32_t thread, bool entry, size_t id, const std::string &class_name,
+	const std::string &method_name, uint32_t &weight)
+{
+	if (!m_threads.empty() && !std::binary_search(m_threads.begin(), m_threads.end(), thread))
+	{
+		return false;
+	}
+
+	if (!wants_method(id, class_name, method_name))
+	{
+		return false;
+	}
+
+	if (m_sample > 1)
+	{
+		// An exit goes out only if its entry did; calls nest, so a stack per thread pairs them
+		std::vector<std::pair<size_t, bool> > &open_calls = m_open_calls[thread];
+		bool sent;
+		if (entry)
+		{
+			if (id >= m_calls.size())
+			{
+				m_calls.resize(id + 1, 0);
+			}
+			sent = m_calls[id]++ % m_sample == 0;
+			open_calls.push_back(std::make_pair(id, sent));
+		}
+		else
+		{
+			// As the agent's pop_frame(): calls left by an exception have no exit, pop down
+			// to this method's call. Calls open before the subscription have no entry at all.
+			size_t depth = open_calls.size();
+			while (depth != 0 && open_calls[depth - 1].first != id)
+			{
+				depth--;
+			}
+			sent = depth != 0 && open_calls[depth - 1].second;
+			if (depth != 0)
+			{
+				open_calls.resize(depth - 1);
+			}
+			if (open_calls.empty())
+			{
+				m_open_calls.erase(thread);
+			}
+		}
+
+		if (!sent)
+		{
+			return false;
+		}
+		weight *= m_sample;
+	}
+
+	return (m_kinds & (entry ? SUBSCRIBE_ENTRY : SUBSCRIBE_EXIT)) != 0;
+}
+
+bool Subscription::select_call(uint32_t thread, size_t id, const std::string &class_name,
+	const std::string &method_name)
+{
+	if (!m_threads.empty() && !std::binary_search(m_threads.begin(), m_threads.end(), thread))
+	{
+		return false;
+	}
+
+	if (!wants_method(id, class_name, method_name))
+	{
+		return false;
+	}
+
+	if (m_sample > 1)
+	{
+		if (id >= m_calls.size())
+		{
+			m_calls.resize(id + 1, 0);
+		}
+		return m_calls[id]++ % m_sample == 0;
+	}
+
+	return true;
+}
+
+bool Subscription::select_record(uint32_t thread, unsigned kind) const
+{
+	if (!m_threads.empty() && !std::binary_search(m_threads.begin(), m_threads.end(), thread))
+	{
+		return false;
+	}
+
+	return (m_kinds & kind) != 0;
+}
+
+std::string &Subscription::output()
+{
+	return m_output;
+}
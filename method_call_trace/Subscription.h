@@ -0,0 +1,77 @@
+#ifndef _INCLUDE_SUBSCRIPTION_H_
+#define _INCLUDE_SUBSCRIPTION_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// Event kinds a subscription can ask for
+enum SubscribedKind
+{
+	SUBSCRIBE_ENTRY = 1,
+	SUBSCRIBE_EXIT = 2,
+	SUBSCRIBE_THREAD = 4,				 // Thread start and end
+	SUBSCRIBE_CLASS_LOAD = 8,
+	SUBSCRIBE_ALL = SUBSCRIBE_ENTRY | SUBSCRIBE_EXIT | SUBSCRIBE_THREAD | SUBSCRIBE_CLASS_LOAD
+};
+
+
+// One client's filter over the trace events, set by text lines it sends on its socket:
+//
+//   include list       only these classes/methods, same syntax as include=
+//   exclude list       not these classes/methods
+//   kinds entry,exit   which events: entry, exit, thread (start and end), classload
+//   threads 1,5        only these thread ids, none for all
+//   sample n           1 in n calls of each method, weighted like sample=
+//   reset              the whole stream again
+//
+// The agent asks select() about each event before encoding it, so what a client did
+// not subscribe to is never encoded for it. Headers, dictionary and snapshot records
+// are not filtered.
+//
+// Only the network worker thread uses a subscription.
+class Subscription
+{
+public:
+	Subscription();
+
+	// Applies one control line, false with error set if it is malformed
+	bool apply(const std::string &line, std::string &error);
+
+	// True while nothing is filtered, the client can share the whole stream
+	bool is_everything() const;
+
+	// Decides on one event of method id, and scales weight up when sampling
+	bool select(uint32_t thread, bool entry, size_t id, const std::string &class_name,
+		const std::string &method_name, uint32_t &weight);
+
+	// Decides on one whole call, as slow_threshold_us sends them; kinds does not apply
+	bool select_call(uint32_t thread, size_t id, const std::string &class_name, const std::string &method_name);
+
+	// Decides on a thread start or end (SUBSCRIBE_THREAD) or class load (SUBSCRIBE_CLASS_LOAD);
+	// only kinds and threads apply
+	bool select_record(uint32_t thread, unsigned kind) const;
+
+	// Encoded events the client is to receive, taken by the server after each drain
+	std::string &output();
+
+private:
+	bool wants_method(size_t id, const std::string &class_name, const std::string &method_name);
+
+	std::string m_include;
+	std::string m_exclude;
+	unsigned m_kinds;					 // SubscribedKind bits
+	std::vector<uint32_t> m_threads;	 // Sorted, empty for all
+	uint32_t m_sample;
+
+	std::vector<uint8_t> m_methods;		 // By method id: 0 undecided, 1 wanted, 2 not
+	std::vector<uint32_t> m_calls;		 // By method id, picks 1 in m_sample
+	std::map<uint32_t, std::vector<std::pair<size_t, bool> > > m_open_calls; // By thread, each open call's method id and whether it was sent
+	std::string m_output;
+};
+
+#endif // _INCLUDE_SUBSCRIPTION_H_
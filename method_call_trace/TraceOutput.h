@@ -0,0 +1,20 @@
+#ifndef _INCLUDE_TRACE_OUTPUT_H_
+#define _INCLUDE_TRACE_OUTPUT_H_
+
+
+// Where the agent's trace stream goes: a worker thread that pulls encoded events
+// from an EventSource and hands them to its consumers.
+class TraceOutput
+{
+public:
+	virtual ~TraceOutput() {}
+
+	// Returns at once, the work happens on the output's own thread
+	virtual void start() = 0;
+	virtual void stop() = 0;
+
+	// Producers call this when output piles up, cheap enough for a probe
+	virtual void wake() = 0;
+};
+
+#endif // _INCLUDE_TRACE_OUTPUT_H_
@@ -0,0 +1,323 @@
+#ifndef _INCLUDE_TRACE_PROTOCOL_H_
+#define _INCLUDE_TRACE_PROTOCOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+// Binary trace stream
+//
+// The stream is a sequence of records, each starting with a one byte record type.
+// All integers are little endian, strings are a u16 length followed by the bytes.
+// A stream always starts with RECORD_STREAM_HEADER. Class and method names are sent
+// once as dictionary records before the first event that refers to them.
+// Timestamps are Clock ticks; RECORD_CLOCK_SYNC follows the header and repeats every
+// second, giving the wall time (ns since 1970) at a tick count and the tick rate.
+//
+//   RECORD_STREAM_HEADER   u32 magic, u16 version
+//   RECORD_CLASS           u32 cnum, str name
+//   RECORD_METHOD          u32 cnum, u32 mnum, str name, str signature
+//   RECORD_METHOD_ENTRY    u32 thread, u32 cnum, u32 mnum, u64 timestamp
+//   RECORD_METHOD_EXIT     u32 thread, u32 cnum, u32 mnum, u64 timestamp
+//   RECORD_COUNT_SNAPSHOT  u64 timestamp, u64 interval, u32 count, then count times
+//                          u32 cnum, u32 mnum, u64 calls, u64 returns
+//   RECORD_CLOCK_SYNC      u64 ticks, u64 wall_nanos, u64 ticks_per_second
+//   RECORD_METHOD_ENTRY_SAMPLED  u32 thread, u32 cnum, u32 mnum, u64 timestamp, u32 weight
+//   RECORD_METHOD_EXIT_SAMPLED   u32 thread, u32 cnum, u32 mnum, u64 timestamp, u32 weight
+//   RECORD_CALL_TREE       u64 timestamp, u32 count, u64 truncated, then count times
+//                          u32 parent, u32 cnum, u32 mnum, u64 calls, u64 inclusive_nanos
+//   RECORD_LATENCY_REPORT  u64 timestamp, u32 count, then count times
+//                          u32 cnum, u32 mnum, u64 calls, u64 inclusive[5], u64 exclusive[5]
+//   RECORD_DROP_REPORT     u64 timestamp, u64 total, u32 count, then count times
+//                          u32 thread, u64 dropped
+//   RECORD_SLOW_CALL       u32 thread, u32 cnum, u32 mnum, u64 timestamp, u64 duration,
+//                          u16 depth, then depth times u32 cnum, u32 mnum
+//   RECORD_METHOD_SKIPPED  u32 cnum, u32 mnum, u8 reason
+//   RECORD_THREAD_START    u32 thread, u64 timestamp
+//   RECORD_THREAD_END      u32 thread, u64 timestamp
+//   RECORD_CLASS_LOAD      u32 thread, u32 cnum, u64 timestamp
+//
+// Count snapshots carry the calls and returns of each method during the interval
+// (in ns) ending at timestamp; methods that were not called are left out.
+//
+// With sampling on, a traced call stands for weight calls of its method; calls traced
+// with weight 1 use the plain entry and exit records.
+//
+// A call tree record lists call paths 1..count, each naming the path it was called
+// from (0 is the root, otherwise an earlier entry). Calls and times are totals since
+// the agent started. truncated counts the calls and paths left out because a tree
+// was full (CALL_TREE_MAX_NODES per thread, CALL_TREE_MAX_MERGED_NODES merged).
+//
+// Latency reports carry, for each method that completed a call since the agent
+// started, the p50, p90, p99, p99.9 and max of its call times in nanoseconds.
+//
+// Drop reports give the number of entry and exit events lost since the agent started,
+// in total and for each thread whose count changed since the previous report.
+//
+// Slow calls replace the entry and exit records with slow_threshold_us: one record
+// per call that took at least that long, sent when it returns. timestamp is its
+// entry, duration in nanoseconds, followed by up to slow_stack of the calls that
+// were still open around it, innermost first.
+//
+// RECORD_METHOD_SKIPPED follows the RECORD_METHOD of a method that got no probes
+// because of skip_small (reason 1), skip_accessors (2) or skip_synthetic (3).
+//
+// Thread start and end records bracket the events of a thread; threads that were
+// running before the agent have no start. A class load record names the thread that
+// loaded class cnum, after its RECORD_CLASS. Both come in the event stream only.
+//
+// Record type 0 is never used: a trace file left at its preallocated size ends in
+// zero bytes, and readers stop at the first one.
+
+#define TRACE_PROTOCOL_MAGIC    0x4352544D     /* "MTRC" */
+#define TRACE_PROTOCOL_VERSION  2
+
+enum RecordType
+{
+	RECORD_STREAM_HEADER = 1,
+	RECORD_CLASS = 2,
+	RECORD_METHOD = 3,
+	RECORD_METHOD_ENTRY = 4,
+	RECORD_METHOD_EXIT = 5,
+	RECORD_COUNT_SNAPSHOT = 6,
+	RECORD_LATENCY_REPORT = 7,
+	RECORD_CLOCK_SYNC = 8,
+	RECORD_METHOD_ENTRY_SAMPLED = 9,
+	RECORD_METHOD_EXIT_SAMPLED = 10,
+	RECORD_CALL_TREE = 11,
+	RECORD_DROP_REPORT = 12,
+	RECORD_SLOW_CALL = 13,
+	RECORD_METHOD_SKIPPED = 14,
+	RECORD_THREAD_START = 15,
+	RECORD_THREAD_END = 16,
+	RECORD_CLASS_LOAD = 17
+};
+
+// Entry and exit records have a fixed size
+const size_t EVENT_RECORD_SIZE = 1 + 4 + 4 + 4 + 8;
+const size_t SAMPLED_EVENT_RECORD_SIZE = EVENT_RECORD_SIZE + 4;
+
+// Percentiles of a latency summary, followed by the max
+const double LATENCY_PERCENTILES[] = { 50.0, 90.0, 99.0, 99.9 };
+const size_t LATENCY_SUMMARY_SIZE = sizeof(LATENCY_PERCENTILES) / sizeof(LATENCY_PERCENTILES[0]) + 1;
+
+
+class TraceEncoder
+{
+public:
+	static void stream_header(std::string &buffer)
+	{
+		put_u8(buffer, RECORD_STREAM_HEADER);
+		put_u32(buffer, TRACE_PROTOCOL_MAGIC);
+		put_u16(buffer, TRACE_PROTOCOL_VERSION);
+	}
+
+	static void class_record(std::string &buffer, uint32_t cnum, const std::string &name)
+	{
+		put_u8(buffer, RECORD_CLASS);
+		put_u32(buffer, cnum);
+		put_string(buffer, name);
+	}
+
+	static void method_record(std::string &buffer, uint32_t cnum, uint32_t mnum,
+		const std::string &name, const std::string &signature)
+	{
+		put_u8(buffer, RECORD_METHOD);
+		put_u32(buffer, cnum);
+		put_u32(buffer, mnum);
+		put_string(buffer, name);
+		put_string(buffer, signature);
+	}
+
+	static void method_skipped(std::string &buffer, uint32_t cnum, uint32_t mnum, uint8_t reason)
+	{
+		put_u8(buffer, RECORD_METHOD_SKIPPED);
+		put_u32(buffer, cnum);
+		put_u32(buffer, mnum);
+		put_u8(buffer, reason);
+	}
+
+	// type is RECORD_METHOD_ENTRY or RECORD_METHOD_EXIT, the sampled variant is used for weight != 1
+	static void event_record(std::string &buffer, RecordType type, uint32_t thread,
+		uint32_t cnum, uint32_t mnum, uint64_t timestamp, uint32_t weight)
+	{
+		// Built on the stack and appended once, this is the per-event path
+		char record[SAMPLED_EVENT_RECORD_SIZE];
+		char *p = record;
+
+		if (weight != 1)
+		{
+			type = (type == RECORD_METHOD_ENTRY) ? RECORD_METHOD_ENTRY_SAMPLED : RECORD_METHOD_EXIT_SAMPLED;
+		}
+
+		*p++ = static_cast<char>(type);
+		p = store(p, thread, 4);
+		p = store(p, cnum, 4);
+		p = store(p, mnum, 4);
+		p = store(p, timestamp, 8);
+		if (weight != 1)
+		{
+			p = store(p, weight, 4);
+		}
+		buffer.append(record, p - record);
+	}
+
+	static void count_snapshot(std::string &buffer, uint64_t timestamp, uint64_t interval, uint32_t count)
+	{
+		put_u8(buffer, RECORD_COUNT_SNAPSHOT);
+		put_u64(buffer, timestamp);
+		put_u64(buffer, interval);
+		put_u32(buffer, count);
+	}
+
+	static void count_entry(std::string &buffer, uint32_t cnum, uint32_t mnum, uint64_t calls, uint64_t returns)
+	{
+		put_u32(buffer, cnum);
+		put_u32(buffer, mnum);
+		put_u64(buffer, calls);
+		put_u64(buffer, returns);
+	}
+
+	static void clock_sync(std::string &buffer, uint64_t ticks, uint64_t wall_nanos, uint64_t ticks_per_second)
+	{
+		put_u8(buffer, RECORD_CLOCK_SYNC);
+		put_u64(buffer, ticks);
+		put_u64(buffer, wall_nanos);
+		put_u64(buffer, ticks_per_second);
+	}
+
+	static void call_tree(std::string &buffer, uint64_t timestamp, uint32_t count, uint64_t truncated)
+	{
+		put_u8(buffer, RECORD_CALL_TREE);
+		put_u64(buffer, timestamp);
+		put_u32(buffer, count);
+		put_u64(buffer, truncated);
+	}
+
+	static void call_tree_node(std::string &buffer, uint32_t parent, uint32_t cnum, uint32_t mnum,
+		uint64_t calls, uint64_t inclusive_nanos)
+	{
+		put_u32(buffer, parent);
+		put_u32(buffer, cnum);
+		put_u32(buffer, mnum);
+		put_u64(buffer, calls);
+		put_u64(buffer, inclusive_nanos);
+	}
+
+	static void latency_report(std::string &buffer, uint64_t timestamp, uint32_t count)
+	{
+		put_u8(buffer, RECORD_LATENCY_REPORT);
+		put_u64(buffer, timestamp);
+		put_u32(buffer, count);
+	}
+
+	static void latency_entry(std::string &buffer, uint32_t cnum, uint32_t mnum, uint64_t calls,
+		const uint64_t inclusive[LATENCY_SUMMARY_SIZE], const uint64_t exclusive[LATENCY_SUMMARY_SIZE])
+	{
+		put_u32(buffer, cnum);
+		put_u32(buffer, mnum);
+		put_u64(buffer, calls);
+		for (size_t i = 0; i < LATENCY_SUMMARY_SIZE; i++)
+		{
+			put_u64(buffer, inclusive[i]);
+		}
+		for (size_t i = 0; i < LATENCY_SUMMARY_SIZE; i++)
+		{
+			put_u64(buffer, exclusive[i]);
+		}
+	}
+
+	static void drop_report(std::string &buffer, uint64_t timestamp, uint64_t total, uint32_t count)
+	{
+		put_u8(buffer, RECORD_DROP_REPORT);
+		put_u64(buffer, timestamp);
+		put_u64(buffer, total);
+		put_u32(buffer, count);
+	}
+
+	static void drop_entry(std::string &buffer, uint32_t thread, uint64_t dropped)
+	{
+		put_u32(buffer, thread);
+		put_u64(buffer, dropped);
+	}
+
+	static void slow_call(std::string &buffer, uint32_t thread, uint32_t cnum, uint32_t mnum,
+		uint64_t timestamp, uint64_t duration, uint16_t depth)
+	{
+		put_u8(buffer, RECORD_SLOW_CALL);
+		put_u32(buffer, thread);
+		put_u32(buffer, cnum);
+		put_u32(buffer, mnum);
+		put_u64(buffer, timestamp);
+		put_u64(buffer, duration);
+		put_u16(buffer, depth);
+	}
+
+	static void slow_call_frame(std::string &buffer, uint32_t cnum, uint32_t mnum)
+	{
+		put_u32(buffer, cnum);
+		put_u32(buffer, mnum);
+	}
+
+	// type is RECORD_THREAD_START or RECORD_THREAD_END
+	static void thread_record(std::string &buffer, RecordType type, uint32_t thread, uint64_t timestamp)
+	{
+		put_u8(buffer, type);
+		put_u32(buffer, thread);
+		put_u64(buffer, timestamp);
+	}
+
+	static void class_load(std::string &buffer, uint32_t thread, uint32_t cnum, uint64_t timestamp)
+	{
+		put_u8(buffer, RECORD_CLASS_LOAD);
+		put_u32(buffer, thread);
+		put_u32(buffer, cnum);
+		put_u64(buffer, timestamp);
+	}
+
+private:
+	static char *store(char *p, uint64_t value, int size)
+	{
+		for (int i = 0; i < size; i++)
+		{
+			*p++ = static_cast<char>(value >> (8 * i));
+		}
+		return p;
+	}
+
+	static void put_u8(std::string &buffer, uint8_t value)
+	{
+		buffer.push_back(static_cast<char>(value));
+	}
+
+	static void put_u16(std::string &buffer, uint16_t value)
+	{
+		char bytes[2];
+		store(bytes, value, 2);
+		buffer.append(bytes, sizeof(bytes));
+	}
+
+	static void put_u32(std::string &buffer, uint32_t value)
+	{
+		char bytes[4];
+		store(bytes, value, 4);
+		buffer.append(bytes, sizeof(bytes));
+	}
+
+	static void put_u64(std::string &buffer, uint64_t value)
+	{
+		char bytes[8];
+		store(bytes, value, 8);
+		buffer.append(bytes, sizeof(bytes));
+	}
+
+	static void put_string(std::string &buffer, const std::string &value)
+	{
+		const size_t length = value.length() > 0xFFFF ? 0xFFFF : value.length();
+		put_u16(buffer, static_cast<uint16_t>(length));
+		buffer.append(value.data(), length);
+	}
+};
+
+#endif // _INCLUDE_TRACE_PROTOCOL_H_
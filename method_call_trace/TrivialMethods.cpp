@@ -0,0 +1,81 @@
+#include "TrivialMethods.h"
+
+#include <classfile_constants.h>
+
+
+TrivialMethods::TrivialMethods() :
+	m_min_code_length(0),
+	m_accessors(false),
+	m_synthetic(false)
+{
+}
+
+void TrivialMethods::set_min_code_length(size_t length)
+{
+	m_min_code_length = length;
+}
+
+void TrivialMethods::set_accessors(bool skip)
+{
+	m_accessors = skip;
+}
+
+void TrivialMethods::set_synthetic(bool skip)
+{
+	m_synthetic = skip;
+}
+
+TrivialKind TrivialMethods::classify(unsigned access_flags, const unsigned char *code, size_t code_length) const
+{
+	if (m_synthetic && (access_flags & (JVM_ACC_SYNTHETIC | JVM_ACC_BRIDGE)) != 0)
+	{
+		return TRIVIAL_SYNTHETIC;
+	}
+
+	if (code_length < m_min_code_length)
+	{
+		return TRIVIAL_SMALL;
+	}
+
+	if (m_accessors && is_accessor(code, code_length))
+	{
+		return TRIVIAL_ACCESSOR;
+	}
+
+	return TRIVIAL_NONE;
+}
+
+static bool is_value_return(unsigned char opcode)
+{
+	return opcode >= JVM_OPC_ireturn && opcode <= JVM_OPC_areturn;
+}
+
+// iload_n, lload_n, fload_n, dload_n or aload_n of local n
+static bool is_load(unsigned char opcode, int local)
+{
+	return opcode >= JVM_OPC_iload_0 && opcode <= JVM_OPC_aload_3 && (opcode - JVM_OPC_iload_0) % 4 == local;
+}
+
+/*static*/
+bool TrivialMethods::is_accessor(const unsigned char *code, size_t code_length)
+{
+	switch (code_length)
+	{
+	case 4:
+		// getstatic f; xreturn
+		return code[0] == JVM_OPC_getstatic && is_value_return(code[3]);
+
+	case 5:
+		// aload_0; getfield f; xreturn  or  xload_0; putstatic f; return
+		return (code[0] == JVM_OPC_aload_0 && code[1] == JVM_OPC_getfield && is_value_return(code[4])) ||
+			(is_load(code[0], 0) && code[1] == JVM_OPC_putstatic && code[4] == JVM_OPC_return);
+
+	case 6:
+		// aload_0; xload_1; putfield f; return
+		return code[0] == JVM_OPC_aload_0 && is_load(code[1], 1) && code[2] == JVM_OPC_putfield &&
+			code[5] == JVM_OPC_return;
+
+	default:
+		return false;
+	}
+}
@@ -0,0 +1,40 @@
+#ifndef _INCLUDE_TRIVIAL_METHODS_H_
+#define _INCLUDE_TRIVIAL_METHODS_H_
+
+#include <cstddef>
+
+
+// Why a method was left without probes
+enum TrivialKind
+{
+	TRIVIAL_NONE = 0,
+	TRIVIAL_SMALL = 1,					 // Fewer bytecodes than skip_small
+	TRIVIAL_ACCESSOR = 2,				 // Plain field getter or setter
+	TRIVIAL_SYNTHETIC = 3				 // Synthetic or bridge method made by the compiler
+};
+
+
+// Rewrite-time heuristics for methods not worth a probe. Their calls swamp the
+// counts, and with probes in them the JIT no longer inlines them away.
+// Every heuristic is off until set.
+class TrivialMethods
+{
+public:
+	TrivialMethods();
+
+	void set_min_code_length(size_t length);
+	void set_accessors(bool skip);
+	void set_synthetic(bool skip);
+
+	// Decides on one method from its access flags and original bytecodes
+	TrivialKind classify(unsigned access_flags, const unsigned char *code, size_t code_length) const;
+
+private:
+	static bool is_accessor(const unsigned char *code, size_t code_length);
+
+	size_t m_min_code_length;			 // 0 for any length
+	bool   m_accessors;
+	bool   m_synthetic;
+};
+
+#endif // _INCLUDE_TRIVIAL_METHODS_H_
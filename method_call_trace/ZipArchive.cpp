@@ -0,0 +1,820 @@
+#include "ZipArchive.h"
+
+#include <cstring>
+
+#ifndef WIN32
+#include <zlib.h>
+#endif
+
+
+static const uint32_t LOCAL_HEADER_SIGNATURE = 0x04034b50;
+static const uint32_t CENTRAL_HEADER_SIGNATURE = 0x02014b50;
+static const uint32_t END_OF_DIRECTORY_SIGNATURE = 0x06054b50;
+static const size_t LOCAL_HEADER_SIZE = 30;
+static const size_t CENTRAL_HEADER_SIZE = 46;
+static const size_t END_OF_DIRECTORY_SIZE = 22;
+
+static const uint16_t FLAG_ENCRYPTED = 0x0001;
+static const uint16_t FLAG_DATA_DESCRIPTOR = 0x0008;	 // Sizes and CRC after the data
+static const uint16_t FLAG_UTF8 = 0x0800;				 // Name in UTF-8
+static const uint16_t METHOD_STORED = 0;
+static const uint16_t METHOD_DEFLATED = 8;
+static const uint16_t VERSION_NEEDED = 20;
+
+
+#ifndef WIN32
+
+uint32_t zip::crc32(const void *data, size_t length)
+{
+	return static_cast<uint32_t>(::crc32(0L, static_cast<const Bytef *>(data), static_cast<uInt>(length)));
+}
+
+bool zip::inflate(const unsigned char *data, size_t length, size_t size, std::string &out)
+{
+	out.assign(size, 0);
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+	{
+		return false;
+	}
+	stream.next_in = const_cast<Bytef *>(data);
+	stream.avail_in = static_cast<uInt>(length);
+	stream.next_out = reinterpret_cast<Bytef *>(&out[0]);
+	stream.avail_out = static_cast<uInt>(size);
+
+	// Z_STREAM_END only if the data ended within size bytes
+	const int rc = ::inflate(&stream, Z_FINISH);
+	const bool ok = rc == Z_STREAM_END && stream.total_out == size;
+	inflateEnd(&stream);
+	return ok;
+}
+
+bool zip::deflate(const std::string &data, std::string &out)
+{
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		return false;
+	}
+
+	// Room for all of it in one go, as deflateBound() promises
+	out.assign(deflateBound(&stream, static_cast<uLong>(data.length())), 0);
+	stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+	stream.avail_in = static_cast<uInt>(data.length());
+	stream.next_out = reinterpret_cast<Bytef *>(&out[0]);
+	stream.avail_out = static_cast<uInt>(out.length());
+
+	const int rc = ::deflate(&stream, Z_FINISH);
+	out.resize(stream.total_out);
+	deflateEnd(&stream);
+	return rc == Z_STREAM_END && out.length() < data.length();
+}
+
+#else
+
+// Filled in before main(), so threads never race to build it
+struct Crc32Table
+{
+	Crc32Table()
+	{
+		for (uint32_t n = 0; n < 256; n++)
+		{
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++)
+			{
+				c = (c & 1) != 0 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			}
+			m_table[n] = c;
+		}
+	}
+
+	uint32_t m_table[256];
+};
+
+static const Crc32Table s_crc32;
+
+uint32_t zip::crc32(const void *data, size_t length)
+{
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+	uint32_t c = 0xFFFFFFFF;
+	for (size_t i = 0; i < length; i++)
+	{
+		c = s_crc32.m_table[(c ^ bytes[i]) & 0xFF] ^ (c >> 8);
+	}
+	return c ^ 0xFFFFFFFF;
+}
+
+
+// Deflate decoding with canonical Huffman codes decoded a bit at a time, after zlib's puff.c
+namespace
+{
+	const int MAX_BITS = 15;
+	const int MAX_LENGTH_CODES = 286;
+	const int MAX_DISTANCE_CODES = 30;
+	const int FIXED_LENGTH_CODES = 288;
+
+	struct Huffman
+	{
+		uint16_t m_count[MAX_BITS + 1];		 // Codes of each length
+		uint16_t m_symbol[FIXED_LENGTH_CODES];	 // Symbols ordered by code
+	};
+
+	class Inflater
+	{
+	public:
+		Inflater(const unsigned char *data, size_t length, size_t size, std::string &out) :
+			m_data(data), m_length(length), m_position(0), m_bit_buffer(0), m_bit_count(0),
+			m_size(size), m_out(out), m_error(false)
+		{
+		}
+
+		bool run();
+
+	private:
+		uint32_t bits(int need);
+		int decode(const Huffman &huffman);
+		bool stored();
+		bool codes(const Huffman &lengths, const Huffman &distances);
+		bool fixed();
+		bool dynamic();
+
+		const unsigned char *m_data;
+		size_t m_length;
+		size_t m_position;
+		uint32_t m_bit_buffer;
+		int m_bit_count;
+		size_t m_size;					 // Output beyond this is an error, not decoded
+		std::string &m_out;
+		bool m_error;					 // Ran past the end of the input
+	};
+
+	// Returns how many codes are missing: 0 complete, more incomplete, less over-subscribed
+	int build(Huffman &huffman, const uint8_t *length, int n)
+	{
+		memset(huffman.m_count, 0, sizeof(huffman.m_count));
+		for (int symbol = 0; symbol < n; symbol++)
+		{
+			huffman.m_count[length[symbol]]++;
+		}
+		if (huffman.m_count[0] == n)
+		{
+			return 0;
+		}
+
+		int left = 1;
+		for (int len = 1; len <= MAX_BITS; len++)
+		{
+			left <<= 1;
+			left -= huffman.m_count[len];
+			if (left < 0)
+			{
+				return left;
+			}
+		}
+
+		uint16_t offsets[MAX_BITS + 1];
+		offsets[1] = 0;
+		for (int len = 1; len < MAX_BITS; len++)
+		{
+			offsets[len + 1] = offsets[len] + huffman.m_count[len];
+		}
+		for (int symbol = 0; symbol < n; symbol++)
+		{
+			if (length[symbol] != 0)
+			{
+				huffman.m_symbol[offsets[length[symbol]]++] = static_cast<uint16_t>(symbol);
+			}
+		}
+		return left;
+	}
+
+	const uint16_t LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+		35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	const uint16_t LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+		3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	const uint16_t DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+		257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	const uint16_t DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+		7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+	uint32_t Inflater::bits(int need)
+	{
+		uint32_t value = m_bit_buffer;
+		while (m_bit_count < need)
+		{
+			if (m_position == m_length)
+			{
+				m_error = true;
+				return 0;
+			}
+			value |= static_cast<uint32_t>(m_data[m_position++]) << m_bit_count;
+			m_bit_count += 8;
+		}
+		m_bit_buffer = value >> need;
+		m_bit_count -= need;
+		return value & ((1u << need) - 1);
+	}
+
+	// Next symbol, -1 for a code that is not in the table
+	int Inflater::decode(const Huffman &huffman)
+	{
+		int code = 0;
+		int first = 0;
+		int index = 0;
+		for (int len = 1; len <= MAX_BITS; len++)
+		{
+			code |= static_cast<int>(bits(1));
+			if (m_error)
+			{
+				return -1;
+			}
+			const int count = huffman.m_count[len];
+			if (code - count < first)
+			{
+				return huffman.m_symbol[index + (code - first)];
+			}
+			index += count;
+			first += count;
+			first <<= 1;
+			code <<= 1;
+		}
+		return -1;
+	}
+
+	bool Inflater::stored()
+	{
+		// Byte aligned from here, what is left of the current byte is dropped
+		m_bit_buffer = 0;
+		m_bit_count = 0;
+
+		if (m_length - m_position < 4)
+		{
+			return false;
+		}
+		const unsigned char *header = m_data + m_position;
+		const size_t length = header[0] | (header[1] << 8);
+		if (length != (~(header[2] | (header[3] << 8)) & 0xFFFF))
+		{
+			return false;
+		}
+		m_position += 4;
+
+		if (m_length - m_position < length || m_size - m_out.length() < length)
+		{
+			return false;
+		}
+		m_out.append(reinterpret_cast<const char *>(m_data + m_position), length);
+		m_position += length;
+		return true;
+	}
+
+	bool Inflater::codes(const Huffman &lengths, const Huffman &distances)
+	{
+		for (;;)
+		{
+			int symbol = decode(lengths);
+			if (symbol < 0)
+			{
+				return false;
+			}
+			if (symbol < 256)
+			{
+				if (m_out.length() == m_size)
+				{
+					return false;
+				}
+				m_out.push_back(static_cast<char>(symbol));
+				continue;
+			}
+			if (symbol == 256)
+			{
+				return true;
+			}
+
+			symbol -= 257;
+			if (symbol >= 29)
+			{
+				return false;
+			}
+			const size_t length = LENGTH_BASE[symbol] + bits(LENGTH_EXTRA[symbol]);
+
+			symbol = decode(distances);
+			if (symbol < 0 || symbol >= MAX_DISTANCE_CODES)
+			{
+				return false;
+			}
+			const size_t distance = DISTANCE_BASE[symbol] + bits(DISTANCE_EXTRA[symbol]);
+			if (m_error || distance > m_out.length() || m_size - m_out.length() < length)
+			{
+				return false;
+			}
+
+			// Source and copy may overlap, a byte at a time
+			size_t from = m_out.length() - distance;
+			for (size_t i = 0; i < length; i++)
+			{
+				m_out.push_back(m_out[from++]);
+			}
+		}
+	}
+
+	bool Inflater::fixed()
+	{
+		uint8_t length[FIXED_LENGTH_CODES];
+		Huffman lengths;
+		Huffman distances;
+
+		int symbol = 0;
+		for (; symbol < 144; symbol++)
+		{
+			length[symbol] = 8;
+		}
+		for (; symbol < 256; symbol++)
+		{
+			length[symbol] = 9;
+		}
+		for (; symbol < 280; symbol++)
+		{
+			length[symbol] = 7;
+		}
+		for (; symbol < FIXED_LENGTH_CODES; symbol++)
+		{
+			length[symbol] = 8;
+		}
+		build(lengths, length, FIXED_LENGTH_CODES);
+
+		for (symbol = 0; symbol < MAX_DISTANCE_CODES; symbol++)
+		{
+			length[symbol] = 5;
+		}
+		build(distances, length, MAX_DISTANCE_CODES);
+
+		return codes(lengths, distances);
+	}
+
+	bool Inflater::dynamic()
+	{
+		static const uint8_t ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+		uint8_t length[MAX_LENGTH_CODES + MAX_DISTANCE_CODES];
+		Huffman lengths;
+		Huffman distances;
+
+		const int length_count = static_cast<int>(bits(5)) + 257;
+		const int distance_count = static_cast<int>(bits(5)) + 1;
+		const int code_count = static_cast<int>(bits(4)) + 4;
+		if (m_error || length_count > MAX_LENGTH_CODES || distance_count > MAX_DISTANCE_CODES)
+		{
+			return false;
+		}
+
+		// The code lengths of the code length code come first, then that code must be complete
+		int index = 0;
+		for (; index < code_count; index++)
+		{
+			length[ORDER[index]] = static_cast<uint8_t>(bits(3));
+		}
+		for (; index < 19; index++)
+		{
+			length[ORDER[index]] = 0;
+		}
+		if (m_error || build(lengths, length, 19) != 0)
+		{
+			return false;
+		}
+
+		index = 0;
+		while (index < length_count + distance_count)
+		{
+			int symbol = decode(lengths);
+			if (symbol < 0)
+			{
+				return false;
+			}
+			if (symbol < 16)
+			{
+				length[index++] = static_cast<uint8_t>(symbol);
+				continue;
+			}
+
+			uint8_t repeated = 0;
+			int times;
+			if (symbol == 16)
+			{
+				if (index == 0)
+				{
+					return false;
+				}
+				repeated = length[index - 1];
+				times = 3 + static_cast<int>(bits(2));
+			}
+			else if (symbol == 17)
+			{
+				times = 3 + static_cast<int>(bits(3));
+			}
+			else
+			{
+				times = 11 + static_cast<int>(bits(7));
+			}
+			if (m_error || index + times > length_count + distance_count)
+			{
+				return false;
+			}
+			while (times-- > 0)
+			{
+				length[index++] = repeated;
+			}
+		}
+
+		// No end of block code, no way out of the block
+		if (length[256] == 0)
+		{
+			return false;
+		}
+
+		// Incomplete codes are allowed only when they are a single code of one bit
+		int missing = build(lengths, length, length_count);
+		if (missing < 0 || (missing > 0 && length_count - lengths.m_count[0] != 1))
+		{
+			return false;
+		}
+		missing = build(distances, length + length_count, distance_count);
+		if (missing < 0 || (missing > 0 && distance_count - distances.m_count[0] != 1))
+		{
+			return false;
+		}
+
+		return codes(lengths, distances);
+	}
+
+	bool Inflater::run()
+	{
+		bool last;
+		do
+		{
+			last = bits(1) != 0;
+			const uint32_t type = bits(2);
+			if (m_error)
+			{
+				return false;
+			}
+
+			bool ok;
+			switch (type)
+			{
+			case 0:
+				ok = stored();
+				break;
+			case 1:
+				ok = fixed();
+				break;
+			case 2:
+				ok = dynamic();
+				break;
+			default:
+				ok = false;
+				break;
+			}
+			if (!ok || m_error)
+			{
+				return false;
+			}
+		} while (!last);
+		return true;
+	}
+}
+
+bool zip::inflate(const unsigned char *data, size_t length, size_t size, std::string &out)
+{
+	out.clear();
+	out.reserve(size);
+	Inflater inflater(data, length, size, out);
+	return inflater.run() && out.length() == size;
+}
+
+bool zip::deflate(const std::string &, std::string &)
+{
+	return false;
+}
+
+#endif // WIN32
+
+
+static uint16_t get_u16(const unsigned char *p)
+{
+	return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+	return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+		(static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static void put_u16(std::string &out, uint16_t value)
+{
+	out.push_back(static_cast<char>(value));
+	out.push_back(static_cast<char>(value >> 8));
+}
+
+static void put_u32(std::string &out, uint32_t value)
+{
+	put_u16(out, static_cast<uint16_t>(value));
+	put_u16(out, static_cast<uint16_t>(value >> 16));
+}
+
+
+bool ZipReader::open(const std::string &path, std::string &error)
+{
+	m_archive.clear();
+	m_entries.clear();
+
+	FILE *file = fopen(path.c_str(), "rb");
+	if (file == nullptr)
+	{
+		error = "cannot open";
+		return false;
+	}
+	char buffer[64 * 1024];
+	size_t length;
+	while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+	{
+		m_archive.append(buffer, length);
+	}
+	fclose(file);
+
+	// The end of central directory record is last, before a comment of up to 64 KB
+	const unsigned char *archive = reinterpret_cast<const unsigned char *>(m_archive.data());
+	const size_t size = m_archive.length();
+	const size_t lowest = size > 0xFFFF + END_OF_DIRECTORY_SIZE ? size - 0xFFFF - END_OF_DIRECTORY_SIZE : 0;
+	size_t end = size < END_OF_DIRECTORY_SIZE ? 0 : size - END_OF_DIRECTORY_SIZE + 1;
+	bool found = false;
+	while (!found && end-- > lowest)
+	{
+		found = get_u32(archive + end) == END_OF_DIRECTORY_SIGNATURE;
+	}
+	if (!found)
+	{
+		error = "not a zip file";
+		return false;
+	}
+
+	const unsigned char *record = archive + end;
+	const uint16_t count = get_u16(record + 10);
+	const uint32_t directory_size = get_u32(record + 12);
+	const uint32_t directory_offset = get_u32(record + 16);
+	if (get_u16(record + 4) != 0 || get_u16(record + 6) != 0 || count == 0xFFFF || directory_offset == 0xFFFFFFFF)
+	{
+		error = "multi-disk and zip64 archives are not supported";
+		return false;
+	}
+	if (static_cast<uint64_t>(directory_offset) + directory_size > end)
+	{
+		error = "broken central directory";
+		return false;
+	}
+
+	size_t position = directory_offset;
+	for (uint16_t i = 0; i < count; i++)
+	{
+		const unsigned char *header = archive + position;
+		if (position + CENTRAL_HEADER_SIZE > end || get_u32(header) != CENTRAL_HEADER_SIGNATURE)
+		{
+			error = "broken central directory";
+			return false;
+		}
+
+		const size_t name_length = get_u16(header + 28);
+		const size_t extra_length = get_u16(header + 30);
+		const size_t comment_length = get_u16(header + 32);
+		if (position + CENTRAL_HEADER_SIZE + name_length + extra_length + comment_length > end)
+		{
+			error = "broken central directory";
+			return false;
+		}
+
+		Entry entry;
+		entry.m_flags = get_u16(header + 8);
+		entry.m_method = get_u16(header + 10);
+		entry.m_time = get_u16(header + 12);
+		entry.m_date = get_u16(header + 14);
+		entry.m_crc = get_u32(header + 16);
+		entry.m_compressed_size = get_u32(header + 20);
+		entry.m_size = get_u32(header + 24);
+		entry.m_external_attributes = get_u32(header + 38);
+		entry.m_local_offset = get_u32(header + 42);
+		entry.m_name.assign(reinterpret_cast<const char *>(header + CENTRAL_HEADER_SIZE), name_length);
+		if ((entry.m_flags & FLAG_ENCRYPTED) != 0)
+		{
+			error = "encrypted entry " + entry.m_name;
+			return false;
+		}
+		m_entries.push_back(entry);
+
+		position += CENTRAL_HEADER_SIZE + name_length + extra_length + comment_length;
+	}
+	return true;
+}
+
+const unsigned char *ZipReader::raw_data(const Entry &entry) const
+{
+	const unsigned char *archive = reinterpret_cast<const unsigned char *>(m_archive.data());
+	const size_t size = m_archive.length();
+	const size_t offset = entry.m_local_offset;
+	if (offset + LOCAL_HEADER_SIZE > size || get_u32(archive + offset) != LOCAL_HEADER_SIGNATURE)
+	{
+		return nullptr;
+	}
+
+	// The local header's name and extra field can differ in length from the central ones
+	const size_t data = offset + LOCAL_HEADER_SIZE + get_u16(archive + offset + 26) + get_u16(archive + offset + 28);
+	if (data > size || size - data < entry.m_compressed_size)
+	{
+		return nullptr;
+	}
+	return archive + data;
+}
+
+bool ZipReader::extract(const Entry &entry, std::string &data) const
+{
+	const unsigned char *raw = raw_data(entry);
+	if (raw == nullptr)
+	{
+		return false;
+	}
+
+	if (entry.m_method == METHOD_STORED)
+	{
+		if (entry.m_compressed_size != entry.m_size)
+		{
+			return false;
+		}
+		data.assign(reinterpret_cast<const char *>(raw), entry.m_size);
+	}
+	else if (entry.m_method == METHOD_DEFLATED)
+	{
+		if (!zip::inflate(raw, entry.m_compressed_size, entry.m_size, data))
+		{
+			return false;
+		}
+	}
+	else
+	{
+		return false;
+	}
+	return zip::crc32(data.data(), data.length()) == entry.m_crc;
+}
+
+
+ZipWriter::ZipWriter() :
+	m_file(nullptr),
+	m_offset(0),
+	m_count(0),
+	m_ok(false)
+{
+}
+
+ZipWriter::~ZipWriter()
+{
+	if (m_file != nullptr)
+	{
+		fclose(m_file);
+	}
+}
+
+bool ZipWriter::open(const std::string &path)
+{
+	m_file = fopen(path.c_str(), "wb");
+	m_offset = 0;
+	m_count = 0;
+	m_central_directory.clear();
+	m_ok = m_file != nullptr;
+	return m_ok;
+}
+
+bool ZipWriter::add(const std::string &name, const std::string &data, uint16_t time, uint16_t date)
+{
+	ZipReader::Entry entry;
+	entry.m_name = name;
+	entry.m_flags = 0;
+	entry.m_method = METHOD_STORED;
+	entry.m_time = time;
+	entry.m_date = date;
+	entry.m_crc = zip::crc32(data.data(), data.length());
+	entry.m_size = static_cast<uint32_t>(data.length());
+	entry.m_external_attributes = 0;
+	entry.m_local_offset = 0;
+
+	// Names are UTF-8 as class files have them, said so when they are not plain ASCII
+	for (size_t i = 0; i < name.length(); i++)
+	{
+		if ((name[i] & 0x80) != 0)
+		{
+			entry.m_flags = FLAG_UTF8;
+			break;
+		}
+	}
+
+	std::string compressed;
+	if (zip::deflate(data, compressed))
+	{
+		entry.m_method = METHOD_DEFLATED;
+		entry.m_compressed_size = static_cast<uint32_t>(compressed.length());
+		return add_entry(entry, reinterpret_cast<const unsigned char *>(compressed.data()));
+	}
+
+	entry.m_compressed_size = static_cast<uint32_t>(data.length());
+	return add_entry(entry, reinterpret_cast<const unsigned char *>(data.data()));
+}
+
+bool ZipWriter::add_raw(const ZipReader::Entry &entry, const unsigned char *raw)
+{
+	// The central directory has the sizes and CRC, so they go in the local header too
+	ZipReader::Entry copy = entry;
+	copy.m_flags &= ~FLAG_DATA_DESCRIPTOR;
+	return add_entry(copy, raw);
+}
+
+bool ZipWriter::add_entry(const ZipReader::Entry &entry, const unsigned char *data)
+{
+	if (!m_ok)
+	{
+		return false;
+	}
+	if (m_offset > 0xFFFFFFFF - LOCAL_HEADER_SIZE - entry.m_name.length() - entry.m_compressed_size || m_count == 0xFFFF)
+	{
+		// Would need zip64
+		m_ok = false;
+		return false;
+	}
+
+	std::string header;
+	put_u32(header, LOCAL_HEADER_SIGNATURE);
+	put_u16(header, VERSION_NEEDED);
+	put_u16(header, entry.m_flags);
+	put_u16(header, entry.m_method);
+	put_u16(header, entry.m_time);
+	put_u16(header, entry.m_date);
+	put_u32(header, entry.m_crc);
+	put_u32(header, entry.m_compressed_size);
+	put_u32(header, entry.m_size);
+	put_u16(header, static_cast<uint16_t>(entry.m_name.length()));
+	put_u16(header, 0);
+	header += entry.m_name;
+
+	put_u32(m_central_directory, CENTRAL_HEADER_SIGNATURE);
+	put_u16(m_central_directory, VERSION_NEEDED);
+	put_u16(m_central_directory, VERSION_NEEDED);
+	put_u16(m_central_directory, entry.m_flags);
+	put_u16(m_central_directory, entry.m_method);
+	put_u16(m_central_directory, entry.m_time);
+	put_u16(m_central_directory, entry.m_date);
+	put_u32(m_central_directory, entry.m_crc);
+	put_u32(m_central_directory, entry.m_compressed_size);
+	put_u32(m_central_directory, entry.m_size);
+	put_u16(m_central_directory, static_cast<uint16_t>(entry.m_name.length()));
+	put_u16(m_central_directory, 0);	 // extra
+	put_u16(m_central_directory, 0);	 // comment
+	put_u16(m_central_directory, 0);	 // disk
+	put_u16(m_central_directory, 0);	 // internal attributes
+	put_u32(m_central_directory, entry.m_external_attributes);
+	put_u32(m_central_directory, static_cast<uint32_t>(m_offset));
+	m_central_directory += entry.m_name;
+
+	m_ok = fwrite(header.data(), header.length(), 1, m_file) == 1 &&
+		(entry.m_compressed_size == 0 || fwrite(data, entry.m_compressed_size, 1, m_file) == 1);
+	m_offset += header.length() + entry.m_compressed_size;
+	m_count++;
+	return m_ok;
+}
+
+bool ZipWriter::close()
+{
+	if (m_file == nullptr)
+	{
+		return false;
+	}
+
+	if (m_ok && m_offset + m_central_directory.length() > 0xFFFFFFFF)
+	{
+		m_ok = false;
+	}
+
+	std::string record;
+	put_u32(record, END_OF_DIRECTORY_SIGNATURE);
+	put_u16(record, 0);
+	put_u16(record, 0);
+	put_u16(record, static_cast<uint16_t>(m_count));
+	put_u16(record, static_cast<uint16_t>(m_count));
+	put_u32(record, static_cast<uint32_t>(m_central_directory.length()));
+	put_u32(record, static_cast<uint32_t>(m_offset));
+	put_u16(record, 0);
+
+	m_ok = m_ok && (m_central_directory.empty() || fwrite(m_central_directory.data(), m_central_directory.length(), 1, m_file) == 1) &&
+		fwrite(record.data(), record.length(), 1, m_file) == 1;
+	m_ok = fclose(m_file) == 0 && m_ok;
+	m_file = nullptr;
+	return m_ok;
+}
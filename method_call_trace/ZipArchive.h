@@ -0,0 +1,88 @@
+#ifndef _INCLUDE_ZIP_ARCHIVE_H_
+#define _INCLUDE_ZIP_ARCHIVE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+// Just enough of the zip format for jar files: reading stored and deflated entries,
+// and writing an archive of new entries and entries copied as they are. No zip64,
+// encryption or multi-disk archives, which jars of class files do not use.
+
+// zlib's on Linux; the Windows build has no zlib, uses a small decoder of its own and
+// cannot compress
+namespace zip
+{
+	uint32_t crc32(const void *data, size_t length);
+
+	// Raw deflate data (RFC 1951) of a known uncompressed size, never decoded past size
+	bool inflate(const unsigned char *data, size_t length, size_t size, std::string &out);
+
+	// Raw deflate data of data, false if it would not be smaller or there is no compressor
+	bool deflate(const std::string &data, std::string &out);
+}
+
+class ZipReader
+{
+public:
+	struct Entry
+	{
+		std::string m_name;
+		uint16_t    m_flags;
+		uint16_t    m_method;				 // 0 stored, 8 deflated
+		uint16_t    m_time;
+		uint16_t    m_date;
+		uint32_t    m_crc;
+		uint32_t    m_compressed_size;
+		uint32_t    m_size;
+		uint32_t    m_external_attributes;
+		uint32_t    m_local_offset;
+	};
+
+	// Reads the whole archive into memory, false with the reason in error if it is not one
+	bool open(const std::string &path, std::string &error);
+
+	const std::vector<Entry> &entries() const { return m_entries; }
+
+	// The entry's bytes as stored in the archive, nullptr if its local header is broken
+	const unsigned char *raw_data(const Entry &entry) const;
+
+	// The entry uncompressed and checked against its CRC. Safe from several threads at once.
+	bool extract(const Entry &entry, std::string &data) const;
+
+private:
+	std::string m_archive;
+	std::vector<Entry> m_entries;
+};
+
+class ZipWriter
+{
+public:
+	ZipWriter();
+	~ZipWriter();
+
+	bool open(const std::string &path);
+
+	// A new entry, deflated where that makes it smaller, stored otherwise and on Windows
+	bool add(const std::string &name, const std::string &data, uint16_t time, uint16_t date);
+
+	// An entry of another archive, its compressed bytes copied as they are
+	bool add_raw(const ZipReader::Entry &entry, const unsigned char *raw);
+
+	// Writes the central directory, false if anything failed since open()
+	bool close();
+
+private:
+	bool add_entry(const ZipReader::Entry &entry, const unsigned char *data);
+
+	FILE *m_file;
+	uint64_t m_offset;
+	uint32_t m_count;
+	std::string m_central_directory;
+	bool m_ok;
+};
+
+#endif // _INCLUDE_ZIP_ARCHIVE_H_
@@ -75,7 +75,7 @@ fatal_error(const char * format, ...)
  *  Returns NULL if no token available or can't do the scan.
  */
 char *
-get_token(char *str, char *seps, char *buf, int max)
+get_token(char *str, const char *seps, char *buf, int max)
 {
     int len;
 
@@ -56,7 +56,7 @@ extern "C" {
 
 void  stdout_message(const char * format, ...);
 void  fatal_error(const char * format, ...);
-char *get_token(char *str, char *seps, char *buf, int max);
+char *get_token(char *str, const char *seps, char *buf, int max);
 int   interested(char *cname, char *mname,
                     char *include_list, char *exclude_list);
 
@@ -0,0 +1,652 @@
+// Rewrites the classes of jar files and class directories ahead of time, on all cores,
+// for the agent's aot=file option.
+//
+//   aot_instrument [options] outdir input.jar|classdir ...
+//
+// options are comma separated, as the agent's: include=item, skip_small=n,
+// skip_accessors=on|off, skip_synthetic=on|off, threads=n (default all cores) and
+// dictionary=file (default outdir/mtrace_aot.dict). Every input is written to outdir
+// under its own name: classes with included methods get entry/exit probes, every other
+// entry is copied as it is. Class numbers count from 0 in the order of the inputs, and
+// the dictionary maps them and the method numbers to names for the agent:
+//   aot_instrument include=com/acme out app.jar lib/util.jar
+//   java -agentpath:./libmethod_call_trace.so=include=com/acme,aot=out/mtrace_aot.dict
+//        -Xbootclasspath/a:bridge.jar -cp out/app.jar:out/util.jar com.acme.Main
+
+#include "JVMAgentConstants.h"
+#include "AotDictionary.h"
+#include "Sha256.h"
+#include "TrivialMethods.h"
+#include "ZipArchive.h"
+#include "agent_util.h"
+#include "java_crw_demo.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+
+static const char *DEFAULT_DICTIONARY = "mtrace_aot.dict";
+
+// One class file of an input, read and scanned by one worker, rewritten by one worker
+struct ClassJob
+{
+	size_t      m_input;
+	size_t      m_entry;				 // Index in the jar or the directory's file list
+	std::string m_image;
+	std::string m_new_image;			 // Empty when the class is copied as it is
+	bool        m_included;				 // Some method is covered by the include list
+	AotDictionary::Class m_class;
+};
+
+struct Input
+{
+	std::string m_path;
+	std::string m_output;
+	bool        m_jar;
+	ZipReader   m_zip;
+	std::vector<std::string> m_files;	 // Directory inputs: relative paths, '/' separated
+	std::vector<size_t> m_jobs;			 // Per entry or file, its ClassJob or NO_JOB
+};
+
+static const size_t NO_JOB = static_cast<size_t>(-1);
+
+static std::string g_include;
+static TrivialMethods g_trivial_methods;
+static std::vector<Input> g_inputs;
+static std::vector<ClassJob> g_jobs;
+
+// The class a worker is on, for the rewriter's callbacks
+static AGENT_THREAD_LOCAL ClassJob *s_job = nullptr;
+
+
+static void fatal(const char *message, const char *file, int line)
+{
+	const ClassJob *job = s_job;
+	if (job != nullptr)
+	{
+		const Input &input = g_inputs[job->m_input];
+		fprintf(stderr, "ERROR: %s: %s: %s [%s:%d]\n", input.m_path.c_str(),
+			(input.m_jar ? input.m_zip.entries()[job->m_entry].m_name : input.m_files[job->m_entry]).c_str(),
+			message, file, line);
+	}
+	else
+	{
+		fprintf(stderr, "ERROR: %s [%s:%d]\n", message, file, line);
+	}
+	exit(1);
+}
+
+static bool ends_with(const std::string &value, const char *suffix)
+{
+	const size_t length = strlen(suffix);
+	return value.length() >= length && value.compare(value.length() - length, length, suffix) == 0;
+}
+
+static bool read_file(const std::string &path, std::string &data)
+{
+	FILE *file = fopen(path.c_str(), "rb");
+	if (file == nullptr)
+	{
+		return false;
+	}
+
+	char buffer[64 * 1024];
+	size_t length;
+	data.clear();
+	while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+	{
+		data.append(buffer, length);
+	}
+	const bool ok = ferror(file) == 0;
+	fclose(file);
+	return ok;
+}
+
+static bool write_file(const std::string &path, const std::string &data)
+{
+	FILE *file = fopen(path.c_str(), "wb");
+	if (file == nullptr)
+	{
+		return false;
+	}
+
+	const bool written = fwrite(data.data(), 1, data.length(), file) == data.length();
+	return fclose(file) == 0 && written;
+}
+
+static bool is_directory(const std::string &path)
+{
+#ifdef WIN32
+	const DWORD attributes = GetFileAttributesA(path.c_str());
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+	struct stat status;
+	return stat(path.c_str(), &status) == 0 && S_ISDIR(status.st_mode);
+#endif
+}
+
+// mkdir -p
+static bool make_directories(const std::string &path)
+{
+	for (size_t end = 1; end <= path.length(); end++)
+	{
+		if (end < path.length() && path[end] != '/' && path[end] != '\\')
+		{
+			continue;
+		}
+
+		const std::string parent = path.substr(0, end);
+		if (is_directory(parent))
+		{
+			continue;
+		}
+#ifdef WIN32
+		if (_mkdir(parent.c_str()) != 0 && !is_directory(parent))
+#else
+		if (mkdir(parent.c_str(), 0777) != 0 && !is_directory(parent))
+#endif
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// The files under directory, recursively, as paths relative to it
+static void list_files(const std::string &directory, const std::string &prefix, std::vector<std::string> &files)
+{
+	std::vector<std::string> names;
+#ifdef WIN32
+	WIN32_FIND_DATAA found;
+	HANDLE find = FindFirstFileA((directory + "\\*").c_str(), &found);
+	if (find != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			names.push_back(found.cFileName);
+		} while (FindNextFileA(find, &found));
+		FindClose(find);
+	}
+#else
+	DIR *dir = opendir(directory.c_str());
+	if (dir != nullptr)
+	{
+		struct dirent *found;
+		while ((found = readdir(dir)) != nullptr)
+		{
+			names.push_back(found->d_name);
+		}
+		closedir(dir);
+	}
+#endif
+
+	// Sorted so class numbers do not depend on the file system's order
+	std::sort(names.begin(), names.end());
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		if (names[i] == "." || names[i] == "..")
+		{
+			continue;
+		}
+
+		if (is_directory(directory + "/" + names[i]))
+		{
+			list_files(directory + "/" + names[i], prefix + names[i] + "/", files);
+		}
+		else
+		{
+			files.push_back(prefix + names[i]);
+		}
+	}
+}
+
+static std::string base_name(std::string path)
+{
+	while (path.length() > 1 && (path.back() == '/' || path.back() == '\\'))
+	{
+		path.erase(path.length() - 1);
+	}
+
+	const size_t slash = path.find_last_of("/\\");
+	return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// Signature files no longer match the rewritten classes, the JVM would reject the jar
+static bool is_signature_file(const std::string &name)
+{
+	return name.compare(0, 9, "META-INF/") == 0 && name.find('/', 9) == std::string::npos &&
+		(ends_with(name, ".SF") || ends_with(name, ".RSA") || ends_with(name, ".DSA") || ends_with(name, ".EC"));
+}
+
+/* Callback from java_crw_demo_scan(), as the agent's method_included() */
+static int method_included(unsigned cnum, unsigned mnum, const char *name, const char *sig,
+	unsigned access_flags, const unsigned char *code, long code_length)
+{
+	return interested(const_cast<char*>(s_job->m_class.m_name.c_str()), const_cast<char*>(name),
+		const_cast<char *>(g_include.c_str()), nullptr);
+}
+
+/* Callback from java_crw_demo(), as the agent's method_filter() */
+static int method_filter(unsigned cnum, unsigned mnum, const char *name, const char *sig,
+	unsigned access_flags, const unsigned char *code, long code_length)
+{
+	std::vector<ClassCache::Method> &methods = s_job->m_class.m_methods;
+	if (mnum >= methods.size())
+	{
+		methods.resize(mnum + 1);
+	}
+
+	ClassCache::Method &method = methods[mnum];
+	method.m_interested = interested(const_cast<char*>(s_job->m_class.m_name.c_str()), const_cast<char*>(name),
+		const_cast<char *>(g_include.c_str()), nullptr) != 0;
+	if (!method.m_interested)
+	{
+		return 0;
+	}
+
+	method.m_trivial = static_cast<uint8_t>(g_trivial_methods.classify(access_flags, code, static_cast<size_t>(code_length)));
+	return method.m_trivial == TRIVIAL_NONE ? 1 : 0;
+}
+
+/* Callback from java_crw_demo(), as the agent's mnum_callbacks() */
+static void mnum_callbacks(unsigned cnum, const char **names, const char **sigs, int mcount)
+{
+	std::vector<ClassCache::Method> &methods = s_job->m_class.m_methods;
+	methods.resize(mcount);
+	for (int mnum = 0; mnum < mcount; mnum++)
+	{
+		methods[mnum].m_name = names[mnum];
+		methods[mnum].m_signature = sigs[mnum];
+	}
+}
+
+// Reads the class, takes its name out and decides if it gets probes
+static void scan_class(ClassJob &job)
+{
+	const Input &input = g_inputs[job.m_input];
+	const bool read = input.m_jar ? input.m_zip.extract(input.m_zip.entries()[job.m_entry], job.m_image) :
+		read_file(input.m_path + "/" + input.m_files[job.m_entry], job.m_image);
+	if (!read)
+	{
+		fprintf(stderr, "ERROR: Cannot read entry %u of %s\n", static_cast<unsigned>(job.m_entry), input.m_path.c_str());
+		exit(1);
+	}
+
+	s_job = &job;
+	const unsigned char *image = reinterpret_cast<const unsigned char *>(job.m_image.data());
+	const long length = static_cast<long>(job.m_image.length());
+	char *classname = java_crw_demo_classname(image, length, &fatal);
+	job.m_class.m_name = classname;
+	free(classname);
+
+	job.m_included = interested(const_cast<char*>(job.m_class.m_name.c_str()), const_cast<char *>(""),
+		const_cast<char *>(g_include.c_str()), nullptr) &&
+		java_crw_demo_scan(0, image, length, &fatal, &method_included) != 0;
+	s_job = nullptr;
+}
+
+// Rewrites the class the way the agent would have when it loaded it
+static void rewrite_class(ClassJob &job)
+{
+	unsigned char *new_image = nullptr;
+	long new_length = 0;
+
+	s_job = &job;
+	java_crw_demo(job.m_class.m_cnum,
+		job.m_class.m_name.c_str(),
+		reinterpret_cast<const unsigned char *>(job.m_image.data()),
+		static_cast<long>(job.m_image.length()),
+		0,
+		const_cast<char *>(STRING(MTRACE_class)), const_cast<char *>("L" STRING(MTRACE_class) ";"),
+		const_cast<char *>(STRING(MTRACE_entry)), const_cast<char *>("(II)V"),
+		const_cast<char *>(STRING(MTRACE_exit)), const_cast<char *>("(II)V"),
+		nullptr, nullptr,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		&new_image,
+		&new_length,
+		nullptr,
+		&fatal,
+		&mnum_callbacks,
+		&method_filter,
+		nullptr);
+	s_job = nullptr;
+
+	if (new_image != nullptr && new_length > 0)
+	{
+		job.m_new_image.assign(reinterpret_cast<const char *>(new_image), new_length);
+
+		Sha256 digest;
+		digest.update(job.m_new_image);
+		job.m_class.m_image_length = static_cast<uint32_t>(job.m_new_image.length());
+		job.m_class.m_digest = digest.hex_digest();
+	}
+	free(new_image);
+}
+
+// Runs work on every job from first to last, spread over threads
+static void run_parallel(unsigned threads, size_t first, size_t last, void (*work)(ClassJob &))
+{
+	std::atomic<size_t> next(first);
+	std::vector<std::thread> workers;
+	for (unsigned i = 0; i < threads; i++)
+	{
+		workers.push_back(std::thread([&next, last, work]()
+		{
+			for (size_t index = next.fetch_add(1); index < last; index = next.fetch_add(1))
+			{
+				work(g_jobs[index]);
+			}
+		}));
+	}
+
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		workers[i].join();
+	}
+}
+
+// The instrumented copy of a jar, entries in their original order
+static bool write_jar(const Input &input, size_t &dropped)
+{
+	bool rewritten = false;
+	for (size_t i = 0; i < input.m_jobs.size(); i++)
+	{
+		rewritten = rewritten || (input.m_jobs[i] != NO_JOB && !g_jobs[input.m_jobs[i]].m_new_image.empty());
+	}
+
+	ZipWriter writer;
+	if (!writer.open(input.m_output))
+	{
+		return false;
+	}
+
+	const std::vector<ZipReader::Entry> &entries = input.m_zip.entries();
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		const ZipReader::Entry &entry = entries[i];
+		if (rewritten && is_signature_file(entry.m_name))
+		{
+			dropped++;
+			continue;
+		}
+
+		if (input.m_jobs[i] != NO_JOB && !g_jobs[input.m_jobs[i]].m_new_image.empty())
+		{
+			writer.add(entry.m_name, g_jobs[input.m_jobs[i]].m_new_image, entry.m_time, entry.m_date);
+		}
+		else
+		{
+			const unsigned char *raw = input.m_zip.raw_data(entry);
+			if (raw == nullptr)
+			{
+				fprintf(stderr, "ERROR: Broken entry %s in %s\n", entry.m_name.c_str(), input.m_path.c_str());
+				return false;
+			}
+			writer.add_raw(entry, raw);
+		}
+	}
+	return writer.close();
+}
+
+// The instrumented copy of a class directory, other files copied along
+static bool write_directory(const Input &input)
+{
+	for (size_t i = 0; i < input.m_files.size(); i++)
+	{
+		const std::string &file = input.m_files[i];
+		const std::string path = input.m_output + "/" + file;
+		const size_t slash = path.find_last_of('/');
+		if (!make_directories(path.substr(0, slash)))
+		{
+			return false;
+		}
+
+		std::string data;
+		if (input.m_jobs[i] != NO_JOB)
+		{
+			const ClassJob &job = g_jobs[input.m_jobs[i]];
+			data = job.m_new_image.empty() ? job.m_image : job.m_new_image;
+		}
+		else if (!read_file(input.m_path + "/" + file, data))
+		{
+			return false;
+		}
+
+		if (!write_file(path, data))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: aot_instrument [options] outdir input.jar|classdir ...\n");
+	fprintf(stderr, "\t include=item\t\t classes/methods to instrument (default all)\n");
+	fprintf(stderr, "\t skip_small=n\t\t leave methods of fewer than n bytecode bytes alone\n");
+	fprintf(stderr, "\t skip_accessors=on|off\t leave plain getters and setters alone\n");
+	fprintf(stderr, "\t skip_synthetic=on|off\t leave synthetic and bridge methods alone\n");
+	fprintf(stderr, "\t threads=n\t\t rewriting threads (default all cores)\n");
+	fprintf(stderr, "\t dictionary=file\t for the agent's aot= option (default outdir/%s)\n", DEFAULT_DICTIONARY);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned threads = std::thread::hardware_concurrency();
+	std::string dictionary_path;
+
+	int arg = 1;
+	if (arg < argc && strchr(argv[arg], '=') != nullptr)
+	{
+		std::vector<char> options(argv[arg], argv[arg] + strlen(argv[arg]) + 1);
+		char *next = options.data();
+		char token[MAX_TOKEN_LENGTH];
+		while ((next = get_token(next, ",=", token, sizeof(token))) != nullptr)
+		{
+			char value[MAX_OUTPUT_LENGTH];
+			next = get_token(next, ",=", value, sizeof(value));
+			if (next == nullptr)
+			{
+				fprintf(stderr, "ERROR: %s option error\n", token);
+				usage();
+			}
+
+			if (strcmp(token, "include") == 0)
+			{
+				g_include += g_include.empty() ? value : std::string(",") + value;
+			}
+			else if (strcmp(token, "skip_small") == 0 && atoi(value) >= 0)
+			{
+				g_trivial_methods.set_min_code_length(atoi(value));
+			}
+			else if ((strcmp(token, "skip_accessors") == 0 || strcmp(token, "skip_synthetic") == 0) &&
+				(strcmp(value, "on") == 0 || strcmp(value, "off") == 0))
+			{
+				if (strcmp(token, "skip_accessors") == 0)
+				{
+					g_trivial_methods.set_accessors(strcmp(value, "on") == 0);
+				}
+				else
+				{
+					g_trivial_methods.set_synthetic(strcmp(value, "on") == 0);
+				}
+			}
+			else if (strcmp(token, "threads") == 0 && atoi(value) > 0)
+			{
+				threads = static_cast<unsigned>(atoi(value));
+			}
+			else if (strcmp(token, "dictionary") == 0 && value[0] != 0)
+			{
+				dictionary_path = value;
+			}
+			else
+			{
+				fprintf(stderr, "ERROR: %s option error\n", token);
+				usage();
+			}
+		}
+		arg++;
+	}
+
+	if (argc - arg < 2)
+	{
+		usage();
+	}
+
+	const std::string output_directory = argv[arg++];
+	if (dictionary_path.empty())
+	{
+		dictionary_path = output_directory + "/" + DEFAULT_DICTIONARY;
+	}
+	if (threads == 0)
+	{
+		threads = 1;
+	}
+	if (!make_directories(output_directory))
+	{
+		fprintf(stderr, "ERROR: Cannot create %s\n", output_directory.c_str());
+		return 1;
+	}
+
+	// Inputs opened and their class files listed, in command line order
+	g_inputs.resize(argc - arg);
+	for (size_t i = 0; i < g_inputs.size(); i++, arg++)
+	{
+		Input &input = g_inputs[i];
+		input.m_path = argv[arg];
+		input.m_output = output_directory + "/" + base_name(input.m_path);
+		input.m_jar = !is_directory(input.m_path);
+
+		std::vector<std::string> names;
+		if (input.m_jar)
+		{
+			std::string error;
+			if (!input.m_zip.open(input.m_path, error))
+			{
+				fprintf(stderr, "ERROR: Cannot read %s: %s\n", input.m_path.c_str(), error.c_str());
+				return 1;
+			}
+			for (size_t entry = 0; entry < input.m_zip.entries().size(); entry++)
+			{
+				names.push_back(input.m_zip.entries()[entry].m_name);
+			}
+		}
+		else
+		{
+			list_files(input.m_path, "", input.m_files);
+			names = input.m_files;
+		}
+
+		for (size_t j = 0; j < g_inputs.size(); j++)
+		{
+			if (j != i && input.m_output == g_inputs[j].m_output)
+			{
+				fprintf(stderr, "ERROR: %s and %s would both be written to %s\n",
+					g_inputs[j].m_path.c_str(), input.m_path.c_str(), input.m_output.c_str());
+				return 1;
+			}
+		}
+
+		input.m_jobs.assign(names.size(), NO_JOB);
+		for (size_t entry = 0; entry < names.size(); entry++)
+		{
+			// Java 9 module descriptors are not classes the agent rewrites
+			if (ends_with(names[entry], ".class") && !ends_with(names[entry], "module-info.class"))
+			{
+				ClassJob job;
+				job.m_input = i;
+				job.m_entry = entry;
+				job.m_included = false;
+				job.m_class.m_cnum = 0;
+				job.m_class.m_image_length = 0;
+				input.m_jobs[entry] = g_jobs.size();
+				g_jobs.push_back(job);
+			}
+		}
+	}
+
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	run_parallel(threads, 0, g_jobs.size(), &scan_class);
+
+	// Dense class numbers in input order, so a run gives the same numbers whatever the threads did
+	std::vector<ClassJob> included;
+	std::vector<ClassJob> excluded;
+	for (size_t i = 0; i < g_jobs.size(); i++)
+	{
+		(g_jobs[i].m_included ? included : excluded).push_back(std::move(g_jobs[i]));
+	}
+	for (size_t i = 0; i < included.size(); i++)
+	{
+		included[i].m_class.m_cnum = static_cast<uint32_t>(i);
+	}
+	g_jobs = std::move(included);
+	const size_t included_count = g_jobs.size();
+	for (size_t i = 0; i < excluded.size(); i++)
+	{
+		g_jobs.push_back(std::move(excluded[i]));
+	}
+	for (size_t i = 0; i < g_jobs.size(); i++)
+	{
+		g_inputs[g_jobs[i].m_input].m_jobs[g_jobs[i].m_entry] = i;
+	}
+
+	run_parallel(threads, 0, included_count, &rewrite_class);
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	size_t dropped = 0;
+	for (size_t i = 0; i < g_inputs.size(); i++)
+	{
+		const Input &input = g_inputs[i];
+		if (!(input.m_jar ? write_jar(input, dropped) : write_directory(input)))
+		{
+			fprintf(stderr, "ERROR: Cannot write %s\n", input.m_output.c_str());
+			return 1;
+		}
+	}
+	if (dropped > 0)
+	{
+		fprintf(stderr, "WARNING: %u signature files dropped, the instrumented jars are unsigned\n",
+			static_cast<unsigned>(dropped));
+	}
+
+	AotDictionary dictionary;
+	size_t instrumented = 0;
+	for (size_t i = 0; i < included_count; i++)
+	{
+		if (!g_jobs[i].m_new_image.empty())
+		{
+			dictionary.add(g_jobs[i].m_class);
+			instrumented++;
+		}
+	}
+	if (!dictionary.save(dictionary_path))
+	{
+		fprintf(stderr, "ERROR: Cannot write %s\n", dictionary_path.c_str());
+		return 1;
+	}
+
+	printf("%u classes in %u inputs, %u instrumented, %.3f s on %u threads (%.0f classes/s)\n",
+		static_cast<unsigned>(g_jobs.size()), static_cast<unsigned>(g_inputs.size()),
+		static_cast<unsigned>(instrumented), seconds, threads, seconds > 0 ? g_jobs.size() / seconds : 0.0);
+	printf("dictionary %s, use with aot=%s\n", dictionary_path.c_str(), dictionary_path.c_str());
+	return 0;
+}
@@ -5,16 +5,24 @@ public class bridge
 
     private static int engaged = 0;
 
+    /* With mode=count, methods count their own calls and returns here
+     *     instead of calling method_entry() and method_exit(): one
+     *     long[] per class number, calls at 2*mnum and returns at
+     *     2*mnum+1. Created and read by the agent.
+     */
+
+    public static long[][] counters;
+
     /* At the very beginning of every method, a call to method_entry()
      *     is injected.
      */
 
-    private static native void _method_entry(Object thr, int cnum, int mnum);
+    private static native void _method_entry(int cnum, int mnum);
     public static void method_entry(int cnum, int mnum)
     {
         if ( engaged != 0 ) 
         {
-            _method_entry(Thread.currentThread(), cnum, mnum);
+            _method_entry(cnum, mnum);
         }
     }
 
@@ -22,12 +30,12 @@ public class bridge
      *     is injected.
      */
 
-    private static native void _method_exit(Object thr, int cnum, int mnum);
+    private static native void _method_exit(int cnum, int mnum);
     public static void method_exit(int cnum, int mnum)
     {
         if ( engaged != 0 ) 
         {
-            _method_exit(Thread.currentThread(), cnum, mnum);
+            _method_exit(cnum, mnum);
         }
     }
 
@@ -0,0 +1,102 @@
+// Measures the cost of the timestamp sources the agent can use, and how far
+// the calibrated Clock drifts from the system monotonic clock.
+//
+//   clock_bench [seconds]
+//
+// Run it on the target host to check which source Clock picked and what a probe
+// timestamp costs there.
+
+#include "Clock.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+
+static const int CALLS = 10 * 1000 * 1000;
+
+// Keeps the compiler from dropping the timed loops
+static volatile uint64_t g_sink;
+
+
+template <typename Source>
+static void measure_cost(const char *name, Source source)
+{
+	uint64_t sum = 0;
+
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < CALLS; i++)
+	{
+		sum += source();
+	}
+	const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+	g_sink = sum;
+	const double nanos = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+	printf("%-20s %6.1f ns/call\n", name, nanos / CALLS);
+}
+
+static uint64_t steady_nanos()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void measure_drift(int seconds)
+{
+	const uint64_t ticks0 = Clock::now();
+	const uint64_t steady0 = steady_nanos();
+
+	printf("\ndrift of Clock against steady_clock\n");
+	for (int second = 1; second <= seconds; second++)
+	{
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+
+		const uint64_t clock = Clock::to_nanos(Clock::now() - ticks0);
+		const uint64_t steady = steady_nanos() - steady0;
+		const double offset = static_cast<double>(clock) - static_cast<double>(steady);
+
+		printf("%4d s  offset %10.0f ns  %8.3f ppm\n", second, offset, offset / steady * 1e6);
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	const int seconds = argc > 1 ? atoi(argv[1]) : 10;
+
+	Clock::init();
+	printf("Clock source %s, %llu ticks/s\n\n", Clock::source(), static_cast<unsigned long long>(Clock::ticks_per_second()));
+
+	measure_cost("Clock::now", []() { return Clock::now(); });
+	measure_cost("steady_clock", []() { return steady_nanos(); });
+#if defined(CLOCK_HAS_TSC)
+	measure_cost("rdtsc", []() { return static_cast<uint64_t>(__rdtsc()); });
+#endif
+#if defined(__linux__)
+	measure_cost("CLOCK_MONOTONIC", []()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<uint64_t>(ts.tv_nsec);
+	});
+	measure_cost("CLOCK_MONOTONIC_RAW", []()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+		return static_cast<uint64_t>(ts.tv_nsec);
+	});
+#endif
+#if defined(WIN32)
+	measure_cost("QueryPerformanceCounter", []()
+	{
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return static_cast<uint64_t>(counter.QuadPart);
+	});
+#endif
+
+	measure_drift(seconds);
+	return 0;
+}
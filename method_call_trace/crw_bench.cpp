@@ -0,0 +1,238 @@
+// Rewrite throughput of java_crw_demo on a corpus of class files, rewritten the
+// way the agent does it, and how often the rewriter calls the C allocator.
+//
+//   crw_bench [passes] file.class ...
+//
+// Also times a startup where 1 class in 100 has included methods, rewriting every
+// class against scanning each first and rewriting only those, and reading the class
+// names out of the images.
+//
+// Real classes make the corpus, e.g. unpacked from an application's jars:
+//   mkdir corpus && cd corpus && unzip -q ../app.jar && cd ..
+//   crw_bench 5 $(find corpus -name "*.class" ! -name module-info.class)
+
+#include "JVMAgentConstants.h"
+#include "java_crw_demo.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+
+static bool g_counting = false;
+static uint64_t g_allocator_calls = 0;
+
+#if defined(__GLIBC__)
+
+// glibc lets the program replace the allocator, these count and pass on
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void __libc_free(void *ptr);
+
+extern "C" void *malloc(size_t size) __THROW
+{
+	g_allocator_calls += g_counting ? 1 : 0;
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) __THROW
+{
+	g_allocator_calls += g_counting ? 1 : 0;
+	return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) __THROW
+{
+	g_allocator_calls += g_counting ? 1 : 0;
+	return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void *ptr) __THROW
+{
+	g_allocator_calls += (g_counting && ptr != nullptr) ? 1 : 0;
+	__libc_free(ptr);
+}
+
+static const bool COUNTS_ALLOCATOR = true;
+#else
+static const bool COUNTS_ALLOCATOR = false;
+#endif
+
+
+static void JNICALL fatal(const char *message, const char *file, int line)
+{
+	fprintf(stderr, "ERROR: %s [%s:%d]\n", message, file, line);
+	exit(1);
+}
+
+static bool read_file(const char *path, std::string &data)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == nullptr)
+	{
+		return false;
+	}
+
+	char buffer[64 * 1024];
+	size_t length;
+	data.clear();
+	while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+	{
+		data.append(buffer, length);
+	}
+	fclose(file);
+	return true;
+}
+
+// Stands in for the include list: the methods of 1 class in 100 are included
+static int one_in_hundred(unsigned cnum, unsigned mnum, const char *name, const char *sig,
+	unsigned access_flags, const unsigned char *code, long code_length)
+{
+	return cnum % 100 == 0 ? 1 : 0;
+}
+
+// One class rewritten with entry/exit probes in the methods the filter passes, as the agent does
+static void rewrite(unsigned cnum, const std::string &image, MethodFilter method_filter = nullptr)
+{
+	unsigned char *new_image = nullptr;
+	long new_length = 0;
+
+	java_crw_demo(cnum,
+		nullptr,
+		reinterpret_cast<const unsigned char *>(image.data()),
+		static_cast<long>(image.length()),
+		0,
+		const_cast<char *>(STRING(MTRACE_class)), const_cast<char *>("L" STRING(MTRACE_class) ";"),
+		const_cast<char *>(STRING(MTRACE_entry)), const_cast<char *>("(II)V"),
+		const_cast<char *>(STRING(MTRACE_exit)), const_cast<char *>("(II)V"),
+		nullptr, nullptr,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		&new_image,
+		&new_length,
+		nullptr,
+		&fatal,
+		nullptr,
+		method_filter,
+		nullptr);
+
+	if (new_image != nullptr)
+	{
+		free(new_image);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int first = 1;
+	int passes = 5;
+	if (argc > 1 && atoi(argv[1]) > 0)
+	{
+		passes = atoi(argv[1]);
+		first = 2;
+	}
+
+	std::vector<std::string> corpus;
+	size_t bytes = 0;
+	for (int i = first; i < argc; i++)
+	{
+		std::string data;
+		if (!read_file(argv[i], data) || data.length() < 10)
+		{
+			fprintf(stderr, "skipping %s\n", argv[i]);
+			continue;
+		}
+		corpus.push_back(data);
+		bytes += data.length();
+	}
+	if (corpus.empty())
+	{
+		fprintf(stderr, "usage: crw_bench [passes] file.class ...\n");
+		return 1;
+	}
+
+	// A pass to warm up, and the allocator calls of one rewrite of each class
+	g_counting = true;
+	for (size_t i = 0; i < corpus.size(); i++)
+	{
+		rewrite(static_cast<unsigned>(i), corpus[i]);
+	}
+	g_counting = false;
+	const uint64_t calls = g_allocator_calls;
+
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int pass = 0; pass < passes; pass++)
+	{
+		for (size_t i = 0; i < corpus.size(); i++)
+		{
+			rewrite(static_cast<unsigned>(i), corpus[i]);
+		}
+	}
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%llu classes, %.1f MB, %d passes\n", static_cast<unsigned long long>(corpus.size()), bytes / 1e6, passes);
+	printf("rewrite: %.0f classes/s, %.1f MB/s\n", corpus.size() * passes / seconds, bytes * passes / seconds / 1e6);
+
+	std::chrono::steady_clock::time_point lap = std::chrono::steady_clock::now();
+	for (int pass = 0; pass < passes; pass++)
+	{
+		for (size_t i = 0; i < corpus.size(); i++)
+		{
+			rewrite(static_cast<unsigned>(i), corpus[i], &one_in_hundred);
+		}
+	}
+	const double rewrite_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - lap).count();
+
+	lap = std::chrono::steady_clock::now();
+	for (int pass = 0; pass < passes; pass++)
+	{
+		for (size_t i = 0; i < corpus.size(); i++)
+		{
+			(void)java_crw_demo_scan(static_cast<unsigned>(i), reinterpret_cast<const unsigned char *>(corpus[i].data()),
+				static_cast<long>(corpus[i].length()), &fatal, &one_in_hundred);
+		}
+	}
+	const double scan_only_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - lap).count();
+
+	lap = std::chrono::steady_clock::now();
+	for (int pass = 0; pass < passes; pass++)
+	{
+		for (size_t i = 0; i < corpus.size(); i++)
+		{
+			const unsigned char *image = reinterpret_cast<const unsigned char *>(corpus[i].data());
+			if (java_crw_demo_scan(static_cast<unsigned>(i), image, static_cast<long>(corpus[i].length()), &fatal, &one_in_hundred))
+			{
+				rewrite(static_cast<unsigned>(i), corpus[i], &one_in_hundred);
+			}
+		}
+	}
+	const double scan_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - lap).count();
+
+	lap = std::chrono::steady_clock::now();
+	for (int pass = 0; pass < passes; pass++)
+	{
+		for (size_t i = 0; i < corpus.size(); i++)
+		{
+			free(java_crw_demo_classname(reinterpret_cast<const unsigned char *>(corpus[i].data()),
+				static_cast<long>(corpus[i].length()), &fatal));
+		}
+	}
+	const double classname_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - lap).count();
+
+	printf("1%% included, rewrite all: %.0f classes/s\n", corpus.size() * passes / rewrite_seconds);
+	printf("1%% included, scan first: %.0f classes/s\n", corpus.size() * passes / scan_seconds);
+	printf("scan alone: %.0f classes/s\n", corpus.size() * passes / scan_only_seconds);
+	printf("class name: %.0f classes/s\n", corpus.size() * passes / classname_seconds);
+	if (COUNTS_ALLOCATOR)
+	{
+		printf("allocator calls: %.1f per class\n", static_cast<double>(calls) / corpus.size());
+	}
+	else
+	{
+		printf("allocator calls: not counted on this platform\n");
+	}
+	return 0;
+}
@@ -0,0 +1,127 @@
+// Bytes and encoding time per event of the two trace formats: the binary records of
+// TraceProtocol.h and the text lines of format=text, built the way the agent's
+// encode_event() builds them.
+//
+//   encode_bench [events] [methods]
+//
+// Events cycle through methods (default 1000) of 50 classes with names of typical
+// length; the binary figure includes the dictionary records those methods need.
+
+#include "TraceProtocol.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+
+static const uint32_t CLASSES = 50;
+static const size_t FLUSH_BYTES = 1024 * 1024;	 // The worker hands its buffer to the output about this often
+
+struct Method
+{
+	uint32_t    m_cnum;
+	uint32_t    m_mnum;
+	std::string m_class_name;
+	std::string m_method_name;
+};
+
+// Keeps the compiler from dropping the timed loops
+static volatile size_t g_sink;
+
+
+static void report(const char *name, uint64_t bytes, uint64_t events, double seconds)
+{
+	printf("%-22s %6.1f bytes/event  %6.1f ns/event  %8.1f MB/s\n", name,
+		static_cast<double>(bytes) / events, seconds * 1e9 / events, bytes / seconds / (1024.0 * 1024.0));
+}
+
+static void bench_binary(const std::vector<Method> &methods, uint64_t events)
+{
+	std::string buffer;
+	buffer.reserve(FLUSH_BYTES + SAMPLED_EVENT_RECORD_SIZE);
+	uint64_t bytes = 0;
+
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	TraceEncoder::stream_header(buffer);
+	for (size_t i = 0; i < methods.size(); i++)
+	{
+		if (methods[i].m_mnum == 0)
+		{
+			TraceEncoder::class_record(buffer, methods[i].m_cnum, methods[i].m_class_name);
+		}
+		TraceEncoder::method_record(buffer, methods[i].m_cnum, methods[i].m_mnum, methods[i].m_method_name, "()V");
+	}
+	const size_t dictionary_bytes = buffer.length();
+
+	for (uint64_t event = 0; event < events; event++)
+	{
+		const Method &method = methods[(event >> 1) % methods.size()];
+		TraceEncoder::event_record(buffer, (event & 1) ? RECORD_METHOD_EXIT : RECORD_METHOD_ENTRY,
+			1, method.m_cnum, method.m_mnum, event, 1);
+		if (buffer.length() >= FLUSH_BYTES)
+		{
+			bytes += buffer.length();
+			g_sink = g_sink + buffer.length();
+			buffer.clear();
+		}
+	}
+	bytes += buffer.length();
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	report("binary", bytes, events, seconds);
+	printf("%-22s %6.1f bytes/event  (dictionary %u bytes)\n", "binary, events only",
+		static_cast<double>(bytes - dictionary_bytes) / events, static_cast<unsigned>(dictionary_bytes));
+}
+
+static void bench_text(const std::vector<Method> &methods, uint64_t events)
+{
+	std::string buffer;
+	buffer.reserve(FLUSH_BYTES + 1024);
+	uint64_t bytes = 0;
+
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (uint64_t event = 0; event < events; event++)
+	{
+		const Method &method = methods[(event >> 1) % methods.size()];
+		buffer += (event & 1) ? "exit: " : "enter: ";
+		buffer += method.m_class_name;
+		buffer += ":";
+		buffer += method.m_method_name;
+		buffer += "\r\n";
+		if (buffer.length() >= FLUSH_BYTES)
+		{
+			bytes += buffer.length();
+			g_sink = g_sink + buffer.length();
+			buffer.clear();
+		}
+	}
+	bytes += buffer.length();
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	report("text", bytes, events, seconds);
+}
+
+
+int main(int argc, char *argv[])
+{
+	const uint64_t events = argc > 1 ? atoi(argv[1]) : 50000000;
+	const uint32_t method_count = argc > 2 ? atoi(argv[2]) : 1000;
+
+	std::vector<Method> methods;
+	for (uint32_t i = 0; i < method_count; i++)
+	{
+		Method method;
+		method.m_cnum = i % CLASSES;
+		method.m_mnum = i / CLASSES;
+		method.m_class_name = "com/example/shop/service/OrderService" + std::to_string(method.m_cnum);
+		method.m_method_name = "processLineItem" + std::to_string(method.m_mnum);
+		methods.push_back(method);
+	}
+
+	printf("%llu events over %u methods\n", static_cast<unsigned long long>(events), method_count);
+	bench_binary(methods, events);
+	bench_text(methods, events);
+	return 0;
+}
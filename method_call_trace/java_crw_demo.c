@@ -120,6 +120,10 @@ typedef unsigned short CrwCpoolIndex;           /* Index into constant pool */
 #define LARGEST_INJECTION               (12*3) /* 3 injections at same site */
 #define MAXIMUM_NEW_CPOOL_ENTRIES       64 /* don't add more than 32 entries */
 
+/* Scratch memory: alignment of every piece, and least size of a block */
+#define SCRATCH_ALIGNMENT               8
+#define SCRATCH_BLOCK_MIN               (64*1024)
+
 /* Constant Pool Entry (internal table that mirrors pool in file image) */
 
 typedef struct {
@@ -132,6 +136,24 @@ typedef struct {
 
 struct MethodImage;
 
+/* Scratch memory block, its bytes follow the (padded) header */
+
+typedef struct CrwScratchBlock {
+    struct CrwScratchBlock *    previous;       /* Block used before this one */
+    size_t                      size;           /* Bytes after the header */
+    size_t                      used;           /* Bytes handed out */
+} CrwScratchBlock;
+
+#define SCRATCH_HEADER  ((sizeof(CrwScratchBlock)+SCRATCH_ALIGNMENT-1) & \
+                                ~(size_t)(SCRATCH_ALIGNMENT-1))
+
+/* Point to rewind the scratch memory to */
+
+typedef struct {
+    CrwScratchBlock *   block;
+    size_t              used;
+} CrwScratchMark;
+
 /* Class file image storage structure */
 
 typedef struct CrwClassImage {
@@ -150,11 +172,21 @@ typedef struct CrwClassImage {
     CrwPosition                 input_position;
     CrwPosition                 output_position;
 
+    /* Output outgrew its scratch buffer and moved to malloc() space */
+    jboolean                    output_on_heap;
+
+    /* Scratch memory of this class, all of it released by cleanup() */
+    CrwScratchBlock *           scratch;
+    size_t                      scratch_first_size;     /* Size of first block */
+
     /* Mirrored constant pool */
     CrwConstantPoolEntry *      cpool;
     CrwCpoolIndex               cpool_max_elements;             /* Max count */
     CrwCpoolIndex               cpool_count_plus_one;
 
+    /* Input positions of the constant pool entries, when only scanning */
+    unsigned *                  cpool_position;
+
     /* Input flags about class (e.g. is it a system class) */
     int                         system_class;
 
@@ -172,6 +204,8 @@ typedef struct CrwClassImage {
     char* obj_init_sig;         /* Signature of this method */
     char* newarray_name;        /* Method name to call after newarray opcodes */
     char* newarray_sig;         /* Signature of this method */
+    char* counters_name;        /* Static long[][] field counting calls instead */
+    char* counters_sig;         /* Signature of this field */
 
     /* Constant pool index values for new entries */
     CrwCpoolIndex               tracker_class_index;
@@ -179,8 +213,13 @@ typedef struct CrwClassImage {
     CrwCpoolIndex               newarray_tracker_index;
     CrwCpoolIndex               call_tracker_index;
     CrwCpoolIndex               return_tracker_index;
+    CrwCpoolIndex               counters_field_index;
     CrwCpoolIndex               class_number_index; /* Class number in pool */
 
+    /* Always load the class number from the pool, and where its u4 went */
+    jboolean                    pool_class_number;
+    CrwPosition                 class_number_position;
+
     /* Count of injections made into this class */
     int                         injection_count;
 
@@ -193,6 +232,8 @@ typedef struct CrwClassImage {
     /* Callback functions */
     FatalErrorHandler           fatal_error_handler;
     MethodNumberRegister        mnum_callback;
+    MethodFilter                method_filter;
+    ImageAllocator              image_allocator;
 
     /* Table of method names and descr's */
     int                         method_count;
@@ -249,6 +290,9 @@ typedef struct MethodImage {
     /* Method access flags gotten from file. */
     unsigned            access_flags;
 
+    /* Scratch memory in use before this method, method_term() rewinds to it */
+    CrwScratchMark      scratch_mark;
+
 } MethodImage;
 
 /* ----------------------------------------------------------------- */
@@ -326,44 +370,166 @@ reallocate(CrwClassImage *ci, void *optr, int nbytes)
     return ptr;
 }
 
+static const char *
+duplicate(CrwClassImage *ci, const char *str, int len)
+{
+    char *copy;
+
+    copy = (char*)allocate(ci, len+1);
+    (void)memcpy(copy, str, len);
+    copy[len] = 0;
+    return (const char *)copy;
+}
+
+static void
+deallocate(CrwClassImage *ci, void *ptr)
+{
+    if ( ptr == NULL ) {
+        CRW_FATAL(ci, "Cannot deallocate NULL");
+    }
+    (void)free(ptr);
+}
+
+/* Scratch memory (tables, strings and method data that live no longer than
+ *   the CrwClassImage) is handed out from large blocks by bumping a pointer
+ *   and never freed piece by piece. A typical class needs one block.
+ */
+
 static void *
-allocate_clean(CrwClassImage *ci, int nbytes)
+scratch_allocate(CrwClassImage *ci, int nbytes)
 {
-    void * ptr;
+    CrwScratchBlock *   block;
+    size_t              size;
+    void *              ptr;
 
     if ( nbytes <= 0 ) {
         CRW_FATAL(ci, "Cannot allocate <= 0 bytes");
     }
-    ptr = calloc(nbytes, 1);
-    if ( ptr == NULL ) {
-        CRW_FATAL(ci, "Ran out of malloc memory");
+    size  = ((size_t)nbytes + SCRATCH_ALIGNMENT - 1) &
+                        ~(size_t)(SCRATCH_ALIGNMENT - 1);
+    block = ci->scratch;
+    if ( block == NULL || block->size - block->used < size ) {
+        size_t block_size;
+
+        /* What is left of the current block is not used again */
+        block_size = SCRATCH_BLOCK_MIN;
+        if ( block == NULL && ci->scratch_first_size > block_size ) {
+            block_size = ci->scratch_first_size;
+        }
+        if ( size > block_size ) {
+            block_size = size;
+        }
+        block = (CrwScratchBlock*)malloc(SCRATCH_HEADER + block_size);
+        if ( block == NULL ) {
+            CRW_FATAL(ci, "Ran out of malloc memory");
+        }
+        block->previous = ci->scratch;
+        block->size     = block_size;
+        block->used     = 0;
+        ci->scratch     = block;
     }
+    ptr = (char*)block + SCRATCH_HEADER + block->used;
+    block->used += size;
+    return ptr;
+}
+
+static void *
+scratch_allocate_clean(CrwClassImage *ci, int nbytes)
+{
+    void * ptr;
+
+    ptr = scratch_allocate(ci, nbytes);
+    (void)memset(ptr, 0, nbytes);
     return ptr;
 }
 
 static const char *
-duplicate(CrwClassImage *ci, const char *str, int len)
+scratch_duplicate(CrwClassImage *ci, const char *str, int len)
 {
     char *copy;
 
-    copy = (char*)allocate(ci, len+1);
+    copy = (char*)scratch_allocate(ci, len+1);
     (void)memcpy(copy, str, len);
     copy[len] = 0;
     return (const char *)copy;
 }
 
+static CrwScratchMark
+scratch_mark(CrwClassImage *ci)
+{
+    CrwScratchMark mark;
+
+    mark.block = ci->scratch;
+    mark.used  = (ci->scratch == NULL) ? 0 : ci->scratch->used;
+    return mark;
+}
+
+/* Gives back everything handed out since mark was taken */
 static void
-deallocate(CrwClassImage *ci, void *ptr)
+scratch_rewind(CrwClassImage *ci, CrwScratchMark mark)
 {
-    if ( ptr == NULL ) {
-        CRW_FATAL(ci, "Cannot deallocate NULL");
+    while ( ci->scratch != mark.block ) {
+        CrwScratchBlock *previous;
+
+        CRW_ASSERT(ci, ci->scratch != NULL);
+        previous = ci->scratch->previous;
+        (void)free(ci->scratch);
+        ci->scratch = previous;
+    }
+    if ( ci->scratch != NULL ) {
+        ci->scratch->used = mark.used;
     }
-    (void)free(ptr);
 }
 
 /* ----------------------------------------------------------------- */
 /* Functions for reading/writing bytes to/from the class images */
 
+/* Makes room for count more bytes of output. The first output buffer is
+ *   scratch memory sized from the input, a class that needs more moves to
+ *   malloc() space that grows as needed and is freed by cleanup().
+ */
+static void
+output_reserve(CrwClassImage *ci, unsigned count)
+{
+    CrwPosition     needed;
+    CrwPosition     new_len;
+    unsigned char * new_output;
+
+    needed = ci->output_position + count;
+    if ( needed <= ci->output_len ) {
+        return;
+    }
+    new_len = ci->output_len * 2;
+    if ( new_len < needed ) {
+        new_len = needed;
+    }
+    if ( ci->output_on_heap ) {
+        new_output = (unsigned char*)reallocate(ci, ci->output, (int)new_len);
+    } else {
+        new_output = (unsigned char*)allocate(ci, (int)new_len);
+        (void)memcpy(new_output, ci->output, ci->output_position);
+        ci->output_on_heap = JNI_TRUE;
+    }
+    ci->output     = new_output;
+    ci->output_len = new_len;
+}
+
+/* The new class image, exactly nbytes, for the caller to keep */
+static unsigned char *
+allocate_image(CrwClassImage *ci, long nbytes)
+{
+    unsigned char * image;
+
+    if ( ci->image_allocator == NULL ) {
+        return (unsigned char*)allocate(ci, (int)nbytes);
+    }
+    image = (*ci->image_allocator)(nbytes);
+    if ( image == NULL ) {
+        CRW_FATAL(ci, "Cannot allocate the new class image");
+    }
+    return image;
+}
+
 static unsigned
 readU1(CrwClassImage *ci)
 {
@@ -403,6 +569,9 @@ writeU1(CrwClassImage *ci, unsigned val)  /* Only writes out lower 8 bits */
 {
     CRW_ASSERT_CI(ci);
     if ( ci->output != NULL ) {
+        if ( ci->output_position >= ci->output_len ) {
+            output_reserve(ci, 1);
+        }
         ci->output[ci->output_position++] = val & 0xFF;
     }
 }
@@ -456,6 +625,7 @@ copy(CrwClassImage *ci, unsigned count)
 {
     CRW_ASSERT_CI(ci);
     if ( ci->output != NULL ) {
+        output_reserve(ci, count);
         (void)memcpy(ci->output+ci->output_position,
                      ci->input+ci->input_position, count);
         ci->output_position += count;
@@ -486,6 +656,7 @@ write_bytes(CrwClassImage *ci, void *bytes, unsigned count)
     CRW_ASSERT_CI(ci);
     CRW_ASSERT(ci, bytes!=NULL);
     if ( ci->output != NULL ) {
+        output_reserve(ci, count);
         (void)memcpy(ci->output+ci->output_position, bytes, count);
         ci->output_position += count;
     }
@@ -579,7 +750,7 @@ add_new_cpool_entry(CrwClassImage *ci, ClassConstant tag,
             CRW_ASSERT(ci, len==(len & 0xFFFF));
             writeU2(ci, len);
             write_bytes(ci, (void*)str, len);
-            utf8 = (char*)duplicate(ci, str, len);
+            utf8 = (char*)scratch_duplicate(ci, str, len);
             break;
         default:
             CRW_FATAL(ci, "Unknown constant");
@@ -609,7 +780,8 @@ add_new_class_cpool_entry(CrwClassImage *ci, const char *class_name)
 }
 
 static CrwCpoolIndex
-add_new_method_cpool_entry(CrwClassImage *ci, CrwCpoolIndex class_index,
+add_new_member_cpool_entry(CrwClassImage *ci, ClassConstant tag,
+                     CrwCpoolIndex class_index,
                      const char *name, const char *descr)
 {
     CrwCpoolIndex name_index;
@@ -629,10 +801,26 @@ add_new_method_cpool_entry(CrwClassImage *ci, CrwCpoolIndex class_index,
     name_type_index =
         add_new_cpool_entry(ci, JVM_CONSTANT_NameAndType,
                                 name_index, descr_index, NULL, 0);
-    return add_new_cpool_entry(ci, JVM_CONSTANT_Methodref,
+    return add_new_cpool_entry(ci, tag,
                                 class_index, name_type_index, NULL, 0);
 }
 
+static CrwCpoolIndex
+add_new_method_cpool_entry(CrwClassImage *ci, CrwCpoolIndex class_index,
+                     const char *name, const char *descr)
+{
+    return add_new_member_cpool_entry(ci, JVM_CONSTANT_Methodref,
+                                class_index, name, descr);
+}
+
+static CrwCpoolIndex
+add_new_field_cpool_entry(CrwClassImage *ci, CrwCpoolIndex class_index,
+                     const char *name, const char *descr)
+{
+    return add_new_member_cpool_entry(ci, JVM_CONSTANT_Fieldref,
+                                class_index, name, descr);
+}
+
 static CrwConstantPoolEntry
 cpool_entry(CrwClassImage *ci, CrwCpoolIndex c_index)
 {
@@ -653,7 +841,7 @@ cpool_setup(CrwClassImage *ci)
     count_plus_one = copyU2(ci);
     CRW_ASSERT(ci, count_plus_one>1);
     ci->cpool_max_elements = count_plus_one+MAXIMUM_NEW_CPOOL_ENTRIES;
-    ci->cpool = (CrwConstantPoolEntry*)allocate_clean(ci,
+    ci->cpool = (CrwConstantPoolEntry*)scratch_allocate_clean(ci,
                 (int)((ci->cpool_max_elements)*sizeof(CrwConstantPoolEntry)));
     ci->cpool_count_plus_one = (CrwCpoolIndex)count_plus_one;
 
@@ -699,7 +887,7 @@ cpool_setup(CrwClassImage *ci)
             case JVM_CONSTANT_Utf8:
                 len     = copyU2(ci);
                 index1  = (unsigned short)len;
-                utf8    = (char*)allocate(ci, len+1);
+                utf8    = (char*)scratch_allocate(ci, len+1);
                 read_bytes(ci, (void*)utf8, len);
                 utf8[len] = 0;
                 write_bytes(ci, (void*)utf8, len);
@@ -723,8 +911,12 @@ cpool_setup(CrwClassImage *ci)
         fillin_cpool_entry(ci, ipos, tag, index1, index2, (const char *)utf8, len);
     }
 
-    if (ci->call_name != NULL || ci->return_name != NULL) {
-        if ( ci->number != (ci->number & 0x7FFF) ) {
+    if (ci->call_name != NULL || ci->return_name != NULL ||
+        ci->counters_name != NULL) {
+        if ( ci->pool_class_number ||
+             ci->number != (ci->number & 0x7FFF) ) {
+            /* Past the tag byte of the entry about to be written */
+            ci->class_number_position = ci->output_position + 1;
             ci->class_number_index =
                 add_new_cpool_entry(ci, JVM_CONSTANT_Integer,
                     (ci->number>>16) & 0xFFFF, ci->number & 0xFFFF, NULL, 0);
@@ -759,6 +951,12 @@ cpool_setup(CrwClassImage *ci)
                     ci->return_name,
                     ci->return_sig);
     }
+    if (ci->counters_name != NULL) {
+        ci->counters_field_index = add_new_field_cpool_entry(ci,
+                    ci->tracker_class_index,
+                    ci->counters_name,
+                    ci->counters_sig);
+    }
 
     random_writeU2(ci, cpool_output_position, ci->cpool_count_plus_one);
 }
@@ -799,6 +997,15 @@ push_short_constant_bytecodes(ByteCode *bytecodes, unsigned number)
     return nbytes;
 }
 
+static ByteOffset
+push_class_number_bytecodes(CrwClassImage *ci, ByteCode *bytecodes)
+{
+    if ( ci->class_number_index == 0 ) {
+        return push_short_constant_bytecodes(bytecodes, ci->number);
+    }
+    return push_pool_constant_bytecodes(bytecodes, ci->class_number_index);
+}
+
 static ByteOffset
 injection_template(MethodImage *mi, ByteCode *bytecodes, ByteOffset max_nbytes,
                         CrwCpoolIndex method_index)
@@ -846,14 +1053,7 @@ injection_template(MethodImage *mi, ByteCode *bytecodes, ByteOffset max_nbytes,
         bytecodes[nbytes++] = (ByteCode)JVM_OPC_aload_0;
     }
     if ( push_cnum ) {
-        if ( ci->number == (ci->number & 0x7FFF) ) {
-            nbytes += push_short_constant_bytecodes(bytecodes+nbytes,
-                                                ci->number);
-        } else {
-            CRW_ASSERT(ci, ci->class_number_index!=0);
-            nbytes += push_pool_constant_bytecodes(bytecodes+nbytes,
-                                                ci->class_number_index);
-        }
+        nbytes += push_class_number_bytecodes(ci, bytecodes+nbytes);
     }
     if ( push_mnum ) {
         nbytes += push_short_constant_bytecodes(bytecodes+nbytes,
@@ -872,6 +1072,55 @@ injection_template(MethodImage *mi, ByteCode *bytecodes, ByteOffset max_nbytes,
     return nbytes;
 }
 
+/* Counter slots of a method: calls at 2*mnum, returns at 2*mnum+1.
+ *   Slots past what sipush can push fall back to the call injections.
+ */
+static int
+use_counters(MethodImage *mi)
+{
+    return mi->ci->counters_field_index != 0 &&
+           (2*mi->number+1) == ((2*mi->number+1) & 0x7FFF);
+}
+
+/* Increments counters[cnum][slot] in place, no call at all:
+ *     getstatic counters; push cnum; aaload; push slot;
+ *     dup2; laload; lconst_1; ladd; lastore
+ */
+static ByteOffset
+counter_injection_template(MethodImage *mi, ByteCode *bytecodes,
+                        ByteOffset max_nbytes, unsigned slot)
+{
+    CrwClassImage *     ci;
+    ByteOffset nbytes = 0;
+    unsigned max_stack;
+
+    ci = mi->ci;
+
+    CRW_ASSERT(ci, bytecodes!=NULL);
+    CRW_ASSERT(ci, ci->counters_field_index!=0);
+
+    bytecodes[nbytes++] = (ByteCode)JVM_OPC_getstatic;
+    bytecodes[nbytes++] = (ByteCode)(ci->counters_field_index >> 8);
+    bytecodes[nbytes++] = (ByteCode)ci->counters_field_index;
+    nbytes += push_class_number_bytecodes(ci, bytecodes+nbytes);
+    bytecodes[nbytes++] = (ByteCode)JVM_OPC_aaload;
+    nbytes += push_short_constant_bytecodes(bytecodes+nbytes, slot);
+    bytecodes[nbytes++] = (ByteCode)JVM_OPC_dup2;
+    bytecodes[nbytes++] = (ByteCode)JVM_OPC_laload;
+    bytecodes[nbytes++] = (ByteCode)JVM_OPC_lconst_1;
+    bytecodes[nbytes++] = (ByteCode)JVM_OPC_ladd;
+    bytecodes[nbytes++] = (ByteCode)JVM_OPC_lastore;
+    bytecodes[nbytes]   = 0;
+    CRW_ASSERT(ci, nbytes<max_nbytes);
+
+    /* Array and slot twice, then the array, slot and two longs */
+    max_stack = mi->max_stack + 6;
+    if ( max_stack > mi->new_max_stack ) {
+        mi->new_max_stack = max_stack;
+    }
+    return nbytes;
+}
+
 /* Called to create injection code at entry to a method */
 static ByteOffset
 entry_injection_code(MethodImage *mi, ByteCode *bytecodes, ByteOffset len)
@@ -888,8 +1137,13 @@ entry_injection_code(MethodImage *mi, ByteCode *bytecodes, ByteOffset len)
                             bytecodes, len, ci->object_init_tracker_index);
     }
     if ( !mi->skip_call_return_sites ) {
-        nbytes += injection_template(mi,
+        if ( use_counters(mi) ) {
+            nbytes += counter_injection_template(mi,
+                    bytecodes+nbytes, len-nbytes, 2*mi->number);
+        } else {
+            nbytes += injection_template(mi,
                     bytecodes+nbytes, len-nbytes, ci->call_tracker_index);
+        }
     }
     return nbytes;
 }
@@ -910,7 +1164,13 @@ before_injection_code(MethodImage *mi, ClassOpcode opcode,
         case JVM_OPC_freturn:
         case JVM_OPC_dreturn:
         case JVM_OPC_areturn:
-            if ( !mi->skip_call_return_sites ) {
+            if ( mi->skip_call_return_sites ) {
+                break;
+            }
+            if ( use_counters(mi) ) {
+                nbytes = counter_injection_template(mi,
+                            bytecodes, len, 2*mi->number+1);
+            } else {
                 nbytes = injection_template(mi,
                             bytecodes, len, mi->ci->return_tracker_index);
             }
@@ -969,7 +1229,7 @@ inject_bytecodes(MethodImage *mi, ByteOffset at,
     /* Either start an injection area or concatenate to what is there */
     if ( injection.code == NULL ) {
         CRW_ASSERT(ci, injection.len==0);
-        injection.code = (ByteCode *)allocate_clean(ci, LARGEST_INJECTION+1);
+        injection.code = (ByteCode *)scratch_allocate_clean(ci, LARGEST_INJECTION+1);
     }
 
     (void)memcpy(injection.code+injection.len, bytecodes, len);
@@ -987,19 +1247,22 @@ method_init(CrwClassImage *ci, unsigned mnum, ByteOffset code_len)
 {
     MethodImage *       mi;
     ByteOffset          i;
+    CrwScratchMark      mark;
 
-    mi                  = (MethodImage*)allocate_clean(ci, (int)sizeof(MethodImage));
+    mark                = scratch_mark(ci);
+    mi                  = (MethodImage*)scratch_allocate_clean(ci, (int)sizeof(MethodImage));
+    mi->scratch_mark    = mark;
     mi->ci              = ci;
     mi->name            = ci->method_name[mnum];
     mi->descr           = ci->method_descr[mnum];
     mi->code_len        = code_len;
-    mi->map             = (ByteOffset*)allocate_clean(ci,
+    mi->map             = (ByteOffset*)scratch_allocate(ci,
                                 (int)((code_len+1)*sizeof(ByteOffset)));
     for(i=0; i<=code_len; i++) {
         mi->map[i] = i;
     }
-    mi->widening        = (signed char*)allocate_clean(ci, code_len+1);
-    mi->injections      = (Injection *)allocate_clean(ci,
+    mi->widening        = (signed char*)scratch_allocate_clean(ci, code_len+1);
+    mi->injections      = (Injection *)scratch_allocate_clean(ci,
                                 (int)((code_len+1)*sizeof(Injection)));
     mi->number          = mnum;
     ci->current_mi      = mi;
@@ -1013,27 +1276,10 @@ method_term(MethodImage *mi)
 
     ci = mi->ci;
     CRW_ASSERT_MI(mi);
-    if ( mi->map != NULL ) {
-        deallocate(ci, (void*)mi->map);
-        mi->map = NULL;
-    }
-    if ( mi->widening != NULL ) {
-        deallocate(ci, (void*)mi->widening);
-        mi->widening = NULL;
-    }
-    if ( mi->injections != NULL ) {
-        ByteOffset i;
-        for(i=0; i<= mi->code_len; i++) {
-            if ( mi->injections[i].code != NULL ) {
-                deallocate(ci, (void*)mi->injections[i].code);
-                mi->injections[i].code = NULL;
-            }
-        }
-        deallocate(ci, (void*)mi->injections);
-        mi->injections = NULL;
-    }
     ci->current_mi = NULL;
-    deallocate(ci, (void*)mi);
+
+    /* The method's tables, injections and mi itself in one go */
+    scratch_rewind(ci, mi->scratch_mark);
 }
 
 static ByteOffset
@@ -2104,6 +2350,14 @@ method_write_bytecodes(CrwClassImage *ci, unsigned mnum, unsigned access_flags)
          */
         copy(ci, attr_len - (2+2+4));
         return;
+    } else if ( ci->method_filter != NULL &&
+                !(*(ci->method_filter))(ci->number, mnum,
+                        ci->method_name[mnum], ci->method_descr[mnum],
+                        access_flags, ci->input + ci->input_position,
+                        (long)code_len) ) {
+        /* Caller is not interested in this method */
+        copy(ci, attr_len - (2+2+4));
+        return;
     }
 
     /* Start Injection */
@@ -2188,8 +2442,8 @@ method_write_all(CrwClassImage *ci)
     count = copyU2(ci);
     ci->method_count = count;
     if ( count > 0 ) {
-        ci->method_name = (const char **)allocate_clean(ci, count*(int)sizeof(const char*));
-        ci->method_descr = (const char **)allocate_clean(ci, count*(int)sizeof(const char*));
+        ci->method_name = (const char **)scratch_allocate_clean(ci, count*(int)sizeof(const char*));
+        ci->method_descr = (const char **)scratch_allocate_clean(ci, count*(int)sizeof(const char*));
     }
 
     for (i = 0; i < count; ++i) {
@@ -2208,30 +2462,26 @@ method_write_all(CrwClassImage *ci)
 static void
 cleanup(CrwClassImage *ci)
 {
+    CrwScratchMark nothing;
+
     CRW_ASSERT_CI(ci);
-    if ( ci->name != NULL ) {
-        deallocate(ci, (void*)ci->name);
-        ci->name = NULL;
-    }
-    if ( ci->method_name != NULL ) {
-        deallocate(ci, (void*)ci->method_name);
-        ci->method_name = NULL;
-    }
-    if ( ci->method_descr != NULL ) {
-        deallocate(ci, (void*)ci->method_descr);
-        ci->method_descr = NULL;
-    }
-    if ( ci->cpool != NULL ) {
-        CrwCpoolIndex i;
-        for(i=0; i<ci->cpool_count_plus_one; i++) {
-            if ( ci->cpool[i].ptr != NULL ) {
-                deallocate(ci, (void*)(ci->cpool[i].ptr));
-                ci->cpool[i].ptr = NULL;
-            }
-        }
-        deallocate(ci, (void*)ci->cpool);
-        ci->cpool = NULL;
+
+    /* Name, method tables and the constant pool are all scratch memory */
+    nothing.block = NULL;
+    nothing.used  = 0;
+    scratch_rewind(ci, nothing);
+    ci->name         = NULL;
+    ci->method_name  = NULL;
+    ci->method_descr = NULL;
+    ci->cpool        = NULL;
+    ci->cpool_position = NULL;
+
+    /* Output that outgrew its scratch buffer */
+    if ( ci->output_on_heap ) {
+        deallocate(ci, (void*)ci->output);
+        ci->output_on_heap = JNI_FALSE;
     }
+    ci->output = NULL;
 }
 
 static jboolean
@@ -2256,6 +2506,8 @@ inject_class(struct CrwClassImage *ci,
                  char* obj_init_sig,
                  char* newarray_name,
                  char* newarray_sig,
+                 char* counters_name,
+                 char* counters_sig,
                  unsigned char *buf,
                  long buf_len)
 {
@@ -2285,6 +2537,8 @@ inject_class(struct CrwClassImage *ci,
     ci->obj_init_sig            = obj_init_sig;
     ci->newarray_name           = newarray_name;
     ci->newarray_sig            = newarray_sig;
+    ci->counters_name           = counters_name;
+    ci->counters_sig            = counters_sig;
     ci->output                  = buf;
     ci->output_len              = buf_len;
 
@@ -2313,7 +2567,7 @@ inject_class(struct CrwClassImage *ci,
 
     cs = cpool_entry(ci, (CrwCpoolIndex)(cpool_entry(ci, this_class).index1));
     if ( ci->name == NULL ) {
-        ci->name = duplicate(ci, cs.ptr, cs.len);
+        ci->name = scratch_duplicate(ci, cs.ptr, cs.len);
         CRW_ASSERT(ci, strchr(ci->name,'.')==NULL); /* internal qualified name */
     }
     CRW_ASSERT(ci, (int)strlen(ci->name)==cs.len && strncmp(ci->name, cs.ptr, cs.len)==0);
@@ -2340,6 +2594,179 @@ inject_class(struct CrwClassImage *ci,
     return (long)ci->output_position;
 }
 
+/* ------------------------------------------------------------------- */
+/* Scanning: a quick look at a class without the mirrored constant pool,
+ *   the input is only read and strings are used where they are.
+ */
+
+static void
+cpool_scan(CrwClassImage *ci)
+{
+    CrwCpoolIndex i;
+    int count_plus_one;
+
+    CRW_ASSERT_CI(ci);
+    count_plus_one = readU2(ci);
+    CRW_ASSERT(ci, count_plus_one>1);
+    ci->cpool_position = (unsigned*)scratch_allocate(ci,
+                (int)(count_plus_one*sizeof(unsigned)));
+    ci->cpool_count_plus_one = (CrwCpoolIndex)count_plus_one;
+
+    /* Index zero not in class file */
+    for (i = 1; i < count_plus_one; ++i) {
+        ClassConstant   tag;
+        char message[BUFSIZE];
+
+        ci->cpool_position[i] = (unsigned)ci->input_position;
+        tag = readU1(ci);
+        switch (tag) {
+            case JVM_CONSTANT_Class:
+            case JVM_CONSTANT_String:
+            case JVM_CONSTANT_MethodType:
+                skip(ci, 2);
+                break;
+            case JVM_CONSTANT_Fieldref:
+            case JVM_CONSTANT_Methodref:
+            case JVM_CONSTANT_InterfaceMethodref:
+            case JVM_CONSTANT_Integer:
+            case JVM_CONSTANT_Float:
+            case JVM_CONSTANT_NameAndType:
+            case JVM_CONSTANT_InvokeDynamic:
+                skip(ci, 4);
+                break;
+            case JVM_CONSTANT_Long:
+            case JVM_CONSTANT_Double:
+                skip(ci, 8);
+                ++i;  /* these take two CP entries */
+                if ( i < count_plus_one ) {
+                    ci->cpool_position[i] = 0;
+                }
+                break;
+            case JVM_CONSTANT_Utf8:
+                skip(ci, readU2(ci));
+                break;
+            case JVM_CONSTANT_MethodHandle:
+                skip(ci, 3);
+                break;
+            default:
+                snprintf(message, BUFSIZE, "Unknown tag: %d, at ipos %hu", tag, i);
+                CRW_FATAL(ci, message);
+                break;
+        }
+    }
+}
+
+/* First u2 after the tag of a scanned entry, e.g. the name of a Class */
+static CrwCpoolIndex
+cpool_scan_index1(CrwClassImage *ci, CrwCpoolIndex c_index)
+{
+    const unsigned char *entry;
+
+    CRW_ASSERT(ci, c_index > 0 && c_index < ci->cpool_count_plus_one);
+    entry = ci->input + ci->cpool_position[c_index];
+    return (CrwCpoolIndex)((entry[1] << 8) | entry[2]);
+}
+
+/* A scanned Utf8 entry, in the input so not 0 terminated */
+static const char *
+cpool_scan_utf8(CrwClassImage *ci, CrwCpoolIndex c_index, int *plen)
+{
+    const unsigned char *entry;
+
+    CRW_ASSERT(ci, c_index > 0 && c_index < ci->cpool_count_plus_one);
+    entry = ci->input + ci->cpool_position[c_index];
+    CRW_ASSERT(ci, entry[0]==JVM_CONSTANT_Utf8);
+    *plen = (entry[1] << 8) | entry[2];
+    return (const char *)entry + 3;
+}
+
+/* Reads up to and including this_class, returns the class name index */
+static CrwCpoolIndex
+class_scan_header(CrwClassImage *ci, unsigned *paccess_flags)
+{
+    unsigned magic;
+
+    magic = readU4(ci);
+    CRW_ASSERT(ci, magic==0xCAFEBABE);
+    if ( magic != 0xCAFEBABE ) {
+        return 0;
+    }
+    skip(ci, 2+2);      /* minor and major version numbers */
+    cpool_scan(ci);
+    *paccess_flags = readU2(ci);
+    return cpool_scan_index1(ci, (CrwCpoolIndex)readU2(ci));
+}
+
+static void
+attributes_scan(CrwClassImage *ci)
+{
+    unsigned i;
+    unsigned attr_count;
+
+    attr_count = readU2(ci);
+    for (i = 0; i < attr_count; ++i) {
+        skip(ci, 2);
+        skip(ci, readU4(ci));
+    }
+}
+
+/* Asks the filter about a method with bytecodes, returns its answer */
+static int
+method_scan(CrwClassImage *ci, unsigned mnum)
+{
+    unsigned            i;
+    unsigned            access_flags;
+    CrwCpoolIndex       name_index;
+    CrwCpoolIndex       descr_index;
+    unsigned            attr_count;
+    int                 wanted;
+
+    access_flags = readU2(ci);
+    name_index   = readU2(ci);
+    descr_index  = readU2(ci);
+    attr_count   = readU2(ci);
+
+    wanted = 0;
+    for (i = 0; i < attr_count; ++i) {
+        const char *    attr_name;
+        int             attr_name_len;
+        unsigned        len;
+        CrwPosition     end;
+
+        attr_name = cpool_scan_utf8(ci, (CrwCpoolIndex)readU2(ci),
+                                    &attr_name_len);
+        len = readU4(ci);
+        end = ci->input_position + len;
+        if ( attr_name_len == 4 && strncmp(attr_name, "Code", 4) == 0 ) {
+            const char *    str;
+            int             str_len;
+            const char *    name;
+            const char *    descr;
+            ByteOffset      code_len;
+            CrwScratchMark  mark;
+
+            skip(ci, 2+2);      /* max_stack and max_locals */
+            code_len = readU4(ci);
+            if ( ci->method_filter == NULL ) {
+                wanted = 1;
+            } else {
+                mark  = scratch_mark(ci);
+                str   = cpool_scan_utf8(ci, name_index, &str_len);
+                name  = scratch_duplicate(ci, str, str_len);
+                str   = cpool_scan_utf8(ci, descr_index, &str_len);
+                descr = scratch_duplicate(ci, str, str_len);
+                wanted = (*(ci->method_filter))(ci->number, mnum, name,
+                            descr, access_flags,
+                            ci->input + ci->input_position,
+                            (long)code_len) != 0;
+                scratch_rewind(ci, mark);
+            }
+        }
+        ci->input_position = end;
+    }
+    return wanted;
+}
+
 /* ------------------------------------------------------------------- */
 /* Exported interfaces */
 
@@ -2359,21 +2786,29 @@ java_crw_demo(unsigned class_number,
          char* obj_init_sig,    /* Signature of this method */
          char* newarray_name,   /* Method name to call after newarray opcodes */
          char* newarray_sig,    /* Signature of this method */
+         char* counters_name,   /* Static long[][] field counting calls */
+         char* counters_sig,    /* Signature of this field */
          unsigned char **pnew_file_image,
          long *pnew_file_len,
+         long *pclass_number_offset,
          FatalErrorHandler fatal_error_handler,
-         MethodNumberRegister mnum_callback)
+         MethodNumberRegister mnum_callback,
+         MethodFilter method_filter,
+         ImageAllocator image_allocator)
 {
-    CrwClassImage ci;
-    long          max_length;
-    long          new_length;
-    void         *new_image;
-    int           len;
+    CrwClassImage  ci;
+    long           max_length;
+    long           new_length;
+    unsigned char *new_image;
+    unsigned char *output;
+    int            len;
 
     /* Initial setup of the CrwClassImage structure */
     (void)memset(&ci, 0, (int)sizeof(CrwClassImage));
     ci.fatal_error_handler = fatal_error_handler;
     ci.mnum_callback       = mnum_callback;
+    ci.method_filter       = method_filter;
+    ci.image_allocator     = image_allocator;
 
     /* Do some interface error checks */
     if ( pnew_file_image==NULL ) {
@@ -2430,13 +2865,30 @@ java_crw_demo(unsigned class_number,
             CRW_FATAL(&ci, "newarray_sig is not (Ljava/lang/Object;)V");
         }
     }
+    if ( counters_name != NULL ) {
+        if ( counters_sig == NULL || strcmp(counters_sig, "[[J") != 0 ) {
+            CRW_FATAL(&ci, "counters_sig is not [[J");
+        }
+    }
+
+    /* Output is written to scratch memory, half as big again as the input
+     *   (twice with counter injections) and grown if a class needs more.
+     *   The first scratch block also has room for the constant pool, names
+     *   and the largest method's tables.
+     */
+    max_length = file_len + file_len/2 + 1024;
+    if ( counters_name != NULL ) {
+        max_length = file_len*2 + 1024;
+    }
+    ci.scratch_first_size = (size_t)file_len*4 + (size_t)max_length +
+                                SCRATCH_BLOCK_MIN/4;
 
     /* Finish setup the CrwClassImage structure */
     ci.is_thread_class = JNI_FALSE;
     if ( name != NULL ) {
         CRW_ASSERT(&ci, strchr(name,'.')==NULL); /* internal qualified name */
 
-        ci.name = duplicate(&ci, name, (int)strlen(name));
+        ci.name = scratch_duplicate(&ci, name, (int)strlen(name));
         if ( strcmp(name, "java/lang/Thread")==0 ) {
             ci.is_thread_class = JNI_TRUE;
         }
@@ -2444,10 +2896,13 @@ java_crw_demo(unsigned class_number,
     ci.number = class_number;
     ci.input = file_image;
     ci.input_len = file_len;
+    ci.pool_class_number = (pclass_number_offset != NULL);
+    if ( pclass_number_offset != NULL ) {
+        *pclass_number_offset = 0;
+    }
 
     /* Do the injection */
-    max_length = file_len*2 + 512; /* Twice as big + 512 */
-    new_image = allocate(&ci, (int)max_length);
+    output = (unsigned char*)scratch_allocate(&ci, (int)max_length);
     new_length = inject_class(&ci,
                                  system_class,
                                  tclass_name,
@@ -2460,20 +2915,24 @@ java_crw_demo(unsigned class_number,
                                  obj_init_sig,
                                  newarray_name,
                                  newarray_sig,
-                                 new_image,
+                                 counters_name,
+                                 counters_sig,
+                                 output,
                                  max_length);
 
-    /* Dispose or shrink the space to be returned. */
-    if ( new_length == 0 ) {
-        deallocate(&ci, (void*)new_image);
-        new_image = NULL;
-    } else {
-        new_image = (void*)reallocate(&ci, (void*)new_image, (int)new_length);
+    /* The one copy of the output, to space of exactly its size */
+    new_image = NULL;
+    if ( new_length != 0 ) {
+        new_image = allocate_image(&ci, new_length);
+        (void)memcpy(new_image, ci.output, new_length);
     }
 
     /* Return the new class image */
-    *pnew_file_image = (unsigned char *)new_image;
+    *pnew_file_image = new_image;
     *pnew_file_len = (long)new_length;
+    if ( pclass_number_offset != NULL && new_length != 0 ) {
+        *pclass_number_offset = (long)ci.class_number_position;
+    }
 
     /* Cleanup before we leave. */
     cleanup(&ci);
@@ -2485,9 +2944,8 @@ java_crw_demo_classname(const unsigned char *file_image, long file_len,
         FatalErrorHandler fatal_error_handler)
 {
     CrwClassImage               ci;
-    CrwConstantPoolEntry        cs;
-    CrwCpoolIndex               this_class;
-    unsigned                    magic;
+    CrwCpoolIndex               name_index;
+    unsigned                    access_flags;
     char *                      name;
 
     name = NULL;
@@ -2505,31 +2963,75 @@ java_crw_demo_classname(const unsigned char *file_image, long file_len,
     ci.input_len = file_len;
     ci.fatal_error_handler = fatal_error_handler;
 
-    /* Read out the bytes from the classfile image */
+    /* Scan the constant pool up to 'this' class, nothing is copied */
+    name_index = class_scan_header(&ci, &access_flags);
+    if ( name_index != 0 ) {
+        const char *str;
+        int         len;
 
-    magic = readU4(&ci); /* magic number */
-    CRW_ASSERT(&ci, magic==0xCAFEBABE);
-    if ( magic != 0xCAFEBABE ) {
-        return name;
+        /* Duplicate the name */
+        str  = cpool_scan_utf8(&ci, name_index, &len);
+        name = (char *)duplicate(&ci, str, len);
     }
-    (void)readU2(&ci); /* minor version number */
-    (void)readU2(&ci); /* major version number */
 
-    /* Read in constant pool. Since no output setup, writes are NOP's */
-    cpool_setup(&ci);
+    /* Cleanup before we leave. */
+    cleanup(&ci);
 
-    (void)readU2(&ci); /* access flags */
-    this_class = readU2(&ci); /* 'this' class */
+    /* Return malloc space */
+    return name;
+}
 
-    /* Get 'this' constant pool entry */
-    cs = cpool_entry(&ci, (CrwCpoolIndex)(cpool_entry(&ci, this_class).index1));
+/* Decide if a class is worth a rewrite: 1 if some method with bytecodes
+ *   passes the method filter, 0 if none does or the class is never
+ *   rewritten (e.g. an interface).
+ */
+JNIEXPORT int JNICALL
+java_crw_demo_scan(unsigned class_number,
+         const unsigned char *file_image,
+         long file_len,
+         FatalErrorHandler fatal_error_handler,
+         MethodFilter method_filter)
+{
+    CrwClassImage               ci;
+    unsigned                    access_flags;
+    unsigned                    count;
+    unsigned                    i;
+    int                         wanted;
+
+    if ( file_len==0 || file_image==NULL ) {
+        return 0;
+    }
+
+    (void)memset(&ci, 0, (int)sizeof(CrwClassImage));
+    ci.number    = class_number;
+    ci.input     = file_image;
+    ci.input_len = file_len;
+    ci.fatal_error_handler = fatal_error_handler;
+    ci.method_filter       = method_filter;
+
+    wanted = 0;
+    if ( class_scan_header(&ci, &access_flags) != 0 &&
+         !skip_class(access_flags) ) {
+        skip(&ci, 2);                   /* super class */
+        count = readU2(&ci);            /* interfaces */
+        skip(&ci, count*2);
+
+        /* Fields, like methods but never looked at */
+        count = readU2(&ci);
+        for (i = 0; i < count; ++i) {
+            skip(&ci, 2+2+2);
+            attributes_scan(&ci);
+        }
 
-    /* Duplicate the name */
-    name = (char *)duplicate(&ci, cs.ptr, cs.len);
+        /* Methods, up to the first one the filter wants */
+        count = readU2(&ci);
+        for (i = 0; i < count && !wanted; ++i) {
+            wanted = method_scan(&ci, i);
+        }
+    }
 
     /* Cleanup before we leave. */
     cleanup(&ci);
 
-    /* Return malloc space */
-    return name;
+    return wanted;
 }
@@ -61,15 +61,33 @@ typedef void (*FatalErrorHandler)(const char*message, const char*file, int line)
 
 typedef void (*MethodNumberRegister)(unsigned, const char**, const char**, int);
 
+/* This callback is used to decide which methods get injections.
+ *   It is called once for every method that has bytecodes, with the
+ *   class number, method number, method name and signature, the method
+ *   access flags and its original bytecodes and their length, before the
+ *   method is rewritten. Returning 0 leaves the method untouched.
+ */
+
+typedef int (*MethodFilter)(unsigned, unsigned, const char*, const char*,
+                            unsigned, const unsigned char*, long);
+
+/* This callback allocates the new classfile image once its exact length
+ *   is known, e.g. with JVMTI Allocate so the image can be handed to the
+ *   VM as it is. Returning NULL is a fatal error.
+ */
+
+typedef unsigned char * (*ImageAllocator)(long);
+
 /* Class file reader/writer interface. Basic input is a classfile image
  *     and details about what to inject. The output is a new classfile image
- *     that was allocated with malloc(), and should be freed by the caller.
+ *     that was allocated with malloc(), and should be freed by the caller,
+ *     unless an ImageAllocator is given.
  */
 
 /* Names of external symbols to look for. These are the names that we
  *   try and lookup in the shared library. On Windows 2000, the naming
  *   convention is to prefix a "_" and suffix a "@N" where N is 4 times
- *   the number or arguments supplied.It has 19 args, so 76 = 19*4.
+ *   the number or arguments supplied.It has 24 args, so 96 = 24*4.
  *   On Windows 2003, Linux, and Solaris, the first name will be
  *   found, on Windows 2000 a second try should find the second name.
  *
@@ -77,7 +95,14 @@ typedef void (*MethodNumberRegister)(unsigned, const char**, const char**, int);
  *            multiple things in this file, including this name.
  */
 
-#define JAVA_CRW_DEMO_SYMBOLS { "java_crw_demo", "_java_crw_demo@76" }
+#define JAVA_CRW_DEMO_SYMBOLS { "java_crw_demo", "_java_crw_demo@96" }
+
+/* Version of the injected code. Bumped whenever the same input and
+ *   arguments would give a different image, so saved images are not
+ *   reused across it.
+ */
+
+#define JAVA_CRW_DEMO_VERSION 1
 
 /* Typedef needed for type casting in dynamic access situations. */
 
@@ -97,10 +122,15 @@ typedef void (JNICALL *JavaCrwDemo)(
          char* obj_init_sig,
          char* newarray_name,
          char* newarray_sig,
+         char* counters_name,
+         char* counters_sig,
          unsigned char **pnew_file_image,
          long *pnew_file_len,
+         long *pclass_number_offset,
          FatalErrorHandler fatal_error_handler,
-         MethodNumberRegister mnum_callback
+         MethodNumberRegister mnum_callback,
+         MethodFilter method_filter,
+         ImageAllocator image_allocator
 );
 
 /* Function export (should match typedef above) */
@@ -151,20 +181,48 @@ JNIEXPORT void JNICALL java_crw_demo(
          char* newarray_sig,    /* Signature of this method */
                                 /*  (Must be "(Ljava/lang/Object;II)V") */
 
+         char* counters_name,   /* Static long[][] field in tclass, a long[] */
+                                /*   per class number; instead of calling */
+                                /*   call_name and return_name, methods */
+                                /*   increment counters[cnum][2*mnum] on */
+                                /*   entry and [2*mnum+1] before returns. */
+                                /*   NULL means use the calls. */
+
+         char* counters_sig,    /* Signature of this field */
+                                /*  (Must be "[[J") */
+
          unsigned char
            **pnew_file_image,   /* Returns a pointer to new classfile image */
 
          long *pnew_file_len,   /* Returns the length of the new image */
 
+         long *pclass_number_offset,
+                                /* Returns where the class number is in */
+                                /*   the new image, a big endian u4 that */
+                                /*   can be rewritten to reuse the image */
+                                /*   for another class number; 0 if none. */
+                                /*   NULL lets small class numbers be */
+                                /*   pushed as immediates instead. */
+
          FatalErrorHandler
            fatal_error_handler, /* Pointer to function to call on any */
                                 /*  fatal error. NULL sends error to stderr */
 
          MethodNumberRegister
-           mnum_callback        /* Pointer to function that gets called */
+           mnum_callback,       /* Pointer to function that gets called */
                                 /*   with all details on methods in this */
                                 /*   class. NULL means skip this call. */
 
+         MethodFilter
+           method_filter,       /* Pointer to function that decides if a */
+                                /*   method gets injections. NULL means */
+                                /*   every method is injected. */
+
+         ImageAllocator
+           image_allocator      /* Pointer to function that allocates the */
+                                /*   new classfile image. NULL means */
+                                /*   malloc(). */
+
            );
 
 
@@ -189,6 +247,37 @@ JNIEXPORT char * JNICALL java_crw_demo_classname(
          long file_len,
          FatalErrorHandler fatal_error_handler);
 
+/* External to decide, before any rewriting, if a class would get
+ *   injections: 1 if the method filter accepts some method with
+ *   bytecodes (any such method if it is NULL), 0 if not or if the class
+ *   is never injected (interfaces). Only the constant pool lengths are
+ *   walked, nothing is copied or allocated per entry, and the scan stops
+ *   at the first accepted method. The filter gets the same class_number,
+ *   method numbers and arguments java_crw_demo() would give it.
+ *
+ *   WARNING: If You change the typedef, you MUST change
+ *            multiple things in this file, including this name.
+ */
+
+#define JAVA_CRW_DEMO_SCAN_SYMBOLS \
+         { "java_crw_demo_scan", "_java_crw_demo_scan@20" }
+
+/* Typedef needed for type casting in dynamic access situations. */
+
+typedef int (JNICALL *JavaCrwDemoScan)(
+         unsigned class_number,
+         const unsigned char *file_image,
+         long file_len,
+         FatalErrorHandler fatal_error_handler,
+         MethodFilter method_filter);
+
+JNIEXPORT int JNICALL java_crw_demo_scan(
+         unsigned class_number,
+         const unsigned char *file_image,
+         long file_len,
+         FatalErrorHandler fatal_error_handler,
+         MethodFilter method_filter);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif /* __cplusplus */
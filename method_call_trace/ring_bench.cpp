@@ -0,0 +1,241 @@
+// Probe scaling from 1 to 32 threads: the per-thread EventRing the probes push into
+// against the path they had before it, the agent's monitor and a locked queue of text
+// lines shared by all threads. One consumer thread drains either as the worker does.
+//
+//   ring_bench [events_per_thread] [max_threads]
+//
+// Prints the probe calls/s over all threads until the last producer is done, the events/s
+// the consumer took, the share the rings dropped, and the p50/p99 probe cost (from the
+// probe's timestamp to the end of its push). With fewer cores than threads + 1 the
+// consumer is starved and full rings drop, while the monitor path makes probes wait.
+
+#include "Clock.h"
+#include "EventRing.h"
+#include "JVMAgentConstants.h"
+#include "LatencyHistogram.h"
+#include "TraceProtocol.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+static const char *CLASS_NAME = "bench/Workload";
+static const char *METHOD_NAME = "run";
+
+
+// What the probes did before: the agent lock around the class table lookup and the
+// line, then the server's queue lock around the push
+class MonitorPath
+{
+public:
+	void probe(int kind, int cnum, int mnum)
+	{
+		std::lock_guard<std::mutex> agent_lock(m_agent_lock);
+		std::string line = (kind == EVENT_METHOD_ENTRY ? "enter: " : "exit: ") +
+			m_class_name + ":" + m_method_name + "\r\n";
+
+		std::lock_guard<std::mutex> queue_lock(m_queue_lock);
+		m_queue.push_back(std::move(line));
+	}
+
+	// Worker side, returns the events taken
+	size_t drain(std::string &buffer)
+	{
+		std::deque<std::string> taken;
+		{
+			std::lock_guard<std::mutex> queue_lock(m_queue_lock);
+			taken.swap(m_queue);
+		}
+
+		for (size_t i = 0; i < taken.size(); i++)
+		{
+			buffer += taken[i];
+		}
+		return taken.size();
+	}
+
+	uint64_t dropped() const
+	{
+		return 0;
+	}
+
+	MonitorPath() : m_class_name(CLASS_NAME), m_method_name(METHOD_NAME)
+	{
+	}
+
+private:
+	std::mutex m_agent_lock;
+	std::mutex m_queue_lock;
+	std::string m_class_name;
+	std::string m_method_name;
+	std::deque<std::string> m_queue;
+};
+
+// What the probes do now: each thread pushes into its own ring, the worker encodes
+class RingPath
+{
+public:
+	explicit RingPath(unsigned threads)
+	{
+		for (unsigned i = 0; i < threads; i++)
+		{
+			m_rings.push_back(std::unique_ptr<EventRing>(new EventRing(EVENT_RING_CAPACITY)));
+		}
+	}
+
+	void probe(unsigned thread, int kind, int cnum, int mnum, uint64_t timestamp)
+	{
+		m_rings[thread]->push(kind, cnum, mnum, timestamp, 1);
+	}
+
+	size_t drain(std::string &buffer)
+	{
+		size_t count = 0;
+		for (size_t thread = 0; thread < m_rings.size(); thread++)
+		{
+			count += m_rings[thread]->drain([&buffer, thread](const TraceEvent &event)
+			{
+				TraceEncoder::event_record(buffer, event.m_kind == EVENT_METHOD_ENTRY ? RECORD_METHOD_ENTRY : RECORD_METHOD_EXIT,
+					static_cast<uint32_t>(thread), event.m_cnum, event.m_mnum, event.m_timestamp, event.m_weight);
+			});
+		}
+		return count;
+	}
+
+	uint64_t dropped() const
+	{
+		uint64_t dropped = 0;
+		for (size_t thread = 0; thread < m_rings.size(); thread++)
+		{
+			dropped += m_rings[thread]->dropped();
+		}
+		return dropped;
+	}
+
+private:
+	std::vector<std::unique_ptr<EventRing> > m_rings;
+};
+
+static void probe(MonitorPath &path, unsigned thread, int kind, uint64_t timestamp)
+{
+	path.probe(kind, 7, 3);
+}
+
+static void probe(RingPath &path, unsigned thread, int kind, uint64_t timestamp)
+{
+	path.probe(thread, kind, 7, 3, timestamp);
+}
+
+// Runs threads producers of events_per_thread events each against one consumer
+template <typename Path>
+static void run(const char *name, Path &path, unsigned threads, uint64_t events_per_thread)
+{
+	std::vector<std::unique_ptr<LatencyHistogram> > costs;
+	for (unsigned i = 0; i < threads; i++)
+	{
+		costs.push_back(std::unique_ptr<LatencyHistogram>(new LatencyHistogram()));
+	}
+
+	std::atomic<unsigned> ready(0);
+	std::atomic<unsigned> finished(0);
+	std::atomic<bool> go(false);
+	std::vector<std::thread> producers;
+	for (unsigned thread = 0; thread < threads; thread++)
+	{
+		producers.push_back(std::thread([&, thread]()
+		{
+			LatencyHistogram &cost = *costs[thread];
+			ready.fetch_add(1);
+			while (!go.load())
+			{
+				std::this_thread::yield();
+			}
+
+			for (uint64_t i = 0; i < events_per_thread; i++)
+			{
+				const uint64_t timestamp = Clock::now();
+				probe(path, thread, (i & 1) ? EVENT_METHOD_EXIT : EVENT_METHOD_ENTRY, timestamp);
+				cost.record(Clock::now() - timestamp);
+			}
+			finished.fetch_add(1);
+		}));
+	}
+
+	while (ready.load() < threads)
+	{
+		std::this_thread::yield();
+	}
+
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	go.store(true);
+
+	// The worker: drains until the producers are done and nothing is left
+	std::string buffer;
+	uint64_t drained = 0;
+	double probe_seconds = 0;
+	for (;;)
+	{
+		const bool last = finished.load() == threads;
+		if (last && probe_seconds == 0)
+		{
+			probe_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+		const size_t count = path.drain(buffer);
+		drained += count;
+		buffer.clear();
+		if (last && count == 0)
+		{
+			break;
+		}
+		if (count == 0)
+		{
+			std::this_thread::yield();
+		}
+	}
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	for (unsigned thread = 0; thread < threads; thread++)
+	{
+		producers[thread].join();
+	}
+
+	LatencyHistogram total;
+	for (unsigned thread = 0; thread < threads; thread++)
+	{
+		total.add(*costs[thread]);
+	}
+
+	printf("%-8s %3u threads %11.0f probes/s %11.0f events/s %5.1f%% dropped  p50 %5llu ns  p99 %5llu ns\n",
+		name, threads, threads * events_per_thread / probe_seconds, drained / seconds,
+		100.0 * path.dropped() / (threads * events_per_thread),
+		static_cast<unsigned long long>(Clock::to_nanos(total.value_at_percentile(50))),
+		static_cast<unsigned long long>(Clock::to_nanos(total.value_at_percentile(99))));
+}
+
+
+int main(int argc, char *argv[])
+{
+	const uint64_t events_per_thread = argc > 1 ? atoi(argv[1]) : 1000000;
+	const unsigned max_threads = argc > 2 ? atoi(argv[2]) : 32;
+
+	Clock::init();
+	printf("clock: %s, %u hardware threads\n", Clock::source(), std::thread::hardware_concurrency());
+
+	for (unsigned threads = 1; threads <= max_threads; threads *= 2)
+	{
+		MonitorPath monitor;
+		run("monitor", monitor, threads, events_per_thread);
+
+		RingPath rings(threads);
+		run("rings", rings, threads, events_per_thread);
+	}
+	return 0;
+}
@@ -0,0 +1,74 @@
+// Reference reader of the agent's shared-memory ring (output=shm:name).
+//
+//   shm_consume name [idle_seconds] > trace.bin
+//   shm_consume name | trace_decode
+//
+// Copies the trace stream to stdout, starting at the ring's latest keyframe, and
+// reports on stderr whenever the agent overran it. Runs until interrupted, or until
+// nothing arrived for idle_seconds.
+
+#include "ShmRing.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#ifdef WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+
+static const int WAIT_MS = 100;
+
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: shm_consume name [idle_seconds]\n");
+		return 1;
+	}
+
+	const int idle_limit_ms = argc > 2 ? atoi(argv[2]) * 1000 : 0;
+
+#ifdef WIN32
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+	ShmRingReader reader;
+	if (!reader.open(argv[1]))
+	{
+		fprintf(stderr, "ERROR: cannot open shared memory ring %s\n", argv[1]);
+		return 1;
+	}
+
+	std::string frame;
+	unsigned long long frames = 0, bytes = 0;
+	uint64_t lost = 0, reported = 0;
+	int idle_ms = 0;
+
+	while (idle_limit_ms == 0 || idle_ms < idle_limit_ms)
+	{
+		if (!reader.read(frame, lost, WAIT_MS))
+		{
+			idle_ms += WAIT_MS;
+			continue;
+		}
+		idle_ms = 0;
+
+		if (lost != reported)
+		{
+			fprintf(stderr, "overrun, %llu bytes lost so far\n", static_cast<unsigned long long>(lost));
+			reported = lost;
+		}
+
+		fwrite(frame.data(), 1, frame.length(), stdout);
+		frames++;
+		bytes += frame.length();
+	}
+
+	fflush(stdout);
+	fprintf(stderr, "%llu frames, %llu bytes, %llu bytes lost\n", frames, bytes, static_cast<unsigned long long>(lost));
+	return 0;
+}
@@ -0,0 +1,397 @@
+// Decodes a binary method_call_trace stream (see TraceProtocol.h) into text.
+//
+//   trace_decode [file]
+//
+// Reads stdin when no file is given, so a live stream can be piped in.
+
+#include "TraceProtocol.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+
+class TraceDecoder
+{
+public:
+	explicit TraceDecoder(FILE *input) :
+		m_input(input),
+		m_events(0),
+		m_bytes(0)
+	{
+	}
+
+	bool run()
+	{
+		int type;
+		while ((type = fgetc(m_input)) != EOF && type != 0)
+		{
+			m_bytes++;
+			if (!decode_record(type))
+			{
+				return false;
+			}
+		}
+
+		fprintf(stderr, "%llu events, %llu bytes\n",
+			static_cast<unsigned long long>(m_events), static_cast<unsigned long long>(m_bytes));
+		return true;
+	}
+
+private:
+	bool decode_record(int type)
+	{
+		uint32_t magic, version, cnum, mnum, thread, count, weight;
+		uint64_t timestamp, interval, calls, returns, wall_nanos, ticks_per_second, dropped, duration;
+		uint64_t inclusive[LATENCY_SUMMARY_SIZE], exclusive[LATENCY_SUMMARY_SIZE];
+		std::string name, signature;
+
+		switch (type)
+		{
+		case RECORD_STREAM_HEADER:
+			if (!get(magic, 4) || !get(version, 2))
+			{
+				return truncated();
+			}
+			if (magic != TRACE_PROTOCOL_MAGIC)
+			{
+				fprintf(stderr, "ERROR: bad stream magic 0x%x\n", magic);
+				return false;
+			}
+			if (version != TRACE_PROTOCOL_VERSION)
+			{
+				fprintf(stderr, "ERROR: unsupported stream version %u\n", version);
+				return false;
+			}
+			printf("stream version %u\n", version);
+			return true;
+
+		case RECORD_CLASS:
+			if (!get(cnum, 4) || !get_string(name))
+			{
+				return truncated();
+			}
+			m_classes[cnum] = name;
+			printf("class %u %s\n", cnum, name.c_str());
+			return true;
+
+		case RECORD_METHOD:
+			if (!get(cnum, 4) || !get(mnum, 4) || !get_string(name) || !get_string(signature))
+			{
+				return truncated();
+			}
+			m_methods[std::make_pair(cnum, mnum)] = name;
+			printf("method %u:%u %s%s\n", cnum, mnum, name.c_str(), signature.c_str());
+			return true;
+
+		case RECORD_METHOD_SKIPPED:
+			if (!get(cnum, 4) || !get(mnum, 4) || !get(count, 1))
+			{
+				return truncated();
+			}
+			printf("skipped %u:%u %s (%s)\n", cnum, mnum, method_name(cnum, mnum).c_str(),
+				count == 1 ? "small" : count == 2 ? "accessor" : count == 3 ? "synthetic" : "?");
+			return true;
+
+		case RECORD_METHOD_ENTRY:
+		case RECORD_METHOD_EXIT:
+			if (!get(thread, 4) || !get(cnum, 4) || !get(mnum, 4) || !get(timestamp, 8))
+			{
+				return truncated();
+			}
+			m_events++;
+			printf("%llu %u %s %s:%s\n", static_cast<unsigned long long>(timestamp), thread,
+				type == RECORD_METHOD_ENTRY ? "enter" : "exit",
+				class_name(cnum).c_str(), method_name(cnum, mnum).c_str());
+			return true;
+
+		case RECORD_METHOD_ENTRY_SAMPLED:
+		case RECORD_METHOD_EXIT_SAMPLED:
+			if (!get(thread, 4) || !get(cnum, 4) || !get(mnum, 4) || !get(timestamp, 8) || !get(weight, 4))
+			{
+				return truncated();
+			}
+			m_events++;
+			printf("%llu %u %s %s:%s x%u\n", static_cast<unsigned long long>(timestamp), thread,
+				type == RECORD_METHOD_ENTRY_SAMPLED ? "enter" : "exit",
+				class_name(cnum).c_str(), method_name(cnum, mnum).c_str(), weight);
+			return true;
+
+		case RECORD_COUNT_SNAPSHOT:
+			if (!get(timestamp, 8) || !get(interval, 8) || !get(count, 4))
+			{
+				return truncated();
+			}
+			printf("%llu counts over %llu ns\n",
+				static_cast<unsigned long long>(timestamp), static_cast<unsigned long long>(interval));
+			for (uint32_t i = 0; i < count; i++)
+			{
+				if (!get(cnum, 4) || !get(mnum, 4) || !get(calls, 8) || !get(returns, 8))
+				{
+					return truncated();
+				}
+				printf("%llu %llu %s:%s\n",
+					static_cast<unsigned long long>(calls), static_cast<unsigned long long>(returns),
+					class_name(cnum).c_str(), method_name(cnum, mnum).c_str());
+			}
+			return true;
+
+		case RECORD_CALL_TREE:
+			if (!get(timestamp, 8) || !get(count, 4) || !get(dropped, 8))
+			{
+				return truncated();
+			}
+			printf("%llu call tree, %u paths, %llu truncated\n", static_cast<unsigned long long>(timestamp), count,
+				static_cast<unsigned long long>(dropped));
+			if (dropped != 0)
+			{
+				printf("# %llu calls left out, the tree was full\n", static_cast<unsigned long long>(dropped));
+			}
+			return decode_call_tree(count);
+
+		case RECORD_CLOCK_SYNC:
+			if (!get(timestamp, 8) || !get(wall_nanos, 8) || !get(ticks_per_second, 8))
+			{
+				return truncated();
+			}
+			printf("%llu clock sync wall %llu ns, %llu ticks/s\n", static_cast<unsigned long long>(timestamp),
+				static_cast<unsigned long long>(wall_nanos), static_cast<unsigned long long>(ticks_per_second));
+			return true;
+
+		case RECORD_LATENCY_REPORT:
+			if (!get(timestamp, 8) || !get(count, 4))
+			{
+				return truncated();
+			}
+			printf("%llu latency (ns): calls, inclusive p50 p90 p99 p99.9 max, exclusive p50 p90 p99 p99.9 max\n",
+				static_cast<unsigned long long>(timestamp));
+			for (uint32_t i = 0; i < count; i++)
+			{
+				if (!get(cnum, 4) || !get(mnum, 4) || !get(calls, 8))
+				{
+					return truncated();
+				}
+				for (size_t j = 0; j < LATENCY_SUMMARY_SIZE; j++)
+				{
+					if (!get(inclusive[j], 8))
+					{
+						return truncated();
+					}
+				}
+				for (size_t j = 0; j < LATENCY_SUMMARY_SIZE; j++)
+				{
+					if (!get(exclusive[j], 8))
+					{
+						return truncated();
+					}
+				}
+
+				printf("%s:%s %llu,", class_name(cnum).c_str(), method_name(cnum, mnum).c_str(),
+					static_cast<unsigned long long>(calls));
+				for (size_t j = 0; j < LATENCY_SUMMARY_SIZE; j++)
+				{
+					printf(" %llu", static_cast<unsigned long long>(inclusive[j]));
+				}
+				printf(",");
+				for (size_t j = 0; j < LATENCY_SUMMARY_SIZE; j++)
+				{
+					printf(" %llu", static_cast<unsigned long long>(exclusive[j]));
+				}
+				printf("\n");
+			}
+			return true;
+
+		case RECORD_DROP_REPORT:
+			if (!get(timestamp, 8) || !get(dropped, 8) || !get(count, 4))
+			{
+				return truncated();
+			}
+			printf("%llu dropped %llu events\n", static_cast<unsigned long long>(timestamp),
+				static_cast<unsigned long long>(dropped));
+			for (uint32_t i = 0; i < count; i++)
+			{
+				if (!get(thread, 4) || !get(dropped, 8))
+				{
+					return truncated();
+				}
+				printf("thread %u dropped %llu\n", thread, static_cast<unsigned long long>(dropped));
+			}
+			return true;
+
+		case RECORD_SLOW_CALL:
+			if (!get(thread, 4) || !get(cnum, 4) || !get(mnum, 4) || !get(timestamp, 8) ||
+				!get(duration, 8) || !get(count, 2))
+			{
+				return truncated();
+			}
+			m_events++;
+			printf("%llu %u slow %s:%s %llu ns\n", static_cast<unsigned long long>(timestamp), thread,
+				class_name(cnum).c_str(), method_name(cnum, mnum).c_str(), static_cast<unsigned long long>(duration));
+			for (uint32_t i = 0; i < count; i++)
+			{
+				if (!get(cnum, 4) || !get(mnum, 4))
+				{
+					return truncated();
+				}
+				printf("\tin %s:%s\n", class_name(cnum).c_str(), method_name(cnum, mnum).c_str());
+			}
+			return true;
+
+		case RECORD_THREAD_START:
+		case RECORD_THREAD_END:
+			if (!get(thread, 4) || !get(timestamp, 8))
+			{
+				return truncated();
+			}
+			printf("%llu %u thread %s\n", static_cast<unsigned long long>(timestamp), thread,
+				type == RECORD_THREAD_START ? "start" : "end");
+			return true;
+
+		case RECORD_CLASS_LOAD:
+			if (!get(thread, 4) || !get(cnum, 4) || !get(timestamp, 8))
+			{
+				return truncated();
+			}
+			printf("%llu %u load %s\n", static_cast<unsigned long long>(timestamp), thread, class_name(cnum).c_str());
+			return true;
+
+		default:
+			fprintf(stderr, "ERROR: unknown record type %d at offset %llu\n",
+				type, static_cast<unsigned long long>(m_bytes - 1));
+			return false;
+		}
+	}
+
+	// Prints the tree as collapsed stacks with each path's self time in ns
+	bool decode_call_tree(uint32_t count)
+	{
+		std::vector<std::string> paths(count + 1);
+		std::vector<uint64_t> self_time(count + 1, 0);
+
+		for (uint32_t index = 1; index <= count; index++)
+		{
+			uint32_t parent, cnum, mnum;
+			uint64_t calls, inclusive;
+			if (!get(parent, 4) || !get(cnum, 4) || !get(mnum, 4) || !get(calls, 8) || !get(inclusive, 8))
+			{
+				return truncated();
+			}
+			if (parent >= index)
+			{
+				fprintf(stderr, "ERROR: call tree path %u has a later parent %u\n", index, parent);
+				return false;
+			}
+
+			paths[index] = (parent != 0 ? paths[parent] + ";" : std::string()) + class_name(cnum) + "." + method_name(cnum, mnum);
+			self_time[index] += inclusive;
+			self_time[parent] -= inclusive;
+		}
+
+		for (uint32_t index = 1; index <= count; index++)
+		{
+			if (static_cast<int64_t>(self_time[index]) > 0)
+			{
+				printf("%s %llu\n", paths[index].c_str(), static_cast<unsigned long long>(self_time[index]));
+			}
+		}
+		return true;
+	}
+
+	template <typename T>
+	bool get(T &value, int size)
+	{
+		value = 0;
+		for (int i = 0; i < size; i++)
+		{
+			int byte = fgetc(m_input);
+			if (byte == EOF)
+			{
+				return false;
+			}
+			value |= static_cast<T>(static_cast<uint8_t>(byte)) << (8 * i);
+		}
+		m_bytes += size;
+		return true;
+	}
+
+	bool get_string(std::string &value)
+	{
+		uint32_t length;
+		if (!get(length, 2))
+		{
+			return false;
+		}
+
+		value.resize(length);
+		if (length != 0 && fread(&value[0], 1, length, m_input) != length)
+		{
+			return false;
+		}
+		m_bytes += length;
+		return true;
+	}
+
+	bool truncated() const
+	{
+		fprintf(stderr, "ERROR: truncated record at offset %llu\n", static_cast<unsigned long long>(m_bytes));
+		return false;
+	}
+
+	std::string class_name(uint32_t cnum) const
+	{
+		std::map<uint32_t, std::string>::const_iterator it = m_classes.find(cnum);
+		return it != m_classes.end() ? it->second : "?";
+	}
+
+	std::string method_name(uint32_t cnum, uint32_t mnum) const
+	{
+		std::map<std::pair<uint32_t, uint32_t>, std::string>::const_iterator it = m_methods.find(std::make_pair(cnum, mnum));
+		return it != m_methods.end() ? it->second : "?";
+	}
+
+private:
+	FILE *m_input;
+	uint64_t m_events;
+	uint64_t m_bytes;
+	std::map<uint32_t, std::string> m_classes;
+	std::map<std::pair<uint32_t, uint32_t>, std::string> m_methods;
+};
+
+
+int main(int argc, char *argv[])
+{
+	FILE *input = stdin;
+
+	if (argc > 1)
+	{
+		input = fopen(argv[1], "rb");
+		if (input == nullptr)
+		{
+			fprintf(stderr, "ERROR: cannot open %s\n", argv[1]);
+			return 1;
+		}
+	}
+#ifdef WIN32
+	else
+	{
+		_setmode(_fileno(stdin), _O_BINARY);
+	}
+#endif
+
+	TraceDecoder decoder(input);
+	bool ok = decoder.run();
+
+	if (input != stdin)
+	{
+		fclose(input);
+	}
+	return ok ? 0 : 2;
+}
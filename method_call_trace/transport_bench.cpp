@@ -0,0 +1,380 @@
+// Compares the two trace outputs on this host: NetworkServer read by a loopback
+// TCP client and SharedMemoryServer read by ShmRingReader. Both are fed the same
+// synthetic entry/exit records as fast as the worker drains them.
+//
+//   transport_bench [megabytes] [drain_kb]
+//
+// drain_kb is what the worker picks up per wakeup (default 1024); small values show
+// the per-batch cost, which is where the two outputs differ most.
+// Prints the throughput of each and the CPU time the whole process used for it.
+//
+// Then runs the TCP output for LOAD_SECONDS each at no load, at MEDIUM_EVENTS_PER_S,
+// and saturated, and prints the events/s the client got and the CPU the sender used:
+// the process's, less what the client and the thread waking the worker used.
+
+#include "EventSource.h"
+#include "JVMAgentConstants.h"
+#include "NetworkServer.h"
+#include "SharedMemoryServer.h"
+#include "ShmRing.h"
+#include "TraceProtocol.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <thread>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+
+static const int BENCH_PORT = 8899;
+static const char *BENCH_RING = "/mtrace_bench";
+static const size_t BENCH_RING_BYTES = 64 * 1024 * 1024;
+static const int LOAD_SECONDS = 3;
+static const uint64_t MEDIUM_EVENTS_PER_S = 1000 * 1000;
+
+
+// Stands in for the agent with records encoded up front, so the outputs are what is measured.
+// With a rate, a drain takes only the events due since run(), as probes would have made them.
+class SyntheticSource : public EventSource
+{
+public:
+	SyntheticSource(uint64_t total, size_t drain_bytes, uint64_t rate = 0) :
+		m_total(total), m_rate(rate), m_produced(0), m_running(false), m_sent(0)
+	{
+		for (uint64_t timestamp = 0; m_events.length() + EVENT_RECORD_SIZE <= drain_bytes; timestamp++)
+		{
+			TraceEncoder::event_record(m_events, (timestamp & 1) ? RECORD_METHOD_EXIT : RECORD_METHOD_ENTRY,
+				1, 7, 3, timestamp, 1);
+		}
+	}
+
+	void stream_header(std::string &buffer) override
+	{
+		const size_t before = buffer.length();
+		TraceEncoder::stream_header(buffer);
+		m_sent += buffer.length() - before;
+	}
+
+	void drain_events(std::string &buffer) override
+	{
+		if (!m_running)
+		{
+			return;
+		}
+
+		uint64_t length = std::min<uint64_t>(m_events.length(), m_total - std::min(m_total, m_produced));
+		if (m_rate != 0)
+		{
+			length = std::min(length, due() * EVENT_RECORD_SIZE - std::min(due() * EVENT_RECORD_SIZE, m_produced));
+		}
+		if (length > 0)
+		{
+			buffer.append(m_events, 0, static_cast<size_t>(length));
+			m_produced += length;
+			m_sent += length;
+		}
+	}
+
+	// Events made by now at the rate, 0 before run()
+	uint64_t due() const
+	{
+		if (!m_running)
+		{
+			return 0;
+		}
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+		return static_cast<uint64_t>(seconds * m_rate);
+	}
+
+	uint64_t produced() const
+	{
+		return m_produced;
+	}
+
+	void discard_events() override
+	{
+	}
+
+	void run()
+	{
+		m_start = std::chrono::steady_clock::now();
+		m_running = true;
+	}
+
+	bool done() const
+	{
+		return m_produced >= m_total;
+	}
+
+	// Everything handed to the output so far, headers included
+	uint64_t sent() const
+	{
+		return m_sent;
+	}
+
+private:
+	const uint64_t m_total;
+	const uint64_t m_rate;				 // Events/s, 0 for as fast as the worker drains
+	std::chrono::steady_clock::time_point m_start;
+	std::string m_events;
+	uint64_t m_produced;
+	std::atomic<bool> m_running;
+	std::atomic<uint64_t> m_sent;
+};
+
+
+static double process_cpu_seconds()
+{
+#ifdef WIN32
+	FILETIME creation, exit, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+	return ((static_cast<uint64_t>(kernel.dwHighDateTime) << 32 | kernel.dwLowDateTime) +
+		(static_cast<uint64_t>(user.dwHighDateTime) << 32 | user.dwLowDateTime)) / 1e7;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static double thread_cpu_seconds()
+{
+#ifdef WIN32
+	FILETIME creation, exit, kernel, user;
+	GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+	return ((static_cast<uint64_t>(kernel.dwHighDateTime) << 32 | kernel.dwLowDateTime) +
+		(static_cast<uint64_t>(user.dwHighDateTime) << 32 | user.dwLowDateTime)) / 1e7;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static void report(const char *name, uint64_t bytes, uint64_t lost, double seconds, double cpu_seconds)
+{
+	printf("%-14s %8.1f MB/s  %10.0f events/s  cpu %5.2f s for %.2f s", name,
+		bytes / seconds / (1024.0 * 1024.0), bytes / EVENT_RECORD_SIZE / seconds, cpu_seconds, seconds);
+	if (lost != 0)
+	{
+		printf("  (%llu bytes lost)", static_cast<unsigned long long>(lost));
+	}
+	printf("\n");
+}
+
+/* Keeps the worker busy the way probes do when their rings fill up */
+static void pump(TraceOutput &output, SyntheticSource &source)
+{
+	while (!source.done())
+	{
+		output.wake();
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+}
+
+static void bench_tcp(uint64_t total, size_t drain_bytes)
+{
+	SyntheticSource source(total, drain_bytes);
+	NetworkServer server(source);
+	server.set_port(BENCH_PORT);
+	server.set_overflow(BENCH_RING_BYTES, OVERFLOW_DROP_NEWEST);
+	server.start();
+
+	NetworkServer::socket_t client = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address;
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(0x7F000001);
+	address.sin_port = htons(BENCH_PORT);
+	if (connect(client, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) != 0)
+	{
+		fprintf(stderr, "ERROR: cannot connect to the trace server\n");
+		exit(1);
+	}
+
+	const std::clock_t cpu_start = std::clock();
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	source.run();
+	std::thread producer(pump, std::ref(server), std::ref(source));
+
+	std::string buffer(1024 * 1024, 0);
+	uint64_t received = 0;
+	while (!source.done() || received < source.sent())
+	{
+		const int count = recv(client, &buffer[0], static_cast<int>(buffer.size()), 0);
+		if (count <= 0)
+		{
+			break;
+		}
+		received += count;
+	}
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	report("tcp loopback", received, 0, seconds, static_cast<double>(std::clock() - cpu_start) / CLOCKS_PER_SEC);
+
+	producer.join();
+#ifdef WIN32
+	closesocket(client);
+#else
+	close(client);
+#endif
+	server.stop();
+}
+
+/* Wakes the worker as the probes do, once half a ring of events is waiting, or all the time */
+static void pace(TraceOutput &output, SyntheticSource &source, bool saturated, const std::atomic<bool> &running,
+	double &cpu_seconds)
+{
+	while (running.load())
+	{
+		if (saturated)
+		{
+			output.wake();
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+			continue;
+		}
+
+		if (source.due() * EVENT_RECORD_SIZE >= source.produced() + EVENT_RING_CAPACITY / 2 * EVENT_RECORD_SIZE)
+		{
+			output.wake();
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	cpu_seconds = thread_cpu_seconds();
+}
+
+/* rate events/s for LOAD_SECONDS, 0 for none and UINT64_MAX for as fast as the worker goes */
+static void bench_load(const char *name, uint64_t rate)
+{
+	const bool saturated = rate == UINT64_MAX;
+	SyntheticSource source(rate == 0 ? 0 : UINT64_MAX, 1024 * 1024, saturated ? 0 : rate);
+	NetworkServer server(source);
+	server.set_port(BENCH_PORT);
+	server.set_overflow(BENCH_RING_BYTES, OVERFLOW_DROP_NEWEST);
+	server.start();
+
+	NetworkServer::socket_t client = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address;
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(0x7F000001);
+	address.sin_port = htons(BENCH_PORT);
+	if (connect(client, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) != 0)
+	{
+		fprintf(stderr, "ERROR: cannot connect to the trace server\n");
+		exit(1);
+	}
+
+	// Header out of the way first, so only the load is measured
+	std::string buffer(1024 * 1024, 0);
+	recv(client, &buffer[0], static_cast<int>(buffer.size()), 0);
+
+	std::atomic<bool> running(true);
+	double pace_cpu = 0;
+	const double process_start = process_cpu_seconds();
+	const double client_start = thread_cpu_seconds();
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	const std::chrono::steady_clock::time_point end = start + std::chrono::seconds(LOAD_SECONDS);
+	source.run();
+	std::thread waker(pace, std::ref(server), std::ref(source), saturated, std::cref(running), std::ref(pace_cpu));
+
+	uint64_t received = 0;
+	while (std::chrono::steady_clock::now() < end)
+	{
+		fd_set readable;
+		FD_ZERO(&readable);
+		FD_SET(client, &readable);
+		struct timeval timeout = { 0, 100 * 1000 };
+		if (select(static_cast<int>(client + 1), &readable, nullptr, nullptr, &timeout) <= 0)
+		{
+			continue;
+		}
+
+		const int count = recv(client, &buffer[0], static_cast<int>(buffer.size()), 0);
+		if (count <= 0)
+		{
+			break;
+		}
+		received += count;
+	}
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	const double client_cpu = thread_cpu_seconds() - client_start;
+	running.store(false);
+	waker.join();
+	const double sender_cpu = process_cpu_seconds() - process_start - client_cpu - pace_cpu;
+
+	printf("%-10s %12.0f events/s  sender cpu %5.1f%% of a core\n", name,
+		received / EVENT_RECORD_SIZE / seconds, 100.0 * sender_cpu / seconds);
+
+#ifdef WIN32
+	closesocket(client);
+#else
+	close(client);
+#endif
+	server.stop();
+}
+
+static void bench_shm(uint64_t total, size_t drain_bytes)
+{
+	SyntheticSource source(total, drain_bytes);
+	SharedMemoryServer server(source, BENCH_RING, BENCH_RING_BYTES);
+	server.start();
+
+	ShmRingReader reader;
+	if (!reader.open(BENCH_RING))
+	{
+		fprintf(stderr, "ERROR: cannot open the shared memory ring\n");
+		exit(1);
+	}
+
+	const std::clock_t cpu_start = std::clock();
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	source.run();
+	std::thread producer(pump, std::ref(server), std::ref(source));
+
+	std::string frame;
+	uint64_t received = 0, lost = 0;
+	while (!source.done() || received + lost < source.sent())
+	{
+		if (reader.read(frame, lost, 1000))
+		{
+			received += frame.length();
+		}
+	}
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	report("shared memory", received, lost, seconds, static_cast<double>(std::clock() - cpu_start) / CLOCKS_PER_SEC);
+
+	producer.join();
+	reader.close();
+	server.stop();
+}
+
+
+int main(int argc, char *argv[])
+{
+	const uint64_t megabytes = argc > 1 ? atoi(argv[1]) : 1024;
+	const uint64_t total = megabytes * 1024 * 1024;
+	const size_t drain_bytes = (argc > 2 ? atoi(argv[2]) : 1024) * static_cast<size_t>(1024);
+
+	bench_tcp(total, drain_bytes);
+	bench_shm(total, drain_bytes);
+
+	printf("\ntcp loopback for %d s each\n", LOAD_SECONDS);
+	bench_load("idle", 0);
+	bench_load("medium", MEDIUM_EVENTS_PER_S);
+	bench_load("saturated", UINT64_MAX);
+	return 0;
+}